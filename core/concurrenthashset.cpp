@@ -0,0 +1,145 @@
+#include "../core/concurrenthashset.h"
+
+#include "../core/rand.h"
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+//Inserts every key, checking each against a std::set that is kept alongside
+static void insertAndCheck(ConcurrentHash128Set& set, std::set<Hash128>& reference, const vector<Hash128>& keys) {
+  for(size_t i = 0; i<keys.size(); i++) {
+    bool isNew = reference.insert(keys[i]).second;
+    testAssert(set.contains(keys[i]) == !isNew);
+    testAssert(set.insert(keys[i]) == isNew);
+    testAssert(set.contains(keys[i]));
+    testAssert(!set.insert(keys[i]));
+  }
+  testAssert(set.size() == reference.size());
+  testAssert(set.toSet() == reference);
+}
+
+void ConcurrentHash128SetTest::runTests() {
+  cout << "Running concurrent hash set tests" << endl;
+
+  //Basic insert and contains, including the all-zero hash, and clear
+  {
+    ConcurrentHash128Set set(2);
+    testAssert(set.size() == 0);
+    testAssert(set.toSet().size() == 0);
+    testAssert(!set.contains(Hash128()));
+    testAssert(set.insert(Hash128()));
+    testAssert(!set.insert(Hash128()));
+    testAssert(set.contains(Hash128()));
+    testAssert(!set.contains(Hash128(0,1)));
+    testAssert(!set.contains(Hash128(1,0)));
+    testAssert(set.insert(Hash128(1,0)));
+    testAssert(set.insert(Hash128(0,1)));
+    testAssert(set.size() == 3);
+    set.clear();
+    testAssert(set.size() == 0);
+    testAssert(!set.contains(Hash128()));
+    testAssert(set.insert(Hash128()));
+    testAssert(set.size() == 1);
+  }
+
+  //Invalid numbers of shards
+  {
+    bool threw = false;
+    try { ConcurrentHash128Set set(-1); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    threw = false;
+    try { ConcurrentHash128Set set(17); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+  }
+
+  //Growing well past the initial capacity of a shard, both with a single shard and with many, and with keys whose
+  //slots all collide so that they form one long probe sequence that must survive each resize
+  {
+    Rand rand("concurrenthashset growth");
+    for(int numShardsPowerOfTwo = 0; numShardsPowerOfTwo <= 4; numShardsPowerOfTwo += 4) {
+      ConcurrentHash128Set set(numShardsPowerOfTwo);
+      std::set<Hash128> reference;
+      vector<Hash128> keys;
+      for(int i = 0; i<2000; i++)
+        keys.push_back(Hash128(rand.nextUInt64(),rand.nextUInt64()));
+      insertAndCheck(set,reference,keys);
+
+      keys.clear();
+      for(uint64_t i = 0; i<300; i++)
+        keys.push_back(Hash128(i << 32, rand.nextUInt64()));
+      insertAndCheck(set,reference,keys);
+
+      //Duplicates of everything so far, shuffled, add nothing
+      keys.assign(reference.begin(),reference.end());
+      for(size_t i = keys.size()-1; i>0; i--)
+        std::swap(keys[i],keys[rand.nextUInt((uint32_t)(i+1))]);
+      insertAndCheck(set,reference,keys);
+
+      //Near misses are not present
+      for(const Hash128& hash : reference) {
+        if(reference.find(Hash128(hash.hash0,hash.hash1^1)) == reference.end())
+          testAssert(!set.contains(Hash128(hash.hash0,hash.hash1^1)));
+        if(reference.find(Hash128(hash.hash0^1,hash.hash1)) == reference.end())
+          testAssert(!set.contains(Hash128(hash.hash0^1,hash.hash1)));
+      }
+    }
+  }
+
+  //Concurrent inserts of overlapping keys from several threads. Every key must be reported as new by exactly one
+  //thread, and each thread must see every key that it inserted.
+  {
+    const int numThreads = 4;
+    const int numKeys = 20000;
+    vector<Hash128> keys;
+    Rand keyRand("concurrenthashset keys");
+    for(int i = 0; i<numKeys; i++)
+      keys.push_back(Hash128(keyRand.nextUInt64(),keyRand.nextUInt64()));
+
+    for(int numShardsPowerOfTwo = 0; numShardsPowerOfTwo <= 6; numShardsPowerOfTwo += 3) {
+      ConcurrentHash128Set set(numShardsPowerOfTwo);
+      vector<vector<Hash128>> inserted(numThreads);
+      vector<int> numNew(numThreads,0);
+      vector<int> numMissing(numThreads,0);
+      auto insertLoop = [&](int threadIdx) {
+        Rand rand("concurrenthashset thread " + Global::intToString(threadIdx));
+        //Each thread inserts an overlapping random two thirds of the keys, in its own order
+        vector<Hash128>& mine = inserted[threadIdx];
+        for(int i = 0; i<numKeys; i++) {
+          if(rand.nextUInt(3) != 0)
+            mine.push_back(keys[i]);
+        }
+        for(size_t i = mine.size()-1; i>0; i--)
+          std::swap(mine[i],mine[rand.nextUInt((uint32_t)(i+1))]);
+        for(size_t i = 0; i<mine.size(); i++) {
+          if(set.insert(mine[i]))
+            numNew[threadIdx]++;
+          if(!set.contains(mine[i]))
+            numMissing[threadIdx]++;
+          //Keys inserted a while ago by this thread are still present, despite growth in the meantime
+          if(!set.contains(mine[i/2]))
+            numMissing[threadIdx]++;
+        }
+      };
+      vector<std::thread> threads;
+      for(int i = 0; i<numThreads; i++)
+        threads.push_back(std::thread(insertLoop,i));
+      for(size_t i = 0; i<threads.size(); i++)
+        threads[i].join();
+
+      std::set<Hash128> reference;
+      int totalNew = 0;
+      for(int i = 0; i<numThreads; i++) {
+        testAssert(numMissing[i] == 0);
+        totalNew += numNew[i];
+        reference.insert(inserted[i].begin(),inserted[i].end());
+      }
+      testAssert(set.toSet() == reference);
+      testAssert(set.size() == reference.size());
+      testAssert((size_t)totalNew == reference.size());
+      //Plenty of keys were inserted by more than one thread
+      testAssert(inserted[0].size() + inserted[1].size() + inserted[2].size() + inserted[3].size() > reference.size() * 2);
+    }
+  }
+}
@@ -0,0 +1,164 @@
+/*
+ * concurrenthashset.h
+ *
+ * Set of Hash128 that many threads can insert into and query at once, such as to deduplicate positions
+ * across a corpus being processed in parallel. The set is split into shards by the high bits of the hash, each
+ * an open-addressed table with its own lock, so threads only contend when they touch the same shard.
+ */
+
+#ifndef CORE_CONCURRENTHASHSET_H
+#define CORE_CONCURRENTHASHSET_H
+
+#include "../core/global.h"
+#include "../core/hash.h"
+#include "../core/multithread.h"
+
+class ConcurrentHash128Set {
+ public:
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    //Open-addressed with linear probing, capacity always a power of two. Since any hash including zero is a valid
+    //key, occupancy is tracked separately from the keys.
+    std::vector<Hash128> keys;
+    std::vector<uint8_t> occupied;
+    size_t count;
+    //Keep shards used by different threads off of each other's cache lines. Padding rather than alignas, since
+    //new is not guaranteed to respect extended alignment before C++17.
+    char padding[CACHE_LINE_SIZE];
+  };
+
+  Shard* shards;
+  int numShardsPowerOfTwo;
+  size_t numShards;
+
+ public:
+  //Creates a set with 2^numShardsPowerOfTwo shards. More shards means less contention between threads.
+  ConcurrentHash128Set(int numShardsPowerOfTwo = 8);
+  ~ConcurrentHash128Set();
+
+  ConcurrentHash128Set(const ConcurrentHash128Set& other) = delete;
+  ConcurrentHash128Set& operator=(const ConcurrentHash128Set& other) = delete;
+
+  //Adds hash to the set, returning true if it was not already present. Thread-safe.
+  bool insert(Hash128 hash);
+  //Thread-safe.
+  bool contains(Hash128 hash) const;
+  //Thread-safe, but only a snapshot if other threads are inserting.
+  size_t size() const;
+
+  //Returns the contents in sorted order. NOT thread-safe with concurrent inserts.
+  std::set<Hash128> toSet() const;
+  //Empties the set. NOT thread-safe, no other thread may be accessing the set.
+  void clear();
+
+ private:
+  Shard& getShard(Hash128 hash) const;
+  static size_t findSlot(const Shard& shard, Hash128 hash);
+  static void grow(Shard& shard);
+};
+
+namespace ConcurrentHash128SetTest {
+  void runTests();
+}
+
+inline ConcurrentHash128Set::ConcurrentHash128Set(int nspot) {
+  if(nspot < 0 || nspot > 16)
+    throw StringError("ConcurrentHash128Set: invalid numShardsPowerOfTwo: " + Global::intToString(nspot));
+  numShardsPowerOfTwo = nspot;
+  numShards = (size_t)1 << nspot;
+  shards = new Shard[numShards];
+  clear();
+}
+
+inline ConcurrentHash128Set::~ConcurrentHash128Set() {
+  delete[] shards;
+}
+
+inline ConcurrentHash128Set::Shard& ConcurrentHash128Set::getShard(Hash128 hash) const {
+  //Shard by the high bits of hash1 so that the slot within a shard, from hash0, is independent of the shard
+  if(numShardsPowerOfTwo == 0)
+    return shards[0];
+  return shards[hash.hash1 >> (64 - numShardsPowerOfTwo)];
+}
+
+//Returns the slot holding hash, or else the empty slot where it would go
+inline size_t ConcurrentHash128Set::findSlot(const Shard& shard, Hash128 hash) {
+  size_t mask = shard.keys.size()-1;
+  size_t slot = (size_t)hash.hash0 & mask;
+  while(shard.occupied[slot] && shard.keys[slot] != hash)
+    slot = (slot+1) & mask;
+  return slot;
+}
+
+inline void ConcurrentHash128Set::grow(Shard& shard) {
+  std::vector<Hash128> oldKeys;
+  std::vector<uint8_t> oldOccupied;
+  oldKeys.swap(shard.keys);
+  oldOccupied.swap(shard.occupied);
+  shard.keys.assign(oldKeys.size()*2, Hash128());
+  shard.occupied.assign(oldKeys.size()*2, 0);
+  for(size_t i = 0; i<oldKeys.size(); i++) {
+    if(oldOccupied[i]) {
+      size_t slot = findSlot(shard,oldKeys[i]);
+      shard.keys[slot] = oldKeys[i];
+      shard.occupied[slot] = 1;
+    }
+  }
+}
+
+inline bool ConcurrentHash128Set::insert(Hash128 hash) {
+  Shard& shard = getShard(hash);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  size_t slot = findSlot(shard,hash);
+  if(shard.occupied[slot])
+    return false;
+  //Keep the load factor at most 1/2
+  if((shard.count+1)*2 > shard.keys.size()) {
+    grow(shard);
+    slot = findSlot(shard,hash);
+  }
+  shard.keys[slot] = hash;
+  shard.occupied[slot] = 1;
+  shard.count++;
+  return true;
+}
+
+inline bool ConcurrentHash128Set::contains(Hash128 hash) const {
+  Shard& shard = getShard(hash);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  return shard.occupied[findSlot(shard,hash)] != 0;
+}
+
+inline size_t ConcurrentHash128Set::size() const {
+  size_t total = 0;
+  for(size_t i = 0; i<numShards; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    total += shards[i].count;
+  }
+  return total;
+}
+
+inline std::set<Hash128> ConcurrentHash128Set::toSet() const {
+  std::set<Hash128> ret;
+  for(size_t i = 0; i<numShards; i++) {
+    const Shard& shard = shards[i];
+    for(size_t j = 0; j<shard.keys.size(); j++) {
+      if(shard.occupied[j])
+        ret.insert(shard.keys[j]);
+    }
+  }
+  return ret;
+}
+
+inline void ConcurrentHash128Set::clear() {
+  for(size_t i = 0; i<numShards; i++) {
+    shards[i].keys.assign(16, Hash128());
+    shards[i].occupied.assign(16, 0);
+    shards[i].count = 0;
+  }
+}
+
+#endif // CORE_CONCURRENTHASHSET_H
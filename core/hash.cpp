@@ -1,5 +1,7 @@
 #include "../core/hash.h"
 
+#include <cstring>
+
 /*
  * hash.cpp
  * Author: David Wu
@@ -173,6 +175,62 @@ uint64_t Hash::simpleHash(const int *input, int len)
   return combine(hi ^ m4, lo + m4);
 }
 
+static inline uint64_t rotateLeft(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+Hash128 Hash::murmur3x64_128(const void* data, size_t len, uint32_t seed)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+
+  size_t numBlocks = len / 16;
+  for(size_t i = 0; i < numBlocks; i++)
+  {
+    uint64_t k1;
+    uint64_t k2;
+    std::memcpy(&k1, bytes + i * 16, 8);
+    std::memcpy(&k2, bytes + i * 16 + 8, 8);
+
+    k1 *= c1; k1 = rotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotateLeft(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotateLeft(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // 处理不足16字节的尾部
+  const uint8_t* tail = bytes + numBlocks * 16;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  size_t tailLen = len & 15;
+  for(size_t i = tailLen; i > 8; i--)
+    k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+  if(tailLen > 8)
+  {
+    k2 *= c2; k2 = rotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+  for(size_t i = std::min(tailLen, (size_t)8); i > 0; i--)
+    k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+  if(tailLen > 0)
+  {
+    k1 *= c1; k1 = rotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= (uint64_t)len;
+  h2 ^= (uint64_t)len;
+  h1 += h2;
+  h2 += h1;
+  h1 = murmurMix(h1);
+  h2 = murmurMix(h2);
+  h1 += h2;
+  h2 += h1;
+  return Hash128(h2, h1);
+}
+
 // Hash128------------------------------------------------------------------------
 
 // 重载运算符输出hash128
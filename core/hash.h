@@ -10,6 +10,8 @@
 
 #include "../core/global.h"
 
+struct Hash128;
+
 namespace Hash
 {
   //Splitting of uint64s
@@ -31,6 +33,10 @@ namespace Hash
 
   uint64_t simpleHash(const char* str);
   uint64_t simpleHash(const int* input, int len);
+
+  //MurmurHash3_x64_128 of arbitrary bytes, as hash1 = first 8 bytes of the reference output and hash0 = the second.
+  //Fast and well distributed, but not cryptographic.
+  Hash128 murmur3x64_128(const void* data, size_t len, uint32_t seed);
 }
 
 //Hash is "little endian" in the sense that if you printed out hash1, then hash0, you would
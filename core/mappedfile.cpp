@@ -0,0 +1,76 @@
+#include "../core/mappedfile.h"
+
+#include <fstream>
+
+#include "../core/fileutils.h"
+#include "../core/os.h"
+
+#ifdef OS_IS_UNIX_OR_APPLE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+MappedFile::MappedFile(const string& f)
+  :file(f),
+   fileData(NULL),
+   fileSize(0),
+   isMapped(false),
+   contents()
+{
+#ifdef OS_IS_UNIX_OR_APPLE
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw IOError("Could not open file: " + file);
+  struct stat st;
+  if(fstat(fd,&st) != 0) {
+    ::close(fd);
+    throw IOError("Could not stat file: " + file);
+  }
+  fileSize = (size_t)st.st_size;
+  if(fileSize > 0) {
+    void* mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped != MAP_FAILED) {
+      fileData = (const char*)mapped;
+      isMapped = true;
+    }
+  }
+  ::close(fd);
+#endif
+  if(!isMapped) {
+    ifstream in;
+    FileUtils::open(in,file,std::ios::in | std::ios::binary);
+    in.seekg(0,std::ios::end);
+    fileSize = (size_t)in.tellg();
+    in.seekg(0,std::ios::beg);
+    contents.resize((fileSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    in.read((char*)contents.data(),fileSize);
+    if(!in.good())
+      throw IOError("Error reading file: " + file);
+    fileData = (const char*)contents.data();
+  }
+}
+
+MappedFile::~MappedFile() {
+#ifdef OS_IS_UNIX_OR_APPLE
+  if(isMapped)
+    munmap((void*)fileData,fileSize);
+#endif
+}
+
+const char* MappedFile::data() const {
+  return fileData;
+}
+
+size_t MappedFile::size() const {
+  return fileSize;
+}
+
+const string& MappedFile::getFileName() const {
+  return file;
+}
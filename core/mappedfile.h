@@ -0,0 +1,35 @@
+/*
+ * mappedfile.h
+ *
+ * Read-only view of the whole contents of a file, for binary formats that are accessed in place rather than parsed
+ * up front. The file is mapped into memory where supported, so that only the parts actually touched get read from
+ * disk, or otherwise read whole into memory. Either way, the data is aligned to at least 8 bytes.
+ */
+
+#ifndef CORE_MAPPEDFILE_H_
+#define CORE_MAPPEDFILE_H_
+
+#include "../core/global.h"
+
+class MappedFile {
+  std::string file;
+  const char* fileData;
+  size_t fileSize;
+  bool isMapped;
+  //Used instead of mapping when mapping is unsupported or fails
+  std::vector<uint64_t> contents;
+
+ public:
+  //Throws IOError if the file cannot be read
+  MappedFile(const std::string& file);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const;
+  size_t size() const;
+  const std::string& getFileName() const;
+};
+
+#endif // CORE_MAPPEDFILE_H_
@@ -0,0 +1,131 @@
+#include "../core/persistentvector.h"
+
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+template<typename T>
+static void checkMatches(const PersistentVector<T>& vec, const vector<T>& expected) {
+  testAssert(vec.size() == expected.size());
+  testAssert(vec.empty() == expected.empty());
+  testAssert(vec.sharedSize() == (expected.size() / PersistentVector<T>::CHUNK_SIZE) * PersistentVector<T>::CHUNK_SIZE);
+  for(size_t i = 0; i<expected.size(); i++)
+    testAssert(vec[i] == expected[i]);
+  if(!expected.empty())
+    testAssert(vec.back() == expected.back());
+  testAssert(vec.toVector() == expected);
+}
+
+void PersistentVectorTest::runTests() {
+  cout << "Running persistent vector tests" << endl;
+  const size_t chunkSize = PersistentVector<int>::CHUNK_SIZE;
+  testAssert(chunkSize == 32);
+
+  //push_back and pop_back back and forth across chunk boundaries
+  {
+    PersistentVector<int> vec;
+    vector<int> expected;
+    checkMatches(vec,expected);
+    for(int i = 0; i<(int)(chunkSize*3+5); i++) {
+      vec.push_back(i*7+1);
+      expected.push_back(i*7+1);
+      checkMatches(vec,expected);
+    }
+    while(!expected.empty()) {
+      vec.pop_back();
+      expected.pop_back();
+      checkMatches(vec,expected);
+    }
+    //Straddle a single boundary repeatedly
+    for(int i = 0; i<(int)chunkSize; i++) {
+      vec.push_back(i);
+      expected.push_back(i);
+    }
+    for(int rep = 0; rep<3; rep++) {
+      vec.pop_back();
+      expected.pop_back();
+      checkMatches(vec,expected);
+      vec.push_back(100+rep);
+      expected.push_back(100+rep);
+      checkMatches(vec,expected);
+    }
+    vec.clear();
+    expected.clear();
+    checkMatches(vec,expected);
+  }
+
+  //Copies diverge after a fork without disturbing each other or the chunks they share
+  {
+    PersistentVector<string> a;
+    vector<string> expectedA;
+    for(int i = 0; i<(int)(chunkSize*2+3); i++) {
+      a.push_back("a" + Global::intToString(i));
+      expectedA.push_back("a" + Global::intToString(i));
+    }
+    PersistentVector<string> b(a);
+    vector<string> expectedB = expectedA;
+    checkMatches(b,expectedB);
+
+    //Pop b back into a full chunk shared with a, forcing it to be unfrozen, then overwrite it
+    for(int i = 0; i<8; i++) {
+      b.pop_back();
+      expectedB.pop_back();
+    }
+    testAssert(b.sharedSize() == chunkSize);
+    for(int i = 0; i<(int)chunkSize; i++) {
+      b.push_back("b" + Global::intToString(i));
+      expectedB.push_back("b" + Global::intToString(i));
+    }
+    checkMatches(b,expectedB);
+    checkMatches(a,expectedA);
+
+    //And the other way around
+    for(int i = 0; i<(int)chunkSize; i++) {
+      a.push_back("c" + Global::intToString(i));
+      expectedA.push_back("c" + Global::intToString(i));
+    }
+    checkMatches(a,expectedA);
+    checkMatches(b,expectedB);
+
+    //Copy assignment, including over a longer vector and onto itself
+    PersistentVector<string> c;
+    for(int i = 0; i<(int)(chunkSize*4); i++)
+      c.push_back("x");
+    c = b;
+    checkMatches(c,expectedB);
+    PersistentVector<string>& cRef = c;
+    c = cRef;
+    checkMatches(c,expectedB);
+    c.pop_back();
+    c.push_back("d");
+    checkMatches(b,expectedB);
+  }
+
+  //Move construction and assignment
+  {
+    PersistentVector<int> a;
+    vector<int> expected;
+    for(int i = 0; i<(int)(chunkSize+10); i++) {
+      a.push_back(i);
+      expected.push_back(i);
+    }
+    PersistentVector<int> b(std::move(a));
+    checkMatches(b,expected);
+    testAssert(a.size() == 0);
+
+    PersistentVector<int> c;
+    c.push_back(-1);
+    c = std::move(b);
+    checkMatches(c,expected);
+    testAssert(b.size() == 0);
+
+    //Moved-from vectors remain usable
+    b.push_back(5);
+    checkMatches(b,vector<int>({5}));
+    c.push_back(99);
+    expected.push_back(99);
+    checkMatches(c,expected);
+  }
+}
@@ -0,0 +1,133 @@
+/*
+ * persistentvector.h
+ *
+ * Append-mostly vector whose full chunks are immutable and shared by reference count between copies.
+ * Copying one costs a pointer per chunk plus the partially filled tail, rather than the whole contents,
+ * which makes it cheap to fork long histories. Chunks are never mutated once full, so copies may be handed
+ * to and read from different threads independently.
+ */
+
+#ifndef CORE_PERSISTENTVECTOR_H
+#define CORE_PERSISTENTVECTOR_H
+
+#include "../core/global.h"
+
+template<typename T>
+class PersistentVector
+{
+ public:
+  static constexpr size_t CHUNK_BITS = 5;
+  static constexpr size_t CHUNK_SIZE = (size_t)1 << CHUNK_BITS;
+  static constexpr size_t CHUNK_MASK = CHUNK_SIZE-1;
+
+ private:
+  struct Chunk {
+    T elts[CHUNK_SIZE];
+  };
+  std::vector<std::shared_ptr<const Chunk>> chunks;
+  T tail[CHUNK_SIZE];
+  size_t tailSize;
+
+ public:
+  inline PersistentVector()
+    :chunks(),tailSize(0)
+  {}
+  inline ~PersistentVector()
+  {}
+
+  inline PersistentVector(const PersistentVector& other)
+    :chunks(other.chunks),tailSize(other.tailSize)
+  {
+    std::copy(other.tail, other.tail+other.tailSize, tail);
+  }
+  inline PersistentVector& operator=(const PersistentVector& other) {
+    if(this == &other)
+      return *this;
+    chunks = other.chunks;
+    tailSize = other.tailSize;
+    std::copy(other.tail, other.tail+other.tailSize, tail);
+    return *this;
+  }
+  inline PersistentVector(PersistentVector&& other) noexcept
+    :chunks(std::move(other.chunks)),tailSize(other.tailSize)
+  {
+    std::copy(other.tail, other.tail+other.tailSize, tail);
+    other.tailSize = 0;
+  }
+  inline PersistentVector& operator=(PersistentVector&& other) noexcept {
+    chunks = std::move(other.chunks);
+    tailSize = other.tailSize;
+    std::copy(other.tail, other.tail+other.tailSize, tail);
+    other.tailSize = 0;
+    return *this;
+  }
+
+  inline size_t size() const {
+    return (chunks.size() << CHUNK_BITS) + tailSize;
+  }
+  inline bool empty() const {
+    return chunks.size() == 0 && tailSize == 0;
+  }
+
+  inline const T& operator[](size_t idx) const {
+    assert(idx < size());
+    size_t chunkIdx = idx >> CHUNK_BITS;
+    if(chunkIdx < chunks.size())
+      return chunks[chunkIdx]->elts[idx & CHUNK_MASK];
+    return tail[idx & CHUNK_MASK];
+  }
+  inline const T& back() const {
+    assert(!empty());
+    return (*this)[size()-1];
+  }
+
+  inline void push_back(const T& elt) {
+    tail[tailSize] = elt;
+    tailSize++;
+    //Freeze the tail into a new shared chunk once full
+    if(tailSize == CHUNK_SIZE) {
+      std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+      std::copy(tail, tail+CHUNK_SIZE, chunk->elts);
+      chunks.push_back(std::move(chunk));
+      tailSize = 0;
+    }
+  }
+
+  //Removes the last element. If that requires unfreezing the last chunk, copies it back into the tail
+  //and leaves the shared chunk untouched for any other copies still referencing it.
+  inline void pop_back() {
+    assert(!empty());
+    if(tailSize == 0) {
+      const Chunk& chunk = *(chunks.back());
+      std::copy(chunk.elts, chunk.elts+CHUNK_SIZE, tail);
+      tailSize = CHUNK_SIZE;
+      chunks.pop_back();
+    }
+    tailSize--;
+  }
+
+  inline void clear() {
+    chunks.clear();
+    tailSize = 0;
+  }
+
+  //Number of leading elements that are stored in shared chunks rather than in this vector's own tail
+  inline size_t sharedSize() const {
+    return chunks.size() << CHUNK_BITS;
+  }
+
+  inline std::vector<T> toVector() const {
+    std::vector<T> ret;
+    ret.reserve(size());
+    for(size_t i = 0; i<chunks.size(); i++)
+      ret.insert(ret.end(), chunks[i]->elts, chunks[i]->elts+CHUNK_SIZE);
+    ret.insert(ret.end(), tail, tail+tailSize);
+    return ret;
+  }
+};
+
+namespace PersistentVectorTest {
+  void runTests();
+}
+
+#endif // CORE_PERSISTENTVECTOR_H
@@ -1,11 +1,32 @@
 #include <iostream>
 #include "base64.h"
 #include "bsearch.h"
+#include "concurrenthashset.h"
+#include "persistentvector.h"
+#include "transpositiontable.h"
+#include "weightedsampler.h"
+#include "../dataio/positionpool.h"
+#include "../dataio/poswriter.h"
+#include "../dataio/sgf.h"
+#include "../dataio/sgfarchive.h"
+#include "../game/boardhistory.h"
 using namespace std;
 
 int main() {
+  Board::initHash();
+
   Base64::runTests();
   BSearch::runTests();
+  ConcurrentHash128SetTest::runTests();
+  PersistentVectorTest::runTests();
+  TranspositionTableTest::runTests();
+  WeightedSamplerTest::runTests();
+  PositionSamplePool::runTests();
+  BoardHistory::runTests();
+  Sgf::runTests();
+  Sgf::PositionSample::runTests();
+  PosWriter::runTests();
+  SgfArchive::runTests();
   Global::pauseForKey();
   return 0;
 }
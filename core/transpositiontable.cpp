@@ -0,0 +1,185 @@
+#include "../core/transpositiontable.h"
+
+#include "../core/rand.h"
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+//Several words that are all derived from one another, so that a reader seeing a mix of two writes can tell
+//Large enough that copying one takes a while, giving overlapping writes plenty of chances to tear it.
+struct TranspositionTestValue {
+  uint64_t version;
+  uint64_t keyMix;
+  uint64_t checks[14];
+};
+
+static TranspositionTestValue makeCheckedValue(Hash128 key, uint64_t version) {
+  TranspositionTestValue value;
+  value.version = version;
+  value.keyMix = key.hash0 ^ key.hash1;
+  uint64_t check = version ^ value.keyMix;
+  for(int i = 0; i<14; i++) {
+    check = Hash::murmurMix(check);
+    value.checks[i] = check;
+  }
+  return value;
+}
+
+static bool isConsistent(Hash128 key, const TranspositionTestValue& value) {
+  if(value.keyMix != (key.hash0 ^ key.hash1))
+    return false;
+  uint64_t check = value.version ^ value.keyMix;
+  for(int i = 0; i<14; i++) {
+    check = Hash::murmurMix(check);
+    if(value.checks[i] != check)
+      return false;
+  }
+  return true;
+}
+
+void TranspositionTableTest::runTests() {
+  cout << "Running transposition table tests" << endl;
+
+  //Basic store and find, overwriting, and clear
+  {
+    TranspositionTable<int> table(4);
+    testAssert(table.getNumBuckets() == 16);
+    testAssert(table.getNumEntries() == 16 * TranspositionTable<int>::ENTRIES_PER_BUCKET);
+    testAssert(TranspositionTable<int>::BUCKET_STRIDE % TranspositionTable<int>::CACHE_LINE_SIZE == 0);
+    //Small values pack several entries along with the lock into a single cache line
+    testAssert(TranspositionTable<int>::ENTRIES_PER_BUCKET > 1);
+    testAssert(TranspositionTable<int>::BUCKET_STRIDE == TranspositionTable<int>::CACHE_LINE_SIZE);
+    testAssert(TranspositionTable<TranspositionTestValue>::ENTRIES_PER_BUCKET > 1);
+
+    int buf = -1;
+    Hash128 key(3,1000);
+    testAssert(!table.find(key,buf));
+    testAssert(table.store(key,5,10));
+    testAssert(table.find(key,buf) && buf == 5);
+    //The same key is overwritten regardless of priority
+    testAssert(table.store(key,6,0));
+    testAssert(table.find(key,buf) && buf == 6);
+    //Different key in the same bucket with the same hash0, must not be confused with it
+    testAssert(!table.find(Hash128(3,1001),buf));
+    testAssert(table.store(Hash128(3,1001),8,0));
+    testAssert(table.find(Hash128(3,1001),buf) && buf == 8);
+    testAssert(table.find(key,buf) && buf == 6);
+    table.clear();
+    testAssert(!table.find(key,buf));
+  }
+
+  //Eviction priority within a single full bucket
+  {
+    TranspositionTable<int> table(3);
+    const size_t n = TranspositionTable<int>::ENTRIES_PER_BUCKET;
+    //All keys land in bucket 5 since only hash0 picks the bucket
+    auto keyOf = [](uint64_t i) { return Hash128(5 + (i << 3), 777 + i); };
+    for(size_t i = 0; i<n; i++)
+      testAssert(table.store(keyOf(i),(int)i,(uint32_t)(10+i)));
+    int buf;
+    for(size_t i = 0; i<n; i++)
+      testAssert(table.find(keyOf(i),buf) && buf == (int)i);
+
+    //Lower priority than everything present is rejected and evicts nothing
+    testAssert(!table.store(keyOf(n),100,9));
+    testAssert(!table.find(keyOf(n),buf));
+    for(size_t i = 0; i<n; i++)
+      testAssert(table.find(keyOf(i),buf) && buf == (int)i);
+
+    //Equal to the lowest priority evicts exactly that entry
+    testAssert(table.store(keyOf(n),101,10));
+    testAssert(table.find(keyOf(n),buf) && buf == 101);
+    testAssert(!table.find(keyOf(0),buf));
+    for(size_t i = 1; i<n; i++)
+      testAssert(table.find(keyOf(i),buf) && buf == (int)i);
+
+    //Higher evicts whichever entry is now lowest
+    testAssert(table.store(keyOf(n+1),102,1000));
+    testAssert(table.find(keyOf(n+1),buf) && buf == 102);
+    testAssert(!table.find(keyOf(n),buf));
+    for(size_t i = 1; i<n; i++)
+      testAssert(table.find(keyOf(i),buf) && buf == (int)i);
+
+    //The highest priorities take part in eviction like any other, filling the bucket until nothing can be evicted
+    testAssert(table.store(keyOf(n+2),103,0xFFFFFFFFU));
+    testAssert(table.find(keyOf(n+2),buf) && buf == 103);
+    testAssert(table.find(keyOf(n+1),buf) && buf == 102);
+    for(size_t i = 1; i<n; i++)
+      testAssert(table.store(keyOf(n+2+i),(int)(103+i),0xFFFFFFFFU-1));
+    testAssert(!table.find(keyOf(n+1),buf));
+    testAssert(!table.store(keyOf(2*n+2),200,0xFFFFFFFFU-2));
+    for(size_t i = 0; i<n; i++)
+      testAssert(table.find(keyOf(n+2+i),buf) && buf == (int)(103+i));
+
+    //Other buckets are unaffected
+    testAssert(!table.find(Hash128(4,777),buf));
+    testAssert(table.store(Hash128(4,777),7,0));
+    testAssert(table.find(Hash128(4,777),buf) && buf == 7);
+  }
+
+  //Concurrent writers and readers on a small table, so that they constantly collide on the same buckets.
+  //Readers must never see a value mixing two writes, or a value for a different key.
+  {
+    TranspositionTable<TranspositionTestValue> table(3);
+    const int numKeys = 32;
+    vector<Hash128> keys;
+    Rand keyRand("transpositiontable keys");
+    for(int i = 0; i<numKeys; i++)
+      keys.push_back(Hash128(keyRand.nextUInt64(),keyRand.nextUInt64()));
+
+    const int numWriters = 4;
+    const int numReaders = 4;
+    const int numOpsPerThread = 300000;
+    std::atomic<int64_t> numFound(0);
+    std::atomic<int64_t> numTorn(0);
+
+    auto writeLoop = [&](int threadIdx) {
+      Rand rand("transpositiontable writer " + Global::intToString(threadIdx));
+      for(int i = 0; i<numOpsPerThread; i++) {
+        Hash128 key = keys[rand.nextUInt(numKeys)];
+        uint64_t version = ((uint64_t)threadIdx << 32) | (uint64_t)i;
+        table.store(key,makeCheckedValue(key,version),rand.nextUInt(100));
+      }
+    };
+    auto readLoop = [&](int threadIdx) {
+      Rand rand("transpositiontable reader " + Global::intToString(threadIdx));
+      int64_t found = 0;
+      int64_t torn = 0;
+      for(int i = 0; i<numOpsPerThread; i++) {
+        Hash128 key = keys[rand.nextUInt(numKeys)];
+        TranspositionTestValue value;
+        if(table.find(key,value)) {
+          found++;
+          if(!isConsistent(key,value))
+            torn++;
+        }
+      }
+      numFound += found;
+      numTorn += torn;
+    };
+
+    vector<std::thread> threads;
+    for(int i = 0; i<numWriters; i++)
+      threads.push_back(std::thread(writeLoop,i));
+    for(int i = 0; i<numReaders; i++)
+      threads.push_back(std::thread(readLoop,i));
+    for(size_t i = 0; i<threads.size(); i++)
+      threads[i].join();
+
+    testAssert(numTorn.load() == 0);
+    testAssert(numFound.load() > 0);
+
+    //Everything left in the table afterward is intact too
+    int numPresent = 0;
+    for(int i = 0; i<numKeys; i++) {
+      TranspositionTestValue value;
+      if(table.find(keys[i],value)) {
+        numPresent++;
+        testAssert(isConsistent(keys[i],value));
+      }
+    }
+    testAssert(numPresent > 0 && (size_t)numPresent <= table.getNumEntries());
+  }
+}
@@ -0,0 +1,259 @@
+/*
+ * transpositiontable.h
+ *
+ * Fixed-capacity hash table keyed by Hash128 (such as from GraphHash), shared between search threads without a global mutex.
+ * Each bucket holds several entries packed into as few cache lines as possible (one, for small values), and is
+ * guarded by its own sequence lock: writers to
+ * the same bucket briefly spin on each other, while readers take no lock and never hold up writers, simply retrying
+ * if they overlap a write. Either one waiting on a writer spins only briefly before yielding, in case that writer
+ * was preempted partway through.
+ *
+ * Value is the payload and must be trivially copyable, since readers may copy it while it is being written
+ * and discard the copy afterward. When a bucket is full, a store evicts the entry with the lowest priority
+ * (such as search depth or visits), and only if the new entry's priority is at least as high.
+ *
+ * Keys are assumed to be well-mixed hashes. The low bits of hash0 pick the bucket and entries keep only hash1 to tell
+ * keys within a bucket apart, so two different keys are confused only if they share a bucket and all 64 bits of hash1.
+ */
+
+#ifndef CORE_TRANSPOSITIONTABLE_H
+#define CORE_TRANSPOSITIONTABLE_H
+
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define TRANSPOSITIONTABLE_HAS_MM_PAUSE
+#endif
+
+#include "../core/global.h"
+#include "../core/hash.h"
+
+template<typename Value>
+class TranspositionTable {
+  static_assert(std::is_trivially_copyable<Value>::value, "TranspositionTable values must be trivially copyable");
+
+ public:
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+
+  struct Entry {
+    uint64_t keyHash1;
+    //Priority plus one, saturating, or 0 if the entry is empty
+    uint32_t storedPriority;
+    Value value;
+  };
+
+  //As many entries as fit in a cache line along with the lock, but always at least two so that stores have a choice
+  //of what to evict, letting the bucket span several cache lines if the values are large
+  static constexpr size_t ENTRIES_PER_BUCKET =
+    (CACHE_LINE_SIZE - sizeof(uint64_t)) / sizeof(Entry) > 2 ? (CACHE_LINE_SIZE - sizeof(uint64_t)) / sizeof(Entry) : 2;
+
+  struct Bucket {
+    //Odd while a writer holds the bucket, incremented once on lock and once on unlock
+    std::atomic<uint64_t> seq;
+    Entry entries[ENTRIES_PER_BUCKET];
+  };
+  //Buckets are laid out this far apart, a whole number of cache lines, starting from a cache-line-aligned address.
+  //Aligned by hand rather than with alignas, since new is not guaranteed to respect extended alignment before C++17.
+  static constexpr size_t BUCKET_STRIDE = (sizeof(Bucket) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  static_assert(std::is_trivially_destructible<Bucket>::value, "");
+
+  //Number of times to spin on a bucket held by a writer before starting to yield the thread
+  static constexpr int SPINS_BEFORE_YIELD = 64;
+
+ private:
+  char* storage;
+  char* bucketStart;
+  uint64_t bucketMask;
+  size_t numBuckets;
+
+ public:
+  //Creates a table with 2^sizePowerOfTwo buckets
+  TranspositionTable(int sizePowerOfTwo);
+  ~TranspositionTable();
+
+  TranspositionTable(const TranspositionTable& other) = delete;
+  TranspositionTable& operator=(const TranspositionTable& other) = delete;
+
+  size_t getNumBuckets() const;
+  size_t getNumEntries() const;
+
+  //Hint that key will be looked up soon, so its bucket can be brought into cache while the caller does other work.
+  void prefetch(Hash128 key) const;
+
+  //Returns true and copies the value into buf if key is present. Thread-safe, never blocks writers.
+  bool find(Hash128 key, Value& buf) const;
+  //Stores value for key, overwriting any existing value for key. Otherwise uses an empty entry in the bucket,
+  //or else replaces the lowest-priority entry if its priority is <= priority. Returns false if nothing was stored.
+  //Priorities of 0xFFFFFFFE and 0xFFFFFFFF are treated as equal. Thread-safe.
+  bool store(Hash128 key, const Value& value, uint32_t priority);
+
+  //Empties the table. NOT thread-safe, no other thread may be accessing the table.
+  void clear();
+
+ private:
+  Bucket& getBucket(Hash128 key) const;
+  void lockBucket(Bucket& bucket) const;
+  void unlockBucket(Bucket& bucket) const;
+  static void spinWait(int& numSpins);
+};
+
+namespace TranspositionTableTest {
+  void runTests();
+}
+
+template<typename Value>
+TranspositionTable<Value>::TranspositionTable(int sizePowerOfTwo) {
+  if(sizePowerOfTwo < 0 || sizePowerOfTwo > 40)
+    throw StringError("TranspositionTable: invalid sizePowerOfTwo: " + Global::intToString(sizePowerOfTwo));
+  numBuckets = (size_t)1 << sizePowerOfTwo;
+  bucketMask = numBuckets-1;
+  storage = new char[numBuckets * BUCKET_STRIDE + CACHE_LINE_SIZE];
+  size_t misalignment = (size_t)((uintptr_t)storage % CACHE_LINE_SIZE);
+  bucketStart = storage + (misalignment == 0 ? 0 : CACHE_LINE_SIZE - misalignment);
+  for(size_t i = 0; i<numBuckets; i++)
+    new (bucketStart + i * BUCKET_STRIDE) Bucket();
+  clear();
+}
+
+template<typename Value>
+TranspositionTable<Value>::~TranspositionTable() {
+  //Buckets are trivially destructible, so just release the storage
+  delete[] storage;
+}
+
+template<typename Value>
+size_t TranspositionTable<Value>::getNumBuckets() const {
+  return numBuckets;
+}
+
+template<typename Value>
+size_t TranspositionTable<Value>::getNumEntries() const {
+  return numBuckets * ENTRIES_PER_BUCKET;
+}
+
+template<typename Value>
+typename TranspositionTable<Value>::Bucket& TranspositionTable<Value>::getBucket(Hash128 key) const {
+  return *reinterpret_cast<Bucket*>(bucketStart + (key.hash0 & bucketMask) * BUCKET_STRIDE);
+}
+
+template<typename Value>
+void TranspositionTable<Value>::prefetch(Hash128 key) const {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(&getBucket(key));
+#else
+  (void)key;
+#endif
+}
+
+template<typename Value>
+void TranspositionTable<Value>::spinWait(int& numSpins) {
+  if(numSpins < SPINS_BEFORE_YIELD) {
+    numSpins++;
+#ifdef TRANSPOSITIONTABLE_HAS_MM_PAUSE
+    _mm_pause();
+#endif
+  }
+  else
+    std::this_thread::yield();
+}
+
+template<typename Value>
+void TranspositionTable<Value>::lockBucket(Bucket& bucket) const {
+  int numSpins = 0;
+  while(true) {
+    uint64_t seq = bucket.seq.load(std::memory_order_relaxed);
+    if((seq & 1) == 0 && bucket.seq.compare_exchange_weak(seq, seq+1, std::memory_order_acquire, std::memory_order_relaxed))
+      break;
+    spinWait(numSpins);
+  }
+  //Order the lock before any of the writes to the entries, as seen by readers
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+template<typename Value>
+void TranspositionTable<Value>::unlockBucket(Bucket& bucket) const {
+  bucket.seq.fetch_add(1, std::memory_order_release);
+}
+
+template<typename Value>
+bool TranspositionTable<Value>::find(Hash128 key, Value& buf) const {
+  const Bucket& bucket = getBucket(key);
+  int numSpins = 0;
+  while(true) {
+    uint64_t seqBefore = bucket.seq.load(std::memory_order_acquire);
+    if(seqBefore & 1) {
+      spinWait(numSpins);
+      continue;
+    }
+    bool found = false;
+    for(size_t i = 0; i<ENTRIES_PER_BUCKET; i++) {
+      const Entry& entry = bucket.entries[i];
+      if(entry.storedPriority != 0 && entry.keyHash1 == key.hash1) {
+        std::memcpy((void*)&buf, (const void*)&entry.value, sizeof(Value));
+        found = true;
+        break;
+      }
+    }
+    //If a writer touched the bucket in the meantime, what we read may be torn, so try again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(bucket.seq.load(std::memory_order_relaxed) == seqBefore)
+      return found;
+  }
+}
+
+template<typename Value>
+bool TranspositionTable<Value>::store(Hash128 key, const Value& value, uint32_t priority) {
+  uint32_t storedPriority = priority < 0xFFFFFFFFU ? priority+1 : priority;
+  Bucket& bucket = getBucket(key);
+  lockBucket(bucket);
+
+  Entry* match = NULL;
+  Entry* empty = NULL;
+  Entry* lowest = NULL;
+  for(size_t i = 0; i<ENTRIES_PER_BUCKET; i++) {
+    Entry& entry = bucket.entries[i];
+    if(entry.storedPriority == 0) {
+      if(empty == NULL)
+        empty = &entry;
+    }
+    else if(entry.keyHash1 == key.hash1) {
+      match = &entry;
+      break;
+    }
+    else if(lowest == NULL || entry.storedPriority < lowest->storedPriority)
+      lowest = &entry;
+  }
+
+  Entry* target = NULL;
+  if(match != NULL)
+    target = match;
+  else if(empty != NULL)
+    target = empty;
+  else if(lowest != NULL && lowest->storedPriority <= storedPriority)
+    target = lowest;
+
+  bool stored = false;
+  if(target != NULL) {
+    target->keyHash1 = key.hash1;
+    target->storedPriority = storedPriority;
+    std::memcpy((void*)&target->value, (const void*)&value, sizeof(Value));
+    stored = true;
+  }
+  unlockBucket(bucket);
+  return stored;
+}
+
+template<typename Value>
+void TranspositionTable<Value>::clear() {
+  for(size_t i = 0; i<numBuckets; i++) {
+    Bucket& bucket = *reinterpret_cast<Bucket*>(bucketStart + i * BUCKET_STRIDE);
+    bucket.seq.store(0, std::memory_order_relaxed);
+    std::memset((void*)bucket.entries, 0, sizeof(bucket.entries));
+  }
+}
+
+#endif // CORE_TRANSPOSITIONTABLE_H
@@ -0,0 +1,366 @@
+#include "../core/weightedsampler.h"
+
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+static void checkSamplerWeight(const char* who, double weight) {
+  if(!(weight >= 0.0) || !std::isfinite(weight))
+    throw StringError(string(who) + ": invalid weight " + Global::doubleToString(weight));
+}
+
+//AliasTable---------------------------------------------------------------------------------------------------
+
+AliasTable::AliasTable()
+  :buckets(),totalWeight(0.0)
+{}
+
+AliasTable::AliasTable(const double* weights, size_t n)
+  :buckets(),totalWeight(0.0)
+{
+  init(weights,n);
+}
+
+AliasTable::AliasTable(const vector<double>& weights)
+  :buckets(),totalWeight(0.0)
+{
+  init(weights);
+}
+
+AliasTable::~AliasTable()
+{}
+
+void AliasTable::init(const vector<double>& weights) {
+  init(weights.data(),weights.size());
+}
+
+void AliasTable::clear() {
+  buckets.clear();
+  totalWeight = 0.0;
+}
+
+void AliasTable::init(const double* weights, size_t n) {
+  clear();
+  if(n <= 0)
+    throw StringError("AliasTable: no weights");
+  if(n > (size_t)0xFFFFFFFFU)
+    throw StringError("AliasTable: too many weights");
+
+  double sum = 0.0;
+  for(size_t i = 0; i<n; i++) {
+    checkSamplerWeight("AliasTable",weights[i]);
+    sum += weights[i];
+  }
+  if(!(sum > 0.0) || !std::isfinite(sum))
+    throw StringError("AliasTable: total weight must be positive and finite");
+
+  //Vose's construction. Scale the weights to average 1, then repeatedly fill up an underfull bucket from an
+  //overfull one, which then has that much less left over.
+  buckets.resize(n);
+  vector<double> scaled(n);
+  vector<uint32_t> small;
+  vector<uint32_t> large;
+  double scale = (double)n / sum;
+  for(size_t i = 0; i<n; i++) {
+    scaled[i] = weights[i] * scale;
+    if(scaled[i] < 1.0)
+      small.push_back((uint32_t)i);
+    else
+      large.push_back((uint32_t)i);
+  }
+  while(small.size() > 0 && large.size() > 0) {
+    uint32_t s = small.back();
+    small.pop_back();
+    uint32_t l = large.back();
+    buckets[s].keepProb = scaled[s];
+    buckets[s].alias = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if(scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  //Whatever remains is within rounding error of exactly full
+  for(size_t i = 0; i<large.size(); i++) {
+    buckets[large[i]].keepProb = 1.0;
+    buckets[large[i]].alias = large[i];
+  }
+  for(size_t i = 0; i<small.size(); i++) {
+    buckets[small[i]].keepProb = 1.0;
+    buckets[small[i]].alias = small[i];
+  }
+  totalWeight = sum;
+}
+
+size_t AliasTable::size() const {
+  return buckets.size();
+}
+
+double AliasTable::getTotalWeight() const {
+  return totalWeight;
+}
+
+double AliasTable::getProb(size_t idx) const {
+  size_t n = buckets.size();
+  assert(idx < n);
+  double prob = buckets[idx].keepProb;
+  for(size_t i = 0; i<n; i++) {
+    if(i != idx && buckets[i].alias == idx)
+      prob += 1.0 - buckets[i].keepProb;
+  }
+  return prob / (double)n;
+}
+
+//DynamicWeightedSampler---------------------------------------------------------------------------------------
+
+DynamicWeightedSampler::DynamicWeightedSampler()
+  :tree(),capacity(0),numItems(0)
+{
+  clear();
+}
+
+DynamicWeightedSampler::DynamicWeightedSampler(const double* weights, size_t n)
+  :tree(),capacity(0),numItems(0)
+{
+  init(weights,n);
+}
+
+DynamicWeightedSampler::DynamicWeightedSampler(const vector<double>& weights)
+  :tree(),capacity(0),numItems(0)
+{
+  init(weights);
+}
+
+DynamicWeightedSampler::~DynamicWeightedSampler()
+{}
+
+void DynamicWeightedSampler::init(const vector<double>& weights) {
+  init(weights.data(),weights.size());
+}
+
+void DynamicWeightedSampler::clear() {
+  capacity = 1;
+  numItems = 0;
+  tree.assign(2,0.0);
+}
+
+void DynamicWeightedSampler::init(const double* weights, size_t n) {
+  for(size_t i = 0; i<n; i++)
+    checkSamplerWeight("DynamicWeightedSampler",weights[i]);
+  size_t newCapacity = 1;
+  while(newCapacity < n)
+    newCapacity *= 2;
+  capacity = newCapacity;
+  numItems = n;
+  tree.assign(2*capacity,0.0);
+  std::copy(weights,weights+n,tree.begin()+capacity);
+  for(size_t node = capacity-1; node >= 1; node--)
+    tree[node] = tree[2*node] + tree[2*node+1];
+}
+
+void DynamicWeightedSampler::rebuild(size_t newCapacity) {
+  vector<double> weights(tree.begin()+capacity, tree.begin()+capacity+numItems);
+  capacity = newCapacity;
+  tree.assign(2*capacity,0.0);
+  std::copy(weights.begin(),weights.end(),tree.begin()+capacity);
+  for(size_t node = capacity-1; node >= 1; node--)
+    tree[node] = tree[2*node] + tree[2*node+1];
+}
+
+size_t DynamicWeightedSampler::add(double weight) {
+  checkSamplerWeight("DynamicWeightedSampler",weight);
+  if(numItems >= capacity)
+    rebuild(capacity*2);
+  size_t idx = numItems;
+  numItems++;
+  setWeight(idx,weight);
+  return idx;
+}
+
+void DynamicWeightedSampler::setWeight(size_t idx, double weight) {
+  checkSamplerWeight("DynamicWeightedSampler",weight);
+  if(idx >= numItems)
+    throw StringError("DynamicWeightedSampler::setWeight: index out of range");
+  size_t node = capacity + idx;
+  tree[node] = weight;
+  for(node /= 2; node >= 1; node /= 2)
+    tree[node] = tree[2*node] + tree[2*node+1];
+}
+
+double DynamicWeightedSampler::getWeight(size_t idx) const {
+  assert(idx < numItems);
+  return tree[capacity + idx];
+}
+
+size_t DynamicWeightedSampler::size() const {
+  return numItems;
+}
+
+double DynamicWeightedSampler::getTotalWeight() const {
+  return tree[1];
+}
+
+//Tests--------------------------------------------------------------------------------------------------------
+
+//Draws numDraws samples and checks their frequencies against weights with a chi-square test. Items of zero weight
+//must never be drawn and are left out of the statistic.
+template<typename Sampler>
+static void checkSampleFrequencies(const Sampler& sampler, const vector<double>& weights, Rand& rand, int numDraws) {
+  size_t n = weights.size();
+  vector<int> counts(n,0);
+  for(int i = 0; i<numDraws; i++) {
+    size_t idx = sampler.sample(rand);
+    testAssert(idx < n);
+    counts[idx]++;
+  }
+  double sum = 0.0;
+  for(size_t i = 0; i<n; i++)
+    sum += weights[i];
+  double chiSquare = 0.0;
+  int numNonzero = 0;
+  for(size_t i = 0; i<n; i++) {
+    if(weights[i] <= 0.0) {
+      testAssert(counts[i] == 0);
+      continue;
+    }
+    double expected = numDraws * weights[i] / sum;
+    chiSquare += (counts[i] - expected) * (counts[i] - expected) / expected;
+    numNonzero++;
+  }
+  //Mean of the distribution plus about 5 standard deviations, loose enough not to fail by chance for fixed seeds
+  //but still far below the statistic for a sampler that is off by a few percent on any item.
+  double degreesOfFreedom = std::max(numNonzero-1,1);
+  testAssert(chiSquare < degreesOfFreedom + 5.0 * sqrt(2.0 * degreesOfFreedom));
+}
+
+static void checkAliasProbs(const vector<double>& weights) {
+  AliasTable table(weights);
+  testAssert(table.size() == weights.size());
+  double sum = 0.0;
+  for(size_t i = 0; i<weights.size(); i++)
+    sum += weights[i];
+  testAssert(table.getTotalWeight() == sum);
+  double totalProb = 0.0;
+  for(size_t i = 0; i<weights.size(); i++) {
+    double prob = table.getProb(i);
+    if(weights[i] <= 0.0)
+      testAssert(prob == 0.0);
+    else
+      testAssert(std::fabs(prob - weights[i] / sum) < 1e-12);
+    totalProb += prob;
+  }
+  testAssert(std::fabs(totalProb - 1.0) < 1e-12);
+}
+
+void WeightedSamplerTest::runTests() {
+  cout << "Running weighted sampler tests" << endl;
+  Rand rand("weightedsampler tests");
+  const int numDraws = 200000;
+
+  vector<vector<double>> weightSets;
+  weightSets.push_back({1.0});
+  weightSets.push_back({0.0, 2.5});
+  weightSets.push_back({3.0, 0.0, 1.0, 0.0, 6.0});
+  weightSets.push_back({1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0});
+  weightSets.push_back({1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0});
+  weightSets.push_back({1e-6, 1.0, 1e3, 0.0, 50.0, 0.25});
+  {
+    vector<double> weights;
+    for(int i = 0; i<37; i++)
+      weights.push_back(i % 5 == 0 ? 0.0 : rand.nextDouble() * 10.0);
+    weightSets.push_back(weights);
+  }
+
+  //AliasTable probabilities exactly match the normalized weights, and samples match them in frequency
+  for(size_t i = 0; i<weightSets.size(); i++) {
+    checkAliasProbs(weightSets[i]);
+    AliasTable table(weightSets[i]);
+    checkSampleFrequencies(table,weightSets[i],rand,numDraws);
+  }
+  {
+    bool threw = false;
+    try { AliasTable table(vector<double>({0.0, 0.0})); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    threw = false;
+    try { AliasTable table(vector<double>({1.0, -1.0})); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    threw = false;
+    vector<double> noWeights;
+    try { AliasTable table(noWeights); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+  }
+
+  //DynamicWeightedSampler built all at once
+  for(size_t i = 0; i<weightSets.size(); i++) {
+    DynamicWeightedSampler sampler(weightSets[i]);
+    testAssert(sampler.size() == weightSets[i].size());
+    for(size_t j = 0; j<weightSets[i].size(); j++)
+      testAssert(sampler.getWeight(j) == weightSets[i][j]);
+    checkSampleFrequencies(sampler,weightSets[i],rand,numDraws);
+  }
+
+  //Growing one at a time past several capacities, then changing weights, including to and from zero
+  {
+    DynamicWeightedSampler sampler;
+    vector<double> weights;
+    testAssert(sampler.size() == 0);
+    for(int i = 0; i<11; i++) {
+      double weight = (i == 4) ? 0.0 : 1.0 + i;
+      testAssert(sampler.add(weight) == (size_t)i);
+      weights.push_back(weight);
+      checkSampleFrequencies(sampler,weights,rand,numDraws/10);
+    }
+    checkSampleFrequencies(sampler,weights,rand,numDraws);
+
+    sampler.setWeight(0,0.0);
+    weights[0] = 0.0;
+    sampler.setWeight(4,20.0);
+    weights[4] = 20.0;
+    sampler.setWeight(10,0.5);
+    weights[10] = 0.5;
+    double sum = 0.0;
+    for(size_t i = 0; i<weights.size(); i++)
+      sum += weights[i];
+    testAssert(std::fabs(sampler.getTotalWeight() - sum) < 1e-12);
+    checkSampleFrequencies(sampler,weights,rand,numDraws);
+
+    bool threw = false;
+    try { sampler.setWeight(11,1.0); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    threw = false;
+    try { sampler.setWeight(3,-1.0); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+  }
+
+  //Descent never enters a subtree of zero weight, wherever the only nonzero leaves are
+  {
+    for(int n = 1; n <= 9; n++) {
+      for(int nonzero = 0; nonzero < n; nonzero++) {
+        vector<double> weights(n,0.0);
+        weights[nonzero] = 1e-300;
+        DynamicWeightedSampler sampler(weights);
+        for(int i = 0; i<200; i++)
+          testAssert(sampler.sample(rand) == (size_t)nonzero);
+      }
+    }
+    //Weights differing so much that the smaller ones vanish in the partial sums
+    vector<double> weights({0.0, 1e-20, 0.0, 0.0, 1.0, 0.0});
+    DynamicWeightedSampler sampler(weights);
+    for(int i = 0; i<10000; i++) {
+      size_t idx = sampler.sample(rand);
+      testAssert(idx == 1 || idx == 4);
+    }
+
+    sampler.setWeight(1,0.0);
+    sampler.setWeight(4,0.0);
+    testAssert(sampler.getTotalWeight() == 0.0);
+    bool threw = false;
+    try { sampler.sample(rand); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    sampler.setWeight(5,2.0);
+    for(int i = 0; i<200; i++)
+      testAssert(sampler.sample(rand) == 5);
+  }
+}
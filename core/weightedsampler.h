@@ -0,0 +1,120 @@
+/*
+ * weightedsampler.h
+ *
+ * Repeated random selection of indices in proportion to nonnegative weights, for when there are too many items to
+ * scan over the weights on every draw as Rand::nextUInt(const double*,size_t) does.
+ *
+ * AliasTable is Walker's alias method with Vose's construction: O(n) to build, then O(1) per draw, but the weights
+ * are fixed once built. DynamicWeightedSampler keeps the weights in a binary tree of partial sums so that weights can
+ * be changed or items appended at O(log n) each, at the cost of O(log n) per draw.
+ */
+
+#ifndef CORE_WEIGHTEDSAMPLER_H_
+#define CORE_WEIGHTEDSAMPLER_H_
+
+#include "../core/global.h"
+#include "../core/rand.h"
+
+class AliasTable {
+  struct Bucket {
+    //Probability of keeping this bucket's own index rather than taking the alias
+    double keepProb;
+    uint32_t alias;
+  };
+  std::vector<Bucket> buckets;
+  double totalWeight;
+
+ public:
+  //An empty table, that cannot be sampled until initialized.
+  AliasTable();
+  //Throws StringError if any weight is negative or not finite, or if all weights are zero.
+  AliasTable(const double* weights, size_t n);
+  AliasTable(const std::vector<double>& weights);
+  ~AliasTable();
+
+  void init(const double* weights, size_t n);
+  void init(const std::vector<double>& weights);
+  void clear();
+
+  size_t size() const;
+  double getTotalWeight() const;
+  //Probability that sample returns idx, for testing
+  double getProb(size_t idx) const;
+
+  //Returns an index in [0,size()) with probability proportional to its weight.
+  size_t sample(Rand& rand) const;
+};
+
+class DynamicWeightedSampler {
+  //Implicit complete binary tree, node i has children 2i and 2i+1 and holds the sum of the weights below it,
+  //with the weights themselves as the leaves starting at index capacity. Each node is recomputed from its children
+  //rather than adjusted by the change in weight, so that rounding errors do not accumulate over many updates.
+  std::vector<double> tree;
+  size_t capacity;
+  size_t numItems;
+
+ public:
+  DynamicWeightedSampler();
+  //Throws StringError if any weight is negative or not finite. Unlike AliasTable, all weights may be zero.
+  DynamicWeightedSampler(const double* weights, size_t n);
+  DynamicWeightedSampler(const std::vector<double>& weights);
+  ~DynamicWeightedSampler();
+
+  void init(const double* weights, size_t n);
+  void init(const std::vector<double>& weights);
+  void clear();
+
+  //Appends a new item, returning its index.
+  size_t add(double weight);
+  void setWeight(size_t idx, double weight);
+  double getWeight(size_t idx) const;
+
+  size_t size() const;
+  double getTotalWeight() const;
+
+  //Returns an index in [0,size()) with probability proportional to its weight.
+  //Throws StringError if the total weight is zero.
+  size_t sample(Rand& rand) const;
+
+ private:
+  void rebuild(size_t newCapacity);
+};
+
+inline size_t AliasTable::sample(Rand& rand) const {
+  size_t n = buckets.size();
+  if(n <= 0)
+    throw StringError("AliasTable::sample: table is empty");
+  //A single double in [0,n) gives both the bucket and, from the fractional part, whether to take its alias.
+  double d = rand.nextDouble() * (double)n;
+  size_t idx = (size_t)d;
+  if(idx >= n)
+    idx = n-1;
+  const Bucket& bucket = buckets[idx];
+  if(d - (double)idx < bucket.keepProb)
+    return idx;
+  return bucket.alias;
+}
+
+inline size_t DynamicWeightedSampler::sample(Rand& rand) const {
+  if(!(tree[1] > 0.0))
+    throw StringError("DynamicWeightedSampler::sample: total weight is zero");
+  double r = rand.nextDouble(tree[1]);
+  size_t node = 1;
+  while(node < capacity) {
+    double leftWeight = tree[2*node];
+    //Never descend into a subtree with zero weight, even if rounding leaves r at the edge of the range.
+    if((r < leftWeight && leftWeight > 0.0) || !(tree[2*node+1] > 0.0))
+      node = 2*node;
+    else {
+      r -= leftWeight;
+      node = 2*node+1;
+    }
+  }
+  return node - capacity;
+}
+
+namespace WeightedSamplerTest {
+  void runTests();
+}
+
+#endif // CORE_WEIGHTEDSAMPLER_H_
@@ -0,0 +1,263 @@
+#include "../dataio/hashquality.h"
+
+#include "../core/multithread.h"
+#include "../core/timer.h"
+#include "../dataio/sgf.h"
+#include "../game/graphhash.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+int64_t HashQuality::countTruncatedCollisions(const vector<Hash128>& distinctHashes, int numBits) {
+  if(numBits < 1 || numBits > 128)
+    throw StringError("countTruncatedCollisions: invalid numBits: " + Global::intToString(numBits));
+  uint64_t mask0 = numBits >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << numBits) - 1);
+  uint64_t mask1 = numBits >= 128 ? ~(uint64_t)0 : numBits <= 64 ? 0 : (((uint64_t)1 << (numBits-64)) - 1);
+
+  vector<Hash128> truncated(distinctHashes.size());
+  for(size_t i = 0; i<distinctHashes.size(); i++)
+    truncated[i] = Hash128(distinctHashes[i].hash0 & mask0, distinctHashes[i].hash1 & mask1);
+  std::sort(truncated.begin(),truncated.end());
+
+  int64_t numCollisions = 0;
+  for(size_t i = 1; i<truncated.size(); i++) {
+    if(truncated[i] == truncated[i-1])
+      numCollisions++;
+  }
+  return numCollisions;
+}
+
+double HashQuality::expectedTruncatedCollisions(int64_t n, int numBits) {
+  if(n <= 1)
+    return 0.0;
+  double numBuckets = std::ldexp(1.0, numBits);
+  double dn = (double)n;
+  //Well into the sparse regime, the exact formula below cancels catastrophically, so use the birthday approximation
+  if(dn * dn < numBuckets * 1e-6)
+    return dn * (dn - 1.0) / (2.0 * numBuckets);
+  //n minus the expected number of occupied buckets
+  double expectedOccupied = -numBuckets * std::expm1(dn * std::log1p(-1.0 / numBuckets));
+  return dn - expectedOccupied;
+}
+
+HashQuality::AvalancheStats HashQuality::measureAvalanche(const std::function<uint64_t(uint64_t)>& mix, const vector<uint64_t>& inputs) {
+  //flipCounts[i*64+j] counts how often flipping input bit i flipped output bit j
+  vector<int64_t> flipCounts(64*64, 0);
+  for(size_t n = 0; n<inputs.size(); n++) {
+    uint64_t x = inputs[n];
+    uint64_t y = mix(x);
+    for(int i = 0; i<64; i++) {
+      uint64_t diff = y ^ mix(x ^ ((uint64_t)1 << i));
+      int64_t* counts = flipCounts.data() + i*64;
+      for(int j = 0; j<64; j++)
+        counts[j] += (int64_t)((diff >> j) & 1);
+    }
+  }
+
+  AvalancheStats stats;
+  stats.numSamples = (int64_t)inputs.size();
+  stats.meanFlipRate = 0.0;
+  stats.maxBias = 0.0;
+  if(inputs.size() <= 0)
+    return stats;
+
+  double total = 0.0;
+  for(int k = 0; k<64*64; k++) {
+    double rate = (double)flipCounts[k] / (double)inputs.size();
+    total += rate;
+    stats.maxBias = std::max(stats.maxBias, std::fabs(rate - 0.5));
+  }
+  stats.meanFlipRate = total / (64.0*64.0);
+  return stats;
+}
+
+static const int HQ_POS_HASH = 0;
+static const int HQ_SITUATION_HASH = 1;
+static const int HQ_GRAPH_HASH = 2;
+static const int HQ_NUM_KINDS = 3;
+static const char* HQ_KIND_NAMES[HQ_NUM_KINDS] = {
+  "Board::pos_hash",
+  "getSituationRulesAndKoHash",
+  "GraphHash::getGraphHash",
+};
+
+struct HashQualityThreadResult {
+  vector<Hash128> hashes[HQ_NUM_KINDS];
+  //Seconds spent replaying, and replaying while also computing each kind of hash
+  double replaySeconds = 0.0;
+  double kindSeconds[HQ_NUM_KINDS] = {0.0, 0.0, 0.0};
+  int64_t numPositions = 0;
+  int64_t numGames = 0;
+  int64_t numSkipped = 0;
+  vector<string> errors;
+};
+
+static void hashQualityProcessSgf(
+  const CompactSgf* sgf,
+  const Rules& defaultRules,
+  int repBound,
+  HashQualityThreadResult& result
+) {
+  const double drawEquivalentWinsForWhite = 0.5;
+  Rules rules = sgf->getRulesOrFailAllowUnspecified(defaultRules);
+
+  Board board;
+  Player nextPla;
+  BoardHistory hist;
+  ClockTimer timer;
+
+  //Pass 1 - plain replay, which maintains pos_hash incrementally anyways, so it is free to record
+  vector<Hash128> posHashes;
+  posHashes.reserve(sgf->moves.size()+1);
+  timer.reset();
+  sgf->setupInitialBoardAndHist(rules, board, nextPla, hist);
+  posHashes.push_back(board.pos_hash);
+  for(size_t i = 0; i<sgf->moves.size(); i++) {
+    const Move& move = sgf->moves[i];
+    if(!hist.makeBoardMoveTolerant(board, move.loc, move.pla))
+      throw StringError("Illegal move " + Location::toString(move.loc,board) + " at turn " + Global::uint64ToString(i));
+    posHashes.push_back(board.pos_hash);
+  }
+  double replaySeconds = timer.getSeconds();
+
+  //Pass 2 - replay computing the situation hash at every position
+  vector<Hash128> situationHashes;
+  situationHashes.reserve(sgf->moves.size()+1);
+  timer.reset();
+  sgf->setupInitialBoardAndHist(rules, board, nextPla, hist);
+  situationHashes.push_back(BoardHistory::getSituationRulesAndKoHash(board, hist, nextPla, drawEquivalentWinsForWhite));
+  for(size_t i = 0; i<sgf->moves.size(); i++) {
+    const Move& move = sgf->moves[i];
+    hist.makeBoardMoveTolerant(board, move.loc, move.pla);
+    nextPla = getOpp(move.pla);
+    situationHashes.push_back(BoardHistory::getSituationRulesAndKoHash(board, hist, nextPla, drawEquivalentWinsForWhite));
+  }
+  double situationSeconds = timer.getSeconds();
+
+  //Pass 3 - the bulk graph hash computation replays the history itself
+  vector<Hash128> graphHashes;
+  timer.reset();
+  GraphHash::getGraphHashesForAllTurns(hist, repBound, drawEquivalentWinsForWhite, graphHashes);
+  double graphSeconds = timer.getSeconds();
+
+  result.hashes[HQ_POS_HASH].insert(result.hashes[HQ_POS_HASH].end(), posHashes.begin(), posHashes.end());
+  result.hashes[HQ_SITUATION_HASH].insert(result.hashes[HQ_SITUATION_HASH].end(), situationHashes.begin(), situationHashes.end());
+  result.hashes[HQ_GRAPH_HASH].insert(result.hashes[HQ_GRAPH_HASH].end(), graphHashes.begin(), graphHashes.end());
+  result.replaySeconds += replaySeconds;
+  result.kindSeconds[HQ_POS_HASH] += replaySeconds;
+  result.kindSeconds[HQ_SITUATION_HASH] += situationSeconds;
+  result.kindSeconds[HQ_GRAPH_HASH] += graphSeconds;
+  result.numPositions += (int64_t)posHashes.size();
+  result.numGames += 1;
+}
+
+static void hashQualitySortUnique(vector<Hash128>& hashes) {
+  std::sort(hashes.begin(),hashes.end());
+  hashes.erase(std::unique(hashes.begin(),hashes.end()),hashes.end());
+}
+
+void HashQuality::runCorpusBenchmark(
+  const vector<string>& sgfFiles,
+  const Rules& defaultRules,
+  int numThreads,
+  int repBound,
+  const vector<int>& bitWidths,
+  int64_t maxAvalancheSamples,
+  ostream& out
+) {
+  if(numThreads <= 0)
+    throw StringError("runCorpusBenchmark: numThreads must be positive");
+
+  vector<HashQualityThreadResult> results(numThreads);
+  std::atomic<size_t> nextFileIdx(0);
+  auto runThread = [&](int threadIdx) {
+    HashQualityThreadResult& result = results[threadIdx];
+    while(true) {
+      size_t fileIdx = nextFileIdx.fetch_add(1);
+      if(fileIdx >= sgfFiles.size())
+        break;
+      const string& file = sgfFiles[fileIdx];
+      CompactSgf* sgf = NULL;
+      try {
+        sgf = CompactSgf::loadFile(file);
+        hashQualityProcessSgf(sgf, defaultRules, repBound, result);
+      }
+      catch(const StringError& e) {
+        result.numSkipped++;
+        result.errors.push_back(file + ": " + e.what());
+      }
+      delete sgf;
+    }
+  };
+
+  ClockTimer wallTimer;
+  vector<std::thread> threads;
+  for(int i = 0; i<numThreads; i++)
+    threads.push_back(std::thread(runThread, i));
+  for(int i = 0; i<numThreads; i++)
+    threads[i].join();
+  double wallSeconds = wallTimer.getSeconds();
+
+  //Merge per-thread results
+  vector<Hash128> hashes[HQ_NUM_KINDS];
+  double replaySeconds = 0.0;
+  double kindSeconds[HQ_NUM_KINDS] = {0.0, 0.0, 0.0};
+  int64_t numPositions = 0;
+  int64_t numGames = 0;
+  int64_t numSkipped = 0;
+  for(int t = 0; t<numThreads; t++) {
+    HashQualityThreadResult& result = results[t];
+    for(int k = 0; k<HQ_NUM_KINDS; k++) {
+      hashes[k].insert(hashes[k].end(), result.hashes[k].begin(), result.hashes[k].end());
+      kindSeconds[k] += result.kindSeconds[k];
+      vector<Hash128>().swap(result.hashes[k]);
+    }
+    replaySeconds += result.replaySeconds;
+    numPositions += result.numPositions;
+    numGames += result.numGames;
+    numSkipped += result.numSkipped;
+    for(const string& error: result.errors)
+      out << "Skipping sgf file: " << error << endl;
+  }
+
+  out << "Games: " << numGames << " skipped: " << numSkipped << " positions: " << numPositions
+      << " threads: " << numThreads << " wall seconds: " << Global::strprintf("%.3f", wallSeconds) << endl;
+  out << endl;
+
+  out << "Throughput (positions per thread-second)" << endl;
+  out << Global::strprintf("  %-30s %14.0f", "replay only", replaySeconds > 0 ? numPositions / replaySeconds : 0.0) << endl;
+  for(int k = 1; k<HQ_NUM_KINDS; k++)
+    out << Global::strprintf("  %-30s %14.0f", (string("replay + ") + HQ_KIND_NAMES[k]).c_str(), kindSeconds[k] > 0 ? numPositions / kindSeconds[k] : 0.0) << endl;
+  out << endl;
+
+  //The same position legitimately recurs within and across games, so collisions are measured among distinct full hashes
+  out << "Truncated-bit collisions among distinct hashes (observed / expected for random)" << endl;
+  for(int k = 0; k<HQ_NUM_KINDS; k++) {
+    hashQualitySortUnique(hashes[k]);
+    out << "  " << HQ_KIND_NAMES[k] << " distinct: " << hashes[k].size() << endl;
+    for(int numBits: bitWidths) {
+      int64_t observed = countTruncatedCollisions(hashes[k], numBits);
+      double expected = expectedTruncatedCollisions((int64_t)hashes[k].size(), numBits);
+      out << Global::strprintf("    %3d bits: %12lld / %16.4f", numBits, (long long)observed, expected) << endl;
+    }
+  }
+  out << endl;
+
+  //Feed the mixers the low halves of actual corpus hashes, which are structured (xors of zobrist values) rather than uniformly random
+  vector<uint64_t> avalancheInputs;
+  const vector<Hash128>& sourceHashes = hashes[HQ_POS_HASH];
+  size_t numInputs = std::min(sourceHashes.size(), (size_t)std::max(maxAvalancheSamples, (int64_t)0));
+  avalancheInputs.reserve(numInputs);
+  for(size_t i = 0; i<numInputs; i++)
+    avalancheInputs.push_back(sourceHashes[i * sourceHashes.size() / numInputs].hash0);
+
+  const int numMixers = 4;
+  const char* mixerNames[numMixers] = {"splitMix64", "nasam", "murmurMix", "rrmxmx"};
+  std::function<uint64_t(uint64_t)> mixers[numMixers] = {Hash::splitMix64, Hash::nasam, Hash::murmurMix, Hash::rrmxmx};
+  out << "Avalanche over " << numInputs << " corpus inputs (ideal flip rate 0.5)" << endl;
+  for(int m = 0; m<numMixers; m++) {
+    AvalancheStats stats = measureAvalanche(mixers[m], avalancheInputs);
+    out << Global::strprintf("  %-12s mean flip rate %.6f max bias %.6f", mixerNames[m], stats.meanFlipRate, stats.maxBias) << endl;
+  }
+}
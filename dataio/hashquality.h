@@ -0,0 +1,45 @@
+#ifndef DATAIO_HASHQUALITY_H_
+#define DATAIO_HASHQUALITY_H_
+
+#include "../core/global.h"
+#include "../core/hash.h"
+#include "../game/rules.h"
+
+//Tools for measuring the collision behavior and mixing quality of the position hashes used throughout,
+//to provide evidence for decisions like how many bits of a hash are safe to store as a key.
+namespace HashQuality {
+  //Given a set of DISTINCT full 128-bit hashes, returns how many of them collide with an earlier one
+  //when truncated to their lowest numBits bits (hash0 first, then hash1). numBits must be in [1,128].
+  int64_t countTruncatedCollisions(const std::vector<Hash128>& distinctHashes, int numBits);
+  //Expected value of the above for n uniformly random hashes.
+  double expectedTruncatedCollisions(int64_t n, int numBits);
+
+  struct AvalancheStats {
+    //Average over inputs, input bits, and output bits of the probability that flipping the input bit flips the output bit.
+    //Ideally 0.5.
+    double meanFlipRate;
+    //Largest deviation from 0.5 of the flip probability for any single (input bit, output bit) pair.
+    double maxBias;
+    int64_t numSamples;
+  };
+  //Measure the strict avalanche behavior of a 64-bit mixing function over the given inputs.
+  AvalancheStats measureAvalanche(const std::function<uint64_t(uint64_t)>& mix, const std::vector<uint64_t>& inputs);
+
+  //Streams every position on the main line of every sgf in sgfFiles using numThreads threads, and for each of
+  //Board::pos_hash, BoardHistory::getSituationRulesAndKoHash, and GraphHash::getGraphHash reports
+  //  * truncated-bit collision counts at each of bitWidths, versus the count expected for random hashes
+  //  * replay throughput with and without computing the hash
+  //and also reports avalanche statistics for the 64-bit mixers in Hash using corpus hashes as inputs.
+  //Sgfs that fail to load or replay are counted and skipped. Uses defaultRules for sgfs that do not specify rules.
+  void runCorpusBenchmark(
+    const std::vector<std::string>& sgfFiles,
+    const Rules& defaultRules,
+    int numThreads,
+    int repBound,
+    const std::vector<int>& bitWidths,
+    int64_t maxAvalancheSamples,
+    std::ostream& out
+  );
+}
+
+#endif // DATAIO_HASHQUALITY_H_
@@ -0,0 +1,291 @@
+#include "../dataio/openingtree.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#include "../core/fileutils.h"
+#include "../game/boardhistory.h"
+#include "../game/symmetry.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+using OpeningTree::FileHeader;
+using OpeningTree::Entry;
+
+static_assert(sizeof(FileHeader) == 32, "Unexpected padding in OpeningTree::FileHeader");
+static_assert(sizeof(Entry) == 48, "Unexpected padding in OpeningTree::Entry");
+
+static const char OPENING_TREE_MAGIC[8] = {'K','G','O','P','T','R','E','E'};
+static const uint32_t OPENING_TREE_ENDIAN_MARKER = 0x01020304;
+
+static bool entryLess(const Entry& a, const Entry& b) {
+  if(a.hash0 != b.hash0)
+    return a.hash0 < b.hash0;
+  if(a.hash1 != b.hash1)
+    return a.hash1 < b.hash1;
+  return a.move < b.move;
+}
+
+static bool entryPositionLess(const Entry& a, const Entry& b) {
+  if(a.hash0 != b.hash0)
+    return a.hash0 < b.hash0;
+  return a.hash1 < b.hash1;
+}
+
+static uint16_t packOpeningTreeMove(Loc loc, int xSize) {
+  if(loc == Board::PASS_LOC)
+    return OpeningTree::PASS_MOVE;
+  return (uint16_t)(Location::getY(loc,xSize) * xSize + Location::getX(loc,xSize));
+}
+
+Hash128 OpeningTree::getPositionKey(const Board& board, Player nextPla, bool canonicalizeSymmetry, int& symmetryBuf) {
+  if(!canonicalizeSymmetry) {
+    symmetryBuf = 0;
+    return SymmetryHelpers::getSymSituationHash(board,nextPla,0);
+  }
+  return SymmetryHelpers::getCanonicalSituationHash(board,nextPla,symmetryBuf);
+}
+
+Loc OpeningTree::getMoveLoc(const Entry& entry, int symmetry) {
+  if(entry.move == PASS_MOVE)
+    return Board::PASS_LOC;
+  int x = entry.move % entry.xSize;
+  int y = entry.move / entry.xSize;
+  return SymmetryHelpers::getSymLoc(x,y,entry.xSize,entry.ySize,SymmetryHelpers::invert(symmetry));
+}
+
+//------------------------------------------------------------------------------------------------------------
+
+struct OpeningTreeEdgeKey {
+  Hash128 hash;
+  uint16_t move;
+  uint8_t xSize;
+  uint8_t ySize;
+
+  bool operator==(const OpeningTreeEdgeKey& other) const {
+    return hash == other.hash && move == other.move && xSize == other.xSize && ySize == other.ySize;
+  }
+};
+
+struct OpeningTreeEdgeKeyHasher {
+  size_t operator()(const OpeningTreeEdgeKey& key) const {
+    return (size_t)(key.hash.hash0 ^ Hash::murmurMix(key.hash.hash1 + key.move));
+  }
+};
+
+struct OpeningTreeStats {
+  uint64_t visits = 0;
+  uint64_t moverWins = 0;
+  uint64_t moverLosses = 0;
+};
+
+typedef std::unordered_map<OpeningTreeEdgeKey,OpeningTreeStats,OpeningTreeEdgeKeyHasher> OpeningTreeEdgeMap;
+
+static void addGameToOpeningTree(
+  const CompactSgf& sgf,
+  const Rules& defaultRules,
+  const OpeningTree::BuildOptions& options,
+  OpeningTreeEdgeMap& edges
+) {
+  if(sgf.xSize > 255 || sgf.ySize > 255 || sgf.xSize * sgf.ySize >= OpeningTree::PASS_MOVE)
+    throw StringError("Board too large for opening tree");
+  Rules rules = sgf.getRulesOrFailAllowUnspecified(defaultRules);
+  Board board;
+  Player nextPla;
+  BoardHistory hist;
+  sgf.setupInitialBoardAndHist(rules,board,nextPla,hist);
+
+  size_t numMoves = std::min(sgf.moves.size(),(size_t)std::max(options.maxDepth,0));
+  Hash128 hashes[SymmetryHelpers::NUM_SYMMETRIES];
+  for(size_t i = 0; i<numMoves; i++) {
+    Move move = sgf.moves[i];
+    OpeningTreeEdgeKey key;
+    if(!options.canonicalizeSymmetry) {
+      key.hash = SymmetryHelpers::getSymSituationHash(board,move.pla,0);
+      key.move = packOpeningTreeMove(move.loc,board.x_size);
+      key.xSize = (uint8_t)board.x_size;
+      key.ySize = (uint8_t)board.y_size;
+    }
+    else {
+      //Among the symmetries that give the smallest hash, which are several for a symmetric position, pick the one
+      //that gives the smallest move, so that equivalent moves from a symmetric position are counted together.
+      int numSymmetries = SymmetryHelpers::getNumSymmetries(board.x_size,board.y_size);
+      SymmetryHelpers::getSymSituationHashes(board,move.pla,hashes);
+      bool found = false;
+      for(int s = 0; s<numSymmetries; s++) {
+        if(found && key.hash < hashes[s])
+          continue;
+        bool transpose = SymmetryHelpers::isTranspose(s);
+        int symXSize = transpose ? board.y_size : board.x_size;
+        uint16_t symMove = packOpeningTreeMove(SymmetryHelpers::getSymLoc(move.loc,board.x_size,board.y_size,s),symXSize);
+        if(!found || hashes[s] < key.hash || symMove < key.move) {
+          found = true;
+          key.hash = hashes[s];
+          key.move = symMove;
+          key.xSize = (uint8_t)symXSize;
+          key.ySize = (uint8_t)(transpose ? board.x_size : board.y_size);
+        }
+      }
+    }
+
+    bool suc = hist.makeBoardMoveTolerant(board,move.loc,move.pla);
+    if(!suc)
+      throw StringError("Illegal move " + Location::toString(move.loc,board) + " at turn " + Global::uint64ToString(i));
+
+    OpeningTreeStats& stats = edges[key];
+    stats.visits += 1;
+    if(sgf.sgfWinner == move.pla)
+      stats.moverWins += 1;
+    else if(sgf.sgfWinner == getOpp(move.pla))
+      stats.moverLosses += 1;
+  }
+}
+
+void OpeningTree::build(
+  const vector<string>& files,
+  const Rules& defaultRules,
+  const BuildOptions& options,
+  vector<SgfLoadError>& errors,
+  vector<Entry>& entries
+) {
+  if(options.numThreads <= 0)
+    throw StringError("OpeningTree::build: numThreads must be positive");
+
+  SgfLoadOptions loadOptions;
+  loadOptions.numThreads = options.numThreads;
+  //Only the moves matter here, not the content hash of each sgf
+  loadOptions.hashMode = SgfHashMode::FAST;
+
+  vector<OpeningTreeEdgeMap> edgesByThread(options.numThreads);
+  Sgf::iterFilesParallel(
+    files, loadOptions, errors,
+    [&](int threadIdx, size_t fileIdx, size_t sgfIdx, Sgf& sgf) {
+      (void)fileIdx;
+      (void)sgfIdx;
+      CompactSgf compact(std::move(sgf));
+      addGameToOpeningTree(compact,defaultRules,options,edgesByThread[threadIdx]);
+    }
+  );
+
+  //Merge the tables of all threads and drop rare entries
+  vector<Entry> merged;
+  for(size_t t = 0; t<edgesByThread.size(); t++) {
+    for(auto iter = edgesByThread[t].begin(); iter != edgesByThread[t].end(); ++iter) {
+      Entry entry;
+      std::memset(&entry,0,sizeof(entry));
+      entry.hash0 = iter->first.hash.hash0;
+      entry.hash1 = iter->first.hash.hash1;
+      entry.move = iter->first.move;
+      entry.xSize = iter->first.xSize;
+      entry.ySize = iter->first.ySize;
+      entry.visits = iter->second.visits;
+      entry.moverWins = iter->second.moverWins;
+      entry.moverLosses = iter->second.moverLosses;
+      merged.push_back(entry);
+    }
+    OpeningTreeEdgeMap().swap(edgesByThread[t]);
+  }
+  std::sort(merged.begin(),merged.end(),entryLess);
+
+  entries.clear();
+  for(size_t i = 0; i<merged.size(); i++) {
+    if(entries.size() > 0 && !entryLess(entries.back(),merged[i])) {
+      entries.back().visits += merged[i].visits;
+      entries.back().moverWins += merged[i].moverWins;
+      entries.back().moverLosses += merged[i].moverLosses;
+    }
+    else {
+      if(entries.size() > 0 && (int64_t)entries.back().visits < options.minVisits)
+        entries.pop_back();
+      entries.push_back(merged[i]);
+    }
+  }
+  if(entries.size() > 0 && (int64_t)entries.back().visits < options.minVisits)
+    entries.pop_back();
+}
+
+void OpeningTree::write(const string& file, const vector<Entry>& entries, const BuildOptions& options) {
+  FileHeader header;
+  std::memset(&header,0,sizeof(header));
+  std::memcpy(header.magic,OPENING_TREE_MAGIC,sizeof(header.magic));
+  header.version = VERSION;
+  header.endianMarker = OPENING_TREE_ENDIAN_MARKER;
+  header.numEntries = entries.size();
+  header.canonicalizeSymmetry = options.canonicalizeSymmetry ? 1 : 0;
+  header.maxDepth = (uint32_t)std::max(options.maxDepth,0);
+
+  ofstream out;
+  FileUtils::open(out,file,std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write((const char*)&header,sizeof(header));
+  if(entries.size() > 0)
+    out.write((const char*)entries.data(),entries.size() * sizeof(Entry));
+  out.close();
+  if(out.fail())
+    throw IOError("OpeningTree: error writing " + file);
+}
+
+//------------------------------------------------------------------------------------------------------------
+
+OpeningTreeReader::OpeningTreeReader(const string& file)
+  :mappedFile(file),
+   header(),
+   entries(NULL)
+{
+  const char* data = mappedFile.data();
+  size_t dataLen = mappedFile.size();
+  if(dataLen < sizeof(FileHeader))
+    throw IOError("OpeningTreeReader: file too short: " + file);
+  std::memcpy(&header,data,sizeof(FileHeader));
+  if(std::memcmp(header.magic,OPENING_TREE_MAGIC,sizeof(header.magic)) != 0)
+    throw IOError("OpeningTreeReader: not an opening tree: " + file);
+  if(header.endianMarker != OPENING_TREE_ENDIAN_MARKER)
+    throw IOError("OpeningTreeReader: file has the wrong endianness for this machine: " + file);
+  if(header.version != OpeningTree::VERSION)
+    throw IOError("OpeningTreeReader: unsupported version " + Global::uint32ToString(header.version) + ": " + file);
+  if((dataLen - sizeof(FileHeader)) / sizeof(Entry) < header.numEntries)
+    throw IOError("OpeningTreeReader: truncated file: " + file);
+  entries = (const Entry*)(data + sizeof(FileHeader));
+}
+
+OpeningTreeReader::~OpeningTreeReader() {
+}
+
+bool OpeningTreeReader::isCanonicalized() const {
+  return header.canonicalizeSymmetry != 0;
+}
+
+int OpeningTreeReader::getMaxDepth() const {
+  return (int)header.maxDepth;
+}
+
+size_t OpeningTreeReader::getNumEntries() const {
+  return (size_t)header.numEntries;
+}
+
+const Entry* OpeningTreeReader::getEntries() const {
+  return entries;
+}
+
+bool OpeningTreeReader::findMoves(Hash128 positionKey, const Entry*& beginBuf, const Entry*& endBuf) const {
+  Entry target;
+  std::memset(&target,0,sizeof(target));
+  target.hash0 = positionKey.hash0;
+  target.hash1 = positionKey.hash1;
+  const Entry* end = entries + header.numEntries;
+  std::pair<const Entry*,const Entry*> range = std::equal_range((const Entry*)entries, end, target, entryPositionLess);
+  if(range.first == range.second)
+    return false;
+  beginBuf = range.first;
+  endBuf = range.second;
+  return true;
+}
+
+bool OpeningTreeReader::findMoves(
+  const Board& board, Player nextPla,
+  const Entry*& beginBuf, const Entry*& endBuf, int& symmetryBuf
+) const {
+  Hash128 key = OpeningTree::getPositionKey(board,nextPla,isCanonicalized(),symmetryBuf);
+  return findMoves(key,beginBuf,endBuf);
+}
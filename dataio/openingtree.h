@@ -0,0 +1,108 @@
+#ifndef DATAIO_OPENINGTREE_H_
+#define DATAIO_OPENINGTREE_H_
+
+#include "../core/global.h"
+#include "../core/hash.h"
+#include "../core/mappedfile.h"
+#include "../dataio/sgf.h"
+#include "../game/board.h"
+#include "../game/rules.h"
+
+//Statistics of the moves played from each position over a corpus of games, such as for building an opening book or
+//weighting positions by how common they are.
+//
+//Positions are identified by a situation hash (stones, board size, player to move, simple ko), optionally minimized
+//over the symmetries of the board so that all orientations of a position are counted together. In that case moves
+//are recorded in the orientation of the chosen symmetry, see SymmetryHelpers::getCanonicalSituationHash.
+//
+//The tree is stored as a flat table of entries, one per (position, move), sorted by position and then move, so that
+//all the moves from a position are contiguous and can be found by binary search directly in a mapped file.
+namespace OpeningTree {
+  static constexpr uint32_t VERSION = 1;
+  static constexpr uint16_t PASS_MOVE = 0xFFFF;
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianMarker;
+    uint64_t numEntries;
+    uint32_t canonicalizeSymmetry;
+    uint32_t maxDepth;
+  };
+
+  struct Entry {
+    uint64_t hash0;
+    uint64_t hash1;
+    //y * xSize + x in the recorded orientation of the position, or PASS_MOVE
+    uint16_t move;
+    uint8_t xSize;
+    uint8_t ySize;
+    uint32_t reserved;
+    //Number of games in which this move was played from this position, and how many of those the player making the
+    //move won and lost. The rest were draws or had no known result.
+    uint64_t visits;
+    uint64_t moverWins;
+    uint64_t moverLosses;
+  };
+
+  struct BuildOptions {
+    //Number of moves of each game to record, including passes
+    int maxDepth = 40;
+    bool canonicalizeSymmetry = true;
+    //Entries visited fewer times than this are dropped from the final table
+    int64_t minVisits = 1;
+    int numThreads = 1;
+  };
+
+  //Replays the main line of every sgf in files, loading files ending in ".sgfs" as multiple sgfs per file, using
+  //options.numThreads threads, and fills entries with the resulting table in sorted order.
+  //Uses defaultRules for sgfs that do not specify rules. Files that fail to load are skipped and appended to errors,
+  //as are sgfs with an illegal move, though moves of those sgfs before the illegal one are still counted.
+  void build(
+    const std::vector<std::string>& files,
+    const Rules& defaultRules,
+    const BuildOptions& options,
+    std::vector<SgfLoadError>& errors,
+    std::vector<Entry>& entries
+  );
+
+  //Entries must be sorted as from build
+  void write(const std::string& file, const std::vector<Entry>& entries, const BuildOptions& options);
+
+  //The key of a position as used in the table. symmetryBuf is set to the symmetry mapping the actual board to the
+  //recorded orientation, which is 0 if not canonicalizing.
+  Hash128 getPositionKey(const Board& board, Player nextPla, bool canonicalizeSymmetry, int& symmetryBuf);
+  //Convert the move of an entry back to a location on the actual board, given the symmetry from getPositionKey.
+  Loc getMoveLoc(const Entry& entry, int symmetry);
+}
+
+//Reads a table written by OpeningTree::write. Thread-safe.
+class OpeningTreeReader {
+ public:
+  //Throws IOError if the file cannot be read or is not a valid table
+  OpeningTreeReader(const std::string& file);
+  ~OpeningTreeReader();
+
+  OpeningTreeReader(const OpeningTreeReader&) = delete;
+  OpeningTreeReader& operator=(const OpeningTreeReader&) = delete;
+
+  bool isCanonicalized() const;
+  int getMaxDepth() const;
+  size_t getNumEntries() const;
+  const OpeningTree::Entry* getEntries() const;
+
+  //Finds the entries for the moves from the position with the given key, returning false if there are none.
+  bool findMoves(Hash128 positionKey, const OpeningTree::Entry*& beginBuf, const OpeningTree::Entry*& endBuf) const;
+  //Same, finding the key from the board
+  bool findMoves(
+    const Board& board, Player nextPla,
+    const OpeningTree::Entry*& beginBuf, const OpeningTree::Entry*& endBuf, int& symmetryBuf
+  ) const;
+
+ private:
+  MappedFile mappedFile;
+  OpeningTree::FileHeader header;
+  const OpeningTree::Entry* entries;
+};
+
+#endif // DATAIO_OPENINGTREE_H_
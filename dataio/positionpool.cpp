@@ -0,0 +1,225 @@
+#include "../dataio/positionpool.h"
+
+#include "../core/fileutils.h"
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+static void checkPoolWeight(double weight) {
+  if(!(weight >= 0.0) || !std::isfinite(weight))
+    throw StringError("PositionSamplePool: invalid sample weight " + Global::doubleToString(weight));
+}
+
+PositionSamplePool::PositionSamplePool(bool allow)
+  :allowWeightUpdates(allow),
+   samples(),
+   totalWeight(0.0),
+   aliasTable(),
+   aliasTableIsStale(true),
+   dynamicSampler()
+{}
+
+PositionSamplePool::~PositionSamplePool()
+{}
+
+void PositionSamplePool::loadFile(const string& file) {
+  if(PositionSampleFileReader::isBinaryFile(file)) {
+    vector<Sgf::PositionSample> loaded;
+    PositionSampleFileReader reader(file);
+    Sgf::PositionSample sample;
+    while(reader.next(sample)) {
+      try {
+        checkPoolWeight(sample.weight);
+      }
+      catch(const StringError& e) {
+        throw IOError("Error loading position samples from " + file + " record " + Global::int64ToString(reader.getNumSamplesRead()) + ": " + e.what());
+      }
+      loaded.push_back(sample);
+    }
+    samples.reserve(samples.size() + loaded.size());
+    for(size_t i = 0; i<loaded.size(); i++)
+      add(std::move(loaded[i]));
+    return;
+  }
+
+  vector<string> lines = FileUtils::readFileLines(file,'\n');
+  vector<Sgf::PositionSample> loaded;
+  for(size_t i = 0; i<lines.size(); i++) {
+    string line = Global::trim(lines[i]);
+    if(line.length() <= 0)
+      continue;
+    try {
+      Sgf::PositionSample sample = Sgf::PositionSample::ofJsonLine(line);
+      checkPoolWeight(sample.weight);
+      loaded.push_back(std::move(sample));
+    }
+    catch(const std::exception& e) {
+      throw IOError("Error loading position samples from " + file + " line " + Global::uint64ToString(i+1) + ": " + e.what());
+    }
+  }
+  samples.reserve(samples.size() + loaded.size());
+  for(size_t i = 0; i<loaded.size(); i++)
+    add(std::move(loaded[i]));
+}
+
+void PositionSamplePool::loadFiles(const vector<string>& files) {
+  for(size_t i = 0; i<files.size(); i++)
+    loadFile(files[i]);
+}
+
+void PositionSamplePool::add(const Sgf::PositionSample& sample) {
+  Sgf::PositionSample copy = sample;
+  add(std::move(copy));
+}
+
+void PositionSamplePool::add(Sgf::PositionSample&& sample) {
+  checkPoolWeight(sample.weight);
+  double weight = sample.weight;
+  samples.push_back(std::move(sample));
+  if(allowWeightUpdates)
+    dynamicSampler.add(weight);
+  else
+    aliasTableIsStale = true;
+  totalWeight += weight;
+}
+
+size_t PositionSamplePool::size() const {
+  return samples.size();
+}
+
+double PositionSamplePool::getTotalWeight() const {
+  if(allowWeightUpdates)
+    return dynamicSampler.getTotalWeight();
+  return totalWeight;
+}
+
+const Sgf::PositionSample& PositionSamplePool::get(size_t idx) const {
+  assert(idx < samples.size());
+  return samples[idx];
+}
+
+void PositionSamplePool::setWeight(size_t idx, double weight) {
+  checkPoolWeight(weight);
+  if(idx >= samples.size())
+    throw StringError("PositionSamplePool::setWeight: index out of range");
+  totalWeight += weight - samples[idx].weight;
+  samples[idx].weight = weight;
+  if(allowWeightUpdates)
+    dynamicSampler.setWeight(idx,weight);
+  else
+    aliasTableIsStale = true;
+}
+
+size_t PositionSamplePool::sampleIdx(Rand& rand) {
+  if(samples.size() <= 0)
+    throw StringError("PositionSamplePool: cannot sample from an empty pool");
+  if(allowWeightUpdates)
+    return dynamicSampler.sample(rand);
+
+  if(aliasTableIsStale) {
+    vector<double> weights(samples.size());
+    //Recompute the total exactly as well, rather than keeping the running sum from setWeight
+    totalWeight = 0.0;
+    for(size_t i = 0; i<samples.size(); i++) {
+      weights[i] = samples[i].weight;
+      totalWeight += weights[i];
+    }
+    if(!(totalWeight > 0.0))
+      throw StringError("PositionSamplePool: cannot sample when all weights are zero");
+    aliasTable.init(weights);
+    aliasTableIsStale = false;
+  }
+  return aliasTable.sample(rand);
+}
+
+const Sgf::PositionSample& PositionSamplePool::sample(Rand& rand) {
+  return samples[sampleIdx(rand)];
+}
+
+//Checks that each sample is drawn about as often as its weight says, within several standard deviations
+static void checkPoolFrequencies(PositionSamplePool& pool, const vector<double>& weights, Rand& rand) {
+  const int numDraws = 100000;
+  testAssert(pool.size() == weights.size());
+  vector<int> counts(weights.size(),0);
+  for(int i = 0; i<numDraws; i++)
+    counts[pool.sampleIdx(rand)]++;
+  double sum = 0.0;
+  for(size_t i = 0; i<weights.size(); i++)
+    sum += weights[i];
+  testAssert(std::fabs(pool.getTotalWeight() - sum) < 1e-9);
+  for(size_t i = 0; i<weights.size(); i++) {
+    testAssert(pool.get(i).weight == weights[i]);
+    double p = weights[i] / sum;
+    double expected = numDraws * p;
+    double stdev = sqrt(numDraws * p * (1.0 - p));
+    if(weights[i] <= 0.0)
+      testAssert(counts[i] == 0);
+    else
+      testAssert(std::fabs(counts[i] - expected) <= 6.0 * stdev + 1.0);
+  }
+}
+
+void PositionSamplePool::runTests() {
+  cout << "Running position sample pool tests" << endl;
+  Rand rand("positionpool tests");
+
+  for(int allowUpdates = 0; allowUpdates <= 1; allowUpdates++) {
+    PositionSamplePool pool(allowUpdates != 0);
+    bool threw = false;
+    try { pool.sampleIdx(rand); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+
+    vector<double> weights({1.0, 2.0, 3.0, 4.0});
+    for(size_t i = 0; i<weights.size(); i++) {
+      Sgf::PositionSample sample;
+      sample.board = Board(9,9);
+      sample.nextPla = P_BLACK;
+      sample.initialTurnNumber = (int64_t)i;
+      sample.hintLoc = Board::NULL_LOC;
+      sample.weight = weights[i];
+      pool.add(sample);
+    }
+    checkPoolFrequencies(pool,weights,rand);
+
+    //Changes after the first draws must be picked up, rather than drawing from a table built for the old weights
+    pool.setWeight(3,0.0);
+    weights[3] = 0.0;
+    checkPoolFrequencies(pool,weights,rand);
+    pool.setWeight(0,10.0);
+    weights[0] = 10.0;
+    pool.setWeight(3,0.5);
+    weights[3] = 0.5;
+    checkPoolFrequencies(pool,weights,rand);
+
+    //As must samples added after the first draws
+    Sgf::PositionSample added;
+    added.board = Board(9,9);
+    added.nextPla = P_WHITE;
+    added.initialTurnNumber = 100;
+    added.hintLoc = Board::NULL_LOC;
+    added.weight = 5.0;
+    pool.add(std::move(added));
+    weights.push_back(5.0);
+    checkPoolFrequencies(pool,weights,rand);
+    testAssert(pool.get(4).initialTurnNumber == 100);
+
+    for(size_t i = 0; i<weights.size(); i++)
+      pool.setWeight(i,0.0);
+    testAssert(pool.getTotalWeight() == 0.0);
+    threw = false;
+    try { pool.sampleIdx(rand); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    pool.setWeight(2,1.0);
+    for(int i = 0; i<1000; i++)
+      testAssert(pool.sampleIdx(rand) == 2);
+
+    threw = false;
+    try { pool.setWeight(5,1.0); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+    threw = false;
+    try { pool.setWeight(0,-1.0); } catch(const StringError&) { threw = true; }
+    testAssert(threw);
+  }
+}
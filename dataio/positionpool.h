@@ -0,0 +1,59 @@
+#ifndef DATAIO_POSITIONPOOL_H_
+#define DATAIO_POSITIONPOOL_H_
+
+#include "../core/global.h"
+#include "../core/rand.h"
+#include "../core/weightedsampler.h"
+#include "../dataio/sgf.h"
+
+//A pool of position samples, such as loaded from poses.txt files, to draw from at random in proportion to each
+//sample's weight.
+//
+//If allowWeightUpdates is false, draws use an AliasTable and take O(1), with the table rebuilt in O(n) on the first
+//draw after any samples are added or weights changed, so it suits pools that are loaded once and then only drawn from.
+//If true, draws and weight changes both take O(log n) using a DynamicWeightedSampler, which suits pools whose weights
+//are adjusted as they are used.
+//
+//NOT thread-safe, even for draws alone, callers sharing a pool between threads must lock around it.
+class PositionSamplePool {
+ public:
+  PositionSamplePool(bool allowWeightUpdates);
+  ~PositionSamplePool();
+
+  PositionSamplePool(const PositionSamplePool&) = delete;
+  PositionSamplePool& operator=(const PositionSamplePool&) = delete;
+
+  //Appends all samples in a file of Sgf::PositionSample binary records, or else with one Sgf::PositionSample::toJsonLine
+  //per line, skipping blank lines.
+  //Throws IOError on a sample that fails to parse or has an invalid weight, in which case no samples of that file are added.
+  void loadFile(const std::string& file);
+  void loadFiles(const std::vector<std::string>& files);
+
+  //Throws StringError if the weight is negative or not finite.
+  void add(const Sgf::PositionSample& sample);
+  void add(Sgf::PositionSample&& sample);
+
+  size_t size() const;
+  double getTotalWeight() const;
+  const Sgf::PositionSample& get(size_t idx) const;
+
+  //Sets both the weight used for drawing and the weight field of the sample itself.
+  void setWeight(size_t idx, double weight);
+
+  //Returns the index of a random sample. Throws StringError if the pool is empty or all weights are zero.
+  size_t sampleIdx(Rand& rand);
+  const Sgf::PositionSample& sample(Rand& rand);
+
+  static void runTests();
+
+ private:
+  bool allowWeightUpdates;
+  std::vector<Sgf::PositionSample> samples;
+  double totalWeight;
+
+  AliasTable aliasTable;
+  bool aliasTableIsStale;
+  DynamicWeightedSampler dynamicSampler;
+};
+
+#endif // DATAIO_POSITIONPOOL_H_
@@ -1,6 +1,7 @@
 #include "../dataio/poswriter.h"
 
 #include "../core/fileutils.h"
+#include "../core/test.h"
 
 //------------------------
 #include "../core/using.h"
@@ -11,13 +12,15 @@ PosWriter::PosWriter(
   const std::string& out,
   int sgfCount,
   int sgfIdx,
-  int maxPerFile
+  int maxPerFile,
+  bool bin
 ) :
   suffix(s),
   outDir(out),
   sgfSplitCount(sgfCount),
   sgfSplitIdx(sgfIdx),
   maxPosesPerOutFile(maxPerFile),
+  binary(bin),
   toWriteQueue(),
   writeLoopThread(NULL)
 {}
@@ -41,6 +44,7 @@ static void writeLoop(
   int sgfSplitCount,
   int sgfSplitIdx,
   int maxPosesPerOutFile,
+  bool binary,
   ThreadSafeQueue<string*>* toWriteQueue
 ) {
   int fileCounter = 0;
@@ -65,11 +69,21 @@ static void writeLoop(
         fileNameToWrite = outDir + "/" + Global::intToString(fileCounter) + "." + suffix;
 
       out = new ofstream();
-      FileUtils::open(*out,fileNameToWrite);
+      if(binary) {
+        FileUtils::open(*out,fileNameToWrite,std::ios::out | std::ios::binary);
+        string header;
+        Sgf::PositionSample::appendBinaryFileHeader(header);
+        out->write(header.data(),header.size());
+      }
+      else
+        FileUtils::open(*out,fileNameToWrite);
       fileCounter += 1;
       numWrittenThisFile = 0;
     }
-    (*out) << *message << endl;
+    if(binary)
+      out->write(message->data(),message->size());
+    else
+      (*out) << *message << endl;
     numWrittenThisFile += 1;
     delete message;
   }
@@ -83,13 +97,168 @@ static void writeLoop(
 void PosWriter::start() {
   assert(!toWriteQueue.isReadOnly());
   assert(writeLoopThread == NULL);
-  writeLoopThread = new std::thread(writeLoop, suffix, outDir, sgfSplitCount, sgfSplitIdx, maxPosesPerOutFile, &toWriteQueue);
+  writeLoopThread = new std::thread(writeLoop, suffix, outDir, sgfSplitCount, sgfSplitIdx, maxPosesPerOutFile, binary, &toWriteQueue);
 }
 
 void PosWriter::writeLine(const std::string& line) {
+  if(binary)
+    throw StringError("PosWriter: cannot write lines to binary position sample files");
   toWriteQueue.waitPush(new string(line));
 }
 
 void PosWriter::writePos(const Sgf::PositionSample& pos) {
-  toWriteQueue.waitPush(new string(Sgf::PositionSample::toJsonLine(pos)));
+  if(binary) {
+    string record;
+    Sgf::PositionSample::appendBinary(pos,record);
+    toWriteQueue.waitPush(new string(std::move(record)));
+  }
+  else
+    toWriteQueue.waitPush(new string(Sgf::PositionSample::toJsonLine(pos)));
+}
+
+//Writes the samples through a PosWriter, starting new files often, and reads them back from every file written
+static vector<Sgf::PositionSample> writeAndReadBack(const vector<Sgf::PositionSample>& samples, const string& suffix, bool binary) {
+  const int maxPosesPerOutFile = 3;
+  {
+    PosWriter writer(suffix,".",2,1,maxPosesPerOutFile,binary);
+    writer.start();
+    for(size_t i = 0; i<samples.size(); i++)
+      writer.writePos(samples[i]);
+    writer.flushAndStop();
+  }
+
+  vector<Sgf::PositionSample> loaded;
+  int numFiles = 0;
+  while(true) {
+    string file = "./" + Global::intToString(numFiles) + ".1." + suffix;
+    if(!FileUtils::exists(file))
+      break;
+    numFiles++;
+    testAssert(PositionSampleFileReader::isBinaryFile(file) == binary);
+    size_t numBefore = loaded.size();
+    if(binary) {
+      PositionSampleFileReader reader(file);
+      Sgf::PositionSample sample;
+      while(reader.next(sample))
+        loaded.push_back(sample);
+      testAssert(reader.getNumSamplesRead() == (int64_t)(loaded.size() - numBefore));
+    }
+    else {
+      vector<string> lines = FileUtils::readFileLines(file,'\n');
+      for(size_t i = 0; i<lines.size(); i++) {
+        if(Global::trim(lines[i]).size() > 0)
+          loaded.push_back(Sgf::PositionSample::ofJsonLine(lines[i]));
+      }
+    }
+    //Each file after the first is started once the previous one has one more than the max
+    testAssert(loaded.size() - numBefore <= (size_t)maxPosesPerOutFile+1);
+    FileUtils::tryRemoveFile(file);
+  }
+  testAssert(numFiles == (int)((samples.size() + maxPosesPerOutFile) / (maxPosesPerOutFile+1)));
+  return loaded;
+}
+
+void PosWriter::runTests() {
+  cout << "Running pos writer tests" << endl;
+
+  //Samples covering every field: several board sizes including non-square, passes and null or pass hints, unusual
+  //weights, metadata that needs escaping in json, and symmetries other than the identity
+  vector<Sgf::PositionSample> samples;
+  {
+    Sgf::PositionSample sample;
+    sample.board = Board(19,19);
+    sample.board.setStone(Location::getLoc(3,3,19),P_BLACK);
+    sample.board.setStone(Location::getLoc(15,16,19),P_WHITE);
+    sample.board.setStone(Location::getLoc(0,18,19),P_WHITE);
+    sample.nextPla = P_WHITE;
+    sample.moves.push_back(Move(Location::getLoc(16,3,19),P_WHITE));
+    sample.moves.push_back(Move(Board::PASS_LOC,P_BLACK));
+    sample.moves.push_back(Move(Location::getLoc(18,0,19),P_WHITE));
+    sample.moves.push_back(Move(Location::getLoc(2,15,19),P_BLACK));
+    sample.initialTurnNumber = 123;
+    sample.hintLoc = Location::getLoc(10,9,19);
+    sample.weight = 0.1;
+    sample.metadata = "game \"1\"\n\tback\\slash \xE5\x9B\xB4\xE6\xA3\x8B";
+    sample.trainingWeight = 0.3;
+    sample.symmetry = 5;
+    samples.push_back(sample);
+  }
+  {
+    Sgf::PositionSample sample;
+    sample.board = Board(7,5);
+    sample.board.setStone(Location::getLoc(6,4,7),P_BLACK);
+    sample.nextPla = P_BLACK;
+    sample.initialTurnNumber = 0;
+    sample.hintLoc = Board::NULL_LOC;
+    sample.weight = 1.0;
+    sample.symmetry = 3;
+    samples.push_back(sample);
+  }
+  {
+    Sgf::PositionSample sample;
+    sample.board = Board(9,9);
+    sample.nextPla = P_BLACK;
+    sample.moves.push_back(Move(Board::PASS_LOC,P_WHITE));
+    sample.initialTurnNumber = 1000000000000LL;
+    sample.hintLoc = Board::PASS_LOC;
+    sample.weight = 1e-10;
+    sample.metadata = " ";
+    sample.trainingWeight = 2.5;
+    samples.push_back(sample);
+  }
+  {
+    Sgf::PositionSample sample;
+    sample.board = Board(1,1);
+    sample.nextPla = P_WHITE;
+    sample.moves.push_back(Move(Location::getLoc(0,0,1),P_BLACK));
+    sample.initialTurnNumber = 5;
+    sample.hintLoc = Board::NULL_LOC;
+    sample.weight = 3.0 / 7.0;
+    sample.symmetry = 7;
+    samples.push_back(sample);
+  }
+  //Samples as produced when deduplicating up to symmetry, including after a capture
+  {
+    std::unique_ptr<Sgf> sgf(Sgf::parse(
+      "(;FF[4]GM[1]SZ[9];B[cc];W[aa];B[ab];W[gg];B[ba];W[gc];B[ee];W[cg];B[dd];W[ff];B[fc];W[dg])"
+    ));
+    std::set<Hash128> uniqueHashes;
+    vector<Sgf::PositionSample> loaded;
+    sgf->loadAllUniquePositions(uniqueHashes,false,false,true,false,false,NULL,loaded);
+    bool anyNonIdentity = false;
+    for(size_t i = 0; i<loaded.size(); i++) {
+      loaded[i].metadata = "sample " + Global::uint64ToString(i);
+      loaded[i].weight = 1.0 + (double)i / 3.0;
+      anyNonIdentity = anyNonIdentity || loaded[i].symmetry != 0;
+      samples.push_back(loaded[i]);
+    }
+    testAssert(loaded.size() > 10);
+    testAssert(anyNonIdentity);
+  }
+
+  vector<Sgf::PositionSample> fromText = writeAndReadBack(samples,"poswriter_test.txt",false);
+  vector<Sgf::PositionSample> fromBinary = writeAndReadBack(samples,"poswriter_test.bin",true);
+  testAssert(fromText.size() == samples.size());
+  testAssert(fromBinary.size() == samples.size());
+  for(size_t i = 0; i<samples.size(); i++) {
+    //Neither format keeps capture counts or the simple ko, which are not part of a sample
+    testAssert(fromText[i].isEqualForTesting(samples[i],false,false));
+    testAssert(fromBinary[i].isEqualForTesting(samples[i],false,false));
+    testAssert(fromText[i].isEqualForTesting(fromBinary[i],true,true));
+    testAssert(Sgf::PositionSample::toJsonLine(fromText[i]) == Sgf::PositionSample::toJsonLine(samples[i]));
+    testAssert(Sgf::PositionSample::toJsonLine(fromBinary[i]) == Sgf::PositionSample::toJsonLine(samples[i]));
+  }
+
+  //Lines of text cannot go into a binary file
+  {
+    PosWriter writer("poswriter_test.bin",".",1,0,10,true);
+    bool threw = false;
+    try {
+      writer.writeLine("{}");
+    }
+    catch(const StringError&) {
+      threw = true;
+    }
+    testAssert(threw);
+  }
 }
@@ -8,12 +8,15 @@
 
 class PosWriter {
  public:
+  //If binary, writes position samples as Sgf::PositionSample::appendBinary records, each file starting with the
+  //binary file header, rather than as json lines. writeLine cannot be used in that case.
   PosWriter(
     const std::string& suffix,
     const std::string& outDir,
     int sgfSplitCount,
     int sgfSplitIdx,
-    int maxPosesPerOutFile
+    int maxPosesPerOutFile,
+    bool binary = false
   );
   ~PosWriter();
 
@@ -22,12 +25,15 @@ class PosWriter {
   void writeLine(const std::string& line);
   void writePos(const Sgf::PositionSample& pos);
 
+  static void runTests();
+
  private:
   std::string suffix;
   std::string outDir;
   int sgfSplitCount;
   int sgfSplitIdx;
   int maxPosesPerOutFile;
+  bool binary;
   ThreadSafeQueue<std::string*> toWriteQueue;
   std::thread* writeLoopThread;
 };
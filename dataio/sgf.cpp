@@ -1,57 +1,178 @@
 #include "../dataio/sgf.h"
 
+#include <cstring>
+#include <deque>
+
+#include "../core/config_parser.h"
 #include "../core/fileutils.h"
+#include "../core/multithread.h"
 #include "../core/sha2.h"
+#include "../core/test.h"
+#include "../game/rulesregistry.h"
+#include "../game/symmetry.h"
 
 #include "../external/nlohmann_json/json.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
+//Codes for keys too long to pack have this bit set, along with their index in the interned table
+static const uint64_t SGF_INTERNED_KEY_BIT = (uint64_t)1 << 63;
+static const size_t SGF_MAX_PACKED_KEY_LEN = 7;
+
+struct SgfKeyInternTable {
+  std::mutex mutex;
+  map<string,uint64_t> codeByKey;
+  vector<string> keys;
+};
+static SgfKeyInternTable& getSgfKeyInternTable() {
+  static SgfKeyInternTable table;
+  return table;
+}
+
+//Returns false if key is too long to pack
+static bool tryPackSgfKey(const char* key, uint64_t& buf) {
+  uint64_t code = 0;
+  for(size_t i = 0; key[i] != '\0'; i++) {
+    if(i >= SGF_MAX_PACKED_KEY_LEN)
+      return false;
+    code |= (uint64_t)(uint8_t)key[i] << (8*i);
+  }
+  buf = code;
+  return true;
+}
+
+static const uint64_t SGF_KEY_B = SgfProp::getKeyCode("B");
+static const uint64_t SGF_KEY_W = SgfProp::getKeyCode("W");
+static const uint64_t SGF_KEY_AB = SgfProp::getKeyCode("AB");
+static const uint64_t SGF_KEY_AW = SgfProp::getKeyCode("AW");
+static const uint64_t SGF_KEY_AE = SgfProp::getKeyCode("AE");
+
+uint64_t SgfProp::getKeyCode(const char* key) {
+  uint64_t code;
+  if(tryPackSgfKey(key,code))
+    return code;
+  SgfKeyInternTable& table = getSgfKeyInternTable();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  auto iter = table.codeByKey.find(key);
+  if(iter != table.codeByKey.end())
+    return iter->second;
+  code = SGF_INTERNED_KEY_BIT | (uint64_t)table.keys.size();
+  table.keys.push_back(key);
+  table.codeByKey[key] = code;
+  return code;
+}
+uint64_t SgfProp::getKeyCode(const string& key) {
+  return getKeyCode(key.c_str());
+}
+
+bool SgfProp::tryGetKeyCode(const char* key, uint64_t& buf) {
+  if(tryPackSgfKey(key,buf))
+    return true;
+  SgfKeyInternTable& table = getSgfKeyInternTable();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  auto iter = table.codeByKey.find(key);
+  if(iter == table.codeByKey.end())
+    return false;
+  buf = iter->second;
+  return true;
+}
+
+string SgfProp::getKey(uint64_t keyCode) {
+  if(keyCode & SGF_INTERNED_KEY_BIT) {
+    SgfKeyInternTable& table = getSgfKeyInternTable();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    size_t idx = (size_t)(keyCode & ~SGF_INTERNED_KEY_BIT);
+    if(idx >= table.keys.size())
+      throw StringError("SgfProp::getKey: invalid key code");
+    return table.keys[idx];
+  }
+  string key;
+  for(; keyCode != 0; keyCode >>= 8)
+    key += (char)(keyCode & 0xFF);
+  return key;
+}
+
+SgfProp::SgfProp()
+  :keyCode(0),value(),moreValues()
+{}
+SgfProp::SgfProp(uint64_t k, const string& v)
+  :keyCode(k),value(v),moreValues()
+{}
+SgfProp::~SgfProp()
+{}
+
+size_t SgfProp::numValues() const {
+  return 1 + moreValues.size();
+}
+const string& SgfProp::getValue(size_t idx) const {
+  if(idx == 0)
+    return value;
+  return moreValues[idx-1];
+}
+vector<string> SgfProp::getValues() const {
+  vector<string> ret;
+  ret.reserve(numValues());
+  ret.push_back(value);
+  ret.insert(ret.end(),moreValues.begin(),moreValues.end());
+  return ret;
+}
+void SgfProp::addValue(const string& v) {
+  moreValues.push_back(v);
+}
+
 SgfNode::SgfNode()
-  :props(NULL),move(0,0,C_EMPTY)
+  :props(),move(0,0,C_EMPTY)
 {}
 SgfNode::SgfNode(const SgfNode& other)
-  :props(NULL),move(0,0,C_EMPTY)
-{
-  if(other.props != NULL)
-    props = new map<string,vector<string>>(*(other.props));
-  move = other.move;
-}
+  :props(other.props),move(other.move)
+{}
 SgfNode::SgfNode(SgfNode&& other) noexcept
-  :props(NULL),move(0,0,C_EMPTY)
-{
-  props = other.props;
-  other.props = NULL;
-  move = other.move;
-}
+  :props(std::move(other.props)),move(other.move)
+{}
 SgfNode::~SgfNode()
-{
-  if(props != NULL)
-    delete props;
-}
+{}
 
 SgfNode& SgfNode::operator=(const SgfNode& other) {
   if(this == &other)
     return *this;
-  if(props != NULL)
-    delete props;
-  if(other.props != NULL)
-    props = new map<string,vector<string>>(*(other.props));
-  else
-    props = NULL;
+  props = other.props;
   move = other.move;
   return *this;
 }
 SgfNode& SgfNode::operator=(SgfNode&& other) noexcept {
-  if(props != NULL)
-    delete props;
-  props = other.props;
-  other.props = NULL;
+  props = std::move(other.props);
   move = other.move;
   return *this;
 }
 
+const SgfProp* SgfNode::findProperty(uint64_t keyCode) const {
+  size_t len = props.size();
+  for(size_t i = 0; i<len; i++) {
+    if(props[i].keyCode == keyCode)
+      return &props[i];
+  }
+  return NULL;
+}
+const SgfProp* SgfNode::findProperty(const char* key) const {
+  if(props.size() <= 0)
+    return NULL;
+  uint64_t keyCode;
+  if(!SgfProp::tryGetKeyCode(key,keyCode))
+    return NULL;
+  return findProperty(keyCode);
+}
+
+void SgfNode::addPropertyValue(uint64_t keyCode, const string& value) {
+  size_t len = props.size();
+  for(size_t i = 0; i<len; i++) {
+    if(props[i].keyCode == keyCode) {
+      props[i].addValue(value);
+      return;
+    }
+  }
+  props.push_back(SgfProp(keyCode,value));
+}
 
 static void propertyFail(const string& msg) {
   throw IOError(msg);
@@ -128,7 +249,7 @@ static Loc parseSgfLocOrPass(const string& s, int xSize, int ySize) {
   return parseSgfLoc(s,xSize,ySize);
 }
 
-static void writeSgfLoc(ostream& out, Loc loc, int xSize, int ySize) {
+static void appendSgfLoc(string& buf, Loc loc, int xSize, int ySize) {
   if(xSize >= 53 || ySize >= 53)
     throw StringError("Writing coordinates for SGF files for board sizes >= 53 is not implemented");
   if(loc == Board::PASS_LOC || loc == Board::NULL_LOC)
@@ -136,58 +257,55 @@ static void writeSgfLoc(ostream& out, Loc loc, int xSize, int ySize) {
   int x = Location::getX(loc,xSize);
   int y = Location::getY(loc,xSize);
   const char* chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
-  out << chars[x];
-  out << chars[y];
+  char locBuf[2] = {chars[x], chars[y]};
+  buf.append(locBuf,2);
 }
 
 bool SgfNode::hasProperty(const char* key) const {
-  if(props == NULL)
-    return false;
-  return contains(*props,key);
+  return findProperty(key) != NULL;
 }
 bool SgfNode::hasProperty(const string& key) const {
   return hasProperty(key.c_str());
 }
 
 string SgfNode::getSingleProperty(const char* key) const {
-  if(props == NULL)
+  const SgfProp* prop = findProperty(key);
+  if(prop == NULL)
     propertyFail("SGF does not contain property: " + string(key));
-  if(!contains(*props,key))
-    propertyFail("SGF does not contain property: " + string(key));
-  const vector<string>& prop = map_get(*props,key);
-  if(prop.size() != 1)
+  if(prop->numValues() != 1)
     propertyFail("SGF property is not a singleton: " + string(key));
-  return prop[0];
+  return prop->value;
 }
 string SgfNode::getSingleProperty(const string& key) const {
   return getSingleProperty(key.c_str());
 }
 
 const vector<string> SgfNode::getProperties(const char* key) const {
-  if(props == NULL)
-    propertyFail("SGF does not contain property: " + string(key));
-  if(!contains(*props,key))
+  const SgfProp* prop = findProperty(key);
+  if(prop == NULL)
     propertyFail("SGF does not contain property: " + string(key));
-  return map_get(*props,key);
+  return prop->getValues();
 }
 const vector<string> SgfNode::getProperties(const string& key) const {
   return getProperties(key.c_str());
 }
 
 bool SgfNode::hasPlacements() const {
-  return props != NULL && (contains(*props,"AB") || contains(*props,"AW") || contains(*props,"AE"));
+  return findProperty(SGF_KEY_AB) != NULL || findProperty(SGF_KEY_AW) != NULL || findProperty(SGF_KEY_AE) != NULL;
 }
 
 void SgfNode::accumPlacements(vector<Move>& moves, int xSize, int ySize) const {
-  if(props == NULL)
+  if(props.size() <= 0)
     return;
 
-  auto handleRectangleList = [&](const vector<string>& elts, Player color) {
-    size_t len = elts.size();
+  auto handleRectangleList = [&](const SgfProp* prop, Player color) {
+    if(prop == NULL)
+      return;
+    size_t len = prop->numValues();
     for(size_t i = 0; i<len; i++) {
       int x1; int y1;
       int x2; int y2;
-      parseSgfLocRectangle(elts[i],xSize,ySize,x1,y1,x2,y2);
+      parseSgfLocRectangle(prop->getValue(i),xSize,ySize,x1,y1,x2,y2);
       for(int x = x1; x <= x2; x++) {
         for(int y = y1; y <= y2; y++) {
           Loc loc = Location::getLoc(x,y,xSize);
@@ -197,18 +315,9 @@ void SgfNode::accumPlacements(vector<Move>& moves, int xSize, int ySize) const {
     }
   };
 
-  if(contains(*props,"AB")) {
-    const vector<string>& ab = map_get(*props,"AB");
-    handleRectangleList(ab,P_BLACK);
-  }
-  if(contains(*props,"AW")) {
-    const vector<string>& aw = map_get(*props,"AW");
-    handleRectangleList(aw,P_WHITE);
-  }
-  if(contains(*props,"AE")) {
-    const vector<string>& ae = map_get(*props,"AE");
-    handleRectangleList(ae,C_EMPTY);
-  }
+  handleRectangleList(findProperty(SGF_KEY_AB),P_BLACK);
+  handleRectangleList(findProperty(SGF_KEY_AW),P_WHITE);
+  handleRectangleList(findProperty(SGF_KEY_AE),C_EMPTY);
 }
 
 void SgfNode::accumMoves(vector<Move>& moves, int xSize, int ySize) const {
@@ -221,11 +330,11 @@ void SgfNode::accumMoves(vector<Move>& moves, int xSize, int ySize) const {
       moves.push_back(Move(Location::getLoc(move.x,move.y,xSize),move.pla));
     }
   }
-  if(props != NULL && contains(*props,"B")) {
-    const vector<string>& b = map_get(*props,"B");
-    size_t len = b.size();
+  const SgfProp* b = findProperty(SGF_KEY_B);
+  if(b != NULL) {
+    size_t len = b->numValues();
     for(size_t i = 0; i<len; i++) {
-      Loc loc = parseSgfLocOrPass(b[i],xSize,ySize);
+      Loc loc = parseSgfLocOrPass(b->getValue(i),xSize,ySize);
       moves.push_back(Move(loc,P_BLACK));
     }
   }
@@ -238,11 +347,11 @@ void SgfNode::accumMoves(vector<Move>& moves, int xSize, int ySize) const {
       moves.push_back(Move(Location::getLoc(move.x,move.y,xSize),move.pla));
     }
   }
-  if(props != NULL && contains(*props,"W")) {
-    const vector<string>& w = map_get(*props,"W");
-    size_t len = w.size();
+  const SgfProp* w = findProperty(SGF_KEY_W);
+  if(w != NULL) {
+    size_t len = w->numValues();
     for(size_t i = 0; i<len; i++) {
-      Loc loc = parseSgfLocOrPass(w[i],xSize,ySize);
+      Loc loc = parseSgfLocOrPass(w->getValue(i),xSize,ySize);
       moves.push_back(Move(loc,P_WHITE));
     }
   }
@@ -264,11 +373,12 @@ Rules SgfNode::getRulesFromRUTagOrFail() const {
     throw StringError("SGF file does not specify rules");
   string s = getSingleProperty("RU");
 
-  Rules parsed;
-  bool suc = Rules::tryParseRules(s,parsed);
+  //Corpora use only a handful of distinct RU strings, so look them up rather than reparsing every time
+  RulesRegistry::RulesId rulesId;
+  bool suc = RulesRegistry::tryParseRules(s,rulesId);
   if(!suc)
     throw StringError("Could not parse rules in sgf: " + s);
-  return parsed;
+  return RulesRegistry::getRules(rulesId);
 }
 
 Player SgfNode::getSgfWinner() const {
@@ -633,6 +743,26 @@ void Sgf::loadAllUniquePositions(
   std::set<Hash128>& uniqueHashes,
   bool hashComments,
   bool hashParent,
+  bool dedupSymmetries,
+  bool flipIfPassOrWFirst,
+  bool allowGameOver,
+  Rand* rand,
+  vector<PositionSample>& samples
+) const {
+  std::function<void(PositionSample&, const BoardHistory&, const string&)> f = [&samples](PositionSample& sample, const BoardHistory& hist, const string& comments) {
+    (void)hist;
+    (void)comments;
+    samples.push_back(sample);
+  };
+
+  iterAllUniquePositions(uniqueHashes,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,rand,f);
+}
+
+void Sgf::loadAllUniquePositions(
+  ConcurrentHash128Set& uniqueHashes,
+  bool hashComments,
+  bool hashParent,
+  bool dedupSymmetries,
   bool flipIfPassOrWFirst,
   bool allowGameOver,
   Rand* rand,
@@ -644,44 +774,151 @@ void Sgf::loadAllUniquePositions(
     samples.push_back(sample);
   };
 
-  iterAllUniquePositions(uniqueHashes,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,rand,f);
+  iterAllUniquePositions(uniqueHashes,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,rand,f);
 }
 
 void Sgf::iterAllUniquePositions(
   std::set<Hash128>& uniqueHashes,
   bool hashComments,
   bool hashParent,
+  bool dedupSymmetries,
   bool flipIfPassOrWFirst,
   bool allowGameOver,
   Rand* rand,
   std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
 ) const {
-  XYSize size = getXYSize();
-  int xSize = size.x;
-  int ySize = size.y;
+  std::function<bool(Hash128)> tryInsertUnique = [&uniqueHashes](Hash128 hash) {
+    return uniqueHashes.insert(hash).second;
+  };
+  iterAllUniquePositionsHelper(tryInsertUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,rand,f);
+}
 
-  Board board(xSize,ySize);
-  Player nextPla = nodes.size() > 0 ? nodes[0]->getPLSpecifiedColor() : C_EMPTY;
-  if(nextPla == C_EMPTY)
-    nextPla = C_BLACK;
-  Rules rules = Rules::getTrompTaylorish();
-  rules.koRule = Rules::KO_SITUATIONAL;
-  rules.multiStoneSuicideLegal = true;
-  BoardHistory hist(board,nextPla,rules,0);
+void Sgf::iterAllUniquePositions(
+  ConcurrentHash128Set& uniqueHashes,
+  bool hashComments,
+  bool hashParent,
+  bool dedupSymmetries,
+  bool flipIfPassOrWFirst,
+  bool allowGameOver,
+  Rand* rand,
+  std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+) const {
+  std::function<bool(Hash128)> tryInsertUnique = [&uniqueHashes](Hash128 hash) {
+    return uniqueHashes.insert(hash);
+  };
+  iterAllUniquePositionsHelper(tryInsertUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,rand,f);
+}
 
-  PositionSample sampleBuf;
-  std::vector<std::pair<int64_t,int64_t>> variationTraceNodesBranch;
-  bool isRoot = true;
+void Sgf::iterAllUniquePositionsHelper(
+  const std::function<bool(Hash128)>& tryInsertUnique,
+  bool hashComments,
+  bool hashParent,
+  bool dedupSymmetries,
+  bool flipIfPassOrWFirst,
+  bool allowGameOver,
+  Rand* rand,
+  std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+) const {
   bool requireUnique = true;
-  iterAllPositionsHelper(
-    board,hist,nextPla,rules,xSize,ySize,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,isRoot,rand,variationTraceNodesBranch,f
-  );
+  bool useUndoLog = true;
+  iterAllPositionsStart(tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,useUndoLog,rand,f);
 }
+
 void Sgf::iterAllPositions(
   bool flipIfPassOrWFirst,
   bool allowGameOver,
   Rand* rand,
   std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+) const {
+  std::function<bool(Hash128)> tryInsertUnique = [](Hash128 hash) {
+    (void)hash;
+    return true;
+  };
+  bool requireUnique = false;
+  bool hashComments = false;
+  bool hashParent = false;
+  bool dedupSymmetries = false;
+  bool useUndoLog = true;
+  iterAllPositionsStart(tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,useUndoLog,rand,f);
+}
+
+struct Sgf::VariationUndoLog {
+  struct Entry {
+    //If not a snapshot, a move undone through BoardHistory::undoBoardMove
+    bool isSnapshot;
+    BoardHistory::MoveUndoRecord moveRecord;
+    //Placements clear the history, so for those the entire prior board and history are saved instead.
+    //Rare outside the root, so allocated only when needed and then kept for reuse.
+    std::unique_ptr<Board> boardBefore;
+    std::unique_ptr<BoardHistory> histBefore;
+  };
+  //Entries beyond size are unused, but kept so as to not reallocate them. A deque so that growing never has to
+  //relocate the existing entries.
+  std::deque<Entry> entries;
+  size_t size;
+  //If false, nothing is ever logged, see iterAllPositionsStart
+  bool enabled;
+
+  VariationUndoLog(bool e)
+    :entries(),size(0),enabled(e)
+  {}
+
+  Entry& push() {
+    if(size >= entries.size())
+      entries.resize(size+1);
+    return entries[size++];
+  }
+
+  //Same as BoardHistory::makeBoardMoveTolerant, logging the move if it succeeds
+  bool pushMove(Board& board, BoardHistory& hist, Loc loc, Player pla) {
+    Entry& entry = push();
+    entry.isSnapshot = false;
+    bool suc = hist.makeBoardMoveTolerant(board,loc,pla,entry.moveRecord);
+    if(!suc)
+      size--;
+    return suc;
+  }
+
+  void pushSnapshot(const Board& board, const BoardHistory& hist) {
+    Entry& entry = push();
+    entry.isSnapshot = true;
+    if(entry.boardBefore == nullptr) {
+      entry.boardBefore = std::make_unique<Board>(board);
+      entry.histBefore = std::make_unique<BoardHistory>(hist);
+    }
+    else {
+      *entry.boardBefore = board;
+      *entry.histBefore = hist;
+    }
+  }
+
+  //Undo everything logged since the log had the given size, most recent first
+  void undoTo(size_t mark, Board& board, BoardHistory& hist) {
+    assert(mark <= size);
+    while(size > mark) {
+      size--;
+      Entry& entry = entries[size];
+      if(entry.isSnapshot) {
+        board = *entry.boardBefore;
+        hist = *entry.histBefore;
+      }
+      else
+        hist.undoBoardMove(board,entry.moveRecord);
+    }
+  }
+};
+
+void Sgf::iterAllPositionsStart(
+  const std::function<bool(Hash128)>& tryInsertUnique,
+  bool requireUnique,
+  bool hashComments,
+  bool hashParent,
+  bool dedupSymmetries,
+  bool flipIfPassOrWFirst,
+  bool allowGameOver,
+  bool useUndoLog,
+  Rand* rand,
+  const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
 ) const {
   XYSize size = getXYSize();
   int xSize = size.x;
@@ -698,13 +935,14 @@ void Sgf::iterAllPositions(
 
   PositionSample sampleBuf;
   std::vector<std::pair<int64_t,int64_t>> variationTraceNodesBranch;
-  std::set<Hash128> uniqueHashes;
+  VariationUndoLog undoLog(useUndoLog);
   bool isRoot = true;
-  bool requireUnique = false;
-  bool hashComments = false;
-  bool hashParent = false;
+  //Nothing needs to be restored after the root, nor after any variation that is the last one explored at every
+  //branch point on the way to it, such as the entire main line of a game without variations.
+  bool logForUndo = false;
   iterAllPositionsHelper(
-    board,hist,nextPla,rules,xSize,ySize,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,isRoot,rand,variationTraceNodesBranch,f
+    board,hist,nextPla,rules,xSize,ySize,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,
+    isRoot,logForUndo,rand,variationTraceNodesBranch,undoLog,f
   );
 }
 
@@ -712,16 +950,19 @@ void Sgf::iterAllPositionsHelper(
   Board& board, BoardHistory& hist, Player nextPla,
   const Rules& rules, int xSize, int ySize,
   PositionSample& sampleBuf,
-  std::set<Hash128>& uniqueHashes,
+  const std::function<bool(Hash128)>& tryInsertUnique,
   bool requireUnique,
   bool hashComments,
   bool hashParent,
+  bool dedupSymmetries,
   bool flipIfPassOrWFirst,
   bool allowGameOver,
   bool isRoot,
+  bool logForUndo,
   Rand* rand,
   std::vector<std::pair<int64_t,int64_t>>& variationTraceNodesBranch,
-  std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+  VariationUndoLog& undoLog,
+  const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
 ) const {
   vector<Move> buf;
   for(size_t i = 0; i<nodes.size(); i++) {
@@ -731,7 +972,7 @@ void Sgf::iterAllPositionsHelper(
 
     //Do the root node even if it has no placements since nothing else will do it.
     if(isRoot && i == 0 && !nodes[i]->hasPlacements()) {
-      samplePositionHelper(board,hist,nextPla,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,comments,f);
+      samplePositionHelper(board,hist,nextPla,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,comments,f);
     }
 
     //Handle placements
@@ -746,6 +987,8 @@ void Sgf::iterAllPositionsHelper(
           if(board.colors[buf[j].loc] == C_EMPTY && buf[j].pla != C_EMPTY)
             netStonesAdded++;
         }
+        if(logForUndo)
+          undoLog.pushSnapshot(board,hist);
         bool suc = board.setStonesFailIfNoLibs(buf);
         if(!suc) {
           ostringstream trace;
@@ -777,7 +1020,7 @@ void Sgf::iterAllPositionsHelper(
         hist.clear(board,nextPla,rules,0);
         hist.setInitialTurnNumber(initialTurnNumber);
       }
-      samplePositionHelper(board,hist,nextPla,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,comments,f);
+      samplePositionHelper(board,hist,nextPla,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,comments,f);
     }
 
     //Handle actual moves
@@ -785,7 +1028,9 @@ void Sgf::iterAllPositionsHelper(
     nodes[i]->accumMoves(buf,xSize,ySize);
 
     for(size_t j = 0; j<buf.size(); j++) {
-      bool suc = hist.makeBoardMoveTolerant(board,buf[j].loc,buf[j].pla);
+      bool suc = logForUndo ?
+        undoLog.pushMove(board,hist,buf[j].loc,buf[j].pla) :
+        hist.makeBoardMoveTolerant(board,buf[j].loc,buf[j].pla);
       if(!suc) {
         ostringstream trace;
         for(size_t s = 0; s < variationTraceNodesBranch.size(); s++) {
@@ -806,7 +1051,7 @@ void Sgf::iterAllPositionsHelper(
       if(hist.moveHistory.size() > 0x3FFFFFFF)
         throw StringError("too many moves in sgf");
       nextPla = getOpp(buf[j].pla);
-      samplePositionHelper(board,hist,nextPla,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,comments,f);
+      samplePositionHelper(board,hist,nextPla,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,comments,f);
     }
   }
 
@@ -821,30 +1066,52 @@ void Sgf::iterAllPositionsHelper(
     }
   }
 
+  //Every variation starts from the same board and history, restored by undoing the previous variation rather than by
+  //handing each its own copy. The last one can keep whatever it leaves behind unless our own caller needs it restored.
   for(size_t c = 0; c<children.size(); c++) {
     size_t i = permutation[c];
-    std::unique_ptr<Board> copy = std::make_unique<Board>(board);
-    std::unique_ptr<BoardHistory> histCopy = std::make_unique<BoardHistory>(hist);
+    bool isLast = c+1 == children.size();
     variationTraceNodesBranch.push_back(std::make_pair((int64_t)nodes.size(),(int64_t)i));
-    children[i]->iterAllPositionsHelper(
-      *copy,*histCopy,nextPla,rules,xSize,ySize,sampleBuf,uniqueHashes,requireUnique,hashComments,hashParent,flipIfPassOrWFirst,allowGameOver,false,rand,variationTraceNodesBranch,f
-    );
+    if(!isLast && !undoLog.enabled) {
+      Board boardCopy(board);
+      BoardHistory histCopy(hist);
+      children[i]->iterAllPositionsHelper(
+        boardCopy,histCopy,nextPla,rules,xSize,ySize,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,
+        false,false,rand,variationTraceNodesBranch,undoLog,f
+      );
+    }
+    else {
+      bool childLogForUndo = logForUndo || !isLast;
+      size_t undoMark = undoLog.size;
+      children[i]->iterAllPositionsHelper(
+        board,hist,nextPla,rules,xSize,ySize,sampleBuf,tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,
+        false,childLogForUndo,rand,variationTraceNodesBranch,undoLog,f
+      );
+      if(!isLast)
+        undoLog.undoTo(undoMark,board,hist);
+    }
     assert(variationTraceNodesBranch.size() > 0);
     variationTraceNodesBranch.erase(variationTraceNodesBranch.begin()+(variationTraceNodesBranch.size()-1));
   }
 }
 
+//Mix in a blended up hash of the previous board state to avoid zobrist cancellation, also swapping halves
+static Hash128 mixParentHash(Hash128 parentHash) {
+  return Hash128(Hash::murmurMix(parentHash.hash1),Hash::splitMix64(parentHash.hash0));
+}
+
 void Sgf::samplePositionHelper(
   Board& board, BoardHistory& hist, Player nextPla,
   PositionSample& sampleBuf,
-  std::set<Hash128>& uniqueHashes,
+  const std::function<bool(Hash128)>& tryInsertUnique,
   bool requireUnique,
   bool hashComments,
   bool hashParent,
+  bool dedupSymmetries,
   bool flipIfPassOrWFirst,
   bool allowGameOver,
   const std::string& comments,
-  std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+  const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
 ) const {
   //If the game is over or there were two consecutive passes, skip
   if(!allowGameOver) {
@@ -856,32 +1123,63 @@ void Sgf::samplePositionHelper(
       return;
   }
 
-  //Hash based on position, player, and simple ko
-  Hash128 situationHash = board.pos_hash;
-  situationHash ^= Board::ZOBRIST_PLAYER_HASH[nextPla];
   assert(hist.encorePhase == 0);
-  if(board.ko_loc != Board::NULL_LOC)
-    situationHash ^= Board::ZOBRIST_KO_LOC_HASH[board.ko_loc];
-
-  if(hashComments)
-    situationHash.hash0 += Hash::simpleHash(comments.c_str());
-
-  if(hashParent) {
-    Hash128 parentHash = Hash128();
-    if(hist.moveHistory.size() > 0) {
-      const Board& prevBoard = hist.getRecentBoard(1);
-      parentHash = prevBoard.pos_hash;
-      if(prevBoard.ko_loc != Board::NULL_LOC)
-        parentHash ^= Board::ZOBRIST_KO_LOC_HASH[prevBoard.ko_loc];
+  Hash128 situationHash;
+  int symmetry = 0;
+  if(!dedupSymmetries) {
+    //Hash based on position, player, and simple ko
+    situationHash = board.pos_hash;
+    situationHash ^= Board::ZOBRIST_PLAYER_HASH[nextPla];
+    if(board.ko_loc != Board::NULL_LOC)
+      situationHash ^= Board::ZOBRIST_KO_LOC_HASH[board.ko_loc];
+
+    if(hashComments)
+      situationHash.hash0 += Hash::simpleHash(comments.c_str());
+
+    if(hashParent) {
+      Hash128 parentHash = Hash128();
+      if(hist.moveHistory.size() > 0) {
+        const Board& prevBoard = hist.getRecentBoard(1);
+        parentHash = prevBoard.pos_hash;
+        if(prevBoard.ko_loc != Board::NULL_LOC)
+          parentHash ^= Board::ZOBRIST_KO_LOC_HASH[prevBoard.ko_loc];
+      }
+      situationHash ^= mixParentHash(parentHash);
+    }
+  }
+  else {
+    //Same hash as above, but computed in every orientation that maps the board onto itself, keeping the smallest so
+    //that positions that are symmetric to each other collide. The parent is hashed in the same orientation as the
+    //position, so that both have to match up under a single symmetry.
+    int numSymmetries = SymmetryHelpers::getNumSymmetries(board.x_size,board.y_size);
+    Hash128 symHashes[SymmetryHelpers::NUM_SYMMETRIES];
+    SymmetryHelpers::getSymSituationHashes(board,nextPla,symHashes);
+    Hash128 parentSymHashes[SymmetryHelpers::NUM_SYMMETRIES];
+    if(hashParent) {
+      if(hist.moveHistory.size() > 0) {
+        SymmetryHelpers::getSymSituationHashes(hist.getRecentBoard(1),nextPla,parentSymHashes);
+        //The parent hash above does not include the player
+        for(int s = 0; s<numSymmetries; s++)
+          parentSymHashes[s] ^= Board::ZOBRIST_PLAYER_HASH[nextPla];
+      }
+      else
+        std::fill(parentSymHashes,parentSymHashes+SymmetryHelpers::NUM_SYMMETRIES,Hash128());
+    }
+    uint64_t commentsHash = hashComments ? Hash::simpleHash(comments.c_str()) : 0;
+    for(int s = 0; s<numSymmetries; s++) {
+      Hash128 hash = symHashes[s];
+      hash.hash0 += commentsHash;
+      if(hashParent)
+        hash ^= mixParentHash(parentSymHashes[s]);
+      if(s == 0 || hash < situationHash) {
+        situationHash = hash;
+        symmetry = s;
+      }
     }
-    //Mix in a blended up hash of the previous board state to avoid zobrist cancellation, also swapping halves
-    Hash128 mixed = Hash128(Hash::murmurMix(parentHash.hash1),Hash::splitMix64(parentHash.hash0));
-    situationHash ^= mixed;
   }
 
-  if(requireUnique && contains(uniqueHashes,situationHash))
+  if(requireUnique && !tryInsertUnique(situationHash))
     return;
-  uniqueHashes.insert(situationHash);
 
   //Snap the position 5 turns ago so as to include 5 moves of history.
   assert(BoardHistory::NUM_RECENT_BOARDS > 5);
@@ -912,6 +1210,7 @@ void Sgf::samplePositionHelper(
   sampleBuf.initialTurnNumber = hist.initialTurnNumber + startTurnIdx;
   sampleBuf.hintLoc = Board::NULL_LOC;
   sampleBuf.weight = 1.0;
+  sampleBuf.symmetry = symmetry;
 
   if(flipIfPassOrWFirst) {
     if(hist.hasBlackPassOrWhiteFirst())
@@ -982,6 +1281,8 @@ string Sgf::PositionSample::toJsonLine(const Sgf::PositionSample& sample) {
     data["metadata"] = sample.metadata;
   if(sample.trainingWeight != 1.0)
     data["trainingWeight"] = sample.trainingWeight;
+  if(sample.symmetry != 0)
+    data["symmetry"] = sample.symmetry;
   return data.dump();
 }
 
@@ -1024,6 +1325,13 @@ Sgf::PositionSample Sgf::PositionSample::ofJsonLine(const string& s) {
       sample.trainingWeight = data["trainingWeight"].get<double>();
     else
       sample.trainingWeight = 1.0;
+
+    if(data.find("symmetry") != data.end())
+      sample.symmetry = data["symmetry"].get<int>();
+    else
+      sample.symmetry = 0;
+    if(sample.symmetry < 0 || sample.symmetry >= SymmetryHelpers::getNumSymmetries(xSize,ySize))
+      throw StringError("Invalid symmetry for board size: " + Global::intToString(sample.symmetry));
   }
   catch(nlohmann::detail::exception& e) {
     throw StringError("Error parsing position sample json\n" + s + "\n" + e.what());
@@ -1031,6 +1339,172 @@ Sgf::PositionSample Sgf::PositionSample::ofJsonLine(const string& s) {
   return sample;
 }
 
+//Fixed-size start of each binary record, followed by the packed board, the packed moves, and the metadata
+struct PositionSampleBinaryHeader {
+  //Bytes in the record after this field
+  uint32_t recordLen;
+  uint32_t numMoves;
+  uint32_t metadataLen;
+  uint8_t xSize;
+  uint8_t ySize;
+  uint8_t nextPla;
+  uint8_t symmetry;
+  uint16_t hintLoc;
+  uint16_t reserved1;
+  uint32_t reserved2;
+  int64_t initialTurnNumber;
+  double weight;
+  double trainingWeight;
+};
+static_assert(sizeof(PositionSampleBinaryHeader) == 48, "Unexpected padding in PositionSampleBinaryHeader");
+
+static const char POSITION_SAMPLE_BINARY_MAGIC[8] = {'K','G','P','O','S','B','I','N'};
+static const uint32_t POSITION_SAMPLE_BINARY_VERSION = 1;
+static const uint32_t POSITION_SAMPLE_BINARY_ENDIAN_MARKER = 0x01020304;
+//Locations are packed as y * xSize + x, moves additionally with the player in the top 2 bits
+static const uint16_t POSITION_SAMPLE_BINARY_PASS = 0x3FFF;
+static const uint16_t POSITION_SAMPLE_BINARY_NULL = 0xFFFF;
+
+static uint16_t packPositionSampleLoc(Loc loc, const Board& board) {
+  if(loc == Board::NULL_LOC)
+    return POSITION_SAMPLE_BINARY_NULL;
+  if(loc == Board::PASS_LOC)
+    return POSITION_SAMPLE_BINARY_PASS;
+  if(!board.isOnBoard(loc))
+    throw StringError("Position sample has a location not on the board");
+  return (uint16_t)(Location::getY(loc,board.x_size) * board.x_size + Location::getX(loc,board.x_size));
+}
+
+static Loc unpackPositionSampleLoc(uint16_t packed, const Board& board) {
+  if(packed == POSITION_SAMPLE_BINARY_NULL)
+    return Board::NULL_LOC;
+  if(packed == POSITION_SAMPLE_BINARY_PASS)
+    return Board::PASS_LOC;
+  if(packed >= board.x_size * board.y_size)
+    throw StringError("Position sample binary record has a location not on the board");
+  return Location::getLoc(packed % board.x_size, packed / board.x_size, board.x_size);
+}
+
+void Sgf::PositionSample::appendBinaryFileHeader(string& buf) {
+  char header[BINARY_FILE_HEADER_LEN];
+  std::memcpy(header,POSITION_SAMPLE_BINARY_MAGIC,8);
+  std::memcpy(header+8,&POSITION_SAMPLE_BINARY_VERSION,4);
+  std::memcpy(header+12,&POSITION_SAMPLE_BINARY_ENDIAN_MARKER,4);
+  buf.append(header,BINARY_FILE_HEADER_LEN);
+}
+
+void Sgf::PositionSample::appendBinary(const PositionSample& sample, string& buf) {
+  const Board& board = sample.board;
+  int numPoints = board.x_size * board.y_size;
+  size_t boardLen = (size_t)(numPoints + 3) / 4;
+  if(sample.moves.size() > 0xFFFFFFFFU / 4 || sample.metadata.size() > 0xFFFFFFFFU / 2)
+    throw StringError("Position sample too large for binary record");
+  if(sample.symmetry < 0 || sample.symmetry >= SymmetryHelpers::getNumSymmetries(board.x_size,board.y_size))
+    throw StringError("Position sample has an invalid symmetry");
+
+  PositionSampleBinaryHeader header;
+  std::memset(&header,0,sizeof(header));
+  header.recordLen = (uint32_t)(
+    sizeof(PositionSampleBinaryHeader) - sizeof(uint32_t) + boardLen + sample.moves.size() * sizeof(uint16_t) + sample.metadata.size()
+  );
+  header.numMoves = (uint32_t)sample.moves.size();
+  header.metadataLen = (uint32_t)sample.metadata.size();
+  header.xSize = (uint8_t)board.x_size;
+  header.ySize = (uint8_t)board.y_size;
+  header.nextPla = (uint8_t)sample.nextPla;
+  header.symmetry = (uint8_t)sample.symmetry;
+  header.hintLoc = packPositionSampleLoc(sample.hintLoc,board);
+  header.initialTurnNumber = sample.initialTurnNumber;
+  header.weight = sample.weight;
+  header.trainingWeight = sample.trainingWeight;
+
+  size_t start = buf.size();
+  buf.resize(start + sizeof(uint32_t) + header.recordLen);
+  char* dst = &buf[start];
+  std::memcpy(dst,&header,sizeof(header));
+  dst += sizeof(header);
+
+  std::memset(dst,0,boardLen);
+  for(int y = 0; y<board.y_size; y++) {
+    for(int x = 0; x<board.x_size; x++) {
+      int i = y * board.x_size + x;
+      Color color = board.colors[Location::getLoc(x,y,board.x_size)];
+      dst[i / 4] = (char)((uint8_t)dst[i / 4] | (uint8_t)(color << (2 * (i % 4))));
+    }
+  }
+  dst += boardLen;
+
+  for(size_t i = 0; i<sample.moves.size(); i++) {
+    const Move& move = sample.moves[i];
+    if(move.pla != P_BLACK && move.pla != P_WHITE)
+      throw StringError("Position sample has a move by an invalid player");
+    uint16_t loc = packPositionSampleLoc(move.loc,board);
+    if(loc == POSITION_SAMPLE_BINARY_NULL)
+      throw StringError("Position sample has a null move");
+    uint16_t packed = (uint16_t)(((uint16_t)move.pla << 14) | loc);
+    std::memcpy(dst,&packed,sizeof(uint16_t));
+    dst += sizeof(uint16_t);
+  }
+
+  if(sample.metadata.size() > 0)
+    std::memcpy(dst,sample.metadata.data(),sample.metadata.size());
+}
+
+size_t Sgf::PositionSample::ofBinary(const char* data, size_t len, PositionSample& sampleBuf) {
+  PositionSampleBinaryHeader header;
+  if(len < sizeof(header))
+    throw StringError("Position sample binary record is truncated");
+  std::memcpy(&header,data,sizeof(header));
+  size_t totalLen = sizeof(uint32_t) + (size_t)header.recordLen;
+  if(len < totalLen)
+    throw StringError("Position sample binary record is truncated");
+  if(header.xSize < 1 || header.xSize > Board::MAX_LEN || header.ySize < 1 || header.ySize > Board::MAX_LEN)
+    throw StringError("Position sample binary record has invalid board size");
+  int numPoints = (int)header.xSize * (int)header.ySize;
+  size_t boardLen = (size_t)(numPoints + 3) / 4;
+  if(totalLen != sizeof(header) + boardLen + (size_t)header.numMoves * sizeof(uint16_t) + header.metadataLen)
+    throw StringError("Position sample binary record has inconsistent length");
+  if(header.nextPla != P_BLACK && header.nextPla != P_WHITE)
+    throw StringError("Position sample binary record has invalid next player");
+  if(header.symmetry >= SymmetryHelpers::getNumSymmetries(header.xSize,header.ySize))
+    throw StringError("Position sample binary record has invalid symmetry");
+
+  const char* src = data + sizeof(header);
+  Board board(header.xSize,header.ySize);
+  for(int i = 0; i<numPoints; i++) {
+    Color color = (Color)(((uint8_t)src[i / 4] >> (2 * (i % 4))) & 0x3);
+    if(color == C_EMPTY)
+      continue;
+    Loc loc = Location::getLoc(i % board.x_size, i / board.x_size, board.x_size);
+    if(color != C_BLACK && color != C_WHITE)
+      throw StringError("Position sample binary record has invalid board contents");
+    bool suc = board.setStoneFailIfNoLibs(loc,color);
+    if(!suc)
+      throw StringError(string("Position sample binary record has a zero-liberty group near ") + Location::toString(loc,board));
+  }
+  src += boardLen;
+
+  sampleBuf.board = board;
+  sampleBuf.nextPla = (Player)header.nextPla;
+  sampleBuf.moves.resize(header.numMoves);
+  for(uint32_t i = 0; i<header.numMoves; i++) {
+    uint16_t packed;
+    std::memcpy(&packed,src,sizeof(uint16_t));
+    src += sizeof(uint16_t);
+    Player pla = (Player)(packed >> 14);
+    if(pla != P_BLACK && pla != P_WHITE)
+      throw StringError("Position sample binary record has a move by an invalid player");
+    sampleBuf.moves[i] = Move(unpackPositionSampleLoc(packed & POSITION_SAMPLE_BINARY_PASS,board),pla);
+  }
+  sampleBuf.initialTurnNumber = header.initialTurnNumber;
+  sampleBuf.hintLoc = unpackPositionSampleLoc(header.hintLoc,board);
+  sampleBuf.weight = header.weight;
+  sampleBuf.metadata.assign(src,header.metadataLen);
+  sampleBuf.trainingWeight = header.trainingWeight;
+  sampleBuf.symmetry = header.symmetry;
+  return totalLen;
+}
+
 Sgf::PositionSample Sgf::PositionSample::getColorFlipped() const {
   Sgf::PositionSample other = *this;
   Board newBoard(other.board.x_size,other.board.y_size);
@@ -1052,6 +1526,18 @@ Sgf::PositionSample Sgf::PositionSample::getColorFlipped() const {
   return other;
 }
 
+Sgf::PositionSample Sgf::PositionSample::getSymmetric(int sym) const {
+  if(sym < 0 || sym >= SymmetryHelpers::getNumSymmetries(board.x_size,board.y_size))
+    throw StringError("PositionSample::getSymmetric: symmetry " + Global::intToString(sym) + " does not map the board onto itself");
+  Sgf::PositionSample other = *this;
+  other.board = SymmetryHelpers::getSymBoard(board,sym);
+  for(size_t i = 0; i<other.moves.size(); i++)
+    other.moves[i].loc = SymmetryHelpers::getSymLoc(moves[i].loc,board.x_size,board.y_size,sym);
+  other.hintLoc = SymmetryHelpers::getSymLoc(hintLoc,board.x_size,board.y_size,sym);
+  other.symmetry = SymmetryHelpers::compose(SymmetryHelpers::invert(sym),symmetry);
+  return other;
+}
+
 bool Sgf::PositionSample::hasPreviousPositions(int numPrevious) const {
   return moves.size() >= numPrevious;
 }
@@ -1089,6 +1575,12 @@ bool Sgf::PositionSample::isEqualForTesting(const Sgf::PositionSample& other, bo
     return false;
   if(weight != other.weight)
     return false;
+  if(metadata != other.metadata)
+    return false;
+  if(trainingWeight != other.trainingWeight)
+    return false;
+  if(symmetry != other.symmetry)
+    return false;
   return true;
 }
 
@@ -1191,6 +1683,7 @@ static bool maybeParseProperty(SgfNode* node, const string& str, int& pos) {
   }
   if(key.length() <= 0)
     return false;
+  uint64_t keyCode = SgfProp::getKeyCode(key);
 
   bool parsedAtLeastOne = false;
   while(true) {
@@ -1199,18 +1692,14 @@ static bool maybeParseProperty(SgfNode* node, const string& str, int& pos) {
       break;
     consume(str,pos,newPos);
 
-    if(node->move.pla == C_EMPTY && key == "B") {
+    if(node->move.pla == C_EMPTY && keyCode == SGF_KEY_B) {
       node->move = parseSgfLocOrPassNoSize(parseTextValue(str,pos),P_BLACK);
     }
-    else if(node->move.pla == C_EMPTY && key == "W") {
+    else if(node->move.pla == C_EMPTY && keyCode == SGF_KEY_W) {
       node->move = parseSgfLocOrPassNoSize(parseTextValue(str,pos),P_WHITE);
     }
     else {
-      if(node->props == NULL)
-        node->props = new map<string,vector<string>>();
-      vector<string>& contents = (*(node->props))[key];
-      string value = parseTextValue(str,pos);
-      contents.push_back(value);
+      node->addPropertyValue(keyCode,parseTextValue(str,pos));
     }
     if(peekSgfChar(str,pos,newPos) != ']')
       sgfFail("Expected closing bracket",str,pos);
@@ -1282,19 +1771,44 @@ static Sgf* maybeParseSgf(const string& str, int& pos) {
 }
 
 
-Sgf* Sgf::parse(const string& str) {
+Hash128 Sgf::computeHash(const char* str, size_t len, SgfHashMode hashMode) {
+  if(hashMode == SgfHashMode::FAST)
+    return Hash::murmur3x64_128(str,len,0);
+  //Historically the text has been hashed as a C string, so stop at any embedded null
+  const void* nullPos = std::memchr(str,'\0',len);
+  if(nullPos != NULL)
+    len = (size_t)((const char*)nullPos - str);
+  uint64_t hash[4];
+  SHA2::get256((const uint8_t*)str,len,hash);
+  return Hash128(hash[0],hash[1]);
+}
+
+SgfHashMode Sgf::parseHashMode(const string& s) {
+  string lower = Global::toLower(Global::trim(s));
+  if(lower == "sha256")
+    return SgfHashMode::SHA256;
+  if(lower == "fast")
+    return SgfHashMode::FAST;
+  throw StringError("Unknown sgf hash mode, expected sha256 or fast: " + s);
+}
+
+SgfHashMode Sgf::getHashModeFromConfig(ConfigParser& cfg) {
+  if(!cfg.contains("sgfHashMode"))
+    return SgfHashMode::SHA256;
+  return parseHashMode(cfg.getString("sgfHashMode", {"sha256","fast"}));
+}
+
+Sgf* Sgf::parse(const string& str, SgfHashMode hashMode) {
   int pos = 0;
   Sgf* sgf = maybeParseSgf(str,pos);
-  uint64_t hash[4];
-  SHA2::get256(str.c_str(),hash);
   if(sgf == NULL || sgf->nodes.size() == 0)
     sgfFail("Empty or invalid sgf (is the opening parenthesis missing?)",str,0);
-  sgf->hash = Hash128(hash[0],hash[1]);
+  sgf->hash = computeHash(str.data(),str.size(),hashMode);
   return sgf;
 }
 
-Sgf* Sgf::loadFile(const string& file) {
-  Sgf* sgf = parse(FileUtils::readFile(file));
+Sgf* Sgf::loadFile(const string& file, SgfHashMode hashMode) {
+  Sgf* sgf = parse(FileUtils::readFile(file),hashMode);
   if(sgf != NULL)
     sgf->fileName = file;
   return sgf;
@@ -1324,7 +1838,7 @@ vector<Sgf*> Sgf::loadFiles(const vector<string>& files) {
   return sgfs;
 }
 
-vector<Sgf*> Sgf::loadSgfsFile(const string& file) {
+vector<Sgf*> Sgf::loadSgfsFile(const string& file, SgfHashMode hashMode) {
   vector<Sgf*> sgfs;
   vector<string> lines = FileUtils::readFileLines(file,'\n');
   try {
@@ -1332,7 +1846,7 @@ vector<Sgf*> Sgf::loadSgfsFile(const string& file) {
       string line = Global::trim(lines[i]);
       if(line.length() <= 0)
         continue;
-      Sgf* sgf = parse(line);
+      Sgf* sgf = parse(line,hashMode);
       sgf->fileName = file;
       sgfs.push_back(sgf);
     }
@@ -1372,30 +1886,1130 @@ vector<Sgf*> Sgf::loadSgfsFiles(const vector<string>& files) {
 }
 
 
+//Shared driver for the parallel loaders. Worker threads take inputs from nextInput one at a time, which is always called
+//under a lock and returns false once there are no more, and call load on them. Meanwhile the calling thread hands the
+//results to consume, in input order if options.ordered. load also gets the index of the worker calling it, in
+//[0,options.numThreads), and both load and consume get the index of the input, counting from 0 in the order nextInput
+//returned them. An IOError from load
+//skips the input and is passed to onError instead. Any other exception stops everything and is rethrown on the calling
+//thread, after destroy is called on every result that was loaded but not yet handed to consume.
+template<typename T>
+static void loadParallelHelper(
+  const SgfLoadOptions& options,
+  std::function<bool(string&)> nextInput,
+  std::function<T(int,size_t,const string&)> load,
+  std::function<void(size_t,T&)> consume,
+  std::function<void(size_t,const string&)> onError,
+  std::function<void(T&)> destroy
+) {
+  if(options.numThreads <= 0)
+    throw StringError("SgfLoadOptions: numThreads must be positive");
+  if(options.maxInFlight <= 0)
+    throw StringError("SgfLoadOptions: maxInFlight must be positive");
+  const size_t maxInFlight = (size_t)options.maxInFlight;
+
+  struct LoadResult {
+    bool failed;
+    T value;
+    string message;
+  };
 
-CompactSgf::CompactSgf(const Sgf* sgf)
-  :fileName(sgf->fileName),
-   rootNode(),
-   placements(),
-   moves(),
-   xSize(),
-   ySize(),
-   depth()
-{
-  XYSize size = sgf->getXYSize();
-  xSize = size.x;
-  ySize = size.y;
-  depth = sgf->depth();
-  komi = sgf->getKomi();
-  hash = sgf->hash;
+  std::mutex mutex;
+  std::condition_variable workerCondVar;
+  std::condition_variable consumerCondVar;
+  bool inputsDone = false;
+  size_t nextToClaim = 0;
+  size_t nextToConsume = 0;
+  size_t numConsumed = 0;
+  map<size_t,LoadResult> finished;
+  bool aborted = false;
+  std::exception_ptr abortException;
+
+  auto abort = [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!aborted) {
+      aborted = true;
+      abortException = e;
+    }
+    workerCondVar.notify_all();
+    consumerCondVar.notify_all();
+  };
 
-  sgf->getPlacements(placements, xSize, ySize);
-  sgf->getMoves(moves, xSize, ySize);
+  auto runWorker = [&](int threadIdx) {
+    string input;
+    while(true) {
+      size_t inputIdx;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true) {
+          if(aborted || inputsDone)
+            return;
+          //Claim only if it keeps the number of results not yet consumed within bounds
+          size_t base = options.ordered ? nextToConsume : numConsumed;
+          if(nextToClaim < base + maxInFlight)
+            break;
+          workerCondVar.wait(lock);
+        }
+        bool hasInput;
+        try {
+          hasInput = nextInput(input);
+        }
+        catch(...) {
+          lock.unlock();
+          abort(std::current_exception());
+          return;
+        }
+        if(!hasInput) {
+          inputsDone = true;
+          consumerCondVar.notify_all();
+          return;
+        }
+        inputIdx = nextToClaim++;
+      }
 
-  checkNonEmpty(sgf->nodes);
-  rootNode = *(sgf->nodes[0]);
+      LoadResult result = LoadResult();
+      result.failed = false;
+      try {
+        result.value = load(threadIdx,inputIdx,input);
+      }
+      catch(const IOError& e) {
+        result.failed = true;
+        result.message = e.message;
+      }
+      catch(...) {
+        abort(std::current_exception());
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.emplace(inputIdx,std::move(result));
+      }
+      consumerCondVar.notify_one();
+    }
+  };
 
-  sgfWinner = rootNode.getSgfWinner();
+  vector<std::thread> threads;
+  for(int i = 0; i<options.numThreads; i++)
+    threads.push_back(std::thread(runWorker,i));
+
+  while(true) {
+    size_t inputIdx;
+    LoadResult result;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while(true) {
+        if(aborted || (inputsDone && numConsumed >= nextToClaim))
+          break;
+        if(finished.size() > 0 && (!options.ordered || finished.begin()->first == nextToConsume))
+          break;
+        consumerCondVar.wait(lock);
+      }
+      if(aborted || finished.size() <= 0 || (options.ordered && finished.begin()->first != nextToConsume))
+        break;
+      auto iter = finished.begin();
+      inputIdx = iter->first;
+      result = std::move(iter->second);
+      finished.erase(iter);
+      nextToConsume = inputIdx+1;
+      numConsumed++;
+    }
+    workerCondVar.notify_all();
+
+    try {
+      if(result.failed)
+        onError(inputIdx,result.message);
+      else
+        consume(inputIdx,result.value);
+    }
+    catch(...) {
+      abort(std::current_exception());
+      break;
+    }
+  }
+
+  for(size_t i = 0; i<threads.size(); i++)
+    threads[i].join();
+  for(auto iter = finished.begin(); iter != finished.end(); ++iter) {
+    if(!iter->second.failed)
+      destroy(iter->second.value);
+  }
+  if(abortException)
+    std::rethrow_exception(abortException);
+}
+
+//Loads each of files, recording those that fail to load in errors
+template<typename T>
+static void loadFilesParallelHelper(
+  const vector<string>& files,
+  const SgfLoadOptions& options,
+  vector<SgfLoadError>& errors,
+  std::function<T(int,size_t,const string&)> load,
+  std::function<void(size_t,T&)> consume,
+  std::function<void(T&)> destroy
+) {
+  size_t nextFileIdx = 0;
+  loadParallelHelper<T>(
+    options,
+    [&](string& buf) {
+      if(nextFileIdx >= files.size())
+        return false;
+      buf = files[nextFileIdx++];
+      return true;
+    },
+    load,
+    consume,
+    [&](size_t fileIdx, const string& message) {
+      SgfLoadError error;
+      error.fileIdx = fileIdx;
+      error.file = files[fileIdx];
+      error.message = message;
+      errors.push_back(error);
+    },
+    destroy
+  );
+}
+
+void Sgf::loadFilesParallel(
+  const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(size_t,Sgf*)> f
+) {
+  loadFilesParallelHelper<Sgf*>(
+    files, options, errors,
+    [&options](int threadIdx, size_t fileIdx, const string& file) { (void)threadIdx; (void)fileIdx; return loadFile(file,options.hashMode); },
+    [&f](size_t fileIdx, Sgf*& sgf) { f(fileIdx,sgf); },
+    [](Sgf*& sgf) { delete sgf; }
+  );
+}
+
+vector<Sgf*> Sgf::loadFilesParallel(const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors) {
+  vector<Sgf*> sgfs;
+  try {
+    loadFilesParallel(files, options, errors, [&sgfs](size_t fileIdx, Sgf* sgf) {
+      (void)fileIdx;
+      sgfs.push_back(sgf);
+    });
+  }
+  catch(...) {
+    for(int i = 0; i<sgfs.size(); i++) {
+      delete sgfs[i];
+    }
+    throw;
+  }
+  return sgfs;
+}
+
+void Sgf::loadSgfsFilesParallel(
+  const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(size_t,vector<Sgf*>&)> f
+) {
+  loadFilesParallelHelper<vector<Sgf*>>(
+    files, options, errors,
+    [&options](int threadIdx, size_t fileIdx, const string& file) { (void)threadIdx; (void)fileIdx; return loadSgfsFile(file,options.hashMode); },
+    [&f](size_t fileIdx, vector<Sgf*>& sgfs) { f(fileIdx,sgfs); },
+    [](vector<Sgf*>& sgfs) {
+      for(int i = 0; i<sgfs.size(); i++)
+        delete sgfs[i];
+    }
+  );
+}
+
+vector<Sgf*> Sgf::loadSgfsFilesParallel(const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors) {
+  vector<Sgf*> sgfs;
+  try {
+    loadSgfsFilesParallel(files, options, errors, [&sgfs](size_t fileIdx, vector<Sgf*>& s) {
+      (void)fileIdx;
+      sgfs.insert(sgfs.end(),s.begin(),s.end());
+    });
+  }
+  catch(...) {
+    for(int i = 0; i<sgfs.size(); i++) {
+      delete sgfs[i];
+    }
+    throw;
+  }
+  return sgfs;
+}
+
+void Sgf::iterFilesParallel(
+  const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(int,size_t,size_t,Sgf&)> f
+) {
+  //Each file is processed in full by the worker that loads it, which hands back only the problems with individual sgfs
+  //in it for the calling thread to record.
+  loadFilesParallelHelper<vector<string>>(
+    files, options, errors,
+    [&](int threadIdx, size_t fileIdx, const string& file) {
+      vector<Sgf*> sgfs;
+      if(Global::isSuffix(file,".sgfs"))
+        sgfs = loadSgfsFile(file,options.hashMode);
+      else
+        sgfs.push_back(loadFile(file,options.hashMode));
+
+      vector<string> sgfErrors;
+      try {
+        for(size_t i = 0; i<sgfs.size(); i++) {
+          try {
+            f(threadIdx,fileIdx,i,*sgfs[i]);
+          }
+          catch(const StringError& e) {
+            //Illegal moves or placements or other problems with the contents of the sgf, skip just this one
+            sgfErrors.push_back(e.what());
+          }
+        }
+      }
+      catch(...) {
+        for(size_t i = 0; i<sgfs.size(); i++)
+          delete sgfs[i];
+        throw;
+      }
+      for(size_t i = 0; i<sgfs.size(); i++)
+        delete sgfs[i];
+      return sgfErrors;
+    },
+    [&](size_t fileIdx, vector<string>& sgfErrors) {
+      for(size_t i = 0; i<sgfErrors.size(); i++) {
+        SgfLoadError error;
+        error.fileIdx = fileIdx;
+        error.file = files[fileIdx];
+        error.message = sgfErrors[i];
+        errors.push_back(error);
+      }
+    },
+    [](vector<string>& sgfErrors) { (void)sgfErrors; }
+  );
+}
+
+void Sgf::iterAllUniquePositionsParallel(
+  const vector<string>& files,
+  ConcurrentHash128Set& uniqueHashes,
+  bool hashComments,
+  bool hashParent,
+  bool dedupSymmetries,
+  bool flipIfPassOrWFirst,
+  bool allowGameOver,
+  const string& randSeed,
+  int numThreads,
+  vector<SgfLoadError>& errors,
+  std::function<void(size_t,PositionSample&,const BoardHistory&,const std::string&)> f
+) {
+  if(numThreads <= 0)
+    throw StringError("Sgf::iterAllUniquePositionsParallel: numThreads must be positive");
+
+  SgfLoadOptions options;
+  options.numThreads = numThreads;
+  //The content hash of each sgf is never used here, so skip the cost of SHA-256
+  options.hashMode = SgfHashMode::FAST;
+
+  iterFilesParallel(
+    files, options, errors,
+    [&](int threadIdx, size_t fileIdx, size_t sgfIdx, Sgf& sgf) {
+      (void)threadIdx;
+      //Seed per sgf rather than per thread so that the order of iteration doesn't depend on scheduling
+      std::unique_ptr<Rand> rand;
+      if(randSeed.size() > 0)
+        rand = std::make_unique<Rand>(randSeed + ":" + Global::uint64ToString(fileIdx) + ":" + Global::uint64ToString(sgfIdx));
+      sgf.iterAllUniquePositions(
+        uniqueHashes,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,rand.get(),
+        [&f,fileIdx](PositionSample& sample, const BoardHistory& hist, const string& comments) {
+          f(fileIdx,sample,hist,comments);
+        }
+      );
+    }
+  );
+}
+
+//Loads each of the games in a .sgfs file, recording those that fail to load in errors
+template<typename T>
+static void iterSgfsFileParallelHelper(
+  const string& file,
+  const SgfLoadOptions& options,
+  vector<SgfLoadError>& errors,
+  std::function<T(int,size_t,const string&)> load,
+  std::function<void(size_t,T&)> consume,
+  std::function<void(T&)> destroy
+) {
+  SgfsFileReader reader(file,options.hashMode);
+  loadParallelHelper<T>(
+    options,
+    [&reader](string& buf) { return reader.nextLine(buf); },
+    load,
+    consume,
+    [&](size_t gameIdx, const string& message) {
+      SgfLoadError error;
+      error.fileIdx = gameIdx;
+      error.file = file;
+      error.message = message;
+      errors.push_back(error);
+    },
+    destroy
+  );
+}
+
+void Sgf::iterSgfsFileParallel(
+  const string& file, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(size_t,Sgf*)> f
+) {
+  iterSgfsFileParallelHelper<Sgf*>(
+    file, options, errors,
+    [&file,&options](int threadIdx, size_t gameIdx, const string& line) {
+      (void)threadIdx;
+      (void)gameIdx;
+      Sgf* sgf = parse(line,options.hashMode);
+      sgf->fileName = file;
+      return sgf;
+    },
+    [&f](size_t gameIdx, Sgf*& sgf) { f(gameIdx,sgf); },
+    [](Sgf*& sgf) { delete sgf; }
+  );
+}
+
+//Large enough that reading a file of many games is not dominated by small reads
+static const size_t SGFS_READ_BUFFER_SIZE = 1 << 20;
+
+SgfsFileReader::SgfsFileReader(const string& f, SgfHashMode mode)
+  :file(f),
+   in(),
+   streamBuf(SGFS_READ_BUFFER_SIZE),
+   lineBuf(),
+   numGamesRead(0),
+   hashMode(mode)
+{
+  //Must be set before the file is opened to take effect
+  in.rdbuf()->pubsetbuf(streamBuf.data(),streamBuf.size());
+  FileUtils::open(in,file);
+}
+
+SgfsFileReader::~SgfsFileReader()
+{}
+
+bool SgfsFileReader::nextLine(string& buf) {
+  while(std::getline(in,lineBuf)) {
+    buf = Global::trim(lineBuf);
+    if(buf.length() <= 0)
+      continue;
+    numGamesRead++;
+    return true;
+  }
+  if(in.bad())
+    throw IOError("Error while reading " + file);
+  return false;
+}
+
+Sgf* SgfsFileReader::next() {
+  string line;
+  if(!nextLine(line))
+    return NULL;
+  Sgf* sgf = Sgf::parse(line,hashMode);
+  sgf->fileName = file;
+  return sgf;
+}
+
+CompactSgf* SgfsFileReader::nextCompact() {
+  Sgf* sgf = next();
+  if(sgf == NULL)
+    return NULL;
+  CompactSgf* compact = new CompactSgf(std::move(*sgf));
+  delete sgf;
+  return compact;
+}
+
+int64_t SgfsFileReader::getNumGamesRead() const {
+  return numGamesRead;
+}
+
+PositionSampleFileReader::PositionSampleFileReader(const string& f)
+  :file(f),
+   in(),
+   streamBuf(SGFS_READ_BUFFER_SIZE),
+   recordBuf(),
+   numSamplesRead(0)
+{
+  in.rdbuf()->pubsetbuf(streamBuf.data(),streamBuf.size());
+  FileUtils::open(in,file,std::ios::in | std::ios::binary);
+  char header[Sgf::PositionSample::BINARY_FILE_HEADER_LEN];
+  string expected;
+  Sgf::PositionSample::appendBinaryFileHeader(expected);
+  in.read(header,sizeof(header));
+  if(in.gcount() != (std::streamsize)sizeof(header) || std::memcmp(header,expected.data(),8) != 0)
+    throw IOError("Not a binary position sample file: " + file);
+  if(std::memcmp(header,expected.data(),sizeof(header)) != 0)
+    throw IOError("Binary position sample file has an unsupported version or endianness: " + file);
+}
+
+PositionSampleFileReader::~PositionSampleFileReader()
+{}
+
+bool PositionSampleFileReader::next(Sgf::PositionSample& sampleBuf) {
+  uint32_t recordLen;
+  in.read((char*)&recordLen,sizeof(recordLen));
+  if(in.gcount() == 0 && in.eof())
+    return false;
+  if(in.gcount() != (std::streamsize)sizeof(recordLen))
+    throw IOError("Truncated record in " + file);
+  //Guard against allocating absurd amounts of memory for a corrupted length
+  if(recordLen > (1U << 28))
+    throw IOError("Invalid record length in " + file);
+  recordBuf.resize(sizeof(recordLen) + (size_t)recordLen);
+  std::memcpy(&recordBuf[0],&recordLen,sizeof(recordLen));
+  in.read(&recordBuf[sizeof(recordLen)],recordLen);
+  if(in.gcount() != (std::streamsize)recordLen)
+    throw IOError("Truncated record in " + file);
+  numSamplesRead++;
+  try {
+    Sgf::PositionSample::ofBinary(recordBuf.data(),recordBuf.size(),sampleBuf);
+  }
+  catch(const StringError& e) {
+    throw IOError("Error reading record " + Global::int64ToString(numSamplesRead) + " of " + file + ": " + e.what());
+  }
+  return true;
+}
+
+int64_t PositionSampleFileReader::getNumSamplesRead() const {
+  return numSamplesRead;
+}
+
+bool PositionSampleFileReader::isBinaryFile(const string& file) {
+  std::ifstream in;
+  FileUtils::open(in,file,std::ios::in | std::ios::binary);
+  char magic[8];
+  in.read(magic,sizeof(magic));
+  return in.gcount() == (std::streamsize)sizeof(magic) && std::memcmp(magic,POSITION_SAMPLE_BINARY_MAGIC,sizeof(magic)) == 0;
+}
+
+LazySgf::LazySgf()
+  :fileName(),
+   text(),
+   trees(),
+   nodeOffsets(),
+   childTreeIdxs(),
+   rootSgf(NULL),
+   hashMode(SgfHashMode::SHA256),
+   hashComputed(false),
+   hash()
+{}
+
+LazySgf::~LazySgf() {
+  delete rootSgf;
+}
+
+LazySgf* LazySgf::parse(const string& str, SgfHashMode hashMode) {
+  string copy = str;
+  return parse(std::move(copy),hashMode);
+}
+
+LazySgf* LazySgf::parse(string&& str, SgfHashMode hashMode) {
+  LazySgf* sgf = new LazySgf();
+  sgf->text = std::move(str);
+  sgf->hashMode = hashMode;
+  try {
+    sgf->scan();
+  }
+  catch(...) {
+    delete sgf;
+    throw;
+  }
+  return sgf;
+}
+
+LazySgf* LazySgf::loadFile(const string& file, SgfHashMode hashMode) {
+  LazySgf* sgf = parse(FileUtils::readFile(file),hashMode);
+  sgf->fileName = file;
+  return sgf;
+}
+
+//Scans the tree whose opening paren is just before pos, leaving pos just after its closing paren.
+//Only structure is checked here, everything within nodes other than where the values begin and end is left for
+//parseNode. A tree's range in childTreeIdxs comes after those of all of its descendants.
+uint32_t LazySgf::scanTree(int& pos) {
+  int entryPos = pos;
+  uint32_t treeIdx = (uint32_t)trees.size();
+  trees.push_back(Tree());
+  uint32_t nodesBegin = (uint32_t)nodeOffsets.size();
+  //Set once the first child starts, since the nodes of the children follow
+  uint32_t nodesEnd = nodesBegin;
+  vector<uint32_t> children;
+  //Whether we are within the nodes of this tree, rather than before them or among the children
+  bool inNodes = false;
+  const char* str = text.data();
+  int len = (int)text.length();
+  while(true) {
+    if(pos >= len)
+      sgfFail("Unexpected end of str",text,pos);
+    char c = str[pos];
+    if(c == ';' && children.size() <= 0) {
+      nodeOffsets.push_back((uint32_t)pos);
+      inNodes = true;
+      pos++;
+    }
+    else if(c == '[' && inNodes) {
+      //Skip the value, so that parens and brackets within it are not mistaken for structure.
+      //It ends at the first ']' preceded by an even number of backslashes.
+      pos++;
+      while(true) {
+        const char* end = (const char*)std::memchr(str+pos,']',len-pos);
+        if(end == NULL)
+          sgfFail("Unexpected end of str",text,len);
+        int endPos = (int)(end-str);
+        int numBackslashes = 0;
+        while(str[endPos-1-numBackslashes] == '\\')
+          numBackslashes++;
+        pos = endPos+1;
+        if(numBackslashes % 2 == 0)
+          break;
+      }
+    }
+    else if(c == '(') {
+      pos++;
+      if(children.size() <= 0)
+        nodesEnd = (uint32_t)nodeOffsets.size();
+      inNodes = false;
+      children.push_back(scanTree(pos));
+    }
+    else if(c == ')') {
+      pos++;
+      break;
+    }
+    else if(inNodes || Global::isWhitespace(c)) {
+      //Property keys and anything else within a node are checked when the node is parsed
+      pos++;
+    }
+    else
+      sgfFail("Expected closing paren for sgf tree",text,entryPos,pos);
+  }
+
+  if(children.size() <= 0)
+    nodesEnd = (uint32_t)nodeOffsets.size();
+  Tree& tree = trees[treeIdx];
+  tree.nodesBegin = nodesBegin;
+  tree.nodesEnd = nodesEnd;
+  tree.childrenBegin = (uint32_t)childTreeIdxs.size();
+  tree.childrenEnd = (uint32_t)(childTreeIdxs.size() + children.size());
+  childTreeIdxs.insert(childTreeIdxs.end(),children.begin(),children.end());
+  int64_t maxChildDepth = 0;
+  tree.nodeCount = nodesEnd - nodesBegin;
+  tree.branchCount = children.size() > 1 ? (int64_t)children.size()-1 : 0;
+  for(size_t i = 0; i<children.size(); i++) {
+    const Tree& child = trees[children[i]];
+    maxChildDepth = std::max(maxChildDepth,child.depth);
+    tree.nodeCount += child.nodeCount;
+    tree.branchCount += child.branchCount;
+  }
+  tree.depth = maxChildDepth + (int64_t)(nodesEnd - nodesBegin);
+  return treeIdx;
+}
+
+void LazySgf::scan() {
+  if(text.length() >= (size_t)0x7FFFFFFF)
+    throw IOError("Sgf text too long");
+  int pos = 0;
+  //Skip any BOM at the start of the file
+  if(text.length() >= 3 && text[0] == (char)0xEF && text[1] == (char)0xBB && text[2] == (char)0xBF)
+    pos += 3;
+  while(pos < (int)text.length() && Global::isWhitespace(text[pos]))
+    pos++;
+  if(pos >= (int)text.length() || text[pos] != '(')
+    sgfFail("Empty or invalid sgf (is the opening parenthesis missing?)",text,0);
+  pos++;
+
+  trees.clear();
+  nodeOffsets.clear();
+  childTreeIdxs.clear();
+  scanTree(pos);
+  if(trees[0].nodesBegin >= trees[0].nodesEnd)
+    sgfFail("Empty or invalid sgf (is the opening parenthesis missing?)",text,0);
+}
+
+SgfNode* LazySgf::parseNode(const Tree& tree, uint32_t nodeIdx) const {
+  int pos = (int)nodeOffsets[nodeIdx];
+  SgfNode* node = maybeParseNode(text,pos);
+  assert(node != NULL);
+  //Make sure the node parsed all the way up to what the scan found next, else there was junk within it
+  int newPos;
+  char c;
+  try {
+    c = peekSgfChar(text,pos,newPos);
+  }
+  catch(...) {
+    delete node;
+    throw;
+  }
+  bool expectedNext = nodeIdx+1 < tree.nodesEnd ? (c == ';') : (c == '(' || c == ')');
+  if(!expectedNext) {
+    delete node;
+    sgfFail("Expected closing paren for sgf tree",text,pos);
+  }
+  return node;
+}
+
+Sgf* LazySgf::getRootSgf() {
+  if(rootSgf == NULL) {
+    Sgf* sgf = new Sgf();
+    try {
+      sgf->nodes.push_back(parseNode(trees[0],trees[0].nodesBegin));
+    }
+    catch(...) {
+      delete sgf;
+      throw;
+    }
+    sgf->fileName = fileName;
+    rootSgf = sgf;
+  }
+  return rootSgf;
+}
+
+Hash128 LazySgf::getHash() {
+  if(!hashComputed) {
+    hash = Sgf::computeHash(text.data(),text.size(),hashMode);
+    hashComputed = true;
+  }
+  return hash;
+}
+
+const SgfNode& LazySgf::getRootNode() {
+  return *(getRootSgf()->nodes[0]);
+}
+
+XYSize LazySgf::getXYSize() {
+  return getRootSgf()->getXYSize();
+}
+float LazySgf::getKomi() {
+  return getRootSgf()->getKomi();
+}
+bool LazySgf::hasRules() {
+  return getRootSgf()->hasRules();
+}
+Rules LazySgf::getRulesOrFail() {
+  return getRootSgf()->getRulesOrFail();
+}
+int LazySgf::getHandicapValue() {
+  return getRootSgf()->getHandicapValue();
+}
+Player LazySgf::getSgfWinner() {
+  return getRootSgf()->getSgfWinner();
+}
+int LazySgf::getRank(Player pla) {
+  return getRootSgf()->getRank(pla);
+}
+int LazySgf::getRating(Player pla) {
+  return getRootSgf()->getRating(pla);
+}
+string LazySgf::getPlayerName(Player pla) {
+  return getRootSgf()->getPlayerName(pla);
+}
+string LazySgf::getRootPropertyWithDefault(const string& property, const string& defaultRet) {
+  return getRootSgf()->getRootPropertyWithDefault(property,defaultRet);
+}
+
+int64_t LazySgf::depth() const {
+  return trees[0].depth;
+}
+int64_t LazySgf::nodeCount() const {
+  return trees[0].nodeCount;
+}
+int64_t LazySgf::branchCount() const {
+  return trees[0].branchCount;
+}
+
+Sgf* LazySgf::parseMainLine() {
+  Sgf* ret = new Sgf();
+  try {
+    ret->fileName = fileName;
+    ret->hash = getHash();
+    Sgf* sgf = ret;
+    uint32_t treeIdx = 0;
+    while(true) {
+      const Tree& tree = trees[treeIdx];
+      for(uint32_t i = tree.nodesBegin; i<tree.nodesEnd; i++)
+        sgf->nodes.push_back(parseNode(tree,i));
+      //Same choice of child as Sgf::getMovesHelper
+      int64_t maxChildDepth = 0;
+      int64_t maxChildIdx = -1;
+      for(uint32_t i = tree.childrenBegin; i<tree.childrenEnd; i++) {
+        if(trees[childTreeIdxs[i]].depth > maxChildDepth) {
+          maxChildDepth = trees[childTreeIdxs[i]].depth;
+          maxChildIdx = childTreeIdxs[i];
+        }
+      }
+      if(maxChildIdx < 0)
+        break;
+      Sgf* child = new Sgf();
+      sgf->children.push_back(child);
+      sgf = child;
+      treeIdx = (uint32_t)maxChildIdx;
+    }
+  }
+  catch(...) {
+    delete ret;
+    throw;
+  }
+  return ret;
+}
+
+CompactSgf* LazySgf::toCompactSgf() {
+  Sgf* sgf = parseMainLine();
+  CompactSgf* compact = NULL;
+  try {
+    compact = new CompactSgf(std::move(*sgf));
+  }
+  catch(...) {
+    delete sgf;
+    throw;
+  }
+  delete sgf;
+  return compact;
+}
+
+Sgf* LazySgf::toSgf() const {
+  Sgf* sgf = Sgf::parse(text,hashMode);
+  sgf->fileName = fileName;
+  return sgf;
+}
+
+SgfView::SgfView()
+  :text(NULL),
+   textLen(0),
+   ownedText(),
+   trees(),
+   nodes(),
+   props(),
+   values(),
+   childTreeIdxs(),
+   childTreeIdxStack()
+{}
+SgfView::~SgfView()
+{}
+
+void SgfView::fail(const char* msg, size_t pos) const {
+  throw IOError(string(msg) + " (pos " + Global::uint64ToString(pos) + "):\n" + string(text,textLen));
+}
+
+//Equivalent to Global::isWhitespace, which also counts the null char, but without the strchr
+static inline bool isSgfViewWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f' || c == '\0';
+}
+
+//Same as peekSgfChar, but over the view's text
+char SgfView::peekSgfChar(size_t pos, size_t& newPos) const {
+  newPos = pos;
+  while(true) {
+    if(newPos >= textLen)
+      fail("Unexpected end of str",newPos);
+    //Skip any BOM at the start of the file
+    if(newPos == 0 && (textLen >= 3 && text[0] == (char)0xEF && text[1] == (char)0xBB && text[2] == (char)0xBF)) {
+      newPos += 3;
+      continue;
+    }
+    char c = text[newPos++];
+    if(isSgfViewWhitespace(c))
+      continue;
+    return c;
+  }
+}
+
+void SgfView::parse(const string& str) {
+  parse(str.data(),str.size());
+}
+
+void SgfView::parseFile(const string& file) {
+  ownedText = FileUtils::readFile(file);
+  parse(ownedText.data(),ownedText.size());
+}
+
+void SgfView::parse(const char* str, size_t len) {
+  text = str;
+  textLen = len;
+  trees.clear();
+  nodes.clear();
+  props.clear();
+  values.clear();
+  childTreeIdxs.clear();
+  childTreeIdxStack.clear();
+  if(len >= (size_t)0xFFFFFFFFU)
+    throw IOError("Sgf too large to parse: " + Global::uint64ToString(len) + " bytes");
+
+  size_t pos = 0;
+  size_t newPos;
+  if(textLen <= 0 || peekSgfChar(pos,newPos) != '(')
+    fail("Empty or invalid sgf (is the opening parenthesis missing?)",0);
+  pos = newPos;
+  parseTree(pos);
+  if(trees[0].nodesEnd <= trees[0].nodesBegin)
+    fail("Empty or invalid sgf (is the opening parenthesis missing?)",0);
+}
+
+//Requires that the opening paren was just consumed
+void SgfView::parseTree(size_t& pos) {
+  size_t entryPos = pos;
+  size_t newPos;
+  uint32_t treeIdx = (uint32_t)trees.size();
+  trees.push_back(Tree());
+  uint32_t nodesBegin = (uint32_t)nodes.size();
+  while(true) {
+    if(peekSgfChar(pos,newPos) != ';')
+      break;
+    pos = newPos;
+    Node node;
+    node.propsBegin = (uint32_t)props.size();
+    bool nodeHasMove = false;
+    while(maybeParseProp(pos,nodeHasMove)) {}
+    node.propsEnd = (uint32_t)props.size();
+    nodes.push_back(node);
+  }
+  uint32_t nodesEnd = (uint32_t)nodes.size();
+
+  //Children are accumulated on a shared stack while parsing recursively, then copied out contiguously
+  size_t childStackBegin = childTreeIdxStack.size();
+  while(true) {
+    if(pos >= textLen || peekSgfChar(pos,newPos) != '(')
+      break;
+    pos = newPos;
+    childTreeIdxStack.push_back((uint32_t)trees.size());
+    parseTree(pos);
+  }
+  if(peekSgfChar(pos,newPos) != ')')
+    sgfFail("Expected closing paren for sgf tree",string(text,textLen),(int)entryPos,(int)pos);
+  pos = newPos;
+
+  Tree& tree = trees[treeIdx];
+  tree.nodesBegin = nodesBegin;
+  tree.nodesEnd = nodesEnd;
+  tree.childrenBegin = (uint32_t)childTreeIdxs.size();
+  childTreeIdxs.insert(childTreeIdxs.end(), childTreeIdxStack.begin()+childStackBegin, childTreeIdxStack.end());
+  tree.childrenEnd = (uint32_t)childTreeIdxs.size();
+  childTreeIdxStack.resize(childStackBegin);
+}
+
+bool SgfView::maybeParseProp(size_t& pos, bool& nodeHasMove) {
+  size_t newPos;
+  Prop prop;
+  size_t keyStart = 0;
+  size_t keyEnd = 0;
+  size_t numKeyChars = 0;
+  while(true) {
+    char c = peekSgfChar(pos,newPos);
+    if(!Global::isAlpha(c))
+      break;
+    if(numKeyChars == 0)
+      keyStart = newPos-1;
+    keyEnd = newPos;
+    numKeyChars++;
+    pos = newPos;
+  }
+  if(numKeyChars <= 0)
+    return false;
+  prop.key.start = (uint32_t)keyStart;
+  prop.key.len = (uint32_t)(keyEnd - keyStart);
+  prop.keyHasWhitespace = numKeyChars != keyEnd - keyStart;
+  prop.valuesBegin = (uint32_t)values.size();
+
+  //Sgf::parse interprets the first B or W of a node as the move, so it must be validated here too
+  Player movePla = C_EMPTY;
+  if(numKeyChars == 1 && text[keyEnd-1] == 'B')
+    movePla = P_BLACK;
+  else if(numKeyChars == 1 && text[keyEnd-1] == 'W')
+    movePla = P_WHITE;
+
+  while(true) {
+    if(peekSgfChar(pos,newPos) != '[')
+      break;
+    pos = newPos;
+
+    //Scan to the matching unescaped closing bracket, noting whether anything will need decoding
+    Value value;
+    value.span.start = (uint32_t)pos;
+    value.needsDecoding = false;
+    bool escaping = false;
+    while(true) {
+      if(pos >= textLen)
+        fail("Unexpected end of str",pos);
+      char c = text[pos];
+      if(!escaping && c == ']')
+        break;
+      pos++;
+      if(c == '\\' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f')
+        value.needsDecoding = true;
+      escaping = !escaping && c == '\\';
+    }
+    value.span.len = (uint32_t)(pos - value.span.start);
+    //Consume the closing bracket
+    pos++;
+    values.push_back(value);
+
+    if(movePla != C_EMPTY && !nodeHasMove) {
+      //Only build a string in the unusual cases, to get the same error or result as Sgf::parse
+      const char* raw = text + value.span.start;
+      bool isPlainLoc = !value.needsDecoding && value.span.len == 2 && parseSgfCoord(raw[0]) >= 0 && parseSgfCoord(raw[1]) >= 0;
+      if(!isPlainLoc)
+        parseSgfLocOrPassNoSize(decodeValue(value),movePla);
+      nodeHasMove = true;
+    }
+  }
+  prop.valuesEnd = (uint32_t)values.size();
+  if(prop.valuesEnd <= prop.valuesBegin)
+    sgfFail("No property values for property " + getKey(prop),string(text,textLen),(int)pos);
+  props.push_back(prop);
+  return true;
+}
+
+bool SgfView::keyEquals(const Prop& prop, const char* key) const {
+  const char* p = text + prop.key.start;
+  const char* end = p + prop.key.len;
+  for(; p < end; p++) {
+    if(prop.keyHasWhitespace && isSgfViewWhitespace(*p))
+      continue;
+    if(*key != *p)
+      return false;
+    key++;
+  }
+  return *key == '\0';
+}
+
+string SgfView::getKey(const Prop& prop) const {
+  if(!prop.keyHasWhitespace)
+    return string(text + prop.key.start, prop.key.len);
+  string key;
+  for(uint32_t i = 0; i<prop.key.len; i++) {
+    char c = text[prop.key.start+i];
+    if(!isSgfViewWhitespace(c))
+      key += c;
+  }
+  return key;
+}
+
+int64_t SgfView::findProp(size_t nodeIdx, const char* key) const {
+  const Node& node = nodes[nodeIdx];
+  for(uint32_t i = node.propsBegin; i<node.propsEnd; i++) {
+    if(keyEquals(props[i],key))
+      return (int64_t)i;
+  }
+  return -1;
+}
+
+const char* SgfView::getRawValue(const Value& value) const {
+  return text + value.span.start;
+}
+
+string SgfView::decodeValue(const Value& value) const {
+  string buf;
+  decodeValue(value,buf);
+  return buf;
+}
+
+//Same transformation as parseTextValue
+void SgfView::decodeValue(const Value& value, string& buf) const {
+  const char* p = text + value.span.start;
+  const char* end = p + value.span.len;
+  if(!value.needsDecoding) {
+    buf.assign(p,end);
+    return;
+  }
+  buf.clear();
+  bool escaping = false;
+  while(p < end) {
+    char c = *(p++);
+    if(!escaping && c == '\\') {
+      escaping = true;
+      continue;
+    }
+    if(c == '\n' || c == '\r') {
+      while(p < end && (*p == '\n' || *p == '\r'))
+        p++;
+      if(!escaping)
+        buf += '\n';
+      escaping = false;
+      continue;
+    }
+    if(c == '\t' || c == '\v' || c == '\f') {
+      escaping = false;
+      buf += ' ';
+      continue;
+    }
+    escaping = false;
+    buf += c;
+  }
+}
+
+Hash128 SgfView::computeHash(SgfHashMode hashMode) const {
+  return Sgf::computeHash(text,textLen,hashMode);
+}
+
+Sgf* SgfView::toSgf(SgfHashMode hashMode) const {
+  if(trees.size() <= 0)
+    throw StringError("SgfView::toSgf: nothing parsed");
+  string buf;
+  Sgf* sgf = toSgfHelper(0,buf);
+  sgf->hash = computeHash(hashMode);
+  return sgf;
+}
+
+Sgf* SgfView::toSgfHelper(uint32_t treeIdx, string& buf) const {
+  const Tree& tree = trees[treeIdx];
+  Sgf* sgf = new Sgf();
+  try {
+    for(uint32_t n = tree.nodesBegin; n<tree.nodesEnd; n++) {
+      SgfNode* node = new SgfNode();
+      sgf->nodes.push_back(node);
+      for(uint32_t i = nodes[n].propsBegin; i<nodes[n].propsEnd; i++) {
+        const Prop& prop = props[i];
+        uint64_t keyCode = SgfProp::getKeyCode(getKey(prop));
+        for(uint32_t j = prop.valuesBegin; j<prop.valuesEnd; j++) {
+          decodeValue(values[j],buf);
+          if(node->move.pla == C_EMPTY && keyCode == SGF_KEY_B)
+            node->move = parseSgfLocOrPassNoSize(buf,P_BLACK);
+          else if(node->move.pla == C_EMPTY && keyCode == SGF_KEY_W)
+            node->move = parseSgfLocOrPassNoSize(buf,P_WHITE);
+          else
+            node->addPropertyValue(keyCode,buf);
+        }
+      }
+    }
+    for(uint32_t c = tree.childrenBegin; c<tree.childrenEnd; c++)
+      sgf->children.push_back(toSgfHelper(childTreeIdxs[c],buf));
+  }
+  catch(...) {
+    delete sgf;
+    throw;
+  }
+  return sgf;
+}
+
+
+CompactSgf::CompactSgf()
+  :fileName(),
+   rootNode(),
+   placements(),
+   moves(),
+   xSize(0),
+   ySize(0),
+   depth(0),
+   komi(0.0f),
+   sgfWinner(C_EMPTY),
+   hash()
+{}
+
+CompactSgf::CompactSgf(const Sgf* sgf)
+  :fileName(sgf->fileName),
+   rootNode(),
+   placements(),
+   moves(),
+   xSize(),
+   ySize(),
+   depth()
+{
+  XYSize size = sgf->getXYSize();
+  xSize = size.x;
+  ySize = size.y;
+  depth = sgf->depth();
+  komi = sgf->getKomi();
+  hash = sgf->hash;
+
+  sgf->getPlacements(placements, xSize, ySize);
+  sgf->getMoves(moves, xSize, ySize);
+
+  checkNonEmpty(sgf->nodes);
+  rootNode = *(sgf->nodes[0]);
+
+  sgfWinner = rootNode.getSgfWinner();
 }
 
 CompactSgf::CompactSgf(Sgf&& sgf)
@@ -1436,15 +3050,15 @@ CompactSgf::~CompactSgf() {
 }
 
 
-CompactSgf* CompactSgf::parse(const string& str) {
-  Sgf* sgf = Sgf::parse(str);
+CompactSgf* CompactSgf::parse(const string& str, SgfHashMode hashMode) {
+  Sgf* sgf = Sgf::parse(str,hashMode);
   CompactSgf* compact = new CompactSgf(std::move(*sgf));
   delete sgf;
   return compact;
 }
 
-CompactSgf* CompactSgf::loadFile(const string& file) {
-  Sgf* sgf = Sgf::loadFile(file);
+CompactSgf* CompactSgf::loadFile(const string& file, SgfHashMode hashMode) {
+  Sgf* sgf = Sgf::loadFile(file,hashMode);
   CompactSgf* compact = new CompactSgf(std::move(*sgf));
   delete sgf;
   return compact;
@@ -1474,6 +3088,55 @@ vector<CompactSgf*> CompactSgf::loadFiles(const vector<string>& files) {
   return sgfs;
 }
 
+void CompactSgf::loadFilesParallel(
+  const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(size_t,CompactSgf*)> f
+) {
+  loadFilesParallelHelper<CompactSgf*>(
+    files, options, errors,
+    [&options](int threadIdx, size_t fileIdx, const string& file) { (void)threadIdx; (void)fileIdx; return loadFile(file,options.hashMode); },
+    [&f](size_t fileIdx, CompactSgf*& sgf) { f(fileIdx,sgf); },
+    [](CompactSgf*& sgf) { delete sgf; }
+  );
+}
+
+vector<CompactSgf*> CompactSgf::loadFilesParallel(const vector<string>& files, const SgfLoadOptions& options, vector<SgfLoadError>& errors) {
+  vector<CompactSgf*> sgfs;
+  try {
+    loadFilesParallel(files, options, errors, [&sgfs](size_t fileIdx, CompactSgf* sgf) {
+      (void)fileIdx;
+      sgfs.push_back(sgf);
+    });
+  }
+  catch(...) {
+    for(int i = 0; i<sgfs.size(); i++) {
+      delete sgfs[i];
+    }
+    throw;
+  }
+  return sgfs;
+}
+
+void CompactSgf::iterSgfsFileParallel(
+  const string& file, const SgfLoadOptions& options, vector<SgfLoadError>& errors,
+  std::function<void(size_t,CompactSgf*)> f
+) {
+  iterSgfsFileParallelHelper<CompactSgf*>(
+    file, options, errors,
+    [&file,&options](int threadIdx, size_t gameIdx, const string& line) {
+      (void)threadIdx;
+      (void)gameIdx;
+      Sgf* sgf = Sgf::parse(line,options.hashMode);
+      sgf->fileName = file;
+      CompactSgf* compact = new CompactSgf(std::move(*sgf));
+      delete sgf;
+      return compact;
+    },
+    [&f](size_t gameIdx, CompactSgf*& sgf) { f(gameIdx,sgf); },
+    [](CompactSgf*& sgf) { delete sgf; }
+  );
+}
+
 bool CompactSgf::hasRules() const {
   return rootNode.hasProperty("RU");
 }
@@ -1551,10 +3214,9 @@ void CompactSgf::playMovesAssumeLegal(Board& board, Player& nextPla, BoardHistor
       )
     );
 
-  for(int64_t i = 0; i<turnIdx; i++) {
-    hist.makeBoardMoveAssumeLegal(board,moves[i].loc,moves[i].pla,NULL);
-    nextPla = getOpp(moves[i].pla);
-  }
+  hist.replayTrusted(board,moves,0,(size_t)turnIdx);
+  if(turnIdx > 0)
+    nextPla = getOpp(moves[turnIdx-1].pla);
 }
 
 void CompactSgf::playMovesTolerant(Board& board, Player& nextPla, BoardHistory& hist, int64_t turnIdx, bool preventEncore) const {
@@ -1585,6 +3247,95 @@ void CompactSgf::setupBoardAndHistTolerant(const Rules& initialRules, Board& boa
 }
 
 
+//Formatting helpers for writing sgfs directly into a string buffer, avoiding ostream and temporary strings.
+//Numbers are formatted identically to the default formatting of ostream <<.
+static void appendSgfInt(string& buf, int64_t x) {
+  char digits[24];
+  int len = 0;
+  uint64_t ux = x < 0 ? (uint64_t)0 - (uint64_t)x : (uint64_t)x;
+  do {
+    digits[len++] = (char)('0' + (ux % 10));
+    ux /= 10;
+  } while(ux > 0);
+  if(x < 0)
+    buf.push_back('-');
+  while(len > 0)
+    buf.push_back(digits[--len]);
+}
+static void appendSgfDouble(string& buf, double x) {
+  char numBuf[32];
+  int len = snprintf(numBuf,sizeof(numBuf),"%g",x);
+  buf.append(numBuf,len);
+}
+static void appendSgfFormatted(string& buf, const char* fmt, double x) {
+  char numBuf[64];
+  int len = snprintf(numBuf,sizeof(numBuf),fmt,x);
+  buf.append(numBuf,len);
+}
+static void appendSgfHash(string& buf, Hash128 hash) {
+  static const char* digits = "0123456789ABCDEF";
+  char hexBuf[32];
+  for(int i = 0; i<16; i++) {
+    hexBuf[i] = digits[(hash.hash1 >> (60 - i*4)) & 0xF];
+    hexBuf[i+16] = digits[(hash.hash0 >> (60 - i*4)) & 0xF];
+  }
+  buf.append(hexBuf,32);
+}
+
+static void appendGameResultNoSgfTag(string& buf, const BoardHistory& hist, double overrideFinishedWhiteScore) {
+  if(!hist.isGameFinished)
+    return;
+  else if(hist.isNoResult) {
+    buf += "Void";
+    return;
+  }
+  else if(hist.isResignation && hist.winner == C_BLACK) {
+    buf += "B+R";
+    return;
+  }
+  else if(hist.isResignation && hist.winner == C_WHITE) {
+    buf += "W+R";
+    return;
+  }
+
+  if(!std::isnan(overrideFinishedWhiteScore)) {
+    if(overrideFinishedWhiteScore < 0) {
+      buf += "B+";
+      appendSgfDouble(buf,-overrideFinishedWhiteScore);
+    }
+    else if(overrideFinishedWhiteScore > 0) {
+      buf += "W+";
+      appendSgfDouble(buf,overrideFinishedWhiteScore);
+    }
+    else
+      buf += "0";
+  }
+  else {
+    if(hist.winner == C_BLACK) {
+      buf += "B+";
+      appendSgfDouble(buf,-hist.finalWhiteMinusBlackScore);
+    }
+    else if(hist.winner == C_WHITE) {
+      buf += "W+";
+      appendSgfDouble(buf,hist.finalWhiteMinusBlackScore);
+    }
+    else if(hist.winner == C_EMPTY)
+      buf += "0";
+    else
+      ASSERT_UNREACHABLE;
+  }
+}
+
+//Starts the next space-separated part of a move comment, opening the comment if this is the first part
+static void beginSgfCommentPart(string& buf, bool& hasComment) {
+  if(hasComment)
+    buf.push_back(' ');
+  else {
+    buf += "C[";
+    hasComment = true;
+  }
+}
+
 void WriteSgf::printGameResult(ostream& out, const BoardHistory& hist)
 {
   printGameResult(out,hist,std::numeric_limits<double>::quiet_NaN());
@@ -1601,34 +3352,9 @@ string WriteSgf::gameResultNoSgfTag(const BoardHistory& hist) {
   return gameResultNoSgfTag(hist,std::numeric_limits<double>::quiet_NaN());
 }
 string WriteSgf::gameResultNoSgfTag(const BoardHistory& hist, double overrideFinishedWhiteScore) {
-  if(!hist.isGameFinished)
-    return "";
-  else if(hist.isNoResult)
-    return "Void";
-  else if(hist.isResignation && hist.winner == C_BLACK)
-    return "B+R";
-  else if(hist.isResignation && hist.winner == C_WHITE)
-    return "W+R";
-
-  if(!std::isnan(overrideFinishedWhiteScore)) {
-    if(overrideFinishedWhiteScore < 0)
-      return "B+" + Global::doubleToString(-overrideFinishedWhiteScore);
-    else if(overrideFinishedWhiteScore > 0)
-      return "W+" + Global::doubleToString(overrideFinishedWhiteScore);
-    else
-      return "0";
-  }
-  else {
-    if(hist.winner == C_BLACK)
-      return "B+" + Global::doubleToString(-hist.finalWhiteMinusBlackScore);
-    else if(hist.winner == C_WHITE)
-      return "W+" + Global::doubleToString(hist.finalWhiteMinusBlackScore);
-    else if(hist.winner == C_EMPTY)
-      return "0";
-    else
-      ASSERT_UNREACHABLE;
-  }
-  return "";
+  string buf;
+  appendGameResultNoSgfTag(buf,hist,overrideFinishedWhiteScore);
+  return buf;
 }
 void WriteSgf::writeSgf(
   ostream& out, const string& bName, const string& wName,
@@ -1655,33 +3381,73 @@ void WriteSgf::writeSgf(
   bool tryNicerRulesString,
   bool omitResignPlayerMove,
   double overrideFinishedWhiteScore
+) {
+  string buf;
+  appendSgf(buf,bName,wName,endHist,gameData,tryNicerRulesString,omitResignPlayerMove,overrideFinishedWhiteScore);
+  out.write(buf.data(),buf.size());
+}
+
+void WriteSgf::appendSgf(
+  string& buf, const string& bName, const string& wName,
+  const BoardHistory& endHist,
+  const FinishedGameData* gameData,
+  bool tryNicerRulesString,
+  bool omitResignPlayerMove
+) {
+  appendSgf(
+    buf,
+    bName,
+    wName,
+    endHist,
+    gameData,
+    tryNicerRulesString,
+    omitResignPlayerMove,
+    std::numeric_limits<double>::quiet_NaN()
+  );
+}
+void WriteSgf::appendSgf(
+  string& buf, const string& bName, const string& wName,
+  const BoardHistory& endHist,
+  const FinishedGameData* gameData,
+  bool tryNicerRulesString,
+  bool omitResignPlayerMove,
+  double overrideFinishedWhiteScore
 ) {
   const Board& initialBoard = endHist.initialBoard;
-  const Rules& rules = endHist.rules;
+  const Rules& rules = endHist.getRules();
 
   int xSize = initialBoard.x_size;
   int ySize = initialBoard.y_size;
-  out << "(;FF[4]GM[1]";
-  if(xSize == ySize)
-    out << "SZ[" << xSize << "]";
-  else
-    out << "SZ[" << xSize << ":" << ySize << "]";
-  out << "PB[" << bName << "]";
-  out << "PW[" << wName << "]";
-
-  if(gameData != NULL) {
-    out << "HA[" << gameData->handicapForSgf << "]";
+  //Roughly enough for the header plus a move and short comment per turn, so that a fresh buffer rarely regrows
+  buf.reserve(buf.size() + 256 + bName.size() + wName.size() + endHist.moveHistory.size() * (gameData != NULL ? 40 : 8));
+
+  buf += "(;FF[4]GM[1]SZ[";
+  appendSgfInt(buf,xSize);
+  if(xSize != ySize) {
+    buf.push_back(':');
+    appendSgfInt(buf,ySize);
   }
+  buf += "]PB[";
+  buf += bName;
+  buf += "]PW[";
+  buf += wName;
+  buf += "]HA[";
+  if(gameData != NULL)
+    appendSgfInt(buf,gameData->handicapForSgf);
   else {
-    BoardHistory histCopy(endHist);
-    //Always use true for computing the handicap value that goes into an sgf
-    histCopy.setAssumeMultipleStartingBlackMovesAreHandicap(true);
-    out << "HA[" << histCopy.computeNumHandicapStones() << "]";
+    //Always assume multiple starting black moves are handicap for computing the handicap value that goes into an sgf
+    appendSgfInt(buf,endHist.computeNumHandicapStones(true));
+  }
+  buf += "]KM[";
+  appendSgfDouble(buf,rules.komi);
+  buf += "]RU[";
+  buf += (tryNicerRulesString ? rules.toStringNoKomiMaybeNice() : rules.toStringNoKomi());
+  buf += "]";
+  if(endHist.isGameFinished) {
+    buf += "RE[";
+    appendGameResultNoSgfTag(buf,endHist,overrideFinishedWhiteScore);
+    buf += "]";
   }
-
-  out << "KM[" << rules.komi << "]";
-  out << "RU[" << (tryNicerRulesString ? rules.toStringNoKomiMaybeNice() : rules.toStringNoKomi()) << "]";
-  printGameResult(out,endHist,overrideFinishedWhiteScore);
 
   bool hasAB = false;
   for(int y = 0; y<ySize; y++) {
@@ -1689,12 +3455,12 @@ void WriteSgf::writeSgf(
       Loc loc = Location::getLoc(x,y,xSize);
       if(initialBoard.colors[loc] == C_BLACK) {
         if(!hasAB) {
-          out << "AB";
+          buf += "AB";
           hasAB = true;
         }
-        out << "[";
-        writeSgfLoc(out,loc,xSize,ySize);
-        out << "]";
+        buf.push_back('[');
+        appendSgfLoc(buf,loc,xSize,ySize);
+        buf.push_back(']');
       }
     }
   }
@@ -1705,12 +3471,12 @@ void WriteSgf::writeSgf(
       Loc loc = Location::getLoc(x,y,xSize);
       if(initialBoard.colors[loc] == C_WHITE) {
         if(!hasAW) {
-          out << "AW";
+          buf += "AW";
           hasAW = true;
         }
-        out << "[";
-        writeSgfLoc(out,loc,xSize,ySize);
-        out << "]";
+        buf.push_back('[');
+        appendSgfLoc(buf,loc,xSize,ySize);
+        buf.push_back(']');
       }
     }
   }
@@ -1718,132 +3484,906 @@ void WriteSgf::writeSgf(
   size_t startTurnIdx = 0;
   if(gameData != NULL) {
     startTurnIdx = gameData->startHist.moveHistory.size();
-    out << "C[startTurnIdx=" << startTurnIdx;
-    out << ",initTurnNum=" << gameData->startHist.initialTurnNumber;
-    out << ",gameHash=" << gameData->gameHash;
+    buf += "C[startTurnIdx=";
+    appendSgfInt(buf,(int64_t)startTurnIdx);
+    buf += ",initTurnNum=";
+    appendSgfInt(buf,gameData->startHist.initialTurnNumber);
+    buf += ",gameHash=";
+    appendSgfHash(buf,gameData->gameHash);
 
     static_assert(FinishedGameData::NUM_MODES == 8, "");
     if(gameData->mode == FinishedGameData::MODE_NORMAL)
-      out << "," << "gtype=normal";
+      buf += ",gtype=normal";
     else if(gameData->mode == FinishedGameData::MODE_CLEANUP_TRAINING)
-      out << "," << "gtype=cleanuptraining";
+      buf += ",gtype=cleanuptraining";
     else if(gameData->mode == FinishedGameData::MODE_FORK)
-      out << "," << "gtype=fork";
+      buf += ",gtype=fork";
     else if(gameData->mode == FinishedGameData::MODE_HANDICAP)
-      out << "," << "gtype=handicap";
+      buf += ",gtype=handicap";
     else if(gameData->mode == FinishedGameData::MODE_SGFPOS)
-      out << "," << "gtype=sgfpos";
+      buf += ",gtype=sgfpos";
     else if(gameData->mode == FinishedGameData::MODE_HINTPOS)
-      out << "," << "gtype=hintpos";
+      buf += ",gtype=hintpos";
     else if(gameData->mode == FinishedGameData::MODE_HINTFORK)
-      out << "," << "gtype=hintfork";
+      buf += ",gtype=hintfork";
     else if(gameData->mode == FinishedGameData::MODE_ASYM)
-      out << "," << "gtype=asym";
+      buf += ",gtype=asym";
     else
-      out << "," << "gtype=other";
+      buf += ",gtype=other";
 
-    if(gameData->beganInEncorePhase != 0)
-      out << "," << "beganInEncorePhase=" << gameData->beganInEncorePhase;
-    if(gameData->usedInitialPosition != 0)
-      out << "," << "usedInitialPosition=" << gameData->usedInitialPosition;
-    if(gameData->playoutDoublingAdvantage != 0)
-      out << "," << "pdaWhite=" << ((gameData->playoutDoublingAdvantagePla == P_WHITE ? 1 : -1) * gameData->playoutDoublingAdvantage);
+    if(gameData->beganInEncorePhase != 0) {
+      buf += ",beganInEncorePhase=";
+      appendSgfInt(buf,gameData->beganInEncorePhase);
+    }
+    if(gameData->usedInitialPosition != 0) {
+      buf += ",usedInitialPosition=";
+      appendSgfInt(buf,gameData->usedInitialPosition);
+    }
+    if(gameData->playoutDoublingAdvantage != 0) {
+      buf += ",pdaWhite=";
+      appendSgfDouble(buf,(gameData->playoutDoublingAdvantagePla == P_WHITE ? 1 : -1) * gameData->playoutDoublingAdvantage);
+    }
 
     for(int j = 0; j<gameData->changedNeuralNets.size(); j++) {
-      out << ",newNeuralNetTurn" << gameData->changedNeuralNets[j]->turnIdx
-          << "=" << gameData->changedNeuralNets[j]->name;
+      buf += ",newNeuralNetTurn";
+      appendSgfInt(buf,gameData->changedNeuralNets[j]->turnIdx);
+      buf.push_back('=');
+      buf += gameData->changedNeuralNets[j]->name;
     }
     if(gameData->bTimeUsed > 0 || gameData->wTimeUsed > 0) {
-      out << "," << "bTimeUsed=" << gameData->bTimeUsed;
-      out << "," << "wTimeUsed=" << gameData->wTimeUsed;
+      buf += ",bTimeUsed=";
+      appendSgfDouble(buf,gameData->bTimeUsed);
+      buf += ",wTimeUsed=";
+      appendSgfDouble(buf,gameData->wTimeUsed);
     }
-    out << "]";
+    buf.push_back(']');
     assert(endHist.moveHistory.size() <= startTurnIdx + gameData->whiteValueTargetsByTurn.size());
   }
 
-  string comment;
-  Board board(initialBoard);
-  BoardHistory hist(board,endHist.initialPla,endHist.rules,endHist.initialEncorePhase);
+  //Passes for ko only exist in the encore, which only territory scoring has, so only then do we need to replay
+  //the game to find them.
+  const bool mayHavePassForKo = rules.scoringRule == Rules::SCORING_TERRITORY;
+  std::unique_ptr<Board> board;
+  std::unique_ptr<BoardHistory> hist;
+  if(mayHavePassForKo) {
+    board = std::make_unique<Board>(initialBoard);
+    hist = std::make_unique<BoardHistory>(*board,endHist.initialPla,endHist.getRules(),endHist.initialEncorePhase);
+  }
   for(size_t i = 0; i<endHist.moveHistory.size(); i++) {
-    comment.clear();
-    out << ";";
+    bool hasComment = false;
+    buf.push_back(';');
 
     Loc loc = endHist.moveHistory[i].loc;
     Player pla = endHist.moveHistory[i].pla;
 
     bool isResignMove = endHist.isGameFinished && endHist.isResignation && endHist.winner == getOpp(pla) && i+1 == endHist.moveHistory.size();
+    bool isPassForKo = false;
     if(!(omitResignPlayerMove && isResignMove)) {
-      if(pla == P_BLACK)
-        out << "B[";
-      else
-        out << "W[";
-
-      bool isPassForKo = hist.isPassForKo(board,loc,pla);
+      buf += (pla == P_BLACK ? "B[" : "W[");
+      isPassForKo = mayHavePassForKo && hist->isPassForKo(*board,loc,pla);
       if(isPassForKo)
-        writeSgfLoc(out,Board::PASS_LOC,xSize,ySize);
+        appendSgfLoc(buf,Board::PASS_LOC,xSize,ySize);
       else
-        writeSgfLoc(out,loc,xSize,ySize);
-      out << "]";
+        appendSgfLoc(buf,loc,xSize,ySize);
+      buf.push_back(']');
 
       if(isPassForKo) {
-        out << "TR[";
-        writeSgfLoc(out,loc,xSize,ySize);
-        out << "]";
-        comment += "Pass for ko";
+        buf += "TR[";
+        appendSgfLoc(buf,loc,xSize,ySize);
+        buf.push_back(']');
       }
     }
+    //The comment goes after all other properties of the node, so open it only now
+    if(isPassForKo) {
+      beginSgfCommentPart(buf,hasComment);
+      buf += "Pass for ko";
+    }
 
     if(gameData != NULL && i >= startTurnIdx) {
       size_t turnAfterStart = i-startTurnIdx;
       if(turnAfterStart < gameData->whiteValueTargetsByTurn.size()) {
         const ValueTargets& targets = gameData->whiteValueTargetsByTurn[turnAfterStart];
-        char winBuf[32];
-        char lossBuf[32];
-        char noResultBuf[32];
-        char scoreBuf[32];
-        sprintf(winBuf,"%.2f",targets.win);
-        sprintf(lossBuf,"%.2f",targets.loss);
-        sprintf(noResultBuf,"%.2f",targets.noResult);
-        sprintf(scoreBuf,"%.1f",targets.score);
-        if(comment.length() > 0)
-          comment += " ";
-        comment += winBuf;
-        comment += " ";
-        comment += lossBuf;
-        comment += " ";
-        comment += noResultBuf;
-        comment += " ";
-        comment += scoreBuf;
+        beginSgfCommentPart(buf,hasComment);
+        appendSgfFormatted(buf,"%.2f",targets.win);
+        buf.push_back(' ');
+        appendSgfFormatted(buf,"%.2f",targets.loss);
+        buf.push_back(' ');
+        appendSgfFormatted(buf,"%.2f",targets.noResult);
+        buf.push_back(' ');
+        appendSgfFormatted(buf,"%.1f",targets.score);
       }
       if(turnAfterStart < gameData->policyTargetsByTurn.size()) {
-        char visitsBuf[32];
-        sprintf(visitsBuf,"%d",(int)(gameData->policyTargetsByTurn[turnAfterStart].unreducedNumVisits));
-        if(comment.length() > 0)
-          comment += " ";
-        comment += "v=";
-        comment += visitsBuf;
+        beginSgfCommentPart(buf,hasComment);
+        buf += "v=";
+        appendSgfInt(buf,(int)(gameData->policyTargetsByTurn[turnAfterStart].unreducedNumVisits));
       }
       if(turnAfterStart < gameData->targetWeightByTurnUnrounded.size()) {
-        char weightBuf[32];
-        sprintf(weightBuf,"%.2f",gameData->targetWeightByTurnUnrounded[turnAfterStart]);
-        if(comment.length() > 0)
-          comment += " ";
-        comment += "weight=";
-        comment += weightBuf;
+        beginSgfCommentPart(buf,hasComment);
+        buf += "weight=";
+        appendSgfFormatted(buf,"%.2f",gameData->targetWeightByTurnUnrounded[turnAfterStart]);
       }
     }
 
     if(endHist.isGameFinished && i+1 == endHist.moveHistory.size()) {
-      if(comment.length() > 0)
-        comment += " ";
-      comment += "result=" + WriteSgf::gameResultNoSgfTag(endHist,overrideFinishedWhiteScore);
+      beginSgfCommentPart(buf,hasComment);
+      buf += "result=";
+      appendGameResultNoSgfTag(buf,endHist,overrideFinishedWhiteScore);
+    }
+
+    if(hasComment)
+      buf.push_back(']');
+
+    if(mayHavePassForKo)
+      hist->makeBoardMoveAssumeLegal(*board,loc,pla,NULL);
+  }
+  buf.push_back(')');
+}
+
+//Tests--------------------------------------------------------------------------------------------------------
+
+//Undoing a move does not restore the chain representation, only the position, so compare boards as isEqualForTesting does,
+//which also checks that the chains of each board are consistent with its stones.
+static void checkBoardsIdentical(const Board& a, const Board& b) {
+  testAssert(a.isEqualForTesting(b,true,true));
+}
+
+static void checkHashIdxTableMatches(const HashIdxTable& table, const vector<Hash128>& hashes) {
+  testAssert(table.size() == hashes.size());
+  for(size_t i = 0; i<hashes.size(); i++) {
+    bool found = false;
+    table.forEachIdxOfHash(hashes[i], [&](uint32_t idx) {
+      if(idx == i)
+        found = true;
+    });
+    testAssert(found);
+  }
+}
+
+static void checkHistoriesIdentical(const BoardHistory& a, const BoardHistory& b) {
+  testAssert(a.getRules() == b.getRules());
+  testAssert(a.moveHistory.size() == b.moveHistory.size());
+  for(size_t i = 0; i<a.moveHistory.size(); i++) {
+    testAssert(a.moveHistory[i].loc == b.moveHistory[i].loc);
+    testAssert(a.moveHistory[i].pla == b.moveHistory[i].pla);
+  }
+  testAssert(a.preventEncoreHistory.toVector() == b.preventEncoreHistory.toVector());
+  testAssert(a.koHashHistory.toVector() == b.koHashHistory.toVector());
+  testAssert(a.firstTurnIdxWithKoHistory == b.firstTurnIdxWithKoHistory);
+
+  checkBoardsIdentical(a.initialBoard,b.initialBoard);
+  testAssert(a.initialPla == b.initialPla);
+  testAssert(a.initialEncorePhase == b.initialEncorePhase);
+  testAssert(a.initialTurnNumber == b.initialTurnNumber);
+  testAssert(a.assumeMultipleStartingBlackMovesAreHandicap == b.assumeMultipleStartingBlackMovesAreHandicap);
+  testAssert(a.whiteHasMoved == b.whiteHasMoved);
+
+  testAssert(a.currentRecentBoardIdx == b.currentRecentBoardIdx);
+  for(int i = 0; i<BoardHistory::NUM_RECENT_BOARDS; i++)
+    checkBoardsIdentical(a.recentBoards[i],b.recentBoards[i]);
+  testAssert(a.presumedNextMovePla == b.presumedNextMovePla);
+
+  for(int i = 0; i<Board::MAX_ARR_SIZE; i++) {
+    testAssert(a.wasEverOccupiedOrPlayed[i] == b.wasEverOccupiedOrPlayed[i]);
+    testAssert(a.superKoBanned[i] == b.superKoBanned[i]);
+    testAssert(a.koRecapBlocked[i] == b.koRecapBlocked[i]);
+    testAssert(a.secondEncoreStartColors[i] == b.secondEncoreStartColors[i]);
+  }
+
+  testAssert(a.consecutiveEndingPasses == b.consecutiveEndingPasses);
+  testAssert(a.hashesBeforeBlackPass == b.hashesBeforeBlackPass);
+  testAssert(a.hashesBeforeWhitePass == b.hashesBeforeWhitePass);
+  checkHashIdxTableMatches(a.hashesBeforeBlackPassTable,b.hashesBeforeBlackPass);
+  checkHashIdxTableMatches(a.hashesBeforeWhitePassTable,b.hashesBeforeWhitePass);
+
+  testAssert(a.encorePhase == b.encorePhase);
+  testAssert(a.numTurnsThisPhase == b.numTurnsThisPhase);
+  testAssert(a.koRecapBlockedLocs == b.koRecapBlockedLocs);
+  testAssert(a.koRecapBlockHash == b.koRecapBlockHash);
+  testAssert(a.koCapturesInEncore.size() == b.koCapturesInEncore.size());
+  vector<Hash128> koCaptureHashes;
+  for(size_t i = 0; i<a.koCapturesInEncore.size(); i++) {
+    testAssert(a.koCapturesInEncore[i].posHashBeforeMove == b.koCapturesInEncore[i].posHashBeforeMove);
+    testAssert(a.koCapturesInEncore[i].moveLoc == b.koCapturesInEncore[i].moveLoc);
+    testAssert(a.koCapturesInEncore[i].movePla == b.koCapturesInEncore[i].movePla);
+    koCaptureHashes.push_back(b.koCapturesInEncore[i].posHashBeforeMove);
+  }
+  checkHashIdxTableMatches(a.koCapturesInEncoreTable,koCaptureHashes);
+
+  testAssert(a.whiteBonusScore == b.whiteBonusScore);
+  testAssert(a.whiteHandicapBonusScore == b.whiteHandicapBonusScore);
+  testAssert(a.hasButton == b.hasButton);
+  testAssert(a.isPastNormalPhaseEnd == b.isPastNormalPhaseEnd);
+  testAssert(a.isGameFinished == b.isGameFinished);
+  testAssert(a.winner == b.winner);
+  testAssert(a.finalWhiteMinusBlackScore == b.finalWhiteMinusBlackScore);
+  testAssert(a.isScored == b.isScored);
+  testAssert(a.isNoResult == b.isNoResult);
+  testAssert(a.isResignation == b.isResignation);
+}
+
+//Same sgf with every move transformed by the symmetry, for sgfs with no setup stones or other properties with locations
+static string getSymmetricSgfText(const string& text, int xSize, int ySize, int symmetry) {
+  string ret = text;
+  for(size_t i = 0; i+4<ret.size(); i++) {
+    if((ret[i] == 'B' || ret[i] == 'W') && ret[i+1] == '[' && ret[i+4] == ']') {
+      Loc loc = SymmetryHelpers::getSymLoc(ret[i+2]-'a',ret[i+3]-'a',xSize,ySize,symmetry);
+      bool transpose = SymmetryHelpers::isTranspose(symmetry);
+      int symXSize = transpose ? ySize : xSize;
+      ret[i+2] = (char)('a' + Location::getX(loc,symXSize));
+      ret[i+3] = (char)('a' + Location::getY(loc,symXSize));
+    }
+  }
+  return ret;
+}
+
+static void checkSgfNodesIdentical(const SgfNode& a, const SgfNode& b) {
+  testAssert(a.move.x == b.move.x && a.move.y == b.move.y && a.move.pla == b.move.pla);
+  testAssert(a.props.size() == b.props.size());
+  for(size_t j = 0; j<a.props.size(); j++) {
+    testAssert(a.props[j].keyCode == b.props[j].keyCode);
+    testAssert(a.props[j].getValues() == b.props[j].getValues());
+  }
+}
+
+static void checkSgfsIdentical(const Sgf* a, const Sgf* b) {
+  testAssert(a->nodes.size() == b->nodes.size());
+  for(size_t i = 0; i<a->nodes.size(); i++)
+    checkSgfNodesIdentical(*(a->nodes[i]),*(b->nodes[i]));
+  testAssert(a->children.size() == b->children.size());
+  for(size_t i = 0; i<a->children.size(); i++)
+    checkSgfsIdentical(a->children[i],b->children[i]);
+}
+
+//Parses text with both Sgf::parse and the given view, which must either both reject it with an IOError or both accept
+//it and agree exactly on the result. Returns whether it was accepted.
+static bool checkSgfViewMatchesParse(SgfView& view, const string& text) {
+  std::unique_ptr<Sgf> parsed;
+  try {
+    parsed.reset(Sgf::parse(text));
+  }
+  catch(const IOError&) {
+  }
+  //Exactly the bytes of the text, so that reading past the end is not hidden by the string's null terminator
+  vector<char> exact(text.begin(),text.end());
+  bool viewAccepted = true;
+  try {
+    view.parse(exact.data(),exact.size());
+  }
+  catch(const IOError&) {
+    viewAccepted = false;
+  }
+  testAssert(viewAccepted == (parsed != nullptr));
+  if(!viewAccepted)
+    return false;
+
+  std::unique_ptr<Sgf> fromView(view.toSgf());
+  checkSgfsIdentical(fromView.get(),parsed.get());
+  testAssert(fromView->hash == parsed->hash);
+  testAssert(view.computeHash() == parsed->hash);
+  testAssert(view.computeHash(SgfHashMode::FAST) == Sgf::computeHash(text.data(),text.size(),SgfHashMode::FAST));
+  return true;
+}
+
+//Checks that line is exactly the line of full that getMoves follows, with no other variations
+static void checkIsMainLine(const Sgf* line, const Sgf* full) {
+  testAssert(line->nodes.size() == full->nodes.size());
+  for(size_t i = 0; i<line->nodes.size(); i++)
+    checkSgfNodesIdentical(*(line->nodes[i]),*(full->nodes[i]));
+  int64_t maxChildDepth = 0;
+  const Sgf* maxChild = NULL;
+  for(size_t i = 0; i<full->children.size(); i++) {
+    if(full->children[i]->depth() > maxChildDepth) {
+      maxChildDepth = full->children[i]->depth();
+      maxChild = full->children[i];
+    }
+  }
+  if(maxChild == NULL)
+    testAssert(line->children.size() == 0);
+  else {
+    testAssert(line->children.size() == 1);
+    checkIsMainLine(line->children[0],maxChild);
+  }
+}
+
+static void checkCompactSgfsIdentical(const CompactSgf* a, const CompactSgf* b) {
+  checkSgfNodesIdentical(a->rootNode,b->rootNode);
+  testAssert(a->placements.size() == b->placements.size());
+  for(size_t i = 0; i<a->placements.size(); i++)
+    testAssert(a->placements[i].loc == b->placements[i].loc && a->placements[i].pla == b->placements[i].pla);
+  testAssert(a->moves.size() == b->moves.size());
+  for(size_t i = 0; i<a->moves.size(); i++)
+    testAssert(a->moves[i].loc == b->moves[i].loc && a->moves[i].pla == b->moves[i].pla);
+  testAssert(a->xSize == b->xSize && a->ySize == b->ySize);
+  testAssert(a->depth == b->depth);
+  testAssert(a->komi == b->komi);
+  testAssert(a->sgfWinner == b->sgfWinner);
+  testAssert(a->hash == b->hash);
+}
+
+//Calls f, returning whether it threw, and otherwise storing its result in buf
+template<typename F>
+static bool throwsStringError(F f, string& buf) {
+  try {
+    buf = f();
+  }
+  catch(const StringError&) {
+    return true;
+  }
+  return false;
+}
+
+//Checks that each root accessor of the LazySgf gives the same result as that of the Sgf, or throws just the same.
+static void checkLazyRootAccessorsMatch(LazySgf* lazy, const Sgf* sgf) {
+  std::vector<std::pair<std::function<string()>,std::function<string()>>> accessors = {
+    {[&]() { XYSize size = lazy->getXYSize(); return Global::intToString(size.x) + "x" + Global::intToString(size.y); },
+     [&]() { XYSize size = sgf->getXYSize(); return Global::intToString(size.x) + "x" + Global::intToString(size.y); }},
+    {[&]() { return Global::floatToString(lazy->getKomi()); }, [&]() { return Global::floatToString(sgf->getKomi()); }},
+    {[&]() { return string(lazy->hasRules() ? "true" : "false"); }, [&]() { return string(sgf->hasRules() ? "true" : "false"); }},
+    {[&]() { return lazy->getRulesOrFail().toString(); }, [&]() { return sgf->getRulesOrFail().toString(); }},
+    {[&]() { return Global::intToString(lazy->getHandicapValue()); }, [&]() { return Global::intToString(sgf->getHandicapValue()); }},
+    {[&]() { return PlayerIO::playerToString(lazy->getSgfWinner()); }, [&]() { return PlayerIO::playerToString(sgf->getSgfWinner()); }},
+    {[&]() { return Global::intToString(lazy->getRank(P_BLACK)); }, [&]() { return Global::intToString(sgf->getRank(P_BLACK)); }},
+    {[&]() { return Global::intToString(lazy->getRank(P_WHITE)); }, [&]() { return Global::intToString(sgf->getRank(P_WHITE)); }},
+    {[&]() { return Global::intToString(lazy->getRating(P_BLACK)); }, [&]() { return Global::intToString(sgf->getRating(P_BLACK)); }},
+    {[&]() { return lazy->getPlayerName(P_WHITE); }, [&]() { return sgf->getPlayerName(P_WHITE); }},
+    {[&]() { return lazy->getRootPropertyWithDefault("GN","none"); }, [&]() { return sgf->getRootPropertyWithDefault("GN","none"); }},
+  };
+  for(size_t i = 0; i<accessors.size(); i++) {
+    string lazyResult;
+    string sgfResult;
+    bool lazyThrew = throwsStringError(accessors[i].first,lazyResult);
+    bool sgfThrew = throwsStringError(accessors[i].second,sgfResult);
+    testAssert(lazyThrew == sgfThrew);
+    testAssert(lazyResult == sgfResult);
+  }
+  checkSgfNodesIdentical(lazy->getRootNode(),*(sgf->nodes[0]));
+}
+
+//Checks LazySgf against Sgf::parse and CompactSgf::parse on the text. Anything Sgf::parse accepts, LazySgf must also
+//accept and then agree with it on everything. LazySgf may accept more since it only checks the structure up front, but
+//then toSgf must still throw. Returns whether Sgf::parse accepted the text.
+static bool checkLazySgfMatches(const string& text) {
+  std::unique_ptr<Sgf> parsed;
+  try {
+    parsed.reset(Sgf::parse(text));
+  }
+  catch(const IOError&) {
+  }
+  std::unique_ptr<LazySgf> lazy;
+  try {
+    lazy.reset(LazySgf::parse(text));
+  }
+  catch(const IOError&) {
+  }
+  if(parsed == nullptr) {
+    if(lazy != nullptr) {
+      bool threw = false;
+      try {
+        delete lazy->toSgf();
+      }
+      catch(const IOError&) {
+        threw = true;
+      }
+      testAssert(threw);
+    }
+    return false;
+  }
+  testAssert(lazy != nullptr);
+
+  testAssert(lazy->getHash() == parsed->hash);
+  testAssert(lazy->depth() == parsed->depth());
+  testAssert(lazy->nodeCount() == parsed->nodeCount());
+  testAssert(lazy->branchCount() == parsed->branchCount());
+  checkLazyRootAccessorsMatch(lazy.get(),parsed.get());
+
+  std::unique_ptr<Sgf> mainLine(lazy->parseMainLine());
+  checkIsMainLine(mainLine.get(),parsed.get());
+  testAssert(mainLine->hash == parsed->hash);
+
+  std::unique_ptr<CompactSgf> compact;
+  try {
+    compact.reset(CompactSgf::parse(text));
+  }
+  catch(const IOError&) {
+  }
+  std::unique_ptr<CompactSgf> lazyCompact;
+  try {
+    lazyCompact.reset(lazy->toCompactSgf());
+  }
+  catch(const IOError&) {
+  }
+  testAssert((compact == nullptr) == (lazyCompact == nullptr));
+  if(compact != nullptr)
+    checkCompactSgfsIdentical(lazyCompact.get(),compact.get());
+
+  std::unique_ptr<Sgf> full(lazy->toSgf());
+  checkSgfsIdentical(full.get(),parsed.get());
+  testAssert(full->hash == parsed->hash);
+  return true;
+}
+
+void Sgf::runTests() {
+  cout << "Running sgf tests" << endl;
+
+  //Nested variations, a ko, passes including a game-ending pair, and placements both at the start of a variation and
+  //in the middle of one, including one that removes a stone.
+  const string variationsSgf =
+    "(;FF[4]GM[1]SZ[9]C[root]"
+    ";B[cd];W[ec];B[dc];W[ee];B[de];W[fd];B[ed];W[dd]C[ko]"
+    "(;B[];W[gg];B[ed]C[retake]"
+    "  (;W[];B[])"
+    "  (;W[hh];AB[aa][ba]AW[ab]AE[gg]C[setup];B[bb]"
+    "    (;W[cc])"
+    "    (;W[];B[ac])))"
+    "(;B[cc];W[ed]"
+    "  (;B[];W[])"
+    "  (;B[gc];W[]))"
+    "(;AB[hh]AE[dd];W[ab];B[]))";
+
+  std::unique_ptr<Sgf> sgf(Sgf::parse(variationsSgf));
+  XYSize size = sgf->getXYSize();
+  int xSize = size.x;
+  int ySize = size.y;
+  //Same as iterAllPositionsStart
+  Rules rules = Rules::getTrompTaylorish();
+  rules.koRule = Rules::KO_SITUATIONAL;
+  rules.multiStoneSuicideLegal = true;
+
+  //Walk every variation through a VariationUndoLog the same way iterAllPositionsHelper does. Undoing each move right
+  //after making it, and undoing each whole variation after walking it, must restore exactly the board and history
+  //from before, and redoing the move must get back exactly to where it was.
+  {
+    int numMoves = 0;
+    int numPasses = 0;
+    int numCaptures = 0;
+    int numPlacements = 0;
+    int numVariations = 0;
+    VariationUndoLog undoLog(true);
+    std::function<void(const Sgf*,Board&,BoardHistory&,Player)> walk =
+      [&](const Sgf* node, Board& board, BoardHistory& hist, Player nextPla) {
+      vector<Move> buf;
+      for(size_t i = 0; i<node->nodes.size(); i++) {
+        if(node->nodes[i]->hasPlacements()) {
+          buf.clear();
+          node->nodes[i]->accumPlacements(buf,xSize,ySize);
+          undoLog.pushSnapshot(board,hist);
+          testAssert(board.setStonesFailIfNoLibs(buf));
+          board.clearSimpleKoLoc();
+          hist.clear(board,nextPla,rules,0);
+          numPlacements++;
+        }
+        buf.clear();
+        node->nodes[i]->accumMoves(buf,xSize,ySize);
+        for(size_t j = 0; j<buf.size(); j++) {
+          Board boardBefore(board);
+          BoardHistory histBefore(hist);
+          size_t mark = undoLog.size;
+          testAssert(undoLog.pushMove(board,hist,buf[j].loc,buf[j].pla));
+          Board boardAfter(board);
+          BoardHistory histAfter(hist);
+          undoLog.undoTo(mark,board,hist);
+          testAssert(undoLog.size == mark);
+          checkBoardsIdentical(board,boardBefore);
+          checkHistoriesIdentical(hist,histBefore);
+
+          testAssert(undoLog.pushMove(board,hist,buf[j].loc,buf[j].pla));
+          checkBoardsIdentical(board,boardAfter);
+          checkHistoriesIdentical(hist,histAfter);
+
+          numMoves++;
+          if(buf[j].loc == Board::PASS_LOC)
+            numPasses++;
+          if(board.numBlackCaptures + board.numWhiteCaptures > boardBefore.numBlackCaptures + boardBefore.numWhiteCaptures)
+            numCaptures++;
+          nextPla = getOpp(buf[j].pla);
+        }
+      }
+      for(size_t c = 0; c<node->children.size(); c++) {
+        Board boardBefore(board);
+        BoardHistory histBefore(hist);
+        size_t mark = undoLog.size;
+        walk(node->children[c],board,hist,nextPla);
+        undoLog.undoTo(mark,board,hist);
+        checkBoardsIdentical(board,boardBefore);
+        checkHistoriesIdentical(hist,histBefore);
+        numVariations++;
+      }
+    };
+
+    Board board(xSize,ySize);
+    BoardHistory hist(board,P_BLACK,rules,0);
+    Board boardBefore(board);
+    BoardHistory histBefore(hist);
+    walk(sgf.get(),board,hist,P_BLACK);
+    //The main line leaves its changes on the board, undoing everything gets back to the empty board
+    undoLog.undoTo(0,board,hist);
+    checkBoardsIdentical(board,boardBefore);
+    checkHistoriesIdentical(hist,histBefore);
+
+    testAssert(numMoves == 26);
+    testAssert(numPasses == 8);
+    testAssert(numCaptures == 3);
+    testAssert(numPlacements == 2);
+    testAssert(numVariations == 9);
+  }
+
+  //Undo records are only supported for area scoring without a button
+  {
+    Board board(9,9);
+    BoardHistory hist(board,P_BLACK,Rules::getSimpleTerritory(),0);
+    BoardHistory::MoveUndoRecord record;
+    bool threw = false;
+    try {
+      hist.makeBoardMoveTolerant(board,Location::getLoc(2,2,9),P_BLACK,record);
+    }
+    catch(const StringError&) {
+      threw = true;
+    }
+    testAssert(threw);
+  }
+
+  //Iterating with the undo log yields exactly the same samples, with exactly the same histories, in the same order, as
+  //walking each variation on its own copy.
+  {
+    struct Yielded {
+      string sampleJson;
+      string comments;
+      BoardHistory hist;
+    };
+    auto iterate = [&](
+      bool useUndoLog, bool requireUnique, bool hashParent, bool dedupSymmetries, bool allowGameOver, const char* randSeed,
+      vector<Yielded>& yielded
+    ) {
+      std::set<Hash128> uniqueHashes;
+      std::function<bool(Hash128)> tryInsertUnique = [&uniqueHashes](Hash128 hash) {
+        return uniqueHashes.insert(hash).second;
+      };
+      std::unique_ptr<Rand> rand;
+      if(randSeed != NULL)
+        rand = std::make_unique<Rand>(randSeed);
+      bool hashComments = false;
+      bool flipIfPassOrWFirst = false;
+      sgf->iterAllPositionsStart(
+        tryInsertUnique,requireUnique,hashComments,hashParent,dedupSymmetries,flipIfPassOrWFirst,allowGameOver,useUndoLog,rand.get(),
+        [&yielded](PositionSample& sample, const BoardHistory& hist, const string& comments) {
+          Yielded y;
+          y.sampleJson = PositionSample::toJsonLine(sample);
+          y.comments = comments;
+          y.hist = hist;
+          yielded.push_back(y);
+        }
+      );
+    };
+
+    for(int requireUnique = 0; requireUnique <= 1; requireUnique++) {
+      for(int variant = 0; variant < 5; variant++) {
+        bool hashParent = variant == 1;
+        bool dedupSymmetries = variant == 2;
+        bool allowGameOver = variant == 3;
+        const char* randSeed = variant == 4 ? "sgf undo test" : NULL;
+        vector<Yielded> withLog;
+        vector<Yielded> withoutLog;
+        iterate(true,requireUnique != 0,hashParent,dedupSymmetries,allowGameOver,randSeed,withLog);
+        iterate(false,requireUnique != 0,hashParent,dedupSymmetries,allowGameOver,randSeed,withoutLog);
+        testAssert(withLog.size() > 20);
+        testAssert(withLog.size() == withoutLog.size());
+        for(size_t i = 0; i<withLog.size(); i++) {
+          testAssert(withLog[i].sampleJson == withoutLog[i].sampleJson);
+          testAssert(withLog[i].comments == withoutLog[i].comments);
+          checkHistoriesIdentical(withLog[i].hist,withoutLog[i].hist);
+        }
+      }
+    }
+  }
+
+  //SgfView accepts and rejects exactly what Sgf::parse does, and otherwise gives the same tree and hash.
+  //A single view is reused throughout, including right after failed parses.
+  {
+    SgfView view;
+    const string bom = "\xEF\xBB\xBF";
+    const vector<string> validSgfs = {
+      "(;FF[4]GM[1]SZ[9];B[cc];W[gg];B[];W[tt])",
+      //Escapes, escaped and unescaped line breaks of each kind, and other whitespace within values
+      "(;C[a\\]b\\\\c\\d]GN[x\\\ny\\\r\nz];B[cc]C[line\r\n\n\rnext\ttab\vv\ff])",
+      //Escaped characters within the move itself
+      "(;B[\\c\\c];W[d\\d])",
+      bom + "(;SZ[9];B[aa])",
+      bom + " \r\n\t(;SZ[9];B[aa])",
+      "  \n(;SZ[9];B[aa])\n",
+      //Whitespace between the letters of a key and around brackets, parens and semicolons
+      "(;S Z[9]G\nN[name]A\tB[aa] [bb] ; B\n[cc] ;W [dd]\n)",
+      //Variations, nested, including ones starting with setup
+      "(;SZ[9](;B[aa];W[bb](;B[cc])(;B[dd];W[ee]))(;AB[ff]AW[gg];W[hh]))",
+      //Properties repeated within a node, and a second B or W after the move, which is just a property
+      "(;AB[aa][bb]C[x]AB[cc];B[dd]B[ee]W[ff];W[gg]W[])",
+      "(;SZ[19:13]B[Ab])",
+      "(;)",
+      //Nothing is required after the closing paren, whatever it is
+      "(;B[aa])(;W[bb])",
+      "(;B[aa]) trailing",
+      "(;B[aa];W[bb]))",
+      //Empty nodes, and empty variations, which are kept as children with no nodes
+      "(;B[aa];)",
+      "(;B[aa]()(;W[bb]))",
+      string("(;B[aa]\0)",9),
+    };
+    for(const string& text : validSgfs)
+      testAssert(checkSgfViewMatchesParse(view,text));
+
+    const vector<string> invalidSgfs = {
+      "",
+      " \n ",
+      bom,
+      "(",
+      "()",
+      "( )",
+      "(;B[aa]",
+      ";B[aa])",
+      "(;B[aa](;W[bb])",
+      "(;B[aa](;W[bb]",
+      "(;C[unterminated)",
+      "(;C[unterminated\\])",
+      "(;C)",
+      "(;C;B[aa])",
+      "(;B[a])",
+      "(;B[abc])",
+      "(;B[a1])",
+      "(;W[\\]])",
+      "(;B[aa]x)",
+      "x(;B[aa])",
+      //A BOM anywhere but the very start is not skipped
+      " " + bom + "(;B[aa])",
+      "(" + bom + ";B[aa])",
+    };
+    for(const string& text : invalidSgfs)
+      testAssert(!checkSgfViewMatchesParse(view,text));
+
+    //Every prefix of these, and every single deleted character, must give the same outcome from both
+    for(const string& text : validSgfs) {
+      for(size_t len = 0; len<text.size(); len++)
+        checkSgfViewMatchesParse(view,text.substr(0,len));
+      for(size_t i = 0; i<text.size(); i++)
+        checkSgfViewMatchesParse(view,text.substr(0,i) + text.substr(i+1));
+    }
+
+    //Accessors on the raw view, over text that outlives the parse
+    const string accessorSgf = "(;S Z[9]C[a\\]b];B[cc])";
+    testAssert(checkSgfViewMatchesParse(view,accessorSgf));
+    view.parse(accessorSgf);
+    testAssert(view.trees.size() == 1 && view.nodes.size() == 2);
+    int64_t szIdx = view.findProp(0,"SZ");
+    testAssert(szIdx == 0);
+    testAssert(view.getKey(view.props[szIdx]) == "SZ");
+    testAssert(view.props[szIdx].keyHasWhitespace);
+    int64_t cIdx = view.findProp(0,"C");
+    testAssert(cIdx == 1);
+    const SgfView::Value& cValue = view.values[view.props[cIdx].valuesBegin];
+    testAssert(cValue.needsDecoding);
+    testAssert(string(view.getRawValue(cValue),cValue.span.len) == "a\\]b");
+    testAssert(view.decodeValue(cValue) == "a]b");
+    testAssert(view.findProp(0,"B") == -1);
+    testAssert(view.findProp(1,"B") == 2);
+    testAssert(!view.values[view.props[2].valuesBegin].needsDecoding);
+  }
+
+  //LazySgf agrees with Sgf::parse and CompactSgf::parse on the structure, the root, the main line, and everything
+  {
+    const string bom = "\xEF\xBB\xBF";
+    const vector<string> validSgfs = {
+      "(;FF[4]GM[1]SZ[9]KM[6.5]RU[Chinese]PB[black]PW[white]BR[3d]WR[5k]RE[W+R]GN[game];B[cc];W[gg];B[];W[tt])",
+      "(;SZ[19:13]HA[2]AB[dd][pp]KM[0.5];W[qd];B[Ab])",
+      //The main line takes the first deepest variation at each fork, whether it comes first or not
+      "(;SZ[9](;B[aa];W[bb](;B[cc])(;B[dd];W[ee]))(;AB[ff]AW[gg];W[hh])(;B[ii];W[hh];B[gg];W[ff]))",
+      "(;SZ[9];B[aa](;W[bb];B[cc])(;W[cc];B[bb]))",
+      //Parens and brackets within values are not structure
+      "(;C[(;B[aa])];B[cc]C[a\\]b\\\\(];W[dd]GN[)])",
+      bom + " \r\n(;S Z[9]G\nN[name];B\n[cc] ;W [dd]\n)",
+      "(;)",
+      "(;B[aa];)",
+      "(;B[aa]()(;W[bb]))",
+      "(;B[aa];W[bb])) trailing",
+      //Only the first tree matters, after which anything goes
+      "(;B[aa])x)(",
+      //Valid as a whole, but CompactSgf rejects placements after the root, or a bad board size
+      "(;SZ[9];B[aa];AB[cc];W[bb])",
+      "(;SZ[abc];B[aa])",
+      //Rules that getRulesOrFail rejects
+      "(;SZ[9]RU[nonsense];B[aa])",
+    };
+    for(const string& text : validSgfs)
+      testAssert(checkLazySgfMatches(text));
+
+    //Malformed structure, rejected already by LazySgf::parse
+    const vector<string> malformedSgfs = {
+      "",
+      " ",
+      bom,
+      "()",
+      "(;B[aa]",
+      ";B[aa])",
+      "x(;B[aa])",
+      "(;B[aa](;W[bb])",
+      "(;C[unterminated)",
+      "(;C[unterminated\\])",
+    };
+    for(const string& text : malformedSgfs) {
+      bool threw = false;
+      try {
+        delete LazySgf::parse(text);
+      }
+      catch(const IOError&) {
+        threw = true;
+      }
+      testAssert(threw);
+      testAssert(!checkLazySgfMatches(text));
+    }
+
+    //Well-formed structure but malformed nodes, which throw only once parsed
+    auto throws = [](std::function<void()> f) {
+      try {
+        f();
+      }
+      catch(const IOError&) {
+        return true;
+      }
+      return false;
+    };
+    {
+      //Junk in the root node
+      std::unique_ptr<LazySgf> lazy(LazySgf::parse("(;SZ[9]C;B[aa])"));
+      testAssert(lazy->depth() == 2 && lazy->nodeCount() == 2 && lazy->branchCount() == 0);
+      testAssert(throws([&]() { lazy->getRootNode(); }));
+      testAssert(throws([&]() { lazy->getXYSize(); }));
+      testAssert(throws([&]() { delete lazy->parseMainLine(); }));
+      testAssert(throws([&]() { delete lazy->toCompactSgf(); }));
+      testAssert(throws([&]() { delete lazy->toSgf(); }));
+    }
+    {
+      //A bad move on the main line after the root leaves the root usable
+      std::unique_ptr<LazySgf> lazy(LazySgf::parse("(;SZ[9]KM[7];B[aa];W[abc])"));
+      testAssert(lazy->getXYSize().x == 9 && lazy->getKomi() == 7.0f);
+      testAssert(throws([&]() { delete lazy->parseMainLine(); }));
+      testAssert(throws([&]() { delete lazy->toCompactSgf(); }));
+      testAssert(throws([&]() { delete lazy->toSgf(); }));
+    }
+    {
+      //Junk after a node but before its variations, or before the next node
+      testAssert(throws([&]() { std::unique_ptr<LazySgf> lazy(LazySgf::parse("(;SZ[9];B[aa] x (;W[bb]))")); delete lazy->parseMainLine(); }));
+      testAssert(throws([&]() { std::unique_ptr<LazySgf> lazy(LazySgf::parse("(;SZ[9]; ] ;B[aa])")); delete lazy->parseMainLine(); }));
+    }
+    {
+      //A bad move in a side variation is never parsed for the main line
+      const string text = "(;SZ[9];B[aa](;W[bb];B[cc])(;W[b]))";
+      const string withoutBadVariation = "(;SZ[9];B[aa](;W[bb];B[cc]))";
+      std::unique_ptr<LazySgf> lazy(LazySgf::parse(text));
+      testAssert(lazy->depth() == 4 && lazy->nodeCount() == 5 && lazy->branchCount() == 1);
+      std::unique_ptr<Sgf> expected(Sgf::parse(withoutBadVariation));
+      std::unique_ptr<Sgf> mainLine(lazy->parseMainLine());
+      checkIsMainLine(mainLine.get(),expected.get());
+      testAssert(mainLine->hash == Sgf::computeHash(text.data(),text.size(),SgfHashMode::SHA256));
+      std::unique_ptr<CompactSgf> compact(lazy->toCompactSgf());
+      std::unique_ptr<CompactSgf> expectedCompact(CompactSgf::parse(withoutBadVariation));
+      testAssert(compact->moves.size() == 3);
+      expectedCompact->hash = compact->hash;
+      checkCompactSgfsIdentical(compact.get(),expectedCompact.get());
+      testAssert(throws([&]() { delete lazy->toSgf(); }));
+      testAssert(throws([&]() { delete Sgf::parse(text); }));
     }
 
-    if(comment.length() > 0)
-      out << "C[" << comment << "]";
+    //Every prefix of these, and every single deleted character
+    for(const string& text : validSgfs) {
+      for(size_t len = 0; len<text.size(); len++)
+        checkLazySgfMatches(text.substr(0,len));
+      for(size_t i = 0; i<text.size(); i++)
+        checkLazySgfMatches(text.substr(0,i) + text.substr(i+1));
+    }
+  }
+}
 
-    hist.makeBoardMoveAssumeLegal(board,loc,pla,NULL);
+void Sgf::PositionSample::runTests() {
+  cout << "Running position sample tests" << endl;
+
+  //Applying a symmetry and then its inverse gives back exactly the same sample, including the symmetry field, for every
+  //symmetry that maps the board onto itself. Other symmetries are rejected.
+  {
+    const int sizes[2][2] = {{9,9},{7,5}};
+    for(int k = 0; k<2; k++) {
+      int sampleXSize = sizes[k][0];
+      int sampleYSize = sizes[k][1];
+      PositionSample sample;
+      sample.board = Board(sampleXSize,sampleYSize);
+      sample.board.setStone(Location::getLoc(1,0,sampleXSize),P_BLACK);
+      sample.board.setStone(Location::getLoc(2,1,sampleXSize),P_BLACK);
+      sample.board.setStone(Location::getLoc(3,3,sampleXSize),P_WHITE);
+      sample.nextPla = P_WHITE;
+      sample.moves.push_back(Move(Location::getLoc(4,1,sampleXSize),P_WHITE));
+      sample.moves.push_back(Move(Board::PASS_LOC,P_BLACK));
+      sample.moves.push_back(Move(Location::getLoc(0,4,sampleXSize),P_WHITE));
+      sample.initialTurnNumber = 7;
+      sample.hintLoc = Location::getLoc(5,2,sampleXSize);
+      sample.weight = 2.5;
+      sample.symmetry = 3;
+
+      int numSymmetries = SymmetryHelpers::getNumSymmetries(sampleXSize,sampleYSize);
+      testAssert(numSymmetries == (sampleXSize == sampleYSize ? 8 : 4));
+      for(int sym = 0; sym<numSymmetries; sym++) {
+        PositionSample transformed = sample.getSymmetric(sym);
+        testAssert(transformed.symmetry == SymmetryHelpers::compose(SymmetryHelpers::invert(sym),sample.symmetry));
+        testAssert(transformed.moves[1].loc == Board::PASS_LOC);
+        PositionSample roundTrip = transformed.getSymmetric(SymmetryHelpers::invert(sym));
+        testAssert(roundTrip.isEqualForTesting(sample,true,true));
+        testAssert(roundTrip.symmetry == sample.symmetry);
+        testAssert(PositionSample::toJsonLine(roundTrip) == PositionSample::toJsonLine(sample));
+
+        //Applying the symmetry field brings every orientation back to the same one
+        testAssert(transformed.getSymmetric(transformed.symmetry).isEqualForTesting(sample.getSymmetric(sample.symmetry),true,true));
+      }
+      bool threw = false;
+      try {
+        sample.getSymmetric(numSymmetries < 8 ? numSymmetries : 8);
+      }
+      catch(const StringError&) {
+        threw = true;
+      }
+      testAssert(threw);
+    }
+  }
 
+  //All orientations of a game, counting only those that map the board onto itself, yield the same number of positions
+  //when deduplicating up to symmetry, and once one orientation has been seen, none of the others yield anything new.
+  //Without deduplicating up to symmetry, they do.
+  {
+    const string squareSgf = "(;FF[4]GM[1]SZ[9];B[cc];W[gg];B[cg];W[gc];B[ee](;W[df];B[fd];W[])(;W[fe];B[ef]))";
+    const string rectSgf = "(;FF[4]GM[1]SZ[7:5];B[cb];W[ec];B[bc];W[eb](;B[dc];W[da])(;B[db]))";
+    const string texts[2] = {squareSgf,rectSgf};
+    for(int k = 0; k<2; k++) {
+      std::unique_ptr<Sgf> original(Sgf::parse(texts[k]));
+      XYSize origSize = original->getXYSize();
+      int numSymmetries = SymmetryHelpers::getNumSymmetries(origSize.x,origSize.y);
+      testAssert(numSymmetries == (k == 0 ? 8 : 4));
+
+      bool hashComments = false;
+      bool flipIfPassOrWFirst = false;
+      bool allowGameOver = false;
+      for(int hashParent = 0; hashParent <= 1; hashParent++) {
+        std::set<Hash128> sharedDedup;
+        std::set<Hash128> sharedNoDedup;
+        size_t numOriginal = 0;
+        size_t numOriginalNoDedup = 0;
+        for(int sym = 0; sym<numSymmetries; sym++) {
+          std::unique_ptr<Sgf> copy(Sgf::parse(getSymmetricSgfText(texts[k],origSize.x,origSize.y,sym)));
+          XYSize copySize = copy->getXYSize();
+          testAssert(copySize.x == origSize.x && copySize.y == origSize.y);
+
+          vector<PositionSample> alone;
+          std::set<Hash128> aloneDedup;
+          copy->loadAllUniquePositions(aloneDedup,hashComments,hashParent != 0,true,flipIfPassOrWFirst,allowGameOver,NULL,alone);
+          vector<PositionSample> shared;
+          copy->loadAllUniquePositions(sharedDedup,hashComments,hashParent != 0,true,flipIfPassOrWFirst,allowGameOver,NULL,shared);
+          vector<PositionSample> sharedNoSym;
+          copy->loadAllUniquePositions(sharedNoDedup,hashComments,hashParent != 0,false,flipIfPassOrWFirst,allowGameOver,NULL,sharedNoSym);
+
+          if(sym == 0) {
+            numOriginal = alone.size();
+            numOriginalNoDedup = sharedNoSym.size();
+            testAssert(numOriginal > 5);
+            testAssert(shared.size() == numOriginal);
+          }
+          else {
+            testAssert(alone.size() == numOriginal);
+            testAssert(shared.size() == 0);
+            //Only the empty board and other positions that are themselves symmetric collide without the dedup
+            testAssert(sharedNoSym.size() > 0);
+            testAssert(sharedNoSym.size() < numOriginalNoDedup);
+          }
+          for(size_t i = 0; i<alone.size(); i++) {
+            PositionSample canonical = alone[i].getSymmetric(alone[i].symmetry);
+            testAssert(canonical.symmetry == 0);
+          }
+        }
+        testAssert(sharedDedup.size() == numOriginal);
+        testAssert(sharedNoDedup.size() > numOriginal);
+      }
+    }
   }
-  out << ")";
 }
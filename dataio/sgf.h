@@ -1,7 +1,10 @@
 #ifndef DATAIO_SGF_H_
 #define DATAIO_SGF_H_
 
+#include <fstream>
+
 #include "../core/global.h"
+#include "../core/concurrenthashset.h"
 #include "../core/hash.h"
 #include "../core/rand.h"
 #include "../dataio/trainingwrite.h"
@@ -11,8 +14,38 @@
 STRUCT_NAMED_TRIPLE(uint8_t,x,uint8_t,y,Player,pla,MoveNoBSize);
 STRUCT_NAMED_PAIR(int,x,int,y,XYSize);
 
+//A property of an SgfNode and its values, such as AB[aa][bb].
+//The first value is stored inline, since almost every property has only one.
+struct SgfProp {
+  //See getKeyCode
+  uint64_t keyCode;
+  std::string value;
+  std::vector<std::string> moreValues;
+
+  SgfProp();
+  SgfProp(uint64_t keyCode, const std::string& value);
+  ~SgfProp();
+
+  size_t numValues() const;
+  const std::string& getValue(size_t idx) const;
+  std::vector<std::string> getValues() const;
+  void addValue(const std::string& v);
+
+  //Property keys are identified by integer codes so that lookups don't need to compare strings.
+  //Keys of up to 7 characters, which is all of the standard ones, are packed directly into the code, while longer keys
+  //are interned in a process-wide table. Thread-safe.
+  static uint64_t getKeyCode(const char* key);
+  static uint64_t getKeyCode(const std::string& key);
+  //Same as getKeyCode, except returns false instead of interning a long key that hasn't been seen before, in which
+  //case no property can have that key.
+  static bool tryGetKeyCode(const char* key, uint64_t& buf);
+  static std::string getKey(uint64_t keyCode);
+};
+
 struct SgfNode {
-  std::map<std::string,std::vector<std::string>>* props;
+  //All properties of the node other than the move, in the order they first appear.
+  //Nodes have only a few properties, so these are scanned linearly rather than kept in a map.
+  std::vector<SgfProp> props;
   MoveNoBSize move;
 
   SgfNode();
@@ -30,6 +63,11 @@ struct SgfNode {
   std::string getSingleProperty(const std::string& key) const;
   const std::vector<std::string> getProperties(const char* key) const;
   const std::vector<std::string> getProperties(const std::string& key) const;
+  //Returns NULL if the node doesn't have the property
+  const SgfProp* findProperty(const char* key) const;
+  const SgfProp* findProperty(uint64_t keyCode) const;
+  //Appends a value to the property, adding the property if not already present
+  void addPropertyValue(uint64_t keyCode, const std::string& value);
 
   bool hasPlacements() const;
   void accumPlacements(std::vector<Move>& moves, int xSize, int ySize) const;
@@ -40,6 +78,33 @@ struct SgfNode {
   Player getSgfWinner() const;
 };
 
+class ConfigParser;
+
+//How Sgf::hash is computed from the text of an sgf.
+//SHA256 is the default and matches the hashes from earlier versions, such as those saved in files of hashes to exclude.
+//FAST is MurmurHash3, which is far cheaper when loading many small sgfs and is fine for telling sgfs apart, but gives
+//different values and is not resistant to deliberately constructed collisions.
+enum class SgfHashMode { SHA256, FAST };
+
+//Options for the parallel loading functions of Sgf and CompactSgf
+struct SgfLoadOptions {
+  //Number of worker threads reading and parsing files
+  int numThreads = 1;
+  //If true, results are returned in the order of the input files. Otherwise, in whatever order they finish.
+  bool ordered = true;
+  //Maximum number of files that may be claimed by workers but not yet handed back to the caller.
+  //Bounds memory when results are consumed as they arrive, particularly when ordered and a slow file holds up the rest.
+  int maxInFlight = 256;
+  SgfHashMode hashMode = SgfHashMode::SHA256;
+};
+
+//A file that was skipped by one of the parallel loading functions
+struct SgfLoadError {
+  size_t fileIdx;
+  std::string file;
+  std::string message;
+};
+
 struct Sgf {
   static constexpr int RANK_UNKNOWN = -100000;
 
@@ -54,12 +119,56 @@ struct Sgf {
   Sgf(const Sgf&) = delete;
   Sgf& operator=(const Sgf&) = delete;
 
-  static Sgf* parse(const std::string& str);
-  static Sgf* loadFile(const std::string& file);
+  static Sgf* parse(const std::string& str, SgfHashMode hashMode = SgfHashMode::SHA256);
+  static Sgf* loadFile(const std::string& file, SgfHashMode hashMode = SgfHashMode::SHA256);
   static std::vector<Sgf*> loadFiles(const std::vector<std::string>& files);
-  static std::vector<Sgf*> loadSgfsFile(const std::string& file);
+  static std::vector<Sgf*> loadSgfsFile(const std::string& file, SgfHashMode hashMode = SgfHashMode::SHA256);
   static std::vector<Sgf*> loadSgfsFiles(const std::vector<std::string>& files);
 
+  //The hash of the text of an sgf, as stored in Sgf::hash. With SHA256, only the text up to any null char is hashed.
+  static Hash128 computeHash(const char* str, size_t len, SgfHashMode hashMode);
+  //Parses "sha256" or "fast", throws StringError for anything else.
+  static SgfHashMode parseHashMode(const std::string& s);
+  //Reads the hash mode from the config key "sgfHashMode", defaulting to SHA256 if unspecified.
+  static SgfHashMode getHashModeFromConfig(ConfigParser& cfg);
+
+  //Parallel versions of the above. Files that fail to load with an IOError are skipped and appended to errors,
+  //rather than printed. Nothing is printed.
+  static std::vector<Sgf*> loadFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors
+  );
+  static std::vector<Sgf*> loadSgfsFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors
+  );
+  //Streaming versions - instead of returning everything at once, f is called on the calling thread with each
+  //result as it becomes available, along with the index of the file it came from, and takes ownership of the result.
+  static void loadFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,Sgf*)> f
+  );
+  static void loadSgfsFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,std::vector<Sgf*>&)> f
+  );
+  //Streams the sgfs in a single .sgfs file, parsing them using options.numThreads threads, without holding the
+  //whole file in memory. f is called on the calling thread with each sgf and the index of the game within the file,
+  //counting only nonblank lines. Lines that fail to parse are skipped and appended to errors, with fileIdx set to
+  //that same index of the game within the file.
+  static void iterSgfsFileParallel(
+    const std::string& file, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,Sgf*)> f
+  );
+  //Loads files using options.numThreads threads, loading files ending in ".sgfs" as multiple sgfs per file, but calls f
+  //on the worker thread that loaded each sgf rather than on the calling thread, for work that is itself worth
+  //parallelizing. f gets the index of that worker in [0,options.numThreads), so it can keep per-thread state without
+  //locking, along with the index of the file and the index of the sgf within the file. f may modify or move from the
+  //sgf, which is deleted afterward. Files that fail to load are skipped and appended to errors, as are sgfs for which
+  //f throws a StringError. options.ordered is ignored.
+  static void iterFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(int,size_t,size_t,Sgf&)> f
+  );
+
   XYSize getXYSize() const;
   float getKomi() const;
   bool hasRules() const;
@@ -100,12 +209,30 @@ struct Sgf {
     std::string metadata;
     //Scaling of training weight in the training data
     double trainingWeight = 1.0;
+    //For samples from a dedup up to symmetry, the symmetry (see SymmetryHelpers) that maps this sample onto the
+    //orientation whose hash was used for the dedup, so that equivalent samples can be brought to the same orientation.
+    //Otherwise 0.
+    int symmetry = 0;
 
     static std::string toJsonLine(const PositionSample& sample);
     static PositionSample ofJsonLine(const std::string& s);
 
+    //Compact binary encoding, as an alternative to the json lines for large files of samples, see
+    //PositionSampleFileReader. Records are little-endian and begin with their length, followed by the board at 2 bits
+    //per point and the moves at 2 bytes each. Appends one record to buf.
+    static void appendBinary(const PositionSample& sample, std::string& buf);
+    //Decodes the record at the start of data into sampleBuf, returning the number of bytes it took up.
+    //Throws StringError if the record is truncated or invalid.
+    static size_t ofBinary(const char* data, size_t len, PositionSample& sampleBuf);
+    //Every file of binary records begins with this header
+    static void appendBinaryFileHeader(std::string& buf);
+    static constexpr size_t BINARY_FILE_HEADER_LEN = 16;
+
     //Return a copy of this sample with all player stones and moves flipped to the opposite color
     Sgf::PositionSample getColorFlipped() const;
+    //Return a copy of this sample with the board, moves, and hint transformed by the symmetry, with the symmetry field
+    //updated to still map onto the same orientation as before.
+    Sgf::PositionSample getSymmetric(int symmetry) const;
 
     //Return a copy of this sample except one move earlier
     Sgf::PositionSample previousPosition(double newWeight) const;
@@ -116,6 +243,8 @@ struct Sgf {
     //For the moment, only used in testing since it does extra consistency checks.
     //If we need a version to be used in "prod", we could make an efficient version maybe as operator==.
     bool isEqualForTesting(const PositionSample& other, bool checkNumCaptures, bool checkSimpleKo) const;
+
+    static void runTests();
   };
 
   //Loads SGF all unique positions in ALL branches of that SGF.
@@ -124,10 +253,13 @@ struct Sgf {
   //May raise an exception on illegal moves or other SGF issues, only partially appending things on to the boards and hists.
   //If rand is provided, will randomize order of iteration through the SGF.
   //If hashParent is true, will determine uniqueness by the combination of parent hash and own hash.
+  //If dedupSymmetries is true, positions that are rotations or reflections of each other also count as identical,
+  //and each sample records the symmetry that maps it onto the orientation that was hashed.
   void loadAllUniquePositions(
     std::set<Hash128>& uniqueHashes,
     bool hashComments,
     bool hashParent,
+    bool dedupSymmetries,
     bool flipIfPassOrWFirst,
     bool allowGameOver,
     Rand* rand,
@@ -138,12 +270,55 @@ struct Sgf {
     std::set<Hash128>& uniqueHashes,
     bool hashComments,
     bool hashParent,
+    bool dedupSymmetries,
+    bool flipIfPassOrWFirst,
+    bool allowGameOver,
+    Rand* rand,
+    std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+  ) const;
+  //Same as above, but with a uniqueness filter that can be shared with other threads processing other sgfs at the same time.
+  //Which sgf gets to yield a position that occurs in several of them then depends on the timing of the threads.
+  void loadAllUniquePositions(
+    ConcurrentHash128Set& uniqueHashes,
+    bool hashComments,
+    bool hashParent,
+    bool dedupSymmetries,
+    bool flipIfPassOrWFirst,
+    bool allowGameOver,
+    Rand* rand,
+    std::vector<PositionSample>& samples
+  ) const;
+  void iterAllUniquePositions(
+    ConcurrentHash128Set& uniqueHashes,
+    bool hashComments,
+    bool hashParent,
+    bool dedupSymmetries,
     bool flipIfPassOrWFirst,
     bool allowGameOver,
     Rand* rand,
     std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
   ) const;
 
+  //Runs iterAllUniquePositions on every sgf in files using numThreads threads sharing uniqueHashes, loading files
+  //ending in ".sgfs" as multiple sgfs per file. Each file is loaded and freed by the thread that processes it.
+  //f is called on the worker threads, possibly concurrently, along with the index of the file, so must be thread-safe.
+  //If randSeed is nonempty, randomizes the order of iteration through each sgf, deterministically per sgf.
+  //Files that fail to load, and sgfs with illegal moves or other problems, are skipped and appended to errors. Positions
+  //yielded from an sgf before such a problem was found are not retracted.
+  static void iterAllUniquePositionsParallel(
+    const std::vector<std::string>& files,
+    ConcurrentHash128Set& uniqueHashes,
+    bool hashComments,
+    bool hashParent,
+    bool dedupSymmetries,
+    bool flipIfPassOrWFirst,
+    bool allowGameOver,
+    const std::string& randSeed,
+    int numThreads,
+    std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,PositionSample&,const BoardHistory&,const std::string&)> f
+  );
+
   //Same as iterAllUniquePositions, but without the uniqueness. Will re-traverse same positions if they
   //occur multiple times in the SGF.
   //f is allowed to mutate and consume sample.
@@ -156,36 +331,71 @@ struct Sgf {
 
   static std::set<Hash128> readExcludes(const std::vector<std::string>& files);
 
+  static void runTests();
+
   private:
   void getMovesHelper(std::vector<Move>& moves, int xSize, int ySize) const;
 
 
+  void iterAllUniquePositionsHelper(
+    const std::function<bool(Hash128)>& tryInsertUnique,
+    bool hashComments,
+    bool hashParent,
+    bool dedupSymmetries,
+    bool flipIfPassOrWFirst,
+    bool allowGameOver,
+    Rand* rand,
+    std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+  ) const;
+  //Log of the changes made to the board and history while walking variations, so that they can be undone on returning
+  //from each variation and a single board and history can be shared by all of them.
+  struct VariationUndoLog;
+  //If not useUndoLog, each variation but the last is instead walked on its own copy of the board and history, for
+  //testing that the undo log changes nothing.
+  void iterAllPositionsStart(
+    const std::function<bool(Hash128)>& tryInsertUnique,
+    bool requireUnique,
+    bool hashComments,
+    bool hashParent,
+    bool dedupSymmetries,
+    bool flipIfPassOrWFirst,
+    bool allowGameOver,
+    bool useUndoLog,
+    Rand* rand,
+    const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
+  ) const;
+  //tryInsertUnique should add the hash to the set of positions seen and return true if it wasn't already there.
+  //If logForUndo, every change to board and hist is recorded in undoLog so that the caller can revert it afterward.
   void iterAllPositionsHelper(
     Board& board, BoardHistory& hist, Player nextPla,
     const Rules& rules, int xSize, int ySize,
     PositionSample& sampleBuf,
-    std::set<Hash128>& uniqueHashes,
+    const std::function<bool(Hash128)>& tryInsertUnique,
     bool requireUnique,
     bool hashComments,
     bool hashParent,
+    bool dedupSymmetries,
     bool flipIfPassOrWFirst,
     bool allowGameOver,
     bool isRoot,
+    bool logForUndo,
     Rand* rand,
     std::vector<std::pair<int64_t,int64_t>>& variationTraceNodesBranch,
-    std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+    VariationUndoLog& undoLog,
+    const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
   ) const;
   void samplePositionHelper(
     Board& board, BoardHistory& hist, Player nextPla,
     PositionSample& sampleBuf,
-    std::set<Hash128>& uniqueHashes,
+    const std::function<bool(Hash128)>& tryInsertUnique,
     bool requireUnique,
     bool hashComments,
     bool hashParent,
+    bool dedupSymmetries,
     bool flipIfPassOrWFirst,
     bool allowGameOver,
     const std::string& comments,
-    std::function<void(PositionSample&,const BoardHistory&,const std::string&)> f
+    const std::function<void(PositionSample&,const BoardHistory&,const std::string&)>& f
   ) const;
 };
 
@@ -201,6 +411,8 @@ struct CompactSgf {
   Player sgfWinner;
   Hash128 hash;
 
+  //Empty, for filling in directly
+  CompactSgf();
   CompactSgf(const Sgf* sgf);
   CompactSgf(Sgf&& sgf);
   ~CompactSgf();
@@ -208,9 +420,22 @@ struct CompactSgf {
   CompactSgf(const CompactSgf&) = delete;
   CompactSgf& operator=(const CompactSgf&) = delete;
 
-  static CompactSgf* parse(const std::string& str);
-  static CompactSgf* loadFile(const std::string& file);
+  static CompactSgf* parse(const std::string& str, SgfHashMode hashMode = SgfHashMode::SHA256);
+  static CompactSgf* loadFile(const std::string& file, SgfHashMode hashMode = SgfHashMode::SHA256);
   static std::vector<CompactSgf*> loadFiles(const std::vector<std::string>& files);
+  //Parallel versions, see Sgf::loadFilesParallel
+  static std::vector<CompactSgf*> loadFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors
+  );
+  static void loadFilesParallel(
+    const std::vector<std::string>& files, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,CompactSgf*)> f
+  );
+  //See Sgf::iterSgfsFileParallel
+  static void iterSgfsFileParallel(
+    const std::string& file, const SgfLoadOptions& options, std::vector<SgfLoadError>& errors,
+    std::function<void(size_t,CompactSgf*)> f
+  );
 
   bool hasRules() const;
   Rules getRulesOrFail() const;
@@ -225,6 +450,231 @@ struct CompactSgf {
   void setupBoardAndHistTolerant(const Rules& initialRules, Board& board, Player& nextPla, BoardHistory& hist, int64_t turnIdx, bool preventEncore) const;
 };
 
+//Reads the games of a .sgfs file (one sgf per line) one at a time, for files too large to load all at once.
+//Lines are trimmed and blank lines skipped, same as Sgf::loadSgfsFile. NOT thread-safe.
+struct SgfsFileReader {
+  SgfsFileReader(const std::string& file, SgfHashMode hashMode = SgfHashMode::SHA256);
+  ~SgfsFileReader();
+
+  SgfsFileReader(const SgfsFileReader&) = delete;
+  SgfsFileReader& operator=(const SgfsFileReader&) = delete;
+
+  //Returns the next game, or NULL once the end of the file is reached. Throws IOError if the game fails to parse,
+  //after which reading may continue with the next game.
+  Sgf* next();
+  CompactSgf* nextCompact();
+  //Reads the next game as unparsed text into buf, returns false once the end of the file is reached.
+  bool nextLine(std::string& buf);
+
+  //Number of games read so far, including any that failed to parse
+  int64_t getNumGamesRead() const;
+
+ private:
+  std::string file;
+  std::ifstream in;
+  std::vector<char> streamBuf;
+  std::string lineBuf;
+  int64_t numGamesRead;
+  SgfHashMode hashMode;
+};
+
+//Reads a file of Sgf::PositionSample binary records one at a time. NOT thread-safe.
+struct PositionSampleFileReader {
+  //Throws IOError if the file cannot be opened or does not begin with the binary file header.
+  PositionSampleFileReader(const std::string& file);
+  ~PositionSampleFileReader();
+
+  PositionSampleFileReader(const PositionSampleFileReader&) = delete;
+  PositionSampleFileReader& operator=(const PositionSampleFileReader&) = delete;
+
+  //Reads the next sample into sampleBuf, returns false once the end of the file is reached.
+  //Throws IOError if the record is truncated or invalid.
+  bool next(Sgf::PositionSample& sampleBuf);
+
+  int64_t getNumSamplesRead() const;
+
+  //Whether the file begins with the binary file header, as opposed to being json lines.
+  static bool isBinaryFile(const std::string& file);
+
+ private:
+  std::string file;
+  std::ifstream in;
+  std::vector<char> streamBuf;
+  std::string recordBuf;
+  int64_t numSamplesRead;
+};
+
+//Sgf whose text is only scanned up front for the structure of the game tree, matching parentheses and brackets to
+//find where each node and variation starts, with nodes parsed into SgfNodes only when accessed. For consumers that
+//need only the root properties or the main line, such as filtering a corpus by rank, size or rules, this skips
+//parsing the properties of everything else. For an sgf with no variations, parsing the main line costs a little
+//more than Sgf::parse due to the extra scan.
+//Malformed properties are only detected when their node is parsed, so unlike Sgf::parse, parse succeeds on some
+//inputs that have errors in nodes that are never accessed. Accessing such a node throws the same IOError instead.
+//NOT thread-safe, even for const functions, since parsing on access fills in caches.
+struct LazySgf {
+  std::string fileName;
+
+  LazySgf();
+  ~LazySgf();
+
+  LazySgf(const LazySgf&) = delete;
+  LazySgf& operator=(const LazySgf&) = delete;
+
+  //Throws IOError if the structure of the sgf is malformed.
+  static LazySgf* parse(const std::string& str, SgfHashMode hashMode = SgfHashMode::SHA256);
+  static LazySgf* parse(std::string&& str, SgfHashMode hashMode = SgfHashMode::SHA256);
+  static LazySgf* loadFile(const std::string& file, SgfHashMode hashMode = SgfHashMode::SHA256);
+
+  //Same as Sgf::hash, computed on first use since it requires hashing the entire text.
+  Hash128 getHash();
+  const SgfNode& getRootNode();
+
+  //Same as the corresponding functions of Sgf, parsing only the root node.
+  XYSize getXYSize();
+  float getKomi();
+  bool hasRules();
+  Rules getRulesOrFail();
+  int getHandicapValue();
+  Player getSgfWinner();
+  int getRank(Player pla);
+  int getRating(Player pla);
+  std::string getPlayerName(Player pla);
+  std::string getRootPropertyWithDefault(const std::string& property, const std::string& defaultRet);
+
+  //Same as the corresponding functions of Sgf, known from the scan without parsing any nodes.
+  int64_t depth() const;
+  int64_t nodeCount() const;
+  int64_t branchCount() const;
+
+  //Parses only the line that Sgf::getMoves follows, taking the deepest variation at every fork, into a new Sgf
+  //consisting of that line alone, with no siblings at any level.
+  Sgf* parseMainLine();
+  //Same as CompactSgf::parse on the text, parsing only the main line.
+  CompactSgf* toCompactSgf();
+  //Parses everything, same as Sgf::parse on the text.
+  Sgf* toSgf() const;
+
+ private:
+  struct Tree {
+    //Range in nodeOffsets of the tree's own nodes
+    uint32_t nodesBegin;
+    uint32_t nodesEnd;
+    //Range in childTreeIdxs of the indices of its child trees
+    uint32_t childrenBegin;
+    uint32_t childrenEnd;
+    int64_t depth;
+    int64_t nodeCount;
+    int64_t branchCount;
+  };
+
+  std::string text;
+  //Tree 0 is the root
+  std::vector<Tree> trees;
+  //Offset in the text of the ';' starting each node
+  std::vector<uint32_t> nodeOffsets;
+  std::vector<uint32_t> childTreeIdxs;
+
+  //Just the root node, so that the root accessors of Sgf can be reused
+  Sgf* rootSgf;
+  SgfHashMode hashMode;
+  bool hashComputed;
+  Hash128 hash;
+
+  void scan();
+  uint32_t scanTree(int& pos);
+  SgfNode* parseNode(const Tree& tree, uint32_t nodeIdx) const;
+  Sgf* getRootSgf();
+};
+
+//Fast read-only parse of an sgf, for bulk processing of large corpora.
+//Rather than building an Sgf with a heap-allocated node and property map per node, parsing only records the structure
+//of the sgf as offsets into the original text, in flat arrays that are reused across calls to parse. Property values
+//are left exactly as written and are unescaped only when requested.
+//Accepts and rejects exactly the same inputs as Sgf::parse.
+struct SgfView {
+  //Offsets into the text rather than pointers, so that they stay valid if the text is an owned buffer that moves.
+  struct Span {
+    uint32_t start;
+    uint32_t len;
+  };
+  struct Value {
+    //The raw text between the brackets
+    Span span;
+    //False if the raw text is already identical to the decoded value (no escapes, newlines or tabs)
+    bool needsDecoding;
+  };
+  struct Prop {
+    Span key;
+    //Sgf permits whitespace between the letters of a key, in which case it must be skipped when reading key
+    bool keyHasWhitespace;
+    uint32_t valuesBegin;
+    uint32_t valuesEnd;
+  };
+  struct Node {
+    uint32_t propsBegin;
+    uint32_t propsEnd;
+  };
+  struct Tree {
+    //A tree's own nodes are contiguous in the node array
+    uint32_t nodesBegin;
+    uint32_t nodesEnd;
+    //Range in the child index array of the indices of its child trees
+    uint32_t childrenBegin;
+    uint32_t childrenEnd;
+  };
+
+  //The text, either borrowed from the caller of parse or owned by this view if parsed via parseFile
+  const char* text;
+  size_t textLen;
+  std::string ownedText;
+
+  //Tree 0 is the root
+  std::vector<Tree> trees;
+  std::vector<Node> nodes;
+  std::vector<Prop> props;
+  std::vector<Value> values;
+  std::vector<uint32_t> childTreeIdxs;
+
+  SgfView();
+  ~SgfView();
+
+  SgfView(const SgfView&) = delete;
+  SgfView& operator=(const SgfView&) = delete;
+
+  //Parse the given text, which must remain alive and unmodified for as long as this view is used.
+  //Throws IOError if the sgf is malformed.
+  void parse(const char* str, size_t len);
+  void parse(const std::string& str);
+  //Read the file into a buffer owned by this view and parse it.
+  void parseFile(const std::string& file);
+
+  bool keyEquals(const Prop& prop, const char* key) const;
+  std::string getKey(const Prop& prop) const;
+  //Returns the index of the first property of the node with the given key, or -1 if none.
+  int64_t findProp(size_t nodeIdx, const char* key) const;
+
+  //Pointer to the raw text of the value, which has length value.span.len and is NOT null-terminated.
+  const char* getRawValue(const Value& value) const;
+  //The value as Sgf would store it, with escapes removed and whitespace normalized.
+  std::string decodeValue(const Value& value) const;
+  void decodeValue(const Value& value, std::string& buf) const;
+
+  //Same as the hash that Sgf::parse would compute for this text.
+  Hash128 computeHash(SgfHashMode hashMode = SgfHashMode::SHA256) const;
+  //Build the equivalent Sgf, identical to what Sgf::parse would return for this text.
+  Sgf* toSgf(SgfHashMode hashMode = SgfHashMode::SHA256) const;
+
+ private:
+  std::vector<uint32_t> childTreeIdxStack;
+
+  [[noreturn]] void fail(const char* msg, size_t pos) const;
+  char peekSgfChar(size_t pos, size_t& newPos) const;
+  void parseTree(size_t& pos);
+  bool maybeParseProp(size_t& pos, bool& nodeHasMove);
+  Sgf* toSgfHelper(uint32_t treeIdx, std::string& buf) const;
+};
+
 namespace WriteSgf {
   //Write an SGF with no newlines to the given ostream.
   //If startTurnIdx >= 0, write a comment in the SGF root node indicating startTurnIdx, so as to
@@ -247,6 +697,24 @@ namespace WriteSgf {
     double overrideFinishedWhiteScore
   );
 
+  //Same as writeSgf, but appends the SGF to buf rather than writing to an ostream.
+  //Reusing the same buf across many games (clearing it in between) avoids any allocation once it is large enough.
+  void appendSgf(
+    std::string& buf, const std::string& bName, const std::string& wName,
+    const BoardHistory& endHist,
+    const FinishedGameData* gameData,
+    bool tryNicerRulesString,
+    bool omitResignPlayerMove
+  );
+  void appendSgf(
+    std::string& buf, const std::string& bName, const std::string& wName,
+    const BoardHistory& endHist,
+    const FinishedGameData* gameData,
+    bool tryNicerRulesString,
+    bool omitResignPlayerMove,
+    double overrideFinishedWhiteScore
+  );
+
   //If hist is a finished game, print the result to out along with SGF tag, else do nothing
   void printGameResult(std::ostream& out, const BoardHistory& hist);
   void printGameResult(std::ostream& out, const BoardHistory& hist, double overrideFinishedWhiteScore);
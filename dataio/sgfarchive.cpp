@@ -0,0 +1,739 @@
+#include "../dataio/sgfarchive.h"
+
+#include <cstring>
+#include <zlib.h>
+
+#include "../core/fileutils.h"
+#include "../core/test.h"
+
+//------------------------
+#include "../core/using.h"
+//------------------------
+
+using SgfArchive::FileHeader;
+using SgfArchive::BlockIndexEntry;
+using SgfArchive::HashIndexEntry;
+using SgfArchive::GameHeader;
+
+static_assert(sizeof(FileHeader) == 56, "Unexpected padding in SgfArchive::FileHeader");
+static_assert(sizeof(BlockIndexEntry) == 40, "Unexpected padding in SgfArchive::BlockIndexEntry");
+static_assert(sizeof(HashIndexEntry) == 24, "Unexpected padding in SgfArchive::HashIndexEntry");
+static_assert(sizeof(GameHeader) == 56, "Unexpected padding in SgfArchive::GameHeader");
+
+static const char SGF_ARCHIVE_MAGIC[8] = {'K','G','S','G','F','A','R','C'};
+
+//Everything in the file, and every column within a block, starts at a multiple of this
+static const size_t SGF_ARCHIVE_ALIGN = 8;
+
+static size_t roundUpToAlign(size_t x) {
+  return (x + SGF_ARCHIVE_ALIGN - 1) / SGF_ARCHIVE_ALIGN * SGF_ARCHIVE_ALIGN;
+}
+
+static bool hashIndexEntryLess(const HashIndexEntry& a, const HashIndexEntry& b) {
+  if(a.hash0 != b.hash0)
+    return a.hash0 < b.hash0;
+  if(a.hash1 != b.hash1)
+    return a.hash1 < b.hash1;
+  return a.gameIdx < b.gameIdx;
+}
+
+uint16_t SgfArchive::packMove(Move move, int xSize, int ySize) {
+  if(xSize * ySize >= PACKED_PASS)
+    throw StringError("SgfArchive: board too large to pack moves");
+  if(move.pla < 0 || move.pla > 3)
+    throw StringError("SgfArchive: invalid player for move");
+  uint16_t pos;
+  if(move.loc == Board::PASS_LOC)
+    pos = PACKED_PASS;
+  else {
+    int x = Location::getX(move.loc,xSize);
+    int y = Location::getY(move.loc,xSize);
+    if(x < 0 || x >= xSize || y < 0 || y >= ySize)
+      throw StringError("SgfArchive: move is off the board");
+    pos = (uint16_t)(y * xSize + x);
+  }
+  return (uint16_t)(((uint16_t)move.pla << 14) | pos);
+}
+
+Move SgfArchive::unpackMove(uint16_t packed, int xSize, int ySize) {
+  Player pla = (Player)(packed >> 14);
+  int pos = packed & PACKED_PASS;
+  if(pos == PACKED_PASS)
+    return Move(Board::PASS_LOC,pla);
+  if(pos >= xSize * ySize)
+    throw IOError("SgfArchive: corrupt move");
+  return Move(Location::getLoc(pos % xSize, pos / xSize, xSize),pla);
+}
+
+//------------------------------------------------------------------------------------------------------------
+
+static void appendUInt32(string& buf, uint32_t x) {
+  buf.append((const char*)&x, sizeof(x));
+}
+static void appendString(string& buf, const string& s) {
+  if(s.size() > 0xFFFFFFFFULL)
+    throw StringError("SgfArchive: string too long");
+  appendUInt32(buf,(uint32_t)s.size());
+  buf.append(s);
+}
+
+//Reads sequentially from the extra data of a game, failing rather than reading past the end
+struct SgfArchiveExtraReader {
+  const char* p;
+  const char* end;
+
+  uint32_t readUInt32() {
+    if(end - p < (ptrdiff_t)sizeof(uint32_t))
+      throw IOError("SgfArchive: corrupt game data");
+    uint32_t x;
+    std::memcpy(&x,p,sizeof(x));
+    p += sizeof(x);
+    return x;
+  }
+  uint8_t readUInt8() {
+    if(end - p < 1)
+      throw IOError("SgfArchive: corrupt game data");
+    return (uint8_t)*(p++);
+  }
+  void readString(string& buf) {
+    uint32_t len = readUInt32();
+    if((size_t)(end - p) < len)
+      throw IOError("SgfArchive: corrupt game data");
+    buf.assign(p,len);
+    p += len;
+  }
+};
+
+Hash128 SgfArchiveGameView::getHash() const {
+  return Hash128(header->hash0,header->hash1);
+}
+int SgfArchiveGameView::getXSize() const {
+  return header->xSize;
+}
+int SgfArchiveGameView::getYSize() const {
+  return header->ySize;
+}
+size_t SgfArchiveGameView::getNumPlacements() const {
+  return header->numPlacements;
+}
+size_t SgfArchiveGameView::getNumMoves() const {
+  return header->numMoves;
+}
+Move SgfArchiveGameView::getPlacement(size_t idx) const {
+  return SgfArchive::unpackMove(packedPlacements[idx],header->xSize,header->ySize);
+}
+Move SgfArchiveGameView::getMove(size_t idx) const {
+  return SgfArchive::unpackMove(packedMoves[idx],header->xSize,header->ySize);
+}
+
+CompactSgf* SgfArchiveGameView::toCompactSgf() const {
+  CompactSgf* sgf = new CompactSgf();
+  try {
+    sgf->xSize = header->xSize;
+    sgf->ySize = header->ySize;
+    sgf->depth = header->depth;
+    sgf->komi = header->komi;
+    sgf->sgfWinner = (Player)header->sgfWinner;
+    sgf->hash = getHash();
+    sgf->placements.resize(header->numPlacements);
+    for(size_t i = 0; i<header->numPlacements; i++)
+      sgf->placements[i] = getPlacement(i);
+    sgf->moves.resize(header->numMoves);
+    for(size_t i = 0; i<header->numMoves; i++)
+      sgf->moves[i] = getMove(i);
+
+    SgfArchiveExtraReader reader;
+    reader.p = extra;
+    reader.end = extra + header->extraLen;
+    reader.readString(sgf->fileName);
+    uint8_t moveX = reader.readUInt8();
+    uint8_t moveY = reader.readUInt8();
+    uint8_t movePla = reader.readUInt8();
+    sgf->rootNode.move = MoveNoBSize(moveX,moveY,(Player)movePla);
+    uint32_t numProps = reader.readUInt32();
+    string key;
+    string value;
+    for(uint32_t i = 0; i<numProps; i++) {
+      reader.readString(key);
+      uint64_t keyCode = SgfProp::getKeyCode(key);
+      uint32_t numValues = reader.readUInt32();
+      for(uint32_t j = 0; j<numValues; j++) {
+        reader.readString(value);
+        sgf->rootNode.addPropertyValue(keyCode,value);
+      }
+    }
+  }
+  catch(...) {
+    delete sgf;
+    throw;
+  }
+  return sgf;
+}
+
+SgfArchiveBlockBuf::SgfArchiveBlockBuf()
+  :reader(NULL),blockIdx(-1),data()
+{}
+
+//------------------------------------------------------------------------------------------------------------
+
+SgfArchiveWriter::SgfArchiveWriter(const string& f, bool c, int g)
+  :file(f),
+   out(),
+   compress(c),
+   gamesPerBlock(g),
+   closed(false),
+   numGames(0),
+   filePos(0),
+   blockHeaders(),
+   blockMoves(),
+   blockExtra(),
+   blockIndex(),
+   hashIndex()
+{
+  if(gamesPerBlock <= 0)
+    throw StringError("SgfArchiveWriter: gamesPerBlock must be positive");
+  FileUtils::open(out,file,std::ios::out | std::ios::binary | std::ios::trunc);
+  //Placeholder, filled in on close
+  FileHeader header;
+  std::memset(&header,0,sizeof(header));
+  writeBytes(&header,sizeof(header));
+}
+
+SgfArchiveWriter::~SgfArchiveWriter() {
+}
+
+int64_t SgfArchiveWriter::getNumGames() const {
+  return (int64_t)numGames;
+}
+
+void SgfArchiveWriter::writeBytes(const void* data, size_t len) {
+  out.write((const char*)data,len);
+  if(!out.good())
+    throw IOError("SgfArchiveWriter: error writing " + file);
+  filePos += len;
+}
+
+void SgfArchiveWriter::add(const CompactSgf& sgf) {
+  if(closed)
+    throw StringError("SgfArchiveWriter: add called after close");
+  if(sgf.xSize <= 0 || sgf.ySize <= 0 || sgf.xSize > 255 || sgf.ySize > 255)
+    throw StringError("SgfArchiveWriter: invalid board size");
+  if(blockMoves.size() + sgf.placements.size() + sgf.moves.size() > 0x7FFFFFFFULL)
+    throw StringError("SgfArchiveWriter: too many moves in one block");
+
+  GameHeader header;
+  std::memset(&header,0,sizeof(header));
+  header.hash0 = sgf.hash.hash0;
+  header.hash1 = sgf.hash.hash1;
+  header.depth = sgf.depth;
+  header.komi = sgf.komi;
+  header.movesBegin = (uint32_t)blockMoves.size();
+  header.numPlacements = (uint32_t)sgf.placements.size();
+  header.numMoves = (uint32_t)sgf.moves.size();
+  header.xSize = (uint8_t)sgf.xSize;
+  header.ySize = (uint8_t)sgf.ySize;
+  header.sgfWinner = (int8_t)sgf.sgfWinner;
+
+  size_t oldNumMoves = blockMoves.size();
+  size_t oldExtraSize = blockExtra.size();
+  try {
+    for(size_t i = 0; i<sgf.placements.size(); i++)
+      blockMoves.push_back(SgfArchive::packMove(sgf.placements[i],sgf.xSize,sgf.ySize));
+    for(size_t i = 0; i<sgf.moves.size(); i++)
+      blockMoves.push_back(SgfArchive::packMove(sgf.moves[i],sgf.xSize,sgf.ySize));
+
+    appendString(blockExtra,sgf.fileName);
+    blockExtra += (char)sgf.rootNode.move.x;
+    blockExtra += (char)sgf.rootNode.move.y;
+    blockExtra += (char)sgf.rootNode.move.pla;
+    appendUInt32(blockExtra,(uint32_t)sgf.rootNode.props.size());
+    for(const SgfProp& prop: sgf.rootNode.props) {
+      appendString(blockExtra,SgfProp::getKey(prop.keyCode));
+      appendUInt32(blockExtra,(uint32_t)prop.numValues());
+      for(size_t i = 0; i<prop.numValues(); i++)
+        appendString(blockExtra,prop.getValue(i));
+    }
+    if(blockExtra.size() > 0x7FFFFFFFULL)
+      throw StringError("SgfArchiveWriter: too much game data in one block");
+  }
+  catch(...) {
+    //Leave the block as it was so that the writer remains usable
+    blockMoves.resize(oldNumMoves);
+    blockExtra.resize(oldExtraSize);
+    throw;
+  }
+  header.extraBegin = (uint32_t)oldExtraSize;
+  header.extraLen = (uint32_t)(blockExtra.size() - oldExtraSize);
+
+  blockHeaders.push_back(header);
+  HashIndexEntry entry;
+  entry.hash0 = header.hash0;
+  entry.hash1 = header.hash1;
+  entry.gameIdx = numGames;
+  hashIndex.push_back(entry);
+  numGames++;
+
+  if(blockHeaders.size() >= (size_t)gamesPerBlock)
+    flushBlock();
+}
+
+void SgfArchiveWriter::flushBlock() {
+  if(blockHeaders.size() <= 0)
+    return;
+
+  BlockIndexEntry entry;
+  std::memset(&entry,0,sizeof(entry));
+  size_t movesColumnOffset = roundUpToAlign(blockHeaders.size() * sizeof(GameHeader));
+  size_t extraColumnOffset = roundUpToAlign(movesColumnOffset + blockMoves.size() * sizeof(uint16_t));
+  size_t rawSize = extraColumnOffset + blockExtra.size();
+  if(rawSize > 0xFFFFFFFFULL)
+    throw StringError("SgfArchiveWriter: block too large, use fewer gamesPerBlock");
+
+  string raw(rawSize,'\0');
+  std::memcpy(&raw[0], blockHeaders.data(), blockHeaders.size() * sizeof(GameHeader));
+  if(blockMoves.size() > 0)
+    std::memcpy(&raw[movesColumnOffset], blockMoves.data(), blockMoves.size() * sizeof(uint16_t));
+  if(blockExtra.size() > 0)
+    std::memcpy(&raw[extraColumnOffset], blockExtra.data(), blockExtra.size());
+
+  entry.fileOffset = filePos;
+  entry.rawSize = rawSize;
+  entry.numGames = (uint32_t)blockHeaders.size();
+  entry.movesColumnOffset = (uint32_t)movesColumnOffset;
+  entry.extraColumnOffset = (uint32_t)extraColumnOffset;
+
+  if(compress) {
+    uLongf compressedLen = compressBound((uLong)rawSize);
+    string compressed(compressedLen,'\0');
+    int zret = compress2((Bytef*)&compressed[0], &compressedLen, (const Bytef*)raw.data(), (uLong)rawSize, Z_DEFAULT_COMPRESSION);
+    if(zret != Z_OK)
+      throw StringError("SgfArchiveWriter: zlib compression failed");
+    entry.storedSize = compressedLen;
+    writeBytes(compressed.data(),compressedLen);
+  }
+  else {
+    entry.storedSize = rawSize;
+    writeBytes(raw.data(),rawSize);
+  }
+  static const char zeros[SGF_ARCHIVE_ALIGN] = {};
+  writeBytes(zeros, roundUpToAlign(filePos) - filePos);
+
+  blockIndex.push_back(entry);
+  blockHeaders.clear();
+  blockMoves.clear();
+  blockExtra.clear();
+}
+
+void SgfArchiveWriter::close() {
+  if(closed)
+    return;
+  flushBlock();
+
+  FileHeader header;
+  std::memset(&header,0,sizeof(header));
+  std::memcpy(header.magic,SGF_ARCHIVE_MAGIC,sizeof(header.magic));
+  header.version = SgfArchive::VERSION;
+  header.endianMarker = SgfArchive::ENDIAN_MARKER;
+  header.numGames = numGames;
+  header.numBlocks = blockIndex.size();
+  header.gamesPerBlock = (uint32_t)gamesPerBlock;
+  header.compressed = compress ? 1 : 0;
+
+  header.blockIndexOffset = filePos;
+  if(blockIndex.size() > 0)
+    writeBytes(blockIndex.data(), blockIndex.size() * sizeof(BlockIndexEntry));
+  std::sort(hashIndex.begin(),hashIndex.end(),hashIndexEntryLess);
+  header.hashIndexOffset = filePos;
+  if(hashIndex.size() > 0)
+    writeBytes(hashIndex.data(), hashIndex.size() * sizeof(HashIndexEntry));
+
+  out.seekp(0);
+  out.write((const char*)&header,sizeof(header));
+  out.close();
+  if(out.fail())
+    throw IOError("SgfArchiveWriter: error writing " + file);
+  closed = true;
+}
+
+//------------------------------------------------------------------------------------------------------------
+
+SgfArchiveReader::SgfArchiveReader(const string& f)
+  :file(f),
+   mappedFile(f),
+   data(mappedFile.data()),
+   dataLen(mappedFile.size()),
+   header(),
+   blockIndex(NULL),
+   hashIndex(NULL)
+{
+  if(dataLen < sizeof(FileHeader))
+    fail("file too short");
+  std::memcpy(&header,data,sizeof(FileHeader));
+  if(std::memcmp(header.magic,SGF_ARCHIVE_MAGIC,sizeof(header.magic)) != 0)
+    fail("not an sgf archive");
+  if(header.endianMarker != SgfArchive::ENDIAN_MARKER)
+    fail("archive has the wrong endianness for this machine");
+  if(header.version != SgfArchive::VERSION)
+    fail("unsupported version " + Global::uint32ToString(header.version));
+  if(header.gamesPerBlock <= 0)
+    fail("invalid gamesPerBlock");
+  if(header.numBlocks != (header.numGames + header.gamesPerBlock - 1) / header.gamesPerBlock)
+    fail("wrong number of blocks");
+  if(header.blockIndexOffset % SGF_ARCHIVE_ALIGN != 0 || header.hashIndexOffset % SGF_ARCHIVE_ALIGN != 0)
+    fail("misaligned index");
+  if(header.blockIndexOffset > dataLen || (dataLen - header.blockIndexOffset) / sizeof(BlockIndexEntry) < header.numBlocks)
+    fail("truncated block index");
+  if(header.hashIndexOffset > dataLen || (dataLen - header.hashIndexOffset) / sizeof(HashIndexEntry) < header.numGames)
+    fail("truncated hash index");
+  blockIndex = (const BlockIndexEntry*)(data + header.blockIndexOffset);
+  hashIndex = (const HashIndexEntry*)(data + header.hashIndexOffset);
+}
+
+SgfArchiveReader::~SgfArchiveReader() {
+}
+
+void SgfArchiveReader::fail(const string& msg) const {
+  throw IOError("SgfArchiveReader: " + msg + " in " + file);
+}
+
+size_t SgfArchiveReader::getNumGames() const {
+  return (size_t)header.numGames;
+}
+
+bool SgfArchiveReader::isCompressed() const {
+  return header.compressed != 0;
+}
+
+const char* SgfArchiveReader::getBlockData(uint64_t blockIdx, SgfArchiveBlockBuf& buf) const {
+  const BlockIndexEntry& entry = blockIndex[blockIdx];
+  if(entry.fileOffset > dataLen || dataLen - entry.fileOffset < entry.storedSize)
+    fail("truncated block");
+  if(!isCompressed()) {
+    //Offsets within the block are checked against rawSize, which must therefore be exactly what is stored
+    if(entry.rawSize != entry.storedSize)
+      fail("corrupt block index");
+    if(entry.fileOffset % SGF_ARCHIVE_ALIGN != 0)
+      fail("misaligned block");
+    return data + entry.fileOffset;
+  }
+  //Deflate never expands data by more than about 1032 times, so a larger rawSize is corrupt, not a huge allocation
+  if(entry.rawSize / 1032 > entry.storedSize)
+    fail("corrupt block index");
+  if(buf.reader == this && buf.blockIdx == (int64_t)blockIdx)
+    return (const char*)buf.data.data();
+
+  //Invalidate first, so that a failure below doesn't leave the buffer claiming to hold the block
+  buf.reader = NULL;
+  buf.blockIdx = -1;
+  buf.data.resize((entry.rawSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  uLongf rawLen = (uLongf)entry.rawSize;
+  int zret = uncompress((Bytef*)buf.data.data(), &rawLen, (const Bytef*)(data + entry.fileOffset), (uLong)entry.storedSize);
+  if(zret != Z_OK || rawLen != entry.rawSize)
+    fail("corrupt compressed block");
+  buf.reader = this;
+  buf.blockIdx = (int64_t)blockIdx;
+  return (const char*)buf.data.data();
+}
+
+SgfArchiveGameView SgfArchiveReader::getGame(size_t gameIdx, SgfArchiveBlockBuf& buf) const {
+  if(gameIdx >= header.numGames)
+    throw StringError("SgfArchiveReader: game index out of range");
+  uint64_t blockIdx = gameIdx / header.gamesPerBlock;
+  uint64_t idxInBlock = gameIdx % header.gamesPerBlock;
+  const BlockIndexEntry& entry = blockIndex[blockIdx];
+  if(entry.numGames <= idxInBlock ||
+     entry.movesColumnOffset < (uint64_t)entry.numGames * sizeof(GameHeader) ||
+     entry.extraColumnOffset < entry.movesColumnOffset ||
+     entry.rawSize < entry.extraColumnOffset ||
+     entry.movesColumnOffset % SGF_ARCHIVE_ALIGN != 0)
+    fail("corrupt block index");
+
+  const char* block = getBlockData(blockIdx,buf);
+  SgfArchiveGameView view;
+  view.header = (const GameHeader*)block + idxInBlock;
+  uint64_t numPackedMoves = (entry.extraColumnOffset - entry.movesColumnOffset) / sizeof(uint16_t);
+  uint64_t extraColumnLen = entry.rawSize - entry.extraColumnOffset;
+  if((uint64_t)view.header->movesBegin + view.header->numPlacements + view.header->numMoves > numPackedMoves ||
+     (uint64_t)view.header->extraBegin + view.header->extraLen > extraColumnLen)
+    fail("corrupt game header");
+  view.packedPlacements = (const uint16_t*)(block + entry.movesColumnOffset) + view.header->movesBegin;
+  view.packedMoves = view.packedPlacements + view.header->numPlacements;
+  view.extra = block + entry.extraColumnOffset + view.header->extraBegin;
+  return view;
+}
+
+CompactSgf* SgfArchiveReader::loadGame(size_t gameIdx, SgfArchiveBlockBuf& buf) const {
+  return getGame(gameIdx,buf).toCompactSgf();
+}
+
+bool SgfArchiveReader::findGame(Hash128 hash, size_t& gameIdxBuf) const {
+  HashIndexEntry target;
+  target.hash0 = hash.hash0;
+  target.hash1 = hash.hash1;
+  target.gameIdx = 0;
+  const HashIndexEntry* end = hashIndex + header.numGames;
+  const HashIndexEntry* iter = std::lower_bound(hashIndex, end, target, hashIndexEntryLess);
+  if(iter == end || iter->hash0 != hash.hash0 || iter->hash1 != hash.hash1)
+    return false;
+  if(iter->gameIdx >= header.numGames)
+    fail("corrupt hash index");
+  gameIdxBuf = (size_t)iter->gameIdx;
+  return true;
+}
+
+//------------------------------------------------------------------------------------------------------------
+
+static void checkArchivedGameMatches(const CompactSgf* loaded, const CompactSgf* orig) {
+  testAssert(loaded->fileName == orig->fileName);
+  testAssert(loaded->rootNode.move.x == orig->rootNode.move.x);
+  testAssert(loaded->rootNode.move.y == orig->rootNode.move.y);
+  testAssert(loaded->rootNode.move.pla == orig->rootNode.move.pla);
+  testAssert(loaded->rootNode.props.size() == orig->rootNode.props.size());
+  for(size_t i = 0; i<orig->rootNode.props.size(); i++) {
+    testAssert(loaded->rootNode.props[i].keyCode == orig->rootNode.props[i].keyCode);
+    testAssert(loaded->rootNode.props[i].getValues() == orig->rootNode.props[i].getValues());
+  }
+  testAssert(loaded->placements.size() == orig->placements.size());
+  for(size_t i = 0; i<orig->placements.size(); i++)
+    testAssert(loaded->placements[i].loc == orig->placements[i].loc && loaded->placements[i].pla == orig->placements[i].pla);
+  testAssert(loaded->moves.size() == orig->moves.size());
+  for(size_t i = 0; i<orig->moves.size(); i++)
+    testAssert(loaded->moves[i].loc == orig->moves[i].loc && loaded->moves[i].pla == orig->moves[i].pla);
+  testAssert(loaded->xSize == orig->xSize && loaded->ySize == orig->ySize);
+  testAssert(loaded->depth == orig->depth);
+  testAssert(loaded->komi == orig->komi);
+  testAssert(loaded->sgfWinner == orig->sgfWinner);
+  testAssert(loaded->hash == orig->hash);
+}
+
+static void writeTestFile(const string& file, const string& contents) {
+  std::ofstream out;
+  FileUtils::open(out,file,std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(contents.data(),contents.size());
+  out.close();
+  testAssert(!out.fail());
+}
+
+//Whether opening the archive, or else reading every game and looking up the given hash, throws an IOError
+static bool archiveFailsToRead(const string& file, Hash128 hash) {
+  try {
+    SgfArchiveReader reader(file);
+    SgfArchiveBlockBuf buf;
+    for(size_t i = 0; i<reader.getNumGames(); i++) {
+      std::unique_ptr<CompactSgf> sgf(reader.loadGame(i,buf));
+    }
+    size_t gameIdx;
+    reader.findGame(hash,gameIdx);
+  }
+  catch(const IOError&) {
+    return true;
+  }
+  return false;
+}
+
+void SgfArchive::runTests() {
+  cout << "Running sgf archive tests" << endl;
+  const string file = "sgfarchive_test.tmp";
+  const string corruptFile = "sgfarchive_test_corrupt.tmp";
+
+  //Games of several sizes, with placements, passes, no moves at all, escapes and unicode in the root node, and two
+  //identical games that share a hash
+  const vector<string> sgfTexts = {
+    "(;FF[4]GM[1]SZ[19]KM[7.5]RU[Japanese]PB[b]PW[w]RE[B+3.5]C[root \\] comment];B[pd];W[dp];B[pq];W[];B[dd])",
+    "(;SZ[9]KM[-2]AB[cc][gg]AW[ee];W[dd];B[];W[ff](;B[aa])(;B[ii];W[hh]))",
+    "(;SZ[7:5]GN[\xE5\x9B\xB4\xE6\xA3\x8B];B[ab];W[ge];B[])",
+    "(;SZ[13]RE[W+R])",
+    "(;SZ[9];B[aa];W[ii])",
+    "(;SZ[9];B[aa];W[ii])",
+    "(;SZ[19:3]HA[2]AB[aa][sa];W[mb];B[sc])",
+  };
+  vector<CompactSgf*> sgfs;
+  for(size_t i = 0; i<sgfTexts.size(); i++) {
+    CompactSgf* sgf = CompactSgf::parse(sgfTexts[i]);
+    sgf->fileName = "game" + Global::uint64ToString(i) + ".sgf";
+    sgfs.push_back(sgf);
+  }
+
+  for(int compress = 0; compress <= 1; compress++) {
+    for(int gamesPerBlock : {1, 3, 1024}) {
+      {
+        SgfArchiveWriter writer(file,compress != 0,gamesPerBlock);
+        for(size_t i = 0; i<sgfs.size(); i++)
+          writer.add(*sgfs[i]);
+        testAssert(writer.getNumGames() == (int64_t)sgfs.size());
+        writer.close();
+      }
+      SgfArchiveReader reader(file);
+      testAssert(reader.getNumGames() == sgfs.size());
+      testAssert(reader.isCompressed() == (compress != 0));
+
+      //In order, then backwards, so that consecutive reads switch blocks
+      SgfArchiveBlockBuf buf;
+      for(int pass = 0; pass < 2; pass++) {
+        for(size_t k = 0; k<sgfs.size(); k++) {
+          size_t i = pass == 0 ? k : sgfs.size()-1-k;
+          std::unique_ptr<CompactSgf> loaded(reader.loadGame(i,buf));
+          checkArchivedGameMatches(loaded.get(),sgfs[i]);
+
+          SgfArchiveGameView view = reader.getGame(i,buf);
+          testAssert(view.getHash() == sgfs[i]->hash);
+          testAssert(view.getXSize() == sgfs[i]->xSize && view.getYSize() == sgfs[i]->ySize);
+          testAssert(view.getNumPlacements() == sgfs[i]->placements.size());
+          testAssert(view.getNumMoves() == sgfs[i]->moves.size());
+          for(size_t j = 0; j<sgfs[i]->moves.size(); j++)
+            testAssert(view.getMove(j).loc == sgfs[i]->moves[j].loc && view.getMove(j).pla == sgfs[i]->moves[j].pla);
+        }
+      }
+
+      //Lookup by hash finds the first of the duplicates
+      for(size_t i = 0; i<sgfs.size(); i++) {
+        size_t gameIdx = 1000;
+        testAssert(reader.findGame(sgfs[i]->hash,gameIdx));
+        testAssert(gameIdx == (i == 5 ? 4 : i));
+      }
+      size_t gameIdx = 1000;
+      testAssert(!reader.findGame(Hash128(1,2),gameIdx));
+      testAssert(!reader.findGame(Hash128(sgfs[0]->hash.hash0,sgfs[0]->hash.hash1^1),gameIdx));
+      testAssert(gameIdx == 1000);
+
+      bool threw = false;
+      try {
+        reader.getGame(sgfs.size(),buf);
+      }
+      catch(const StringError&) {
+        threw = true;
+      }
+      testAssert(threw);
+    }
+  }
+
+  //An empty archive
+  {
+    SgfArchiveWriter writer(file,true,4);
+    writer.close();
+    SgfArchiveReader reader(file);
+    testAssert(reader.getNumGames() == 0);
+    size_t gameIdx;
+    testAssert(!reader.findGame(sgfs[0]->hash,gameIdx));
+  }
+
+  //Corruption of the header, the block index, the blocks, and the hash index
+  for(int compress = 0; compress <= 1; compress++) {
+    {
+      SgfArchiveWriter writer(file,compress != 0,3);
+      for(size_t i = 0; i<sgfs.size(); i++)
+        writer.add(*sgfs[i]);
+      writer.close();
+    }
+    const string orig = FileUtils::readFileBinary(file);
+    FileHeader header;
+    std::memcpy(&header,orig.data(),sizeof(header));
+    testAssert(header.numBlocks == 3);
+    BlockIndexEntry entries[3];
+    std::memcpy(entries,orig.data() + header.blockIndexOffset,sizeof(entries));
+    Hash128 hash = sgfs[3]->hash;
+
+    writeTestFile(corruptFile,orig);
+    testAssert(!archiveFailsToRead(corruptFile,hash));
+
+    auto corruptHeader = [&](std::function<void(FileHeader&)> f) {
+      string data = orig;
+      FileHeader h = header;
+      f(h);
+      std::memcpy(&data[0],&h,sizeof(h));
+      writeTestFile(corruptFile,data);
+      return archiveFailsToRead(corruptFile,hash);
+    };
+    auto corruptBlockIndex = [&](size_t blockIdx, std::function<void(BlockIndexEntry&)> f) {
+      string data = orig;
+      BlockIndexEntry e = entries[blockIdx];
+      f(e);
+      std::memcpy(&data[header.blockIndexOffset + blockIdx * sizeof(BlockIndexEntry)],&e,sizeof(e));
+      writeTestFile(corruptFile,data);
+      return archiveFailsToRead(corruptFile,hash);
+    };
+
+    writeTestFile(corruptFile,orig.substr(0,sizeof(FileHeader)-1));
+    testAssert(archiveFailsToRead(corruptFile,hash));
+    writeTestFile(corruptFile,orig.substr(0,header.hashIndexOffset + 8));
+    testAssert(archiveFailsToRead(corruptFile,hash));
+    testAssert(corruptHeader([](FileHeader& h) { h.magic[0] = 'X'; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.version = 2; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.endianMarker = 0x04030201; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.gamesPerBlock = 0; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.numBlocks = 2; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.numGames = 100; }));
+    testAssert(corruptHeader([&](FileHeader& h) { h.blockIndexOffset = orig.size() + 8; }));
+    testAssert(corruptHeader([](FileHeader& h) { h.hashIndexOffset += 4; }));
+
+    //The last block is the one that the hash index follows directly, so sizes that are too large there point into it
+    for(size_t b = 0; b<3; b++) {
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.rawSize += 8; }));
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.rawSize -= 8; }));
+      testAssert(corruptBlockIndex(b,[&](BlockIndexEntry& e) { e.storedSize = orig.size(); }));
+      testAssert(corruptBlockIndex(b,[&](BlockIndexEntry& e) { e.fileOffset = orig.size() - 4; }));
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.numGames = 0; }));
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.movesColumnOffset = 8; }));
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.extraColumnOffset = e.movesColumnOffset - 8; }));
+      testAssert(corruptBlockIndex(b,[](BlockIndexEntry& e) { e.extraColumnOffset = (uint32_t)e.rawSize + 8; }));
+    }
+    //Uncompressed, a block whose rawSize and storedSize agree with each other but not with the file
+    if(compress == 0) {
+      testAssert(corruptBlockIndex(2,[](BlockIndexEntry& e) { e.rawSize += 1024; e.storedSize += 1024; }));
+      testAssert(corruptBlockIndex(0,[](BlockIndexEntry& e) { e.fileOffset += 4; }));
+    }
+    //Compressed, a rawSize far beyond what the stored data could hold, which must be rejected before allocating it
+    else {
+      testAssert(corruptBlockIndex(0,[](BlockIndexEntry& e) { e.rawSize = (uint64_t)1 << 60; }));
+      string data = orig;
+      data[entries[1].fileOffset + entries[1].storedSize / 2] ^= 0x10;
+      writeTestFile(corruptFile,data);
+      testAssert(archiveFailsToRead(corruptFile,hash));
+    }
+
+    //Game headers pointing outside of their block's columns, possible to patch in place only when uncompressed
+    if(compress == 0) {
+      auto corruptGameHeader = [&](size_t gameIdxInBlock, std::function<void(GameHeader&)> f) {
+        string data = orig;
+        size_t pos = entries[1].fileOffset + gameIdxInBlock * sizeof(GameHeader);
+        GameHeader g;
+        std::memcpy(&g,&data[pos],sizeof(g));
+        f(g);
+        std::memcpy(&data[pos],&g,sizeof(g));
+        writeTestFile(corruptFile,data);
+        return archiveFailsToRead(corruptFile,hash);
+      };
+      testAssert(corruptGameHeader(2,[](GameHeader& g) { g.numMoves += 1; }));
+      testAssert(corruptGameHeader(0,[](GameHeader& g) { g.movesBegin = 0xFFFFFFF0U; }));
+      testAssert(corruptGameHeader(2,[](GameHeader& g) { g.extraLen += 1; }));
+      testAssert(corruptGameHeader(1,[](GameHeader& g) { g.extraBegin = 0xFFFFFFF0U; }));
+      //Within bounds, but the data there is not what it should be
+      testAssert(corruptGameHeader(1,[](GameHeader& g) { g.extraLen -= 1; }));
+      testAssert(corruptGameHeader(1,[](GameHeader& g) { g.xSize = 1; g.ySize = 1; }));
+    }
+
+    //Hash index pointing to a game that does not exist
+    {
+      string data = orig;
+      size_t gameIdx = 0;
+      SgfArchiveReader reader(file);
+      testAssert(reader.findGame(hash,gameIdx) && gameIdx == 3);
+      for(size_t i = 0; i<sgfs.size(); i++) {
+        HashIndexEntry e;
+        size_t pos = header.hashIndexOffset + i * sizeof(HashIndexEntry);
+        std::memcpy(&e,&data[pos],sizeof(e));
+        if(e.hash0 == hash.hash0 && e.hash1 == hash.hash1) {
+          e.gameIdx = sgfs.size();
+          std::memcpy(&data[pos],&e,sizeof(e));
+        }
+      }
+      writeTestFile(corruptFile,data);
+      testAssert(archiveFailsToRead(corruptFile,hash));
+    }
+  }
+
+  for(size_t i = 0; i<sgfs.size(); i++)
+    delete sgfs[i];
+  FileUtils::tryRemoveFile(file);
+  FileUtils::tryRemoveFile(corruptFile);
+}
@@ -0,0 +1,180 @@
+#ifndef DATAIO_SGFARCHIVE_H_
+#define DATAIO_SGFARCHIVE_H_
+
+#include <fstream>
+
+#include "../core/global.h"
+#include "../core/hash.h"
+#include "../core/mappedfile.h"
+#include "../dataio/sgf.h"
+
+//Binary archive of many CompactSgfs, so that a corpus can be loaded without reparsing sgf text, and individual games
+//looked up by index or by sgf hash without reading the rest of the archive.
+//
+//Games are grouped into blocks of a fixed number of games, each optionally zlib-compressed. Within a block the data
+//is columnar: a fixed-size SgfArchive::GameHeader per game, then the placements and moves of all games packed to
+//2 bytes each, then the remaining variable-length data (file name and root node) of all games. After the blocks come
+//an index of the blocks and an index of the game hashes sorted by hash.
+//All integers are little-endian and the format is only supported on little-endian machines.
+namespace SgfArchive {
+  static constexpr uint32_t VERSION = 1;
+  //Stored as written by the machine, to detect a big-endian writer or reader
+  static constexpr uint32_t ENDIAN_MARKER = 0x01020304;
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianMarker;
+    uint64_t numGames;
+    uint64_t numBlocks;
+    uint32_t gamesPerBlock;
+    uint32_t compressed;
+    uint64_t blockIndexOffset;
+    uint64_t hashIndexOffset;
+  };
+
+  struct BlockIndexEntry {
+    uint64_t fileOffset;
+    //Size in the file, and size once decompressed, which are the same if not compressed
+    uint64_t storedSize;
+    uint64_t rawSize;
+    uint32_t numGames;
+    //Byte offsets of the columns within the decompressed block, the game headers start at 0
+    uint32_t movesColumnOffset;
+    uint32_t extraColumnOffset;
+    uint32_t reserved;
+  };
+
+  struct HashIndexEntry {
+    uint64_t hash0;
+    uint64_t hash1;
+    uint64_t gameIdx;
+  };
+
+  struct GameHeader {
+    uint64_t hash0;
+    uint64_t hash1;
+    int64_t depth;
+    float komi;
+    //Index in the block's move column of the first placement, followed by the moves
+    uint32_t movesBegin;
+    uint32_t numPlacements;
+    uint32_t numMoves;
+    //Byte range in the block's extra column
+    uint32_t extraBegin;
+    uint32_t extraLen;
+    uint8_t xSize;
+    uint8_t ySize;
+    int8_t sgfWinner;
+    uint8_t reserved0;
+    uint32_t reserved1;
+  };
+
+  //Moves are packed as the player in the top 2 bits and y * xSize + x in the rest, or PACKED_PASS for pass.
+  static constexpr uint16_t PACKED_PASS = 0x3FFF;
+  uint16_t packMove(Move move, int xSize, int ySize);
+  Move unpackMove(uint16_t packed, int xSize, int ySize);
+
+  void runTests();
+}
+
+//A game within an archive, pointing directly into the archive data, or into an SgfArchiveBlockBuf for compressed
+//archives. Valid only as long as the reader, and the SgfArchiveBlockBuf if any, are unmodified.
+struct SgfArchiveGameView {
+  const SgfArchive::GameHeader* header;
+  const uint16_t* packedPlacements;
+  const uint16_t* packedMoves;
+  const char* extra;
+
+  Hash128 getHash() const;
+  int getXSize() const;
+  int getYSize() const;
+  size_t getNumPlacements() const;
+  size_t getNumMoves() const;
+  Move getPlacement(size_t idx) const;
+  Move getMove(size_t idx) const;
+
+  //Decode everything, including the file name and root node, into a new CompactSgf.
+  CompactSgf* toCompactSgf() const;
+};
+
+//Decompression buffer for reading from a compressed archive, reused so that reading the games of the same block in
+//a row only decompresses the block once. Use a separate one for each thread.
+struct SgfArchiveBlockBuf {
+  const void* reader;
+  int64_t blockIdx;
+  std::vector<uint64_t> data;
+
+  SgfArchiveBlockBuf();
+};
+
+//Writes games to an archive one at a time, holding only the current block and the indexes in memory.
+//close() must be called to complete the archive, an archive that was not closed cannot be read.
+class SgfArchiveWriter {
+ public:
+  SgfArchiveWriter(const std::string& file, bool compress, int gamesPerBlock = 1024);
+  ~SgfArchiveWriter();
+
+  SgfArchiveWriter(const SgfArchiveWriter&) = delete;
+  SgfArchiveWriter& operator=(const SgfArchiveWriter&) = delete;
+
+  //Throws StringError if the game has a board too large to pack or too many moves
+  void add(const CompactSgf& sgf);
+  void close();
+
+  int64_t getNumGames() const;
+
+ private:
+  std::string file;
+  std::ofstream out;
+  bool compress;
+  int gamesPerBlock;
+  bool closed;
+  uint64_t numGames;
+  uint64_t filePos;
+
+  std::vector<SgfArchive::GameHeader> blockHeaders;
+  std::vector<uint16_t> blockMoves;
+  std::string blockExtra;
+
+  std::vector<SgfArchive::BlockIndexEntry> blockIndex;
+  std::vector<SgfArchive::HashIndexEntry> hashIndex;
+
+  void flushBlock();
+  void writeBytes(const void* data, size_t len);
+};
+
+//Reads an archive by mapping it into memory where supported, or else by reading it whole, see MappedFile.
+//All functions are thread-safe, other than that each thread must use its own SgfArchiveBlockBuf.
+class SgfArchiveReader {
+ public:
+  //Throws IOError if the file cannot be read or is not a valid archive
+  SgfArchiveReader(const std::string& file);
+  ~SgfArchiveReader();
+
+  SgfArchiveReader(const SgfArchiveReader&) = delete;
+  SgfArchiveReader& operator=(const SgfArchiveReader&) = delete;
+
+  size_t getNumGames() const;
+  bool isCompressed() const;
+
+  SgfArchiveGameView getGame(size_t gameIdx, SgfArchiveBlockBuf& buf) const;
+  CompactSgf* loadGame(size_t gameIdx, SgfArchiveBlockBuf& buf) const;
+  //Finds the index of the game with the given Sgf::hash. If several games share it, finds the one added first.
+  bool findGame(Hash128 hash, size_t& gameIdxBuf) const;
+
+ private:
+  std::string file;
+  MappedFile mappedFile;
+  const char* data;
+  size_t dataLen;
+
+  SgfArchive::FileHeader header;
+  const SgfArchive::BlockIndexEntry* blockIndex;
+  const SgfArchive::HashIndexEntry* hashIndex;
+
+  void fail(const std::string& msg) const;
+  const char* getBlockData(uint64_t blockIdx, SgfArchiveBlockBuf& buf) const;
+};
+
+#endif // DATAIO_SGFARCHIVE_H_
@@ -536,7 +536,7 @@ void TrainingWriteBuffers::addRow(
 
   //Various other data
   rowGlobal[47] = hist.currentSelfKomi(nextPlayer,data.drawEquivalentWinsForWhite);
-  rowGlobal[48] = (hist.encorePhase == 2 || hist.rules.scoringRule == Rules::SCORING_AREA) ? 1.0f : 0.0f;
+  rowGlobal[48] = (hist.encorePhase == 2 || hist.getRules().scoringRule == Rules::SCORING_AREA) ? 1.0f : 0.0f;
 
   //Earlier neural net metadata
   rowGlobal[49] = data.changedNeuralNets.size() > 0 ? 1.0f : 0.0f;
@@ -958,8 +958,9 @@ void TrainingDataWriter::writeGame(const FinishedGameData& data) {
 
       Move move = data.endHist.moveHistory[turnIdx];
       assert(move.pla == nextPlayer);
-      assert(hist.isLegal(board,move.loc,move.pla));
-      hist.makeBoardMoveAssumeLegal(board, move.loc, move.pla, NULL);
+      assert(hist.isLegalTolerant(board,move.loc,move.pla));
+      //Only the boards are needed here, so skip recomputing superko bans after every move
+      hist.makeBoardMoveTrusted(board, move.loc, move.pla, false);
       nextPlayer = getOpp(nextPlayer);
 
       posHistForFutureBoards.push_back(board);
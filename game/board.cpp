@@ -754,6 +754,14 @@ bool Board::playMove(Loc loc, Player pla, bool isMultiStoneSuicideLegal)
 
 //Plays the specified move, assuming it is legal, and returns a MoveRecord for the move
 Board::MoveRecord Board::playMoveRecorded(Loc loc, Player pla)
+{
+  MoveRecord record = getMoveRecord(loc,pla);
+  playMoveAssumeLegal(loc, pla);
+  return record;
+}
+
+//Returns the MoveRecord that playMoveRecorded would return for the move, without playing it
+Board::MoveRecord Board::getMoveRecord(Loc loc, Player pla) const
 {
   MoveRecord record;
   record.loc = loc;
@@ -780,8 +788,6 @@ Board::MoveRecord Board::playMoveRecorded(Loc loc, Player pla)
     if(record.capDirs == 0 && isSuicide(loc,pla))
       record.capDirs = 0x10;
   }
-
-  playMoveAssumeLegal(loc, pla);
   return record;
 }
 
@@ -239,6 +239,8 @@ struct Board
 
   //Plays the specified move, assuming it is legal, and returns a MoveRecord for the move
   MoveRecord playMoveRecorded(Loc loc, Player pla);
+  //Returns the MoveRecord that playMoveRecorded would return for the move, without playing it
+  MoveRecord getMoveRecord(Loc loc, Player pla) const;
 
   //Undo the move given by record. Moves MUST be undone in the order they were made.
   //Undos will NOT typically restore the precise representation in the board to the way it was. The heads of chains
@@ -1,6 +1,12 @@
 #include "../game/boardhistory.h"
 
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "../core/fileutils.h"
+#include "../core/rand.h"
+#include "../core/test.h"
 
 using namespace std;
 
@@ -10,12 +16,6 @@ static Hash128 getKoHash(const Rules& rules, const Board& board, Player pla, int
   else
     return board.pos_hash ^ koRecapBlockHash;
 }
-static Hash128 getKoHashAfterMoveNonEncore(const Rules& rules, Hash128 posHashAfterMove, Player pla) {
-  if(rules.koRule == Rules::KO_SITUATIONAL || rules.koRule == Rules::KO_SIMPLE)
-    return posHashAfterMove ^ Board::ZOBRIST_PLAYER_HASH[pla];
-  else
-    return posHashAfterMove;
-}
 // static Hash128 getKoHashAfterMove(const Rules& rules, Hash128 posHashAfterMove, Player pla, int encorePhase, Hash128 koRecapBlockHashAfterMove) {
 //   if(rules.koRule == Rules::KO_SITUATIONAL || rules.koRule == Rules::KO_SIMPLE || encorePhase > 0)
 //     return posHashAfterMove ^ Board::ZOBRIST_PLAYER_HASH[pla] ^ koRecapBlockHashAfterMove;
@@ -24,8 +24,16 @@ static Hash128 getKoHashAfterMoveNonEncore(const Rules& rules, Hash128 posHashAf
 // }
 
 
+struct BoardHistory::RulesSpecializedMoveFuncs {
+  void (BoardHistory::*makeBoardMoveAssumeLegal)(Board&, Loc, Player, const KoHashTable*, bool);
+  void (BoardHistory::*makeBoardMoveTrusted)(Board&, Loc, Player, bool);
+  void (BoardHistory::*recomputeLegalityState)(const Board&, const KoHashTable*);
+};
+
 BoardHistory::BoardHistory()
   :rules(),
+   rulesHash(rules.getZobristHashNoKomi()),
+   moveFuncs(getMoveFuncs(rules)),
    moveHistory(),
    preventEncoreHistory(),
    koHashHistory(),
@@ -41,9 +49,12 @@ BoardHistory::BoardHistory()
    presumedNextMovePla(P_BLACK),
    consecutiveEndingPasses(0),
    hashesBeforeBlackPass(),hashesBeforeWhitePass(),
+   hashesBeforeBlackPassTable(),hashesBeforeWhitePassTable(),
    encorePhase(0),numTurnsThisPhase(0),
+   koRecapBlockedLocs(),
    koRecapBlockHash(),
    koCapturesInEncore(),
+   koCapturesInEncoreTable(),
    whiteBonusScore(0.0f),
    whiteHandicapBonusScore(0.0f),
    hasButton(false),
@@ -62,6 +73,8 @@ BoardHistory::~BoardHistory()
 
 BoardHistory::BoardHistory(const Board& board, Player pla, const Rules& r, int ePhase)
   :rules(r),
+   rulesHash(),
+   moveFuncs(NULL),
    moveHistory(),
    preventEncoreHistory(),
    koHashHistory(),
@@ -77,9 +90,12 @@ BoardHistory::BoardHistory(const Board& board, Player pla, const Rules& r, int e
    presumedNextMovePla(pla),
    consecutiveEndingPasses(0),
    hashesBeforeBlackPass(),hashesBeforeWhitePass(),
+   hashesBeforeBlackPassTable(),hashesBeforeWhitePassTable(),
    encorePhase(0),numTurnsThisPhase(0),
+   koRecapBlockedLocs(),
    koRecapBlockHash(),
    koCapturesInEncore(),
+   koCapturesInEncoreTable(),
    whiteBonusScore(0.0f),
    whiteHandicapBonusScore(0.0f),
    hasButton(false),
@@ -97,6 +113,8 @@ BoardHistory::BoardHistory(const Board& board, Player pla, const Rules& r, int e
 
 BoardHistory::BoardHistory(const BoardHistory& other)
   :rules(other.rules),
+   rulesHash(other.rulesHash),
+   moveFuncs(other.moveFuncs),
    moveHistory(other.moveHistory),
    preventEncoreHistory(other.preventEncoreHistory),
    koHashHistory(other.koHashHistory),
@@ -112,9 +130,12 @@ BoardHistory::BoardHistory(const BoardHistory& other)
    presumedNextMovePla(other.presumedNextMovePla),
    consecutiveEndingPasses(other.consecutiveEndingPasses),
    hashesBeforeBlackPass(other.hashesBeforeBlackPass),hashesBeforeWhitePass(other.hashesBeforeWhitePass),
+   hashesBeforeBlackPassTable(other.hashesBeforeBlackPassTable),hashesBeforeWhitePassTable(other.hashesBeforeWhitePassTable),
    encorePhase(other.encorePhase),numTurnsThisPhase(other.numTurnsThisPhase),
+   koRecapBlockedLocs(other.koRecapBlockedLocs),
    koRecapBlockHash(other.koRecapBlockHash),
    koCapturesInEncore(other.koCapturesInEncore),
+   koCapturesInEncoreTable(other.koCapturesInEncoreTable),
    whiteBonusScore(other.whiteBonusScore),
    whiteHandicapBonusScore(other.whiteHandicapBonusScore),
    hasButton(other.hasButton),
@@ -135,6 +156,8 @@ BoardHistory& BoardHistory::operator=(const BoardHistory& other)
   if(this == &other)
     return *this;
   rules = other.rules;
+  rulesHash = other.rulesHash;
+  moveFuncs = other.moveFuncs;
   moveHistory = other.moveHistory;
   preventEncoreHistory = other.preventEncoreHistory;
   koHashHistory = other.koHashHistory;
@@ -153,11 +176,15 @@ BoardHistory& BoardHistory::operator=(const BoardHistory& other)
   consecutiveEndingPasses = other.consecutiveEndingPasses;
   hashesBeforeBlackPass = other.hashesBeforeBlackPass;
   hashesBeforeWhitePass = other.hashesBeforeWhitePass;
+  hashesBeforeBlackPassTable = other.hashesBeforeBlackPassTable;
+  hashesBeforeWhitePassTable = other.hashesBeforeWhitePassTable;
   encorePhase = other.encorePhase;
   numTurnsThisPhase = other.numTurnsThisPhase;
   std::copy(other.koRecapBlocked, other.koRecapBlocked+Board::MAX_ARR_SIZE, koRecapBlocked);
+  koRecapBlockedLocs = other.koRecapBlockedLocs;
   koRecapBlockHash = other.koRecapBlockHash;
   koCapturesInEncore = other.koCapturesInEncore;
+  koCapturesInEncoreTable = other.koCapturesInEncoreTable;
   std::copy(other.secondEncoreStartColors, other.secondEncoreStartColors+Board::MAX_ARR_SIZE, secondEncoreStartColors);
   whiteBonusScore = other.whiteBonusScore;
   whiteHandicapBonusScore = other.whiteHandicapBonusScore;
@@ -175,6 +202,8 @@ BoardHistory& BoardHistory::operator=(const BoardHistory& other)
 
 BoardHistory::BoardHistory(BoardHistory&& other) noexcept
  :rules(other.rules),
+  rulesHash(other.rulesHash),
+  moveFuncs(other.moveFuncs),
   moveHistory(std::move(other.moveHistory)),
   preventEncoreHistory(std::move(other.preventEncoreHistory)),
   koHashHistory(std::move(other.koHashHistory)),
@@ -190,9 +219,12 @@ BoardHistory::BoardHistory(BoardHistory&& other) noexcept
   presumedNextMovePla(other.presumedNextMovePla),
   consecutiveEndingPasses(other.consecutiveEndingPasses),
   hashesBeforeBlackPass(std::move(other.hashesBeforeBlackPass)),hashesBeforeWhitePass(std::move(other.hashesBeforeWhitePass)),
+  hashesBeforeBlackPassTable(std::move(other.hashesBeforeBlackPassTable)),hashesBeforeWhitePassTable(std::move(other.hashesBeforeWhitePassTable)),
   encorePhase(other.encorePhase),numTurnsThisPhase(other.numTurnsThisPhase),
+  koRecapBlockedLocs(std::move(other.koRecapBlockedLocs)),
   koRecapBlockHash(other.koRecapBlockHash),
   koCapturesInEncore(std::move(other.koCapturesInEncore)),
+  koCapturesInEncoreTable(std::move(other.koCapturesInEncoreTable)),
   whiteBonusScore(other.whiteBonusScore),
   whiteHandicapBonusScore(other.whiteHandicapBonusScore),
   hasButton(other.hasButton),
@@ -210,6 +242,8 @@ BoardHistory::BoardHistory(BoardHistory&& other) noexcept
 BoardHistory& BoardHistory::operator=(BoardHistory&& other) noexcept
 {
   rules = other.rules;
+  rulesHash = other.rulesHash;
+  moveFuncs = other.moveFuncs;
   moveHistory = std::move(other.moveHistory);
   preventEncoreHistory = std::move(other.preventEncoreHistory);
   koHashHistory = std::move(other.koHashHistory);
@@ -228,11 +262,15 @@ BoardHistory& BoardHistory::operator=(BoardHistory&& other) noexcept
   consecutiveEndingPasses = other.consecutiveEndingPasses;
   hashesBeforeBlackPass = std::move(other.hashesBeforeBlackPass);
   hashesBeforeWhitePass = std::move(other.hashesBeforeWhitePass);
+  hashesBeforeBlackPassTable = std::move(other.hashesBeforeBlackPassTable);
+  hashesBeforeWhitePassTable = std::move(other.hashesBeforeWhitePassTable);
   encorePhase = other.encorePhase;
   numTurnsThisPhase = other.numTurnsThisPhase;
   std::copy(other.koRecapBlocked, other.koRecapBlocked+Board::MAX_ARR_SIZE, koRecapBlocked);
+  koRecapBlockedLocs = std::move(other.koRecapBlockedLocs);
   koRecapBlockHash = other.koRecapBlockHash;
   koCapturesInEncore = std::move(other.koCapturesInEncore);
+  koCapturesInEncoreTable = std::move(other.koCapturesInEncoreTable);
   std::copy(other.secondEncoreStartColors, other.secondEncoreStartColors+Board::MAX_ARR_SIZE, secondEncoreStartColors);
   whiteBonusScore = other.whiteBonusScore;
   whiteHandicapBonusScore = other.whiteHandicapBonusScore;
@@ -250,6 +288,8 @@ BoardHistory& BoardHistory::operator=(BoardHistory&& other) noexcept
 
 void BoardHistory::clear(const Board& board, Player pla, const Rules& r, int ePhase) {
   rules = r;
+  rulesHash = rules.getZobristHashNoKomi();
+  moveFuncs = getMoveFuncs(rules);
   moveHistory.clear();
   preventEncoreHistory.clear();
   koHashHistory.clear();
@@ -279,12 +319,10 @@ void BoardHistory::clear(const Board& board, Player pla, const Rules& r, int ePh
 
   std::fill(superKoBanned, superKoBanned+Board::MAX_ARR_SIZE, false);
   consecutiveEndingPasses = 0;
-  hashesBeforeBlackPass.clear();
-  hashesBeforeWhitePass.clear();
+  clearHashesBeforePass();
   numTurnsThisPhase = 0;
-  std::fill(koRecapBlocked, koRecapBlocked+Board::MAX_ARR_SIZE, false);
-  koRecapBlockHash = Hash128();
-  koCapturesInEncore.clear();
+  clearKoRecapBlocked();
+  clearKoCapturesInEncore();
   whiteBonusScore = 0.0f;
   whiteHandicapBonusScore = 0.0f;
   hasButton = rules.hasButton && encorePhase == 0;
@@ -374,8 +412,12 @@ int BoardHistory::numHandicapStonesOnBoard(const Board& b) {
 }
 
 int BoardHistory::computeNumHandicapStones() const {
+  return computeNumHandicapStones(assumeMultipleStartingBlackMovesAreHandicap);
+}
+
+int BoardHistory::computeNumHandicapStones(bool assumeMultipleBlackMovesAreHandicap) const {
   int blackNonPassTurnsToStart = 0;
-  if(assumeMultipleStartingBlackMovesAreHandicap) {
+  if(assumeMultipleBlackMovesAreHandicap) {
     //Find the length of the initial sequence of black moves - treat a string of consecutive black
     //moves at the start of the game as "handicap"
     //This is necessary because when loading sgfs or on some servers, (particularly with free placement)
@@ -421,7 +463,8 @@ int BoardHistory::computeWhiteHandicapBonus() const {
 }
 
 void BoardHistory::printBasicInfo(ostream& out, const Board& board) const {
-  Board::printBoard(out, board, Board::NULL_LOC, &moveHistory);
+  std::vector<Move> moveHistoryVec = moveHistory.toVector();
+  Board::printBoard(out, board, Board::NULL_LOC, &moveHistoryVec);
   out << "Next player: " << PlayerIO::playerToString(presumedNextMovePla) << endl;
   if(encorePhase > 0)
     out << "Game phase: " << encorePhase << endl;
@@ -470,6 +513,10 @@ void BoardHistory::setKomi(float newKomi) {
     setFinalScoreAndWinner(finalWhiteMinusBlackScore - oldKomi + newKomi);
 }
 
+const Rules& BoardHistory::getRules() const {
+  return rules;
+}
+
 
 //If rootKoHashTable is provided, will take advantage of rootKoHashTable rather than search within the first
 //rootKoHashTable->size() moves of koHashHistory.
@@ -729,9 +776,28 @@ void BoardHistory::setKoRecapBlocked(Loc loc, bool b) {
     koRecapBlocked[loc] = b;
     //We used to have per-color marks, so the zobrist was for both. Just combine them.
     koRecapBlockHash ^= Board::ZOBRIST_KO_MARK_HASH[loc][C_BLACK] ^ Board::ZOBRIST_KO_MARK_HASH[loc][C_WHITE];
+    if(b)
+      koRecapBlockedLocs.push_back(loc);
+    else {
+      //Only ever a few of these at once, so a linear search is fine
+      for(size_t i = 0; i<koRecapBlockedLocs.size(); i++) {
+        if(koRecapBlockedLocs[i] == loc) {
+          koRecapBlockedLocs[i] = koRecapBlockedLocs.back();
+          koRecapBlockedLocs.pop_back();
+          break;
+        }
+      }
+    }
   }
 }
 
+void BoardHistory::clearKoRecapBlocked() {
+  for(size_t i = 0; i<koRecapBlockedLocs.size(); i++)
+    koRecapBlocked[koRecapBlockedLocs[i]] = false;
+  koRecapBlockedLocs.clear();
+  koRecapBlockHash = Hash128();
+}
+
 bool BoardHistory::isLegal(const Board& board, Loc moveLoc, Player movePla) const {
   //Ko-moves in the encore that are recapture blocked are interpreted as pass-for-ko, so they are legal
   if(encorePhase > 0) {
@@ -809,14 +875,56 @@ bool BoardHistory::phaseHasSpightlikeEndingAndPassHistoryClearing() const {
 //(i.e. ending that ignores the number of consecutive passes)
 bool BoardHistory::wouldBeSpightlikeEndingPass(Player movePla, Hash128 koHashBeforeMove) const {
   if(phaseHasSpightlikeEndingAndPassHistoryClearing()) {
-    if(movePla == P_BLACK && std::find(hashesBeforeBlackPass.begin(), hashesBeforeBlackPass.end(), koHashBeforeMove) != hashesBeforeBlackPass.end())
+    if(movePla == P_BLACK && hashesBeforeBlackPassTable.containsHash(koHashBeforeMove))
       return true;
-    if(movePla == P_WHITE && std::find(hashesBeforeWhitePass.begin(), hashesBeforeWhitePass.end(), koHashBeforeMove) != hashesBeforeWhitePass.end())
+    if(movePla == P_WHITE && hashesBeforeWhitePassTable.containsHash(koHashBeforeMove))
       return true;
   }
   return false;
 }
 
+void BoardHistory::addHashBeforePass(Player movePla, Hash128 koHashBeforeMove) {
+  if(movePla == P_BLACK) {
+    hashesBeforeBlackPassTable.add(koHashBeforeMove,(uint32_t)hashesBeforeBlackPass.size());
+    hashesBeforeBlackPass.push_back(koHashBeforeMove);
+  }
+  else if(movePla == P_WHITE) {
+    hashesBeforeWhitePassTable.add(koHashBeforeMove,(uint32_t)hashesBeforeWhitePass.size());
+    hashesBeforeWhitePass.push_back(koHashBeforeMove);
+  }
+  else
+    ASSERT_UNREACHABLE;
+}
+
+//HashIdxTable has no removal, but passes are few so just rebuild it
+void BoardHistory::removeLastHashBeforePass(Player movePla) {
+  std::vector<Hash128>& hashes = movePla == P_BLACK ? hashesBeforeBlackPass : hashesBeforeWhitePass;
+  HashIdxTable& table = movePla == P_BLACK ? hashesBeforeBlackPassTable : hashesBeforeWhitePassTable;
+  assert(movePla == P_BLACK || movePla == P_WHITE);
+  assert(hashes.size() > 0);
+  hashes.pop_back();
+  table.clear();
+  for(size_t i = 0; i<hashes.size(); i++)
+    table.add(hashes[i],(uint32_t)i);
+}
+
+void BoardHistory::clearHashesBeforePass() {
+  hashesBeforeBlackPass.clear();
+  hashesBeforeWhitePass.clear();
+  hashesBeforeBlackPassTable.clear();
+  hashesBeforeWhitePassTable.clear();
+}
+
+void BoardHistory::addKoCaptureInEncore(const EncoreKoCapture& ekc) {
+  koCapturesInEncoreTable.add(ekc.posHashBeforeMove,(uint32_t)koCapturesInEncore.size());
+  koCapturesInEncore.push_back(ekc);
+}
+
+void BoardHistory::clearKoCapturesInEncore() {
+  koCapturesInEncore.clear();
+  koCapturesInEncoreTable.clear();
+}
+
 bool BoardHistory::passWouldEndPhase(const Board& board, Player movePla) const {
   Hash128 koHashBeforeMove = getKoHash(rules, board, movePla, encorePhase, koRecapBlockHash);
   if(newConsecutiveEndingPassesAfterPass() >= 2 ||
@@ -872,11 +980,166 @@ bool BoardHistory::makeBoardMoveTolerant(Board& board, Loc moveLoc, Player moveP
   return true;
 }
 
+bool BoardHistory::makeBoardMoveTolerant(Board& board, Loc moveLoc, Player movePla, MoveUndoRecord& undoRecord) {
+  //Under territory scoring or with a button, moves can enter the encore or take the button, which clear or rebuild
+  //far more state than is worth recording
+  if(rules.scoringRule != Rules::SCORING_AREA || rules.hasButton)
+    throw StringError("BoardHistory: undoable moves are only supported for area scoring without a button");
+  assert(encorePhase == 0);
+  if(!isLegalTolerant(board,moveLoc,movePla))
+    return false;
+
+  undoRecord.moveLoc = moveLoc;
+  undoRecord.movePla = movePla;
+  undoRecord.boardMoveRecord = board.getMoveRecord(moveLoc,movePla);
+  //Recent boards are all copies of the starting board until the history has enough moves, after which each one is
+  //the one before it with the corresponding move of the history played
+  size_t numMoves = moveHistory.size();
+  undoRecord.recentBoardOverwrittenIsCopy = numMoves + 1 < NUM_RECENT_BOARDS;
+  if(!undoRecord.recentBoardOverwrittenIsCopy) {
+    const Board& overwritten = recentBoards[(currentRecentBoardIdx + 1) % NUM_RECENT_BOARDS];
+    const Move& nextMove = moveHistory[numMoves + 1 - NUM_RECENT_BOARDS];
+    undoRecord.recentBoardOverwrittenMove = overwritten.getMoveRecord(nextMove.loc,nextMove.pla);
+  }
+  bool superKoBannedBefore[Board::MAX_ARR_SIZE];
+  std::copy(superKoBanned, superKoBanned+Board::MAX_ARR_SIZE, superKoBannedBefore);
+  undoRecord.wasEverOccupiedOrPlayed = moveLoc != Board::PASS_LOC && wasEverOccupiedOrPlayed[moveLoc];
+  undoRecord.koHashHistoryCleared = moveLoc == Board::PASS_LOC && phaseHasSpightlikeEndingAndPassHistoryClearing();
+  if(undoRecord.koHashHistoryCleared)
+    undoRecord.koHashHistory = koHashHistory;
+  else
+    undoRecord.koHashHistory.clear();
+  undoRecord.firstTurnIdxWithKoHistory = firstTurnIdxWithKoHistory;
+  undoRecord.presumedNextMovePla = presumedNextMovePla;
+  undoRecord.whiteHasMoved = whiteHasMoved;
+  undoRecord.consecutiveEndingPasses = consecutiveEndingPasses;
+  undoRecord.numTurnsThisPhase = numTurnsThisPhase;
+  undoRecord.whiteBonusScore = whiteBonusScore;
+  undoRecord.whiteHandicapBonusScore = whiteHandicapBonusScore;
+  undoRecord.isPastNormalPhaseEnd = isPastNormalPhaseEnd;
+  undoRecord.isGameFinished = isGameFinished;
+  undoRecord.winner = winner;
+  undoRecord.finalWhiteMinusBlackScore = finalWhiteMinusBlackScore;
+  undoRecord.isScored = isScored;
+  undoRecord.isNoResult = isNoResult;
+  undoRecord.isResignation = isResignation;
+
+  makeBoardMoveAssumeLegal(board,moveLoc,movePla,NULL);
+
+  //Usually nothing changes, in which case a single compare suffices
+  undoRecord.superKoBannedChanged.clear();
+  if(std::memcmp(superKoBanned, superKoBannedBefore, sizeof(superKoBanned)) != 0) {
+    for(int i = 0; i<Board::MAX_ARR_SIZE; i++) {
+      if(superKoBanned[i] != superKoBannedBefore[i])
+        undoRecord.superKoBannedChanged.push_back((Loc)i);
+    }
+  }
+  return true;
+}
+
+void BoardHistory::undoBoardMove(Board& board, const MoveUndoRecord& undoRecord) {
+  assert(moveHistory.size() > 0);
+  assert(moveHistory.back().loc == undoRecord.moveLoc && moveHistory.back().pla == undoRecord.movePla);
+  Loc moveLoc = undoRecord.moveLoc;
+  moveHistory.pop_back();
+  preventEncoreHistory.pop_back();
+  if(undoRecord.koHashHistoryCleared)
+    koHashHistory = undoRecord.koHashHistory;
+  else
+    koHashHistory.pop_back();
+  firstTurnIdxWithKoHistory = undoRecord.firstTurnIdxWithKoHistory;
+
+  //Rebuild the recent board that the move overwrote from the one after it
+  Board& overwritten = recentBoards[currentRecentBoardIdx];
+  overwritten = recentBoards[(currentRecentBoardIdx + 1) % NUM_RECENT_BOARDS];
+  if(!undoRecord.recentBoardOverwrittenIsCopy)
+    overwritten.undo(undoRecord.recentBoardOverwrittenMove);
+  currentRecentBoardIdx = (currentRecentBoardIdx + NUM_RECENT_BOARDS - 1) % NUM_RECENT_BOARDS;
+  board.undo(undoRecord.boardMoveRecord);
+
+  if(moveLoc == Board::PASS_LOC)
+    removeLastHashBeforePass(undoRecord.movePla);
+  else
+    wasEverOccupiedOrPlayed[moveLoc] = undoRecord.wasEverOccupiedOrPlayed;
+  for(size_t i = 0; i<undoRecord.superKoBannedChanged.size(); i++) {
+    Loc loc = undoRecord.superKoBannedChanged[i];
+    superKoBanned[loc] = !superKoBanned[loc];
+  }
+
+  presumedNextMovePla = undoRecord.presumedNextMovePla;
+  whiteHasMoved = undoRecord.whiteHasMoved;
+  consecutiveEndingPasses = undoRecord.consecutiveEndingPasses;
+  numTurnsThisPhase = undoRecord.numTurnsThisPhase;
+  whiteBonusScore = undoRecord.whiteBonusScore;
+  whiteHandicapBonusScore = undoRecord.whiteHandicapBonusScore;
+  isPastNormalPhaseEnd = undoRecord.isPastNormalPhaseEnd;
+  isGameFinished = undoRecord.isGameFinished;
+  winner = undoRecord.winner;
+  finalWhiteMinusBlackScore = undoRecord.finalWhiteMinusBlackScore;
+  isScored = undoRecord.isScored;
+  isNoResult = undoRecord.isNoResult;
+  isResignation = undoRecord.isResignation;
+}
+
 void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable) {
   makeBoardMoveAssumeLegal(board,moveLoc,movePla,rootKoHashTable,false);
 }
 
 void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable, bool preventEncore) {
+  (this->*(moveFuncs->makeBoardMoveAssumeLegal))(board,moveLoc,movePla,rootKoHashTable,preventEncore);
+}
+
+void BoardHistory::replayTrusted(Board& board, const std::vector<Move>& moves) {
+  replayTrusted(board,moves,0,moves.size());
+}
+
+void BoardHistory::replayTrusted(Board& board, const std::vector<Move>& moves, size_t startIdx, size_t endIdx) {
+  assert(startIdx <= endIdx && endIdx <= moves.size());
+  for(size_t i = startIdx; i<endIdx; i++)
+    makeBoardMoveTrusted(board,moves[i].loc,moves[i].pla,false);
+  if(endIdx > startIdx)
+    recomputeLegalityState(board,NULL);
+}
+
+void BoardHistory::makeBoardMoveTrusted(Board& board, Loc moveLoc, Player movePla, bool preventEncore) {
+  (this->*(moveFuncs->makeBoardMoveTrusted))(board,moveLoc,movePla,preventEncore);
+}
+
+void BoardHistory::recomputeLegalityState(const Board& board, const KoHashTable* rootKoHashTable) {
+  (this->*(moveFuncs->recomputeLegalityState))(board,rootKoHashTable);
+}
+
+//Compile-time versions of the rule-dependent helpers, for use by the specialized move functions below.
+//inEncore must be false under area scoring.
+template<int KO_RULE>
+static inline Hash128 getKoHashSpecialized(Hash128 posHash, Player pla, bool inEncore, Hash128 koRecapBlockHash) {
+  if(KO_RULE == Rules::KO_SITUATIONAL || KO_RULE == Rules::KO_SIMPLE || inEncore)
+    return posHash ^ Board::ZOBRIST_PLAYER_HASH[pla] ^ koRecapBlockHash;
+  else
+    return posHash ^ koRecapBlockHash;
+}
+template<int KO_RULE>
+static inline bool phaseHasSpightlikeEndingAndPassHistoryClearingSpecialized(bool inEncore) {
+  return inEncore || KO_RULE == Rules::KO_SIMPLE || KO_RULE == Rules::KO_SPIGHT;
+}
+template<int KO_RULE>
+static inline int newConsecutiveEndingPassesAfterPassSpecialized(int consecutiveEndingPasses, bool inEncore) {
+  if(inEncore || KO_RULE != Rules::KO_SPIGHT)
+    return consecutiveEndingPasses + 1;
+  return 0;
+}
+
+template<int KO_RULE, int SCORING_RULE>
+void BoardHistory::makeBoardMoveAssumeLegalSpecialized(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable, bool preventEncore) {
+  makeBoardMoveTrustedSpecialized<KO_RULE,SCORING_RULE>(board,moveLoc,movePla,preventEncore);
+  recomputeLegalityStateSpecialized<KO_RULE,SCORING_RULE>(board,rootKoHashTable);
+}
+
+template<int KO_RULE, int SCORING_RULE>
+void BoardHistory::makeBoardMoveTrustedSpecialized(Board& board, Loc moveLoc, Player movePla, bool preventEncore) {
+  assert(rules.koRule == KO_RULE && rules.scoringRule == SCORING_RULE);
+  //Only territory scoring has an encore, so under area scoring all of the encore handling below compiles away
+  const bool inEncore = SCORING_RULE == Rules::SCORING_TERRITORY && encorePhase > 0;
   Hash128 posHashBeforeMove = board.pos_hash;
 
   //If somehow we're making a move after the game was ended, just clear those values and continue
@@ -899,8 +1162,7 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
     consecutiveEndingPasses = 0;
     //Taking the button clears all ko hash histories (this is equivalent to not clearing them and treating buttonless
     //state as different than buttonful state)
-    hashesBeforeBlackPass.clear();
-    hashesBeforeWhitePass.clear();
+    clearHashesBeforePass();
     koHashHistory.clear();
     //The first turn idx with history will be the one RESULTING from this move.
     firstTurnIdxWithKoHistory = moveHistory.size()+1;
@@ -909,7 +1171,7 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
     //Passes clear ko history in the main phase with spight ko rules and in the encore
     //This lifts bans in spight ko rules and lifts 3-fold-repetition checking in the encore for no-resultifying infinite cycles
     //They also clear in simple ko rules for the purpose of no-resulting long cycles. Long cycles with passes do not no-result.
-    if(phaseHasSpightlikeEndingAndPassHistoryClearing()) {
+    if(phaseHasSpightlikeEndingAndPassHistoryClearingSpecialized<KO_RULE>(inEncore)) {
       koHashHistory.clear();
       //The first turn idx with history will be the one RESULTING from this move.
       firstTurnIdxWithKoHistory = moveHistory.size()+1;
@@ -917,23 +1179,19 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
       //still repeated positions after pass end the game or phase, which these arrays are used to check.
     }
 
-    Hash128 koHashBeforeThisMove = getKoHash(rules,board,movePla,encorePhase,koRecapBlockHash);
-    consecutiveEndingPasses = newConsecutiveEndingPassesAfterPass();
+    Hash128 koHashBeforeThisMove = getKoHashSpecialized<KO_RULE>(board.pos_hash,movePla,inEncore,koRecapBlockHash);
+    consecutiveEndingPasses = newConsecutiveEndingPassesAfterPassSpecialized<KO_RULE>(consecutiveEndingPasses,inEncore);
     //Check if we have a game-ending pass BEFORE updating hashesBeforeBlackPass and hashesBeforeWhitePass
-    isSpightlikeEndingPass = wouldBeSpightlikeEndingPass(movePla,koHashBeforeThisMove);
+    if(phaseHasSpightlikeEndingAndPassHistoryClearingSpecialized<KO_RULE>(inEncore))
+      isSpightlikeEndingPass = wouldBeSpightlikeEndingPass(movePla,koHashBeforeThisMove);
 
     //Update hashesBeforeBlackPass and hashesBeforeWhitePass
-    if(movePla == P_BLACK)
-      hashesBeforeBlackPass.push_back(koHashBeforeThisMove);
-    else if(movePla == P_WHITE)
-      hashesBeforeWhitePass.push_back(koHashBeforeThisMove);
-    else
-      ASSERT_UNREACHABLE;
+    addHashBeforePass(movePla,koHashBeforeThisMove);
   }
 
   //Handle pass-for-ko moves in the encore. Pass for ko lifts a ko recapture block and does nothing else.
   bool wasPassForKo = false;
-  if(encorePhase > 0 && moveLoc != Board::PASS_LOC) {
+  if(inEncore && moveLoc != Board::PASS_LOC) {
     if(board.colors[moveLoc] == getOpp(movePla) && koRecapBlocked[moveLoc]) {
       setKoRecapBlocked(moveLoc,false);
       wasPassForKo = true;
@@ -956,22 +1214,20 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
   if(!wasPassForKo) {
     board.playMoveAssumeLegal(moveLoc,movePla);
 
-    if(encorePhase > 0) {
+    if(inEncore) {
       //Update ko recapture blocks and record that this was a ko capture
       if(board.ko_loc != Board::NULL_LOC) {
         setKoRecapBlocked(moveLoc,true);
-        koCapturesInEncore.push_back(EncoreKoCapture(posHashBeforeMove,moveLoc,movePla));
+        addKoCaptureInEncore(EncoreKoCapture(posHashBeforeMove,moveLoc,movePla));
         //Clear simple ko loc now that we've absorbed the ko loc information into the korecap blocks
         //Once we have that, the simple ko loc plays no further role in game state or legality
         board.clearSimpleKoLoc();
       }
-      //Unmark all ko recap blocks not on stones
-      for(int y = 0; y<board.y_size; y++) {
-        for(int x = 0; x<board.x_size; x++) {
-          Loc loc = Location::getLoc(x,y,board.x_size);
-          if(board.colors[loc] == C_EMPTY && koRecapBlocked[loc])
-            setKoRecapBlocked(loc,false);
-        }
+      //Unmark all ko recap blocks not on stones. Iterate backwards since unmarking swaps the last entry into place.
+      for(size_t i = koRecapBlockedLocs.size(); i > 0; i--) {
+        Loc loc = koRecapBlockedLocs[i-1];
+        if(board.colors[loc] == C_EMPTY)
+          setKoRecapBlocked(loc,false);
       }
     }
   }
@@ -980,7 +1236,7 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
   currentRecentBoardIdx = (currentRecentBoardIdx + 1) % NUM_RECENT_BOARDS;
   recentBoards[currentRecentBoardIdx] = board;
 
-  Hash128 koHashAfterThisMove = getKoHash(rules,board,getOpp(movePla),encorePhase,koRecapBlockHash);
+  Hash128 koHashAfterThisMove = getKoHashSpecialized<KO_RULE>(board.pos_hash,getOpp(movePla),inEncore,koRecapBlockHash);
   koHashHistory.push_back(koHashAfterThisMove);
   moveHistory.push_back(Move(moveLoc,movePla));
   preventEncoreHistory.push_back(preventEncore);
@@ -990,40 +1246,8 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
   if(moveLoc != Board::PASS_LOC)
     wasEverOccupiedOrPlayed[moveLoc] = true;
 
-  //Mark all locations that are superko-illegal for the next player, by iterating and testing each point.
-  Player nextPla = getOpp(movePla);
-  if(encorePhase <= 0 && rules.koRule != Rules::KO_SIMPLE) {
-    assert(koRecapBlockHash == Hash128());
-    for(int y = 0; y<board.y_size; y++) {
-      for(int x = 0; x<board.x_size; x++) {
-        Loc loc = Location::getLoc(x,y,board.x_size);
-        //Cannot be superko banned if it's not a pseudolegal move in the first place, or we would already ban the move under simple ko.
-        if(board.colors[loc] != C_EMPTY || board.isIllegalSuicide(loc,nextPla,rules.multiStoneSuicideLegal) || loc == board.ko_loc)
-          superKoBanned[loc] = false;
-        //Also cannot be superko banned if a stone was never there or played there before AND the move is not suicide, because that means
-        //the move results in a new stone there and if no stone was ever there in the past the it must be a new position.
-        else if(!wasEverOccupiedOrPlayed[loc] && !board.isSuicide(loc,nextPla))
-          superKoBanned[loc] = false;
-        else {
-          Hash128 posHashAfterMove = board.getPosHashAfterMove(loc,nextPla);
-          Hash128 koHashAfterMove = getKoHashAfterMoveNonEncore(rules, posHashAfterMove, getOpp(nextPla));
-          superKoBanned[loc] = koHashOccursInHistory(koHashAfterMove,rootKoHashTable);
-        }
-      }
-    }
-  }
-  else if(encorePhase > 0) {
-    //During the encore, only one capture of each ko in a given position by a given player
-    std::fill(superKoBanned, superKoBanned+Board::MAX_ARR_SIZE, false);
-    for(size_t i = 0; i<koCapturesInEncore.size(); i++) {
-      const EncoreKoCapture& ekc = koCapturesInEncore[i];
-      if(ekc.posHashBeforeMove == board.pos_hash && ekc.movePla == nextPla)
-        superKoBanned[ekc.moveLoc] = true;
-    }
-  }
-
   //Territory scoring - chill 1 point per move in main phase and first encore
-  if(rules.scoringRule == Rules::SCORING_TERRITORY && encorePhase <= 1 && moveLoc != Board::PASS_LOC && !wasPassForKo) {
+  if(SCORING_RULE == Rules::SCORING_TERRITORY && encorePhase <= 1 && moveLoc != Board::PASS_LOC && !wasPassForKo) {
     if(movePla == P_BLACK)
       whiteBonusScore += 1.0f;
     else if(movePla == P_WHITE)
@@ -1041,11 +1265,11 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
 
   //Phase transitions and game end
   if(consecutiveEndingPasses >= 2 || isSpightlikeEndingPass) {
-    if(rules.scoringRule == Rules::SCORING_AREA) {
+    if(SCORING_RULE == Rules::SCORING_AREA) {
       assert(encorePhase <= 0);
       endAndScoreGameNow(board);
     }
-    else if(rules.scoringRule == Rules::SCORING_TERRITORY) {
+    else if(SCORING_RULE == Rules::SCORING_TERRITORY) {
       if(encorePhase >= 2)
         endAndScoreGameNow(board);
       else {
@@ -1060,14 +1284,12 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
 
           std::fill(superKoBanned, superKoBanned+Board::MAX_ARR_SIZE, false);
           consecutiveEndingPasses = 0;
-          hashesBeforeBlackPass.clear();
-          hashesBeforeWhitePass.clear();
-          std::fill(koRecapBlocked, koRecapBlocked+Board::MAX_ARR_SIZE, false);
-          koRecapBlockHash = Hash128();
-          koCapturesInEncore.clear();
+          clearHashesBeforePass();
+          clearKoRecapBlocked();
+          clearKoCapturesInEncore();
 
           koHashHistory.clear();
-          koHashHistory.push_back(getKoHash(rules,board,getOpp(movePla),encorePhase,koRecapBlockHash));
+          koHashHistory.push_back(getKoHashSpecialized<KO_RULE>(board.pos_hash,getOpp(movePla),true,koRecapBlockHash));
           //The first ko hash history is the one for the move we JUST appended to the move history earlier.
           firstTurnIdxWithKoHistory = moveHistory.size();
         }
@@ -1076,17 +1298,77 @@ void BoardHistory::makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player mo
     else
       ASSERT_UNREACHABLE;
   }
+}
+
+template<int KO_RULE, int SCORING_RULE>
+void BoardHistory::recomputeLegalityStateSpecialized(const Board& board, const KoHashTable* rootKoHashTable) {
+  assert(rules.koRule == KO_RULE && rules.scoringRule == SCORING_RULE);
+  const bool inEncore = SCORING_RULE == Rules::SCORING_TERRITORY && encorePhase > 0;
+  //Mark all locations that are superko-illegal for the next player, by iterating and testing each point.
+  Player nextPla = presumedNextMovePla;
+  if(!inEncore && KO_RULE != Rules::KO_SIMPLE) {
+    assert(koRecapBlockHash == Hash128());
+    for(int y = 0; y<board.y_size; y++) {
+      for(int x = 0; x<board.x_size; x++) {
+        Loc loc = Location::getLoc(x,y,board.x_size);
+        //Cannot be superko banned if it's not a pseudolegal move in the first place, or we would already ban the move under simple ko.
+        if(board.colors[loc] != C_EMPTY || board.isIllegalSuicide(loc,nextPla,rules.multiStoneSuicideLegal) || loc == board.ko_loc)
+          superKoBanned[loc] = false;
+        //Also cannot be superko banned if a stone was never there or played there before AND the move is not suicide, because that means
+        //the move results in a new stone there and if no stone was ever there in the past the it must be a new position.
+        else if(!wasEverOccupiedOrPlayed[loc] && !board.isSuicide(loc,nextPla))
+          superKoBanned[loc] = false;
+        else {
+          Hash128 posHashAfterMove = board.getPosHashAfterMove(loc,nextPla);
+          Hash128 koHashAfterMove = getKoHashSpecialized<KO_RULE>(posHashAfterMove, getOpp(nextPla), false, Hash128());
+          superKoBanned[loc] = koHashOccursInHistory(koHashAfterMove,rootKoHashTable);
+        }
+      }
+    }
+  }
+  else if(inEncore) {
+    //During the encore, only one capture of each ko in a given position by a given player
+    std::fill(superKoBanned, superKoBanned+Board::MAX_ARR_SIZE, false);
+    koCapturesInEncoreTable.forEachIdxOfHash(board.pos_hash, [&](uint32_t idx) {
+      const EncoreKoCapture& ekc = koCapturesInEncore[idx];
+      if(ekc.movePla == nextPla)
+        superKoBanned[ekc.moveLoc] = true;
+    });
+  }
 
   //Break long cycles with no-result
-  if(moveLoc != Board::PASS_LOC && (encorePhase > 0 || rules.koRule == Rules::KO_SIMPLE)) {
+  if(moveHistory.size() <= 0)
+    return;
+  Loc moveLoc = moveHistory.back().loc;
+  if(moveLoc != Board::PASS_LOC && (inEncore || KO_RULE == Rules::KO_SIMPLE)) {
     if(numberOfKoHashOccurrencesInHistory(koHashHistory[koHashHistory.size()-1], rootKoHashTable) >= 3) {
       isNoResult = true;
       isGameFinished = true;
     }
   }
-
 }
 
+const BoardHistory::RulesSpecializedMoveFuncs* BoardHistory::getMoveFuncs(const Rules& rules) {
+#define BOARDHISTORY_MOVE_FUNCS(KO_RULE,SCORING_RULE) {                     \
+    &BoardHistory::makeBoardMoveAssumeLegalSpecialized<KO_RULE,SCORING_RULE>, \
+    &BoardHistory::makeBoardMoveTrustedSpecialized<KO_RULE,SCORING_RULE>,     \
+    &BoardHistory::recomputeLegalityStateSpecialized<KO_RULE,SCORING_RULE>    \
+  }
+  //Indexed by [koRule][scoringRule]
+  static const RulesSpecializedMoveFuncs moveFuncsByRules[4][2] = {
+    {BOARDHISTORY_MOVE_FUNCS(Rules::KO_SIMPLE,Rules::SCORING_AREA), BOARDHISTORY_MOVE_FUNCS(Rules::KO_SIMPLE,Rules::SCORING_TERRITORY)},
+    {BOARDHISTORY_MOVE_FUNCS(Rules::KO_POSITIONAL,Rules::SCORING_AREA), BOARDHISTORY_MOVE_FUNCS(Rules::KO_POSITIONAL,Rules::SCORING_TERRITORY)},
+    {BOARDHISTORY_MOVE_FUNCS(Rules::KO_SITUATIONAL,Rules::SCORING_AREA), BOARDHISTORY_MOVE_FUNCS(Rules::KO_SITUATIONAL,Rules::SCORING_TERRITORY)},
+    {BOARDHISTORY_MOVE_FUNCS(Rules::KO_SPIGHT,Rules::SCORING_AREA), BOARDHISTORY_MOVE_FUNCS(Rules::KO_SPIGHT,Rules::SCORING_TERRITORY)},
+  };
+#undef BOARDHISTORY_MOVE_FUNCS
+  static_assert(Rules::KO_SIMPLE == 0 && Rules::KO_POSITIONAL == 1 && Rules::KO_SITUATIONAL == 2 && Rules::KO_SPIGHT == 3, "");
+  static_assert(Rules::SCORING_AREA == 0 && Rules::SCORING_TERRITORY == 1, "");
+
+  if(rules.koRule < 0 || rules.koRule >= 4 || rules.scoringRule < 0 || rules.scoringRule >= 2)
+    throw StringError("BoardHistory: unsupported rules: " + rules.toString());
+  return &moveFuncsByRules[rules.koRule][rules.scoringRule];
+}
 
 bool BoardHistory::hasBlackPassOrWhiteFirst() const {
   //First move was made by white this game, on an empty board.
@@ -1167,10 +1449,10 @@ Hash128 BoardHistory::getSituationRulesAndKoHash(const Board& board, const Board
         Loc loc = Location::getLoc(x,y,xSize);
         if(hist.superKoBanned[loc])
           hash ^= Board::ZOBRIST_KO_LOC_HASH[loc];
-        if(hist.koRecapBlocked[loc])
-          hash ^= Board::ZOBRIST_KO_MARK_HASH[loc][P_BLACK] ^ Board::ZOBRIST_KO_MARK_HASH[loc][P_WHITE];
       }
     }
+    //Equal to folding in ZOBRIST_KO_MARK_HASH for both colors at every koRecapBlocked location
+    hash ^= hist.koRecapBlockHash;
     if(hist.encorePhase == 2) {
       for(int y = 0; y<ySize; y++) {
         for(int x = 0; x<xSize; x++) {
@@ -1192,11 +1474,8 @@ Hash128 BoardHistory::getSituationRulesAndKoHash(const Board& board, const Board
   hash.hash1 ^= Hash::basicLCong(komiHash);
 
   //Fold in the ko, scoring, and suicide rules
-  hash ^= Rules::ZOBRIST_KO_RULE_HASH[hist.rules.koRule];
-  hash ^= Rules::ZOBRIST_SCORING_RULE_HASH[hist.rules.scoringRule];
-  hash ^= Rules::ZOBRIST_TAX_RULE_HASH[hist.rules.taxRule];
-  if(hist.rules.multiStoneSuicideLegal)
-    hash ^= Rules::ZOBRIST_MULTI_STONE_SUICIDE_HASH;
+  assert(hist.rulesHash == hist.rules.getZobristHashNoKomi());
+  hash ^= hist.rulesHash;
   if(hist.hasButton)
     hash ^= Rules::ZOBRIST_BUTTON_HASH;
 
@@ -1221,7 +1500,7 @@ size_t KoHashTable::size() const {
 }
 
 void KoHashTable::recompute(const BoardHistory& history) {
-  koHashHistorySortedByLowBits = history.koHashHistory;
+  koHashHistorySortedByLowBits = history.koHashHistory.toVector();
   firstTurnIdxWithKoHistory = history.firstTurnIdxWithKoHistory;
 
   auto cmpFirstByLowBits = [](const Hash128& a, const Hash128& b) {
@@ -1271,3 +1550,805 @@ int KoHashTable::numberOfOccurrencesOfHash(Hash128 hash) const {
   }
   return count;
 }
+
+
+//SNAPSHOTS-----------------------------------------------------------------------------------------
+
+static const uint32_t SNAPSHOT_MAGIC = 0x53484221; //"!BHS"
+static const uint32_t SNAPSHOT_FILE_MAGIC = 0x46484221; //"!BHF"
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct BoardHistorySnapshotWriter {
+  std::string& buf;
+  BoardHistorySnapshotWriter(std::string& b): buf(b) {}
+
+  template<typename T>
+  void write(T x) {
+    buf.append((const char*)&x, sizeof(T));
+  }
+  void writeHash(Hash128 h) {
+    write<uint64_t>(h.hash0);
+    write<uint64_t>(h.hash1);
+  }
+  void writeRules(const Rules& rules) {
+    write<int8_t>((int8_t)rules.koRule);
+    write<int8_t>((int8_t)rules.scoringRule);
+    write<int8_t>((int8_t)rules.taxRule);
+    write<int8_t>((int8_t)rules.whiteHandicapBonusRule);
+    write<uint8_t>(rules.multiStoneSuicideLegal);
+    write<uint8_t>(rules.hasButton);
+    write<uint8_t>(rules.friendlyPassOk);
+    write<float>(rules.komi);
+  }
+  //Packs a per-location array for the on-board locations only, at bitsPerLoc bits each
+  template<typename T>
+  void writeLocArray(const T* arr, int xSize, int ySize, int bitsPerLoc) {
+    uint8_t acc = 0;
+    int numBits = 0;
+    for(int y = 0; y<ySize; y++) {
+      for(int x = 0; x<xSize; x++) {
+        Loc loc = Location::getLoc(x,y,xSize);
+        acc |= (uint8_t)((uint8_t)arr[loc] << numBits);
+        numBits += bitsPerLoc;
+        if(numBits >= 8) {
+          write<uint8_t>(acc);
+          acc = 0;
+          numBits = 0;
+        }
+      }
+    }
+    if(numBits > 0)
+      write<uint8_t>(acc);
+  }
+  void writeBoard(const Board& board) {
+    write<uint8_t>((uint8_t)board.x_size);
+    write<uint8_t>((uint8_t)board.y_size);
+    write<int16_t>(board.ko_loc);
+    write<int32_t>(board.numBlackCaptures);
+    write<int32_t>(board.numWhiteCaptures);
+    writeLocArray(board.colors,board.x_size,board.y_size,2);
+  }
+};
+
+struct BoardHistorySnapshotReader {
+  const char* data;
+  size_t len;
+  size_t pos;
+  BoardHistorySnapshotReader(const char* d, size_t l): data(d), len(l), pos(0) {}
+
+  void fail(const std::string& msg) {
+    throw IOError("Invalid BoardHistory snapshot: " + msg);
+  }
+  void require(size_t numBytes) {
+    if(numBytes > len - pos)
+      fail("truncated data");
+  }
+  template<typename T>
+  T read() {
+    require(sizeof(T));
+    T x;
+    std::memcpy(&x, data+pos, sizeof(T));
+    pos += sizeof(T);
+    return x;
+  }
+  Hash128 readHash() {
+    uint64_t hash0 = read<uint64_t>();
+    uint64_t hash1 = read<uint64_t>();
+    return Hash128(hash0,hash1);
+  }
+  //Reads a count of elements and checks that at least that many elements of the given size could follow
+  size_t readCount(size_t eltSize) {
+    uint64_t n = read<uint64_t>();
+    if(n > (len - pos) / eltSize)
+      fail("truncated data");
+    return (size_t)n;
+  }
+  bool readBool() {
+    uint8_t b = read<uint8_t>();
+    if(b > 1)
+      fail("invalid bool");
+    return b != 0;
+  }
+  Player readPla(bool allowEmpty) {
+    Player pla = read<int8_t>();
+    if(pla != P_BLACK && pla != P_WHITE && !(allowEmpty && pla == C_EMPTY))
+      fail("invalid player");
+    return pla;
+  }
+  Loc readLoc() {
+    Loc loc = read<int16_t>();
+    if(loc < 0 || loc >= Board::MAX_ARR_SIZE)
+      fail("invalid location");
+    return loc;
+  }
+  Rules readRules() {
+    Rules rules;
+    rules.koRule = read<int8_t>();
+    rules.scoringRule = read<int8_t>();
+    rules.taxRule = read<int8_t>();
+    rules.whiteHandicapBonusRule = read<int8_t>();
+    rules.multiStoneSuicideLegal = readBool();
+    rules.hasButton = readBool();
+    rules.friendlyPassOk = readBool();
+    rules.komi = read<float>();
+    if(rules.koRule < Rules::KO_SIMPLE || rules.koRule > Rules::KO_SPIGHT ||
+       rules.scoringRule < Rules::SCORING_AREA || rules.scoringRule > Rules::SCORING_TERRITORY ||
+       rules.taxRule < Rules::TAX_NONE || rules.taxRule > Rules::TAX_ALL ||
+       rules.whiteHandicapBonusRule < Rules::WHB_ZERO || rules.whiteHandicapBonusRule > Rules::WHB_N_MINUS_ONE ||
+       !std::isfinite(rules.komi))
+      fail("invalid rules");
+    return rules;
+  }
+  template<typename T>
+  void readLocArray(T* arr, int xSize, int ySize, int bitsPerLoc, int maxValue) {
+    uint8_t mask = (uint8_t)((1 << bitsPerLoc) - 1);
+    uint8_t acc = 0;
+    int numBits = 8;
+    for(int y = 0; y<ySize; y++) {
+      for(int x = 0; x<xSize; x++) {
+        if(numBits >= 8) {
+          acc = read<uint8_t>();
+          numBits = 0;
+        }
+        int value = (acc >> numBits) & mask;
+        numBits += bitsPerLoc;
+        if(value > maxValue)
+          fail("invalid location value");
+        arr[Location::getLoc(x,y,xSize)] = (T)value;
+      }
+    }
+  }
+  Board readBoard() {
+    int xSize = read<uint8_t>();
+    int ySize = read<uint8_t>();
+    if(xSize < 1 || ySize < 1 || xSize > Board::MAX_LEN || ySize > Board::MAX_LEN)
+      fail("invalid board size");
+    Loc koLoc = read<int16_t>();
+    int numBlackCaptures = read<int32_t>();
+    int numWhiteCaptures = read<int32_t>();
+    Color colors[Board::MAX_ARR_SIZE];
+    readLocArray(colors,xSize,ySize,2,C_WHITE);
+
+    Board board(xSize,ySize);
+    std::vector<Move> placements;
+    for(int y = 0; y<ySize; y++) {
+      for(int x = 0; x<xSize; x++) {
+        Loc loc = Location::getLoc(x,y,xSize);
+        if(colors[loc] != C_EMPTY)
+          placements.push_back(Move(loc,colors[loc]));
+      }
+    }
+    if(!board.setStonesFailIfNoLibs(placements))
+      fail("board contains zero-liberty stones");
+    if(koLoc != Board::NULL_LOC) {
+      if(!board.isOnBoard(koLoc) || board.colors[koLoc] != C_EMPTY)
+        fail("invalid ko location");
+      board.setSimpleKoLoc(koLoc);
+    }
+    board.numBlackCaptures = numBlackCaptures;
+    board.numWhiteCaptures = numWhiteCaptures;
+    return board;
+  }
+};
+
+void BoardHistory::saveSnapshot(std::string& buf) const {
+  size_t start = buf.size();
+  BoardHistorySnapshotWriter w(buf);
+  w.write<uint32_t>(SNAPSHOT_MAGIC);
+  w.write<uint32_t>(SNAPSHOT_VERSION);
+  //Total length, filled in at the end
+  w.write<uint64_t>(0);
+
+  w.writeRules(rules);
+  w.writeBoard(initialBoard);
+  w.write<int8_t>(initialPla);
+  w.write<int8_t>((int8_t)initialEncorePhase);
+  w.write<int64_t>(initialTurnNumber);
+  w.write<uint8_t>(assumeMultipleStartingBlackMovesAreHandicap);
+  w.write<uint8_t>(whiteHasMoved);
+
+  w.write<uint64_t>(moveHistory.size());
+  for(size_t i = 0; i<moveHistory.size(); i++) {
+    w.write<int16_t>(moveHistory[i].loc);
+    w.write<int8_t>(moveHistory[i].pla);
+    w.write<uint8_t>(preventEncoreHistory[i]);
+  }
+  w.write<uint64_t>(koHashHistory.size());
+  for(size_t i = 0; i<koHashHistory.size(); i++)
+    w.writeHash(koHashHistory[i]);
+  w.write<uint64_t>(firstTurnIdxWithKoHistory);
+
+  //Recent boards, oldest first, so that the last one is the current board
+  for(int i = NUM_RECENT_BOARDS-1; i >= 0; i--)
+    w.writeBoard(getRecentBoard(i));
+  w.write<int8_t>(presumedNextMovePla);
+
+  int xSize = initialBoard.x_size;
+  int ySize = initialBoard.y_size;
+  w.writeLocArray(wasEverOccupiedOrPlayed,xSize,ySize,1);
+  w.writeLocArray(superKoBanned,xSize,ySize,1);
+
+  w.write<int32_t>(consecutiveEndingPasses);
+  w.write<uint64_t>(hashesBeforeBlackPass.size());
+  for(size_t i = 0; i<hashesBeforeBlackPass.size(); i++)
+    w.writeHash(hashesBeforeBlackPass[i]);
+  w.write<uint64_t>(hashesBeforeWhitePass.size());
+  for(size_t i = 0; i<hashesBeforeWhitePass.size(); i++)
+    w.writeHash(hashesBeforeWhitePass[i]);
+
+  w.write<int8_t>((int8_t)encorePhase);
+  w.write<int32_t>(numTurnsThisPhase);
+  w.writeLocArray(koRecapBlocked,xSize,ySize,1);
+  w.writeHash(koRecapBlockHash);
+  w.write<uint64_t>(koCapturesInEncore.size());
+  for(size_t i = 0; i<koCapturesInEncore.size(); i++) {
+    w.writeHash(koCapturesInEncore[i].posHashBeforeMove);
+    w.write<int16_t>(koCapturesInEncore[i].moveLoc);
+    w.write<int8_t>(koCapturesInEncore[i].movePla);
+  }
+  w.writeLocArray(secondEncoreStartColors,xSize,ySize,2);
+
+  w.write<float>(whiteBonusScore);
+  w.write<float>(whiteHandicapBonusScore);
+  w.write<uint8_t>(hasButton);
+  w.write<uint8_t>(isPastNormalPhaseEnd);
+  w.write<uint8_t>(isGameFinished);
+  w.write<int8_t>(winner);
+  w.write<float>(finalWhiteMinusBlackScore);
+  w.write<uint8_t>(isScored);
+  w.write<uint8_t>(isNoResult);
+  w.write<uint8_t>(isResignation);
+
+  uint64_t totalLen = buf.size() - start;
+  std::memcpy(&buf[start + 2*sizeof(uint32_t)], &totalLen, sizeof(uint64_t));
+}
+
+size_t BoardHistory::loadSnapshot(const char* data, size_t len) {
+  BoardHistorySnapshotReader r(data,len);
+  if(r.read<uint32_t>() != SNAPSHOT_MAGIC)
+    r.fail("bad magic number");
+  uint32_t version = r.read<uint32_t>();
+  if(version != SNAPSHOT_VERSION)
+    r.fail("unsupported version " + Global::uint32ToString(version));
+  uint64_t totalLen = r.read<uint64_t>();
+  if(totalLen > len)
+    r.fail("truncated data");
+  //Must at least cover the header just read, or every later bounds check would underflow
+  if(totalLen < r.pos)
+    r.fail("invalid length");
+  r.len = (size_t)totalLen;
+
+  Rules newRules = r.readRules();
+  Board newInitialBoard = r.readBoard();
+  Player newInitialPla = r.readPla(false);
+  int newInitialEncorePhase = r.read<int8_t>();
+  if(newInitialEncorePhase < 0 || newInitialEncorePhase > 2)
+    r.fail("invalid encore phase");
+  clear(newInitialBoard,newInitialPla,newRules,newInitialEncorePhase);
+  int xSize = initialBoard.x_size;
+  int ySize = initialBoard.y_size;
+
+  initialTurnNumber = r.read<int64_t>();
+  assumeMultipleStartingBlackMovesAreHandicap = r.readBool();
+  whiteHasMoved = r.readBool();
+
+  size_t numMoves = r.readCount(4);
+  for(size_t i = 0; i<numMoves; i++) {
+    Loc loc = r.readLoc();
+    Player pla = r.readPla(false);
+    moveHistory.push_back(Move(loc,pla));
+    preventEncoreHistory.push_back(r.readBool());
+  }
+  koHashHistory.clear();
+  size_t numKoHashes = r.readCount(16);
+  for(size_t i = 0; i<numKoHashes; i++)
+    koHashHistory.push_back(r.readHash());
+  firstTurnIdxWithKoHistory = (size_t)r.read<uint64_t>();
+  if(firstTurnIdxWithKoHistory + koHashHistory.size() != moveHistory.size() + 1)
+    r.fail("inconsistent ko hash history length");
+
+  for(int i = 0; i<NUM_RECENT_BOARDS; i++) {
+    recentBoards[i] = r.readBoard();
+    if(recentBoards[i].x_size != xSize || recentBoards[i].y_size != ySize)
+      r.fail("inconsistent board size");
+  }
+  currentRecentBoardIdx = NUM_RECENT_BOARDS-1;
+  presumedNextMovePla = r.readPla(false);
+
+  r.readLocArray(wasEverOccupiedOrPlayed,xSize,ySize,1,1);
+  r.readLocArray(superKoBanned,xSize,ySize,1,1);
+
+  consecutiveEndingPasses = r.read<int32_t>();
+  size_t numBlackPassHashes = r.readCount(16);
+  for(size_t i = 0; i<numBlackPassHashes; i++)
+    addHashBeforePass(P_BLACK,r.readHash());
+  size_t numWhitePassHashes = r.readCount(16);
+  for(size_t i = 0; i<numWhitePassHashes; i++)
+    addHashBeforePass(P_WHITE,r.readHash());
+
+  encorePhase = r.read<int8_t>();
+  if(encorePhase < 0 || encorePhase > 2)
+    r.fail("invalid encore phase");
+  numTurnsThisPhase = r.read<int32_t>();
+  bool newKoRecapBlocked[Board::MAX_ARR_SIZE];
+  r.readLocArray(newKoRecapBlocked,xSize,ySize,1,1);
+  for(int y = 0; y<ySize; y++) {
+    for(int x = 0; x<xSize; x++) {
+      Loc loc = Location::getLoc(x,y,xSize);
+      if(newKoRecapBlocked[loc])
+        setKoRecapBlocked(loc,true);
+    }
+  }
+  if(r.readHash() != koRecapBlockHash)
+    r.fail("inconsistent ko recapture block hash");
+  size_t numKoCaptures = r.readCount(19);
+  for(size_t i = 0; i<numKoCaptures; i++) {
+    Hash128 posHashBeforeMove = r.readHash();
+    Loc moveLoc = r.readLoc();
+    Player movePla = r.readPla(false);
+    addKoCaptureInEncore(EncoreKoCapture(posHashBeforeMove,moveLoc,movePla));
+  }
+  r.readLocArray(secondEncoreStartColors,xSize,ySize,2,C_WHITE);
+
+  whiteBonusScore = r.read<float>();
+  whiteHandicapBonusScore = r.read<float>();
+  hasButton = r.readBool();
+  isPastNormalPhaseEnd = r.readBool();
+  isGameFinished = r.readBool();
+  winner = r.readPla(true);
+  finalWhiteMinusBlackScore = r.read<float>();
+  isScored = r.readBool();
+  isNoResult = r.readBool();
+  isResignation = r.readBool();
+
+  if(r.pos != r.len)
+    r.fail("unexpected trailing data");
+  return r.pos;
+}
+
+void BoardHistory::saveSnapshotsToFile(const std::string& file, const std::vector<const BoardHistory*>& hists) {
+  std::string buf;
+  BoardHistorySnapshotWriter w(buf);
+  w.write<uint32_t>(SNAPSHOT_FILE_MAGIC);
+  w.write<uint32_t>(SNAPSHOT_VERSION);
+  w.write<uint64_t>(hists.size());
+  //Offset index from the start of the file to each snapshot, filled in below
+  size_t indexStart = buf.size();
+  buf.resize(indexStart + hists.size() * sizeof(uint64_t));
+  for(size_t i = 0; i<hists.size(); i++) {
+    uint64_t offset = buf.size();
+    std::memcpy(&buf[indexStart + i * sizeof(uint64_t)], &offset, sizeof(uint64_t));
+    hists[i]->saveSnapshot(buf);
+  }
+
+  std::string tmpFile = file + ".tmp";
+  std::ofstream out;
+  FileUtils::open(out,tmpFile,std::ios::out | std::ios::binary);
+  out.write(buf.data(),buf.size());
+  out.close();
+  if(!out)
+    throw IOError("Failed to write snapshots to " + tmpFile);
+  FileUtils::rename(tmpFile,file);
+}
+
+std::vector<BoardHistory> BoardHistory::loadSnapshotsFromFile(const std::string& file) {
+  std::string buf = FileUtils::readFileBinary(file);
+  return loadSnapshots(buf.data(),buf.size());
+}
+
+std::vector<BoardHistory> BoardHistory::loadSnapshots(const char* data, size_t len) {
+  BoardHistorySnapshotReader r(data,len);
+  if(r.read<uint32_t>() != SNAPSHOT_FILE_MAGIC)
+    r.fail("bad file magic number");
+  uint32_t version = r.read<uint32_t>();
+  if(version != SNAPSHOT_VERSION)
+    r.fail("unsupported version " + Global::uint32ToString(version));
+  size_t numHists = r.readCount(sizeof(uint64_t));
+  std::vector<BoardHistory> hists(numHists);
+  for(size_t i = 0; i<numHists; i++) {
+    uint64_t offset = r.read<uint64_t>();
+    if(offset > len)
+      r.fail("invalid snapshot offset");
+    hists[i].loadSnapshot(data + offset, len - (size_t)offset);
+  }
+  return hists;
+}
+
+static bool hashIdxTableMatches(const HashIdxTable& table, const std::vector<Hash128>& hashes) {
+  if(table.size() != hashes.size())
+    return false;
+  for(size_t i = 0; i<hashes.size(); i++) {
+    bool found = false;
+    table.forEachIdxOfHash(hashes[i], [&](uint32_t idx) {
+      if(idx == i)
+        found = true;
+    });
+    if(!found)
+      return false;
+  }
+  return true;
+}
+
+bool BoardHistory::isEqualForTesting(const BoardHistory& other) const {
+  if(!(rules == other.rules) || rulesHash != other.rulesHash || moveFuncs != other.moveFuncs)
+    return false;
+  if(moveHistory.size() != other.moveHistory.size())
+    return false;
+  for(size_t i = 0; i<moveHistory.size(); i++) {
+    if(moveHistory[i].loc != other.moveHistory[i].loc || moveHistory[i].pla != other.moveHistory[i].pla)
+      return false;
+  }
+  if(preventEncoreHistory.toVector() != other.preventEncoreHistory.toVector())
+    return false;
+  if(koHashHistory.toVector() != other.koHashHistory.toVector() || firstTurnIdxWithKoHistory != other.firstTurnIdxWithKoHistory)
+    return false;
+
+  if(!initialBoard.isEqualForTesting(other.initialBoard,true,true))
+    return false;
+  if(initialPla != other.initialPla || initialEncorePhase != other.initialEncorePhase || initialTurnNumber != other.initialTurnNumber)
+    return false;
+  if(assumeMultipleStartingBlackMovesAreHandicap != other.assumeMultipleStartingBlackMovesAreHandicap || whiteHasMoved != other.whiteHasMoved)
+    return false;
+  for(int i = 0; i<NUM_RECENT_BOARDS; i++) {
+    if(!getRecentBoard(i).isEqualForTesting(other.getRecentBoard(i),true,true))
+      return false;
+  }
+  if(presumedNextMovePla != other.presumedNextMovePla)
+    return false;
+
+  //Only on-board locations are meaningful, off-board entries may hold anything
+  for(int y = 0; y<initialBoard.y_size; y++) {
+    for(int x = 0; x<initialBoard.x_size; x++) {
+      Loc i = Location::getLoc(x,y,initialBoard.x_size);
+      if(wasEverOccupiedOrPlayed[i] != other.wasEverOccupiedOrPlayed[i] || superKoBanned[i] != other.superKoBanned[i])
+        return false;
+      if(koRecapBlocked[i] != other.koRecapBlocked[i] || secondEncoreStartColors[i] != other.secondEncoreStartColors[i])
+        return false;
+    }
+  }
+
+  if(consecutiveEndingPasses != other.consecutiveEndingPasses)
+    return false;
+  if(hashesBeforeBlackPass != other.hashesBeforeBlackPass || hashesBeforeWhitePass != other.hashesBeforeWhitePass)
+    return false;
+  if(!hashIdxTableMatches(hashesBeforeBlackPassTable,other.hashesBeforeBlackPass) ||
+     !hashIdxTableMatches(hashesBeforeWhitePassTable,other.hashesBeforeWhitePass))
+    return false;
+
+  if(encorePhase != other.encorePhase || numTurnsThisPhase != other.numTurnsThisPhase)
+    return false;
+  //The locations are kept unordered
+  std::vector<Loc> locs = koRecapBlockedLocs;
+  std::vector<Loc> otherLocs = other.koRecapBlockedLocs;
+  std::sort(locs.begin(),locs.end());
+  std::sort(otherLocs.begin(),otherLocs.end());
+  if(locs != otherLocs || koRecapBlockHash != other.koRecapBlockHash)
+    return false;
+  if(koCapturesInEncore.size() != other.koCapturesInEncore.size())
+    return false;
+  std::vector<Hash128> koCaptureHashes;
+  for(size_t i = 0; i<koCapturesInEncore.size(); i++) {
+    const EncoreKoCapture& a = koCapturesInEncore[i];
+    const EncoreKoCapture& b = other.koCapturesInEncore[i];
+    if(a.posHashBeforeMove != b.posHashBeforeMove || a.moveLoc != b.moveLoc || a.movePla != b.movePla)
+      return false;
+    koCaptureHashes.push_back(b.posHashBeforeMove);
+  }
+  if(!hashIdxTableMatches(koCapturesInEncoreTable,koCaptureHashes))
+    return false;
+
+  if(whiteBonusScore != other.whiteBonusScore || whiteHandicapBonusScore != other.whiteHandicapBonusScore || hasButton != other.hasButton)
+    return false;
+  if(isPastNormalPhaseEnd != other.isPastNormalPhaseEnd || isGameFinished != other.isGameFinished || winner != other.winner)
+    return false;
+  if(finalWhiteMinusBlackScore != other.finalWhiteMinusBlackScore)
+    return false;
+  if(isScored != other.isScored || isNoResult != other.isNoResult || isResignation != other.isResignation)
+    return false;
+  return true;
+}
+
+//Expects loadSnapshot to reject the data with an IOError, rather than accept it or read outside of it.
+//Copies the data to a buffer of exactly its length so that any overread lands outside of the allocation.
+static void checkSnapshotRejected(const std::string& data) {
+  std::vector<char> exact(data.begin(),data.end());
+  BoardHistory hist;
+  bool threw = false;
+  try {
+    hist.loadSnapshot(exact.data(),exact.size());
+  }
+  catch(const IOError&) {
+    threw = true;
+  }
+  testAssert(threw);
+}
+
+void BoardHistory::runTests() {
+  std::cout << "Running board history tests" << std::endl;
+  Rand rand("boardhistory snapshot tests");
+
+  //Random games under rules covering every ko rule, both scoring rules with the encore, and the button, saving and
+  //loading a snapshot after every move.
+  std::vector<std::string> snapshots;
+  std::vector<BoardHistory> histsOfSnapshots;
+  const char* rulesNames[4] = {"tromp-taylor", "japanese", "aga-button", "stone_scoring"};
+  for(int r = 0; r<4; r++) {
+    Rules rules = Rules::parseRules(rulesNames[r]);
+    for(int game = 0; game<3; game++) {
+      int xSize = game == 2 ? 7 : 9;
+      int ySize = game == 2 ? 5 : 9;
+      Board board(xSize,ySize);
+      Player pla = P_BLACK;
+      BoardHistory hist(board,pla,rules,0);
+      hist.setInitialTurnNumber(game * 10);
+      for(int turn = 0; turn<300 && !hist.isGameFinished; turn++) {
+        Loc loc = Board::PASS_LOC;
+        //Pass more often later on so that games reach the end and the encore
+        if(rand.nextDouble() >= (double)turn / 300.0) {
+          for(int attempt = 0; attempt<20; attempt++) {
+            Loc candidate = Location::getLoc((int)rand.nextUInt(xSize),(int)rand.nextUInt(ySize),xSize);
+            if(hist.isLegal(board,candidate,pla)) {
+              loc = candidate;
+              break;
+            }
+          }
+        }
+        testAssert(hist.isLegal(board,loc,pla));
+        hist.makeBoardMoveAssumeLegal(board,loc,pla,NULL);
+        pla = getOpp(pla);
+
+        std::string buf;
+        hist.saveSnapshot(buf);
+        BoardHistory loaded;
+        testAssert(loaded.loadSnapshot(buf.data(),buf.size()) == buf.size());
+        testAssert(loaded.isEqualForTesting(hist));
+        testAssert(loaded.getRecentBoard(0).isEqualForTesting(board,true,true));
+        if(turn % 25 == 0) {
+          snapshots.push_back(buf);
+          histsOfSnapshots.push_back(hist);
+        }
+      }
+      testAssert(hist.isGameFinished || hist.moveHistory.size() == 300);
+    }
+  }
+
+  //Several snapshots in one buffer with the offset index, as written to files
+  {
+    std::string buf;
+    BoardHistorySnapshotWriter w(buf);
+    w.write<uint32_t>(SNAPSHOT_FILE_MAGIC);
+    w.write<uint32_t>(SNAPSHOT_VERSION);
+    w.write<uint64_t>(snapshots.size());
+    size_t indexStart = buf.size();
+    buf.resize(indexStart + snapshots.size() * sizeof(uint64_t));
+    for(size_t i = 0; i<snapshots.size(); i++) {
+      uint64_t offset = buf.size();
+      std::memcpy(&buf[indexStart + i * sizeof(uint64_t)], &offset, sizeof(uint64_t));
+      buf += snapshots[i];
+    }
+    std::vector<BoardHistory> loaded = loadSnapshots(buf.data(),buf.size());
+    testAssert(loaded.size() == histsOfSnapshots.size());
+    for(size_t i = 0; i<loaded.size(); i++)
+      testAssert(loaded[i].isEqualForTesting(histsOfSnapshots[i]));
+
+    //Offsets and counts pointing past the end
+    std::string badOffset = buf;
+    uint64_t offset = buf.size() - 4;
+    std::memcpy(&badOffset[indexStart], &offset, sizeof(uint64_t));
+    bool threw = false;
+    try { loadSnapshots(badOffset.data(),badOffset.size()); } catch(const IOError&) { threw = true; }
+    testAssert(threw);
+    std::string badCount = buf;
+    uint64_t count = 1ULL << 40;
+    std::memcpy(&badCount[2*sizeof(uint32_t)], &count, sizeof(uint64_t));
+    threw = false;
+    try { loadSnapshots(badCount.data(),badCount.size()); } catch(const IOError&) { threw = true; }
+    testAssert(threw);
+  }
+
+  //Malformed snapshots
+  {
+    const std::string& valid = snapshots.back();
+    uint64_t validLen = valid.size();
+
+    //A length shorter than the header itself
+    {
+      std::string data = valid.substr(0,16);
+      uint64_t totalLen = 8;
+      std::memcpy(&data[8], &totalLen, sizeof(uint64_t));
+      checkSnapshotRejected(data);
+      totalLen = 0;
+      std::memcpy(&data[8], &totalLen, sizeof(uint64_t));
+      checkSnapshotRejected(data);
+    }
+    //Bad magic and version
+    {
+      std::string data = valid;
+      data[0] ^= 1;
+      checkSnapshotRejected(data);
+      data = valid;
+      data[4] ^= 1;
+      checkSnapshotRejected(data);
+    }
+    //Every truncation, both with the original length, which then runs past the end of the data, and with the length
+    //rewritten to match, which then ends partway through a field
+    for(size_t len = 0; len<validLen; len++) {
+      std::string data = valid.substr(0,len);
+      checkSnapshotRejected(data);
+      if(len >= 16) {
+        uint64_t totalLen = len;
+        std::memcpy(&data[8], &totalLen, sizeof(uint64_t));
+        checkSnapshotRejected(data);
+      }
+    }
+    //Trailing bytes claimed as part of the snapshot
+    {
+      std::string data = valid + std::string(8,'\0');
+      uint64_t totalLen = data.size();
+      std::memcpy(&data[8], &totalLen, sizeof(uint64_t));
+      checkSnapshotRejected(data);
+    }
+    //Arbitrary corruption must either load or be rejected, never read outside the data
+    for(int i = 0; i<2000; i++) {
+      std::vector<char> data(valid.begin(),valid.end());
+      size_t pos = 16 + (size_t)rand.nextUInt((uint32_t)(validLen-16));
+      data[pos] = (char)(data[pos] ^ (1 << rand.nextUInt(8)));
+      BoardHistory hist;
+      try {
+        hist.loadSnapshot(data.data(),data.size());
+      }
+      catch(const IOError&) {
+      }
+    }
+  }
+
+  //Random walks of moves and undos under every ko rule on a small board, where captures are frequent. Every undo must
+  //get back exactly the board and history from before the move, including the recent boards rebuilt by undoing a move
+  //on them and the superko bans.
+  {
+    int numWithSuperKoBannedChanged = 0;
+    int numWithRecentBoardRebuilt = 0;
+    int numWithRecentBoardCaptureUndone = 0;
+    int koRules[3] = {Rules::KO_SIMPLE, Rules::KO_POSITIONAL, Rules::KO_SITUATIONAL};
+    for(int r = 0; r<3; r++) {
+      Rules rules = Rules::getTrompTaylorish();
+      rules.koRule = koRules[r];
+      rules.multiStoneSuicideLegal = r != 1;
+      Board board(5,5);
+      BoardHistory hist(board,P_BLACK,rules,0);
+      std::vector<BoardHistory::MoveUndoRecord> records;
+      std::vector<Board> boardsBefore;
+      std::vector<BoardHistory> histsBefore;
+      auto makeMove = [&](Loc loc, Player pla) {
+        boardsBefore.push_back(board);
+        histsBefore.push_back(hist);
+        records.push_back(BoardHistory::MoveUndoRecord());
+        BoardHistory::MoveUndoRecord& record = records.back();
+        testAssert(hist.makeBoardMoveTolerant(board,loc,pla,record));
+        if(record.superKoBannedChanged.size() > 0)
+          numWithSuperKoBannedChanged++;
+        if(!record.recentBoardOverwrittenIsCopy) {
+          numWithRecentBoardRebuilt++;
+          if(record.recentBoardOverwrittenMove.capDirs != 0)
+            numWithRecentBoardCaptureUndone++;
+        }
+      };
+
+      //Random play almost never repeats a position, so start with black taking a ko and both players passing, after
+      //which white retaking the ko would repeat the position under either superko rule
+      const int script[11][3] = {
+        {0,1,P_BLACK}, {0,2,P_WHITE}, {1,0,P_BLACK}, {2,2,P_WHITE}, {2,1,P_BLACK}, {1,3,P_WHITE},
+        {-1,-1,P_BLACK}, {1,1,P_WHITE}, {1,2,P_BLACK}, {-1,-1,P_WHITE}, {-1,-1,P_BLACK}
+      };
+      for(int i = 0; i<11; i++) {
+        Loc loc = script[i][0] < 0 ? Board::PASS_LOC : Location::getLoc(script[i][0],script[i][1],5);
+        makeMove(loc,(Player)script[i][2]);
+      }
+      testAssert(board.colors[Location::getLoc(1,1,5)] == C_EMPTY);
+      testAssert(hist.superKoBanned[Location::getLoc(1,1,5)] == (rules.koRule != Rules::KO_SIMPLE));
+
+      for(int step = 0; step<3000; step++) {
+        if(records.size() > 0 && rand.nextBool(0.3)) {
+          size_t numToUndo = 1 + (size_t)rand.nextUInt((uint32_t)std::min(records.size(),(size_t)10));
+          for(size_t i = 0; i<numToUndo; i++) {
+            hist.undoBoardMove(board,records.back());
+            testAssert(board.isEqualForTesting(boardsBefore.back(),true,true));
+            testAssert(hist.isEqualForTesting(histsBefore.back()));
+            records.pop_back();
+            boardsBefore.pop_back();
+            histsBefore.pop_back();
+          }
+          continue;
+        }
+        Player pla = hist.presumedNextMovePla;
+        Loc loc = Board::PASS_LOC;
+        if(!rand.nextBool(0.1)) {
+          for(int attempt = 0; attempt<20; attempt++) {
+            Loc candidate = Location::getLoc((int)rand.nextUInt(5),(int)rand.nextUInt(5),5);
+            if(hist.isLegal(board,candidate,pla)) {
+              loc = candidate;
+              break;
+            }
+          }
+        }
+        makeMove(loc,pla);
+      }
+      while(records.size() > 0) {
+        hist.undoBoardMove(board,records.back());
+        testAssert(board.isEqualForTesting(boardsBefore.back(),true,true));
+        testAssert(hist.isEqualForTesting(histsBefore.back()));
+        records.pop_back();
+        boardsBefore.pop_back();
+        histsBefore.pop_back();
+      }
+    }
+    testAssert(numWithSuperKoBannedChanged > 0);
+    testAssert(numWithRecentBoardRebuilt > 0);
+    testAssert(numWithRecentBoardCaptureUndone > 0);
+  }
+}
+
+HashIdxTable::HashIdxTable()
+  :entries(),
+   numEntries(0)
+{}
+HashIdxTable::~HashIdxTable()
+{}
+
+size_t HashIdxTable::size() const {
+  return numEntries;
+}
+
+void HashIdxTable::clear() {
+  if(numEntries <= 0)
+    return;
+  //Keep the capacity, since tables that were filled once tend to be filled again
+  Entry emptyEntry;
+  emptyEntry.hash = Hash128();
+  emptyEntry.idx = EMPTY_IDX;
+  std::fill(entries.begin(),entries.end(),emptyEntry);
+  numEntries = 0;
+}
+
+void HashIdxTable::add(Hash128 hash, uint32_t idx) {
+  assert(idx != EMPTY_IDX);
+  //Keep the load factor at most 1/2
+  if((numEntries+1) * 2 > entries.size())
+    grow();
+  size_t mask = entries.size()-1;
+  size_t i = (size_t)hash.hash0 & mask;
+  while(entries[i].idx != EMPTY_IDX)
+    i = (i+1) & mask;
+  entries[i].hash = hash;
+  entries[i].idx = idx;
+  numEntries++;
+}
+
+bool HashIdxTable::containsHash(Hash128 hash) const {
+  if(numEntries <= 0)
+    return false;
+  size_t mask = entries.size()-1;
+  for(size_t i = (size_t)hash.hash0 & mask; entries[i].idx != EMPTY_IDX; i = (i+1) & mask) {
+    if(entries[i].hash == hash)
+      return true;
+  }
+  return false;
+}
+
+void HashIdxTable::grow() {
+  size_t newCapacity = entries.size() <= 0 ? INITIAL_CAPACITY : entries.size() * 2;
+  Entry emptyEntry;
+  emptyEntry.hash = Hash128();
+  emptyEntry.idx = EMPTY_IDX;
+  std::vector<Entry> oldEntries(newCapacity,emptyEntry);
+  oldEntries.swap(entries);
+  size_t mask = newCapacity-1;
+  for(size_t j = 0; j<oldEntries.size(); j++) {
+    if(oldEntries[j].idx == EMPTY_IDX)
+      continue;
+    size_t i = (size_t)oldEntries[j].hash.hash0 & mask;
+    while(entries[i].idx != EMPTY_IDX)
+      i = (i+1) & mask;
+    entries[i] = oldEntries[j];
+  }
+}
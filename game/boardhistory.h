@@ -3,25 +3,77 @@
 
 #include "../core/global.h"
 #include "../core/hash.h"
+#include "../core/persistentvector.h"
 #include "../game/board.h"
 #include "../game/rules.h"
 
 struct KoHashTable;
 
+//Open-addressed hash index from Hash128 to indices in some separate chronological vector, so that
+//membership and lookup by hash stay O(1) as that vector grows. The same hash may be added multiple times.
+//Allocates nothing until the first add.
+struct HashIdxTable {
+  struct Entry {
+    Hash128 hash;
+    uint32_t idx;
+  };
+  std::vector<Entry> entries;
+  size_t numEntries;
+
+  static const uint32_t EMPTY_IDX = 0xFFFFFFFFU;
+  static const size_t INITIAL_CAPACITY = 16;
+
+  HashIdxTable();
+  ~HashIdxTable();
+
+  size_t size() const;
+  void clear();
+  void add(Hash128 hash, uint32_t idx);
+  bool containsHash(Hash128 hash) const;
+
+  //Calls f(idx) for each idx that was added with this hash, in unspecified order
+  template<typename Func>
+  void forEachIdxOfHash(Hash128 hash, Func f) const {
+    if(numEntries <= 0)
+      return;
+    size_t mask = entries.size()-1;
+    for(size_t i = (size_t)hash.hash0 & mask; entries[i].idx != EMPTY_IDX; i = (i+1) & mask) {
+      if(entries[i].hash == hash)
+        f(entries[i].idx);
+    }
+  }
+
+private:
+  void grow();
+};
+
 //A data structure enabling checking of move legality, including optionally superko,
 //and implements scoring and support for various rulesets (see rules.h)
 struct BoardHistory {
+ private:
+  //Private so that rules can only change through clear and setKomi, which keep rulesHash and moveFuncs in sync with it.
+  //Read it through getRules.
   Rules rules;
+  //Zobrist contribution of the komi-independent fields of rules (ko, scoring, tax, suicide).
+  Hash128 rulesHash;
+  //Move-making functions specialized at compile time for the ko and scoring rule of rules, looked up alongside rulesHash
+  //so that the per-move path does not repeatedly branch on the rules.
+  struct RulesSpecializedMoveFuncs;
+  const RulesSpecializedMoveFuncs* moveFuncs;
 
+ public:
+
+  //The histories below are persistent vectors - copying a BoardHistory shares the immutable prefix of each
+  //with the original, and only the short mutable tail is duplicated.
   //Chronological history of moves
-  std::vector<Move> moveHistory;
+  PersistentVector<Move> moveHistory;
   //Chronological history of preventEncore, for ability to replay a board history
-  std::vector<bool> preventEncoreHistory;
+  PersistentVector<bool> preventEncoreHistory;
   //Chronological history of hashes, including the latest board's hash.
   //Theses are the hashes that determine whether a board is the "same" or not given the rules
   //(e.g. they include the player if situational superko, and not if positional)
   //Cleared on a pass if passes clear ko bans
-  std::vector<Hash128> koHashHistory;
+  PersistentVector<Hash128> koHashHistory;
   //The index of the first turn for which we have a koHashHistory (since depending on rules, passes may clear it).
   //Index 0 = starting state, index 1 = state after move 0, index 2 = state after move 1, etc...
   size_t firstTurnIdxWithKoHistory;
@@ -53,6 +105,9 @@ struct BoardHistory {
   //All ko hashes from which a player passed
   std::vector<Hash128> hashesBeforeBlackPass;
   std::vector<Hash128> hashesBeforeWhitePass;
+  //Hash indices of the above, for fast membership testing
+  HashIdxTable hashesBeforeBlackPassTable;
+  HashIdxTable hashesBeforeWhitePassTable;
 
   //Encore phase 0,1,2 for territory scoring
   int encorePhase;
@@ -61,11 +116,15 @@ struct BoardHistory {
 
   //Ko-recapture-block locations for territory scoring in encore
   bool koRecapBlocked[Board::MAX_ARR_SIZE];
+  //The locations currently marked in koRecapBlocked, unordered, so that they can be visited without scanning the board
+  std::vector<Loc> koRecapBlockedLocs;
   Hash128 koRecapBlockHash; //Hash contribution from ko-recap-block locations in encore.
 
   //Used to implement once-only rules for ko captures in encore
   STRUCT_NAMED_TRIPLE(Hash128,posHashBeforeMove,Loc,moveLoc,Player,movePla,EncoreKoCapture);
   std::vector<EncoreKoCapture> koCapturesInEncore;
+  //Index of koCapturesInEncore by posHashBeforeMove
+  HashIdxTable koCapturesInEncoreTable;
 
   //State of the grid as of the start of encore phase 2 for territory scoring
   Color secondEncoreStartColors[Board::MAX_ARR_SIZE];
@@ -108,6 +167,7 @@ struct BoardHistory {
   void clear(const Board& board, Player pla, const Rules& rules, int encorePhase);
   //Set only the komi field of the rules, does not clear history, does recompute game score if game is over.
   void setKomi(float newKomi);
+  const Rules& getRules() const;
   //Set the initial turn number. Affects nothing else.
   void setInitialTurnNumber(int64_t n);
   //Set assumeMultipleStartingBlackMovesAreHandicap and update bonus points accordingly
@@ -150,6 +210,15 @@ struct BoardHistory {
   //preventEncore artifically prevents any move from entering or advancing the encore phase when using territory scoring.
   void makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable);
   void makeBoardMoveAssumeLegal(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable, bool preventEncore);
+  //Replay moves that are already known to be legal, such as from a finished game record, skipping the per-move
+  //superko ban computation and long-cycle check and only materializing them once at the end of the replay.
+  //To obtain legality state at intermediate checkpoints, call the ranged version repeatedly on consecutive ranges.
+  void replayTrusted(Board& board, const std::vector<Move>& moves);
+  void replayTrusted(Board& board, const std::vector<Move>& moves, size_t startIdx, size_t endIdx);
+  //Lower-level pieces of the above. After makeBoardMoveTrusted, superKoBanned, isLegal, and the no-result status from
+  //long cycles are stale until recomputeLegalityState is called. makeBoardMoveAssumeLegal is exactly these two in sequence.
+  void makeBoardMoveTrusted(Board& board, Loc moveLoc, Player movePla, bool preventEncore);
+  void recomputeLegalityState(const Board& board, const KoHashTable* rootKoHashTable);
   //Make a move with legality checking, but be mostly tolerant and allow moves that can still be handled but that may not technically
   //be legal. This is intended for reading moves from SGFs and such where maybe we're getting moves that were played in a different
   //ruleset than ours. Returns true if successful, false if was illegal even unter tolerant rules.
@@ -157,6 +226,47 @@ struct BoardHistory {
   bool makeBoardMoveTolerant(Board& board, Loc moveLoc, Player movePla, bool preventEncore);
   bool isLegalTolerant(const Board& board, Loc moveLoc, Player movePla) const;
 
+  //Everything about the board and history that a single move may change, so that the move can be undone exactly.
+  struct MoveUndoRecord {
+    Loc moveLoc;
+    Player movePla;
+    //The move on the board, undone in place rather than by restoring a copy
+    Board::MoveRecord boardMoveRecord;
+    //The move pushes the oldest board out of recentBoards. Early in the history that is only a copy of the next oldest,
+    //otherwise the two differ by exactly one move, so it is rebuilt from the next oldest by undoing that move.
+    bool recentBoardOverwrittenIsCopy;
+    Board::MoveRecord recentBoardOverwrittenMove;
+    //Locations whose superKoBanned entry the move changed, usually few or none
+    std::vector<Loc> superKoBannedChanged;
+    bool wasEverOccupiedOrPlayed;
+    //Only filled if the move was a pass that cleared the ko hash history
+    bool koHashHistoryCleared;
+    PersistentVector<Hash128> koHashHistory;
+    size_t firstTurnIdxWithKoHistory;
+    Player presumedNextMovePla;
+    bool whiteHasMoved;
+    int consecutiveEndingPasses;
+    int numTurnsThisPhase;
+    float whiteBonusScore;
+    float whiteHandicapBonusScore;
+    bool isPastNormalPhaseEnd;
+    bool isGameFinished;
+    Player winner;
+    float finalWhiteMinusBlackScore;
+    bool isScored;
+    bool isNoResult;
+    bool isResignation;
+  };
+  //Same as makeBoardMoveTolerant, but also fills undoRecord so that the move can be reverted with undoBoardMove, for
+  //walking a tree of variations with a single board and history rather than a copy of both per branch.
+  //Only supported for area scoring without a button, where no move enters an encore or takes a button.
+  //Throws StringError under other rules.
+  bool makeBoardMoveTolerant(Board& board, Loc moveLoc, Player movePla, MoveUndoRecord& undoRecord);
+  //Reverts the move that filled undoRecord, which must be the most recent move on this history, restoring both this
+  //history and board to their prior state, up to the chain representation as with Board::undo.
+  //Moves MUST be undone in the reverse of the order they were made.
+  void undoBoardMove(Board& board, const MoveUndoRecord& undoRecord);
+
   //Slightly expensive, check if the entire game is all pass-alive-territory, and if so, declare the game finished
   void endGameIfAllPassAlive(const Board& board);
   //Score the board as-is. If the game is already finished, and is NOT a no-result, then this should be idempotent.
@@ -174,12 +284,33 @@ struct BoardHistory {
   static int numHandicapStonesOnBoard(const Board& b);
   //Takes into account assumeMultipleStartingBlackMovesAreHandicap
   int computeNumHandicapStones() const;
+  //Same, but as if assumeMultipleStartingBlackMovesAreHandicap were set to the given value
+  int computeNumHandicapStones(bool assumeMultipleBlackMovesAreHandicap) const;
   int computeWhiteHandicapBonus() const;
 
   //Heuristically check if this history looks like an sgf variation where black passed to effectively
   //turn into white, or similar.
   bool hasBlackPassOrWhiteFirst() const;
 
+  //Binary checkpointing of the full history state, e.g. to resume in-flight games after a crash or preemption.
+  //Snapshots are self-contained byte strings with fixed-width native-endian fields and no pointers, so a file of them
+  //may be read or memory-mapped and snapshots restored directly from the buffer. The current board is part of the
+  //snapshot and after loading is available as getRecentBoard(0).
+  //Appends a snapshot to buf.
+  void saveSnapshot(std::string& buf) const;
+  //Restores from the snapshot at the start of data, returning the number of bytes consumed. Throws IOError if malformed.
+  size_t loadSnapshot(const char* data, size_t len);
+  //Batch versions - write the snapshots of many histories to a file in a single write, along with an offset index.
+  //The file is written to a temporary name and renamed into place, so an interrupted save leaves any previous file intact.
+  static void saveSnapshotsToFile(const std::string& file, const std::vector<const BoardHistory*>& hists);
+  static std::vector<BoardHistory> loadSnapshotsFromFile(const std::string& file);
+  static std::vector<BoardHistory> loadSnapshots(const char* data, size_t len);
+
+  //For testing, whether other is in the same state as this history. Boards are compared as by Board::isEqualForTesting,
+  //and the recent boards by how many moves ago they were rather than by where they are stored.
+  bool isEqualForTesting(const BoardHistory& other) const;
+  static void runTests();
+
   //Compute a hash that takes into account the full situation and simple ko prohibition. Does NOT include rules or history.
   static Hash128 getSituationAndSimpleKoHash(const Board& board, Player nextPlayer);
   //Compute a hash that takes into account the full situation, simple ko prohibition, and the previous turn's position. (Does NOT include rules).
@@ -188,14 +319,27 @@ struct BoardHistory {
   static Hash128 getSituationRulesAndKoHash(const Board& board, const BoardHistory& hist, Player nextPlayer, double drawEquivalentWinsForWhite);
 
 private:
+  static const RulesSpecializedMoveFuncs* getMoveFuncs(const Rules& rules);
+  template<int KO_RULE, int SCORING_RULE>
+  void makeBoardMoveAssumeLegalSpecialized(Board& board, Loc moveLoc, Player movePla, const KoHashTable* rootKoHashTable, bool preventEncore);
+  template<int KO_RULE, int SCORING_RULE>
+  void makeBoardMoveTrustedSpecialized(Board& board, Loc moveLoc, Player movePla, bool preventEncore);
+  template<int KO_RULE, int SCORING_RULE>
+  void recomputeLegalityStateSpecialized(const Board& board, const KoHashTable* rootKoHashTable);
   bool koHashOccursInHistory(Hash128 koHash, const KoHashTable* rootKoHashTable) const;
   void setKoRecapBlocked(Loc loc, bool b);
+  void clearKoRecapBlocked();
   int countAreaScoreWhiteMinusBlack(const Board& board, Color area[Board::MAX_ARR_SIZE]) const;
   int countTerritoryAreaScoreWhiteMinusBlack(const Board& board, Color area[Board::MAX_ARR_SIZE]) const;
   void setFinalScoreAndWinner(float score);
   int newConsecutiveEndingPassesAfterPass() const;
   bool phaseHasSpightlikeEndingAndPassHistoryClearing() const;
   bool wouldBeSpightlikeEndingPass(Player movePla, Hash128 koHashBeforeMove) const;
+  void addHashBeforePass(Player movePla, Hash128 koHashBeforeMove);
+  void removeLastHashBeforePass(Player movePla);
+  void clearHashesBeforePass();
+  void addKoCaptureInEncore(const EncoreKoCapture& ekc);
+  void clearKoCapturesInEncore();
 };
 
 struct KoHashTable {
@@ -1,5 +1,7 @@
 #include "../game/graphhash.h"
 
+#include "../core/multithread.h"
+
 Hash128 GraphHash::getStateHash(const BoardHistory& hist, Player nextPlayer, double drawEquivalentWinsForWhite) {
   const Board& board = hist.getRecentBoard(0);
   Hash128 hash = BoardHistory::getSituationRulesAndKoHash(board, hist, nextPlayer, drawEquivalentWinsForWhite);
@@ -56,3 +58,66 @@ Hash128 GraphHash::getGraphHashFromScratch(const BoardHistory& histOrig, Player
   return graphHash;
 }
 
+void GraphHash::getGraphHashesForAllTurns(const BoardHistory& histOrig, int repBound, double drawEquivalentWinsForWhite, std::vector<Hash128>& buf) {
+  BoardHistory hist = histOrig.copyToInitial();
+  Board board = hist.getRecentBoard(0);
+  Hash128 graphHash = Hash128();
+
+  size_t numMoves = histOrig.moveHistory.size();
+  buf.clear();
+  buf.reserve(numMoves+1);
+  for(size_t i = 0; i<numMoves; i++) {
+    Move move = histOrig.moveHistory[i];
+    graphHash = getGraphHash(graphHash, hist, move.pla, repBound, drawEquivalentWinsForWhite);
+    buf.push_back(graphHash);
+    bool suc = hist.makeBoardMoveTolerant(board, move.loc, move.pla, histOrig.preventEncoreHistory[i]);
+    if(!suc)
+      throw StringError("GraphHash::getGraphHashesForAllTurns: illegal move " + Location::toString(move.loc,board) + " on turn " + Global::uint64ToString(i));
+  }
+  graphHash = getGraphHash(graphHash, hist, histOrig.presumedNextMovePla, repBound, drawEquivalentWinsForWhite);
+  buf.push_back(graphHash);
+}
+
+void GraphHash::getGraphHashesForAllTurns(
+  const std::vector<const BoardHistory*>& hists,
+  int repBound,
+  double drawEquivalentWinsForWhite,
+  int numThreads,
+  std::vector<std::vector<Hash128>>& bufs
+) {
+  if(numThreads <= 0)
+    throw StringError("GraphHash::getGraphHashesForAllTurns: numThreads must be positive");
+  bufs.clear();
+  bufs.resize(hists.size());
+
+  std::atomic<size_t> nextIdx(0);
+  std::mutex errorMutex;
+  std::exception_ptr firstError = nullptr;
+  auto processLoop = [&]() {
+    while(true) {
+      size_t idx = nextIdx.fetch_add(1);
+      if(idx >= hists.size())
+        break;
+      try {
+        getGraphHashesForAllTurns(*(hists[idx]), repBound, drawEquivalentWinsForWhite, bufs[idx]);
+      }
+      catch(...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if(firstError == nullptr)
+          firstError = std::current_exception();
+        //Stop handing out further games
+        nextIdx.store(hists.size());
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(int i = 0; i<numThreads-1; i++)
+    threads.push_back(std::thread(processLoop));
+  processLoop();
+  for(size_t i = 0; i<threads.size(); i++)
+    threads[i].join();
+
+  if(firstError != nullptr)
+    std::rethrow_exception(firstError);
+}
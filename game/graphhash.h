@@ -14,6 +14,21 @@ namespace GraphHash {
 
   //Compute graph hash from scratch by replaying the whole history.
   Hash128 getGraphHashFromScratch(const BoardHistory& hist, Player nextPlayer, int repBound, double drawEquivalentWinsForWhite);
+
+  //Compute the graph hash of every turn of hist in a single replay. Fills buf with hist.moveHistory.size()+1 hashes,
+  //where buf[i] is the graph hash of the position before move i with the player of move i to move, and the final
+  //entry is for the end position with hist.presumedNextMovePla to move. buf[i] is identical to what getGraphHashFromScratch
+  //would return for the history truncated to its first i moves.
+  void getGraphHashesForAllTurns(const BoardHistory& hist, int repBound, double drawEquivalentWinsForWhite, std::vector<Hash128>& buf);
+  //Same, for many games at once, processed concurrently by numThreads threads.
+  //If any game fails to replay, rethrows the first error after all threads finish.
+  void getGraphHashesForAllTurns(
+    const std::vector<const BoardHistory*>& hists,
+    int repBound,
+    double drawEquivalentWinsForWhite,
+    int numThreads,
+    std::vector<std::vector<Hash128>>& bufs
+  );
 }
 
 #endif
@@ -572,23 +572,35 @@ bool Rules::tryParseRulesWithoutKomi(const string& sOrig, Rules& buf, float komi
 }
 
 string Rules::toStringNoKomiMaybeNice() const {
-  if(equalsIgnoringKomi(parseRulesHelper("TrompTaylor",false)))
-    return "TrompTaylor";
-  if(equalsIgnoringKomi(parseRulesHelper("Japanese",false)))
-    return "Japanese";
-  if(equalsIgnoringKomi(parseRulesHelper("Chinese",false)))
-    return "Chinese";
-  if(equalsIgnoringKomi(parseRulesHelper("Chinese-OGS",false)))
-    return "Chinese-OGS";
-  if(equalsIgnoringKomi(parseRulesHelper("AGA",false)))
-    return "AGA";
-  if(equalsIgnoringKomi(parseRulesHelper("StoneScoring",false)))
-    return "StoneScoring";
-  if(equalsIgnoringKomi(parseRulesHelper("NewZealand",false)))
-    return "NewZealand";
+  //Parse the named rulesets only once rather than on every call
+  static const string niceNames[7] = {
+    "TrompTaylor", "Japanese", "Chinese", "Chinese-OGS", "AGA", "StoneScoring", "NewZealand"
+  };
+  static const Rules niceRules[7] = {
+    parseRulesHelper(niceNames[0],false),
+    parseRulesHelper(niceNames[1],false),
+    parseRulesHelper(niceNames[2],false),
+    parseRulesHelper(niceNames[3],false),
+    parseRulesHelper(niceNames[4],false),
+    parseRulesHelper(niceNames[5],false),
+    parseRulesHelper(niceNames[6],false),
+  };
+  for(int i = 0; i<7; i++) {
+    if(equalsIgnoringKomi(niceRules[i]))
+      return niceNames[i];
+  }
   return toStringNoKomi();
 }
 
+Hash128 Rules::getZobristHashNoKomi() const {
+  Hash128 hash = ZOBRIST_KO_RULE_HASH[koRule];
+  hash ^= ZOBRIST_SCORING_RULE_HASH[scoringRule];
+  hash ^= ZOBRIST_TAX_RULE_HASH[taxRule];
+  if(multiStoneSuicideLegal)
+    hash ^= ZOBRIST_MULTI_STONE_SUICIDE_HASH;
+  return hash;
+}
+
 
 const Hash128 Rules::ZOBRIST_KO_RULE_HASH[4] = {
   Hash128(0x3cc7e0bf846820f6ULL, 0x1fb7fbde5fc6ba4eULL),  //Based on sha256 hash of Rules::KO_SIMPLE
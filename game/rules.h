@@ -102,6 +102,9 @@ struct Rules {
   static const Hash128 ZOBRIST_MULTI_STONE_SUICIDE_HASH;
   static const Hash128 ZOBRIST_BUTTON_HASH;
 
+  //Zobrist contribution of the fields of the rules that affect legality and scoring except for komi (ko, scoring, tax, suicide).
+  Hash128 getZobristHashNoKomi() const;
+
 private:
   nlohmann::json toJsonHelper(bool omitKomi, bool omitDefaults) const;
 };
@@ -0,0 +1,152 @@
+#include "../game/rulesregistry.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+using RulesRegistry::RulesId;
+
+//Entries live in fixed-size chunks that are never moved or freed, so that readers can look up an id without locking
+//while other threads are registering new rulesets.
+static const int32_t ENTRY_CHUNK_BITS = 8;
+static const int32_t ENTRY_CHUNK_SIZE = (int32_t)1 << ENTRY_CHUNK_BITS;
+static const int32_t ENTRY_CHUNK_MASK = ENTRY_CHUNK_SIZE-1;
+static const int32_t MAX_NUM_ENTRY_CHUNKS = RulesRegistry::MAX_NUM_RULES / ENTRY_CHUNK_SIZE;
+
+static std::atomic<Rules*> entryChunks[MAX_NUM_ENTRY_CHUNKS];
+static std::atomic<int32_t> numEntries(0);
+
+//Parse results are capped so that a stream of junk RU tags can't grow the cache without bound
+static const size_t MAX_NUM_CACHED_PARSES = 100000;
+//Each thread also keeps a small cache of its own in front of the shared one, so that many loader threads
+//looking up the same few RU strings don't all serialize on the registry mutex. Ids are never invalidated,
+//so these can never go stale, and are simply emptied when full.
+static const size_t MAX_NUM_THREAD_CACHED_PARSES = 256;
+
+struct RulesRegistryState {
+  std::mutex mutex;
+  std::unordered_map<uint64_t,RulesId> idByKey;
+  //NULL_RULES_ID for strings that failed to parse
+  std::unordered_map<string,RulesId> idByParseString;
+};
+
+static RulesRegistryState& getRegistryState() {
+  static RulesRegistryState state;
+  return state;
+}
+
+//Pack all fields of the rules into a single exact key, komi by its bit pattern
+static uint64_t getRulesKey(const Rules& rules) {
+  if(rules.koRule < 0 || rules.koRule >= 4 ||
+     rules.scoringRule < 0 || rules.scoringRule >= 2 ||
+     rules.taxRule < 0 || rules.taxRule >= 3 ||
+     rules.whiteHandicapBonusRule < 0 || rules.whiteHandicapBonusRule >= 3)
+    throw StringError("RulesRegistry: rules have out of range fields");
+  //Normalize so that -0 and 0 komi, which compare equal, are the same key
+  float komi = rules.komi == 0.0f ? 0.0f : rules.komi;
+  uint32_t komiBits;
+  std::memcpy(&komiBits, &komi, sizeof(komiBits));
+
+  uint64_t key = 0;
+  key = (key << 2) | (uint64_t)rules.koRule;
+  key = (key << 1) | (uint64_t)rules.scoringRule;
+  key = (key << 2) | (uint64_t)rules.taxRule;
+  key = (key << 1) | (uint64_t)rules.multiStoneSuicideLegal;
+  key = (key << 1) | (uint64_t)rules.hasButton;
+  key = (key << 2) | (uint64_t)rules.whiteHandicapBonusRule;
+  key = (key << 1) | (uint64_t)rules.friendlyPassOk;
+  key = (key << 32) | (uint64_t)komiBits;
+  return key;
+}
+
+//Requires the registry mutex to be held
+static RulesId internAlreadyLocked(RulesRegistryState& state, const Rules& rules) {
+  uint64_t key = getRulesKey(rules);
+  auto iter = state.idByKey.find(key);
+  if(iter != state.idByKey.end())
+    return iter->second;
+
+  RulesId id = numEntries.load(std::memory_order_relaxed);
+  if(id >= RulesRegistry::MAX_NUM_RULES)
+    throw StringError("RulesRegistry: too many distinct rules registered");
+  int32_t chunkIdx = id >> ENTRY_CHUNK_BITS;
+  Rules* chunk = entryChunks[chunkIdx].load(std::memory_order_relaxed);
+  if(chunk == NULL) {
+    chunk = new Rules[ENTRY_CHUNK_SIZE];
+    entryChunks[chunkIdx].store(chunk, std::memory_order_release);
+  }
+  chunk[id & ENTRY_CHUNK_MASK] = rules;
+
+  //Publish only once the entry is completely filled in
+  numEntries.store(id+1, std::memory_order_release);
+  state.idByKey[key] = id;
+  return id;
+}
+
+RulesId RulesRegistry::intern(const Rules& rules) {
+  RulesRegistryState& state = getRegistryState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  return internAlreadyLocked(state, rules);
+}
+
+const Rules& RulesRegistry::getRules(RulesId id) {
+  if(id < 0 || id >= numEntries.load(std::memory_order_acquire))
+    throw StringError("RulesRegistry: invalid rules id " + Global::intToString(id));
+  Rules* chunk = entryChunks[id >> ENTRY_CHUNK_BITS].load(std::memory_order_acquire);
+  return chunk[id & ENTRY_CHUNK_MASK];
+}
+
+int32_t RulesRegistry::numRules() {
+  return numEntries.load(std::memory_order_acquire);
+}
+
+//Returns NULL_RULES_ID if str does not parse
+static RulesId parseRulesShared(const string& str) {
+  RulesRegistryState& state = getRegistryState();
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    auto iter = state.idByParseString.find(str);
+    if(iter != state.idByParseString.end())
+      return iter->second;
+  }
+
+  //Parse outside of the lock, it's the slow part
+  Rules rules;
+  bool suc = Rules::tryParseRules(str,rules);
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+  RulesId id = suc ? internAlreadyLocked(state, rules) : RulesRegistry::NULL_RULES_ID;
+  if(state.idByParseString.size() < MAX_NUM_CACHED_PARSES)
+    state.idByParseString[str] = id;
+  return id;
+}
+
+bool RulesRegistry::tryParseRules(const string& str, RulesId& buf) {
+  static thread_local std::unordered_map<string,RulesId> threadIdByParseString;
+  RulesId id;
+  auto iter = threadIdByParseString.find(str);
+  if(iter != threadIdByParseString.end())
+    id = iter->second;
+  else {
+    id = parseRulesShared(str);
+    if(threadIdByParseString.size() >= MAX_NUM_THREAD_CACHED_PARSES)
+      threadIdByParseString.clear();
+    threadIdByParseString[str] = id;
+  }
+  if(id == NULL_RULES_ID)
+    return false;
+  buf = id;
+  return true;
+}
+
+RulesId RulesRegistry::parseRules(const string& str) {
+  RulesId id;
+  if(tryParseRules(str,id))
+    return id;
+  //Parse again to throw the original error
+  Rules::parseRules(str);
+  throw IOError("Could not parse rules: " + str);
+}
@@ -0,0 +1,29 @@
+#ifndef GAME_RULESREGISTRY_H_
+#define GAME_RULESREGISTRY_H_
+
+#include "../core/global.h"
+#include "../game/rules.h"
+
+//Process-wide interning of rulesets. Each distinct Rules (including komi) is assigned a small dense integer id,
+//so that code handling the same few rulesets over and over (such as parsing the RU tags of many sgfs) can do
+//table lookups instead.
+//All functions are thread-safe. Ids are stable for the lifetime of the process but are NOT meaningful across processes.
+namespace RulesRegistry {
+  typedef int32_t RulesId;
+  static constexpr RulesId NULL_RULES_ID = -1;
+  static constexpr int32_t MAX_NUM_RULES = 1 << 16;
+
+  //Returns the id of rules, registering it if it has not been seen before.
+  //Throws StringError if rules has out-of-range fields or if MAX_NUM_RULES distinct rulesets have already been registered.
+  RulesId intern(const Rules& rules);
+  //The returned reference remains valid for the lifetime of the process.
+  const Rules& getRules(RulesId id);
+  int32_t numRules();
+
+  //Memoized equivalents of Rules::tryParseRules and Rules::parseRules, keyed by the exact string.
+  //Repeat lookups of a string from the same thread take no lock.
+  bool tryParseRules(const std::string& str, RulesId& buf);
+  RulesId parseRules(const std::string& str);
+}
+
+#endif  // GAME_RULESREGISTRY_H_
@@ -0,0 +1,129 @@
+#include "../game/symmetry.h"
+
+using namespace std;
+
+bool SymmetryHelpers::isTranspose(int symmetry) {
+  return (symmetry & 0x4) != 0;
+}
+
+int SymmetryHelpers::getNumSymmetries(int xSize, int ySize) {
+  return xSize == ySize ? NUM_SYMMETRIES : NUM_SYMMETRIES / 2;
+}
+
+int SymmetryHelpers::invert(int symmetry) {
+  //Flips commute with each other and flips followed by a transpose are self-inverse, except that undoing a transpose
+  //with one flip requires flipping the other axis instead.
+  if(symmetry == 5)
+    return 6;
+  if(symmetry == 6)
+    return 5;
+  return symmetry;
+}
+
+int SymmetryHelpers::compose(int first, int second) {
+  //Find it by where a point goes, using a point whose 8 images are all distinct
+  const int size = 7;
+  Loc target = getSymLoc(getSymLoc(1,2,size,size,first),size,size,second);
+  for(int symmetry = 0; symmetry<NUM_SYMMETRIES; symmetry++) {
+    if(getSymLoc(1,2,size,size,symmetry) == target)
+      return symmetry;
+  }
+  ASSERT_UNREACHABLE;
+  return 0;
+}
+
+Loc SymmetryHelpers::getSymLoc(int x, int y, int xSize, int ySize, int symmetry) {
+  bool flipY = (symmetry & 0x1) != 0;
+  bool flipX = (symmetry & 0x2) != 0;
+  if(flipX)
+    x = xSize - 1 - x;
+  if(flipY)
+    y = ySize - 1 - y;
+  if(isTranspose(symmetry))
+    return Location::getLoc(y,x,ySize);
+  return Location::getLoc(x,y,xSize);
+}
+
+Loc SymmetryHelpers::getSymLoc(Loc loc, int xSize, int ySize, int symmetry) {
+  if(loc == Board::PASS_LOC || loc == Board::NULL_LOC)
+    return loc;
+  return getSymLoc(Location::getX(loc,xSize), Location::getY(loc,xSize), xSize, ySize, symmetry);
+}
+
+Board SymmetryHelpers::getSymBoard(const Board& board, int symmetry) {
+  bool transpose = isTranspose(symmetry);
+  Board symBoard(transpose ? board.y_size : board.x_size, transpose ? board.x_size : board.y_size);
+  Loc symKoLoc = Board::NULL_LOC;
+  for(int y = 0; y<board.y_size; y++) {
+    for(int x = 0; x<board.x_size; x++) {
+      Loc loc = Location::getLoc(x,y,board.x_size);
+      Loc symLoc = getSymLoc(x,y,board.x_size,board.y_size,symmetry);
+      if(board.colors[loc] != C_EMPTY)
+        symBoard.setStone(symLoc,board.colors[loc]);
+      if(loc == board.ko_loc)
+        symKoLoc = symLoc;
+    }
+  }
+  //setStone clears the ko, so restore it at the end
+  if(symKoLoc != Board::NULL_LOC)
+    symBoard.setSimpleKoLoc(symKoLoc);
+  return symBoard;
+}
+
+Hash128 SymmetryHelpers::getSymSituationHash(const Board& board, Player nextPla, int symmetry) {
+  bool transpose = isTranspose(symmetry);
+  int symXSize = transpose ? board.y_size : board.x_size;
+  int symYSize = transpose ? board.x_size : board.y_size;
+  Hash128 hash = Board::ZOBRIST_SIZE_X_HASH[symXSize] ^ Board::ZOBRIST_SIZE_Y_HASH[symYSize];
+  for(int y = 0; y<board.y_size; y++) {
+    for(int x = 0; x<board.x_size; x++) {
+      Loc loc = Location::getLoc(x,y,board.x_size);
+      Color color = board.colors[loc];
+      if(color != C_EMPTY)
+        hash ^= Board::ZOBRIST_BOARD_HASH[getSymLoc(x,y,board.x_size,board.y_size,symmetry)][color];
+    }
+  }
+  hash ^= Board::ZOBRIST_PLAYER_HASH[nextPla];
+  if(board.ko_loc != Board::NULL_LOC)
+    hash ^= Board::ZOBRIST_KO_LOC_HASH[getSymLoc(board.ko_loc,board.x_size,board.y_size,symmetry)];
+  return hash;
+}
+
+void SymmetryHelpers::getSymSituationHashes(const Board& board, Player nextPla, Hash128 buf[NUM_SYMMETRIES]) {
+  int numSymmetries = getNumSymmetries(board.x_size,board.y_size);
+  for(int s = 0; s<numSymmetries; s++) {
+    bool transpose = isTranspose(s);
+    int symXSize = transpose ? board.y_size : board.x_size;
+    int symYSize = transpose ? board.x_size : board.y_size;
+    buf[s] = Board::ZOBRIST_SIZE_X_HASH[symXSize] ^ Board::ZOBRIST_SIZE_Y_HASH[symYSize] ^ Board::ZOBRIST_PLAYER_HASH[nextPla];
+  }
+  for(int y = 0; y<board.y_size; y++) {
+    for(int x = 0; x<board.x_size; x++) {
+      Loc loc = Location::getLoc(x,y,board.x_size);
+      Color color = board.colors[loc];
+      bool isKo = loc == board.ko_loc;
+      if(color == C_EMPTY && !isKo)
+        continue;
+      for(int s = 0; s<numSymmetries; s++) {
+        Loc symLoc = getSymLoc(x,y,board.x_size,board.y_size,s);
+        if(color != C_EMPTY)
+          buf[s] ^= Board::ZOBRIST_BOARD_HASH[symLoc][color];
+        if(isKo)
+          buf[s] ^= Board::ZOBRIST_KO_LOC_HASH[symLoc];
+      }
+    }
+  }
+}
+
+Hash128 SymmetryHelpers::getCanonicalSituationHash(const Board& board, Player nextPla, int& symmetryBuf) {
+  int numSymmetries = getNumSymmetries(board.x_size,board.y_size);
+  Hash128 hashes[NUM_SYMMETRIES];
+  getSymSituationHashes(board,nextPla,hashes);
+  int bestSymmetry = 0;
+  for(int s = 1; s<numSymmetries; s++) {
+    if(hashes[s] < hashes[bestSymmetry])
+      bestSymmetry = s;
+  }
+  symmetryBuf = bestSymmetry;
+  return hashes[bestSymmetry];
+}
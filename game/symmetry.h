@@ -0,0 +1,37 @@
+#ifndef GAME_SYMMETRY_H_
+#define GAME_SYMMETRY_H_
+
+#include "../game/board.h"
+
+//The 8 symmetries of the board. Symmetry s first flips y if (s & 1), then flips x if (s & 2), then transposes if (s & 4).
+//Transposing symmetries swap the dimensions of the board, so for non-square boards only symmetries 0-3 map the board
+//onto itself.
+namespace SymmetryHelpers {
+  static constexpr int NUM_SYMMETRIES = 8;
+
+  bool isTranspose(int symmetry);
+  //Symmetries that map a board of this size onto a board of the same size
+  int getNumSymmetries(int xSize, int ySize);
+  //The symmetry that undoes the given symmetry
+  int invert(int symmetry);
+  //The single symmetry equivalent to applying first and then second
+  int compose(int first, int second);
+
+  //Where loc on a board of size xSize by ySize goes under the symmetry, on the board resulting from the symmetry.
+  //Passes and NULL_LOC are unchanged.
+  Loc getSymLoc(Loc loc, int xSize, int ySize, int symmetry);
+  Loc getSymLoc(int x, int y, int xSize, int ySize, int symmetry);
+  Board getSymBoard(const Board& board, int symmetry);
+
+  //Same as board.pos_hash, plus the player to move and the simple ko location, for the board transformed by the
+  //symmetry but without constructing it.
+  Hash128 getSymSituationHash(const Board& board, Player nextPla, int symmetry);
+  //Computes getSymSituationHash for each of the first getNumSymmetries symmetries into buf, in one pass over the board.
+  void getSymSituationHashes(const Board& board, Player nextPla, Hash128 buf[NUM_SYMMETRIES]);
+  //Finds the symmetry giving the smallest getSymSituationHash among those that map the board onto itself, returning
+  //that hash and storing the symmetry in symmetryBuf. Positions equivalent under symmetry give the same hash.
+  //If several symmetries tie, as for a position that is itself symmetric, picks the smallest one.
+  Hash128 getCanonicalSituationHash(const Board& board, Player nextPla, int& symmetryBuf);
+}
+
+#endif // GAME_SYMMETRY_H_